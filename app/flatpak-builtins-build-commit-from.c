@@ -52,6 +52,7 @@ static char *opt_timestamp;
 static char **opt_extra_collection_ids;
 static int opt_token_type = -1;
 static gboolean opt_no_summary_index = FALSE;
+static gboolean opt_parallel;
 
 static GOptionEntry options[] = {
   { "src-repo", 0, 0, G_OPTION_ARG_STRING, &opt_src_repo, N_("Source repo dir"), N_("SRC-REPO") },
@@ -72,6 +73,7 @@ static GOptionEntry options[] = {
   { "timestamp", 0, 0, G_OPTION_ARG_STRING, &opt_timestamp, N_("Override the timestamp of the commit (NOW for current time)"), N_("TIMESTAMP") },
   { "disable-fsync", 0, 0, G_OPTION_ARG_NONE, &opt_disable_fsync, "Do not invoke fsync()", NULL },
   { "no-summary-index", 0, 0, G_OPTION_ARG_NONE, &opt_no_summary_index, N_("Don't generate a summary index"), NULL },
+  { "parallel", 0, 0, G_OPTION_ARG_NONE, &opt_parallel, N_("Commit all refs at once, using several threads"), NULL },
   { NULL }
 };
 
@@ -252,6 +254,410 @@ get_subsets (char **subsets, GVariant **out)
   return TRUE;
 }
 
+typedef struct
+{
+  OstreeRepo      *src_repo;
+  OstreeRepo      *dst_repo;
+  struct timespec *ts;
+  GCancellable    *cancellable;
+  GMutex           mutex;
+  GHashTable      *download_sizes; /* dirtree checksum -> guint64 * */
+  GError          *error;
+} CommitFrom;
+
+typedef struct
+{
+  const char *dst_ref;
+  const char *resolved_ref;
+  char       *commit_checksum; /* NULL if there was no change */
+} CommitFromRef;
+
+/* Refs with the same tree have the same download size, so only walk
+ * each tree once, even when several refs are committed at once */
+static gboolean
+get_download_size (CommitFrom *commit_from,
+                   GFile      *root,
+                   guint64    *out_download_size,
+                   GError    **error)
+{
+  const char *tree_checksum = ostree_repo_file_tree_get_contents_checksum (OSTREE_REPO_FILE (root));
+  guint64 *cached;
+  guint64 download_size;
+
+  g_mutex_lock (&commit_from->mutex);
+  cached = g_hash_table_lookup (commit_from->download_sizes, tree_checksum);
+  if (cached != NULL)
+    download_size = *cached;
+  g_mutex_unlock (&commit_from->mutex);
+
+  if (cached == NULL)
+    {
+      if (!flatpak_repo_collect_sizes (commit_from->dst_repo, root, NULL, &download_size,
+                                       commit_from->cancellable, error))
+        return FALSE;
+
+      g_mutex_lock (&commit_from->mutex);
+      g_hash_table_replace (commit_from->download_sizes, g_strdup (tree_checksum),
+                            g_memdup (&download_size, sizeof (download_size)));
+      g_mutex_unlock (&commit_from->mutex);
+    }
+
+  *out_download_size = download_size;
+  return TRUE;
+}
+
+/* Returns the root to commit for @src_ref_root. The source commit is
+ * complete in the destination repo by now, so if its dirtree and
+ * dirmeta objects are there we can commit the same tree directly rather
+ * than walking it and writing every object again, which would only end
+ * up with the same checksums. */
+static GFile *
+get_dst_root (CommitFrom   *commit_from,
+              GFile        *src_ref_root,
+              GCancellable *cancellable,
+              GError      **error)
+{
+  OstreeRepoFile *src_root = OSTREE_REPO_FILE (src_ref_root);
+  g_autoptr(OstreeMutableTree) mtree = NULL;
+  g_autoptr(GFile) dst_root = NULL;
+  gboolean has_dirtree = FALSE;
+  gboolean has_dirmeta = FALSE;
+
+  if (!ostree_repo_has_object (commit_from->dst_repo, OSTREE_OBJECT_TYPE_DIR_TREE,
+                               ostree_repo_file_tree_get_contents_checksum (src_root),
+                               &has_dirtree, cancellable, error))
+    return NULL;
+
+  if (has_dirtree &&
+      !ostree_repo_has_object (commit_from->dst_repo, OSTREE_OBJECT_TYPE_DIR_META,
+                               ostree_repo_file_tree_get_metadata_checksum (src_root),
+                               &has_dirmeta, cancellable, error))
+    return NULL;
+
+  if (has_dirtree && has_dirmeta)
+    return g_object_ref (src_ref_root);
+
+  mtree = ostree_mutable_tree_new ();
+  if (!ostree_repo_write_directory_to_mtree (commit_from->dst_repo, src_ref_root, mtree, NULL,
+                                             cancellable, error))
+    return NULL;
+
+  if (!ostree_repo_write_mtree (commit_from->dst_repo, mtree, &dst_root, cancellable, error))
+    return NULL;
+
+  return g_steal_pointer (&dst_root);
+}
+
+/* Makes the new commit for one ref. This doesn't update the ref itself,
+ * so that it can run on several threads; the caller sets all the refs in
+ * the transaction afterwards. */
+static gboolean
+commit_from_ref (CommitFrom    *commit_from,
+                 CommitFromRef *ref_data,
+                 GCancellable  *cancellable,
+                 GError       **error)
+{
+  OstreeRepo *src_repo = commit_from->src_repo;
+  OstreeRepo *dst_repo = commit_from->dst_repo;
+  const char *dst_ref = ref_data->dst_ref;
+  const char *resolved_ref = ref_data->resolved_ref;
+  g_autofree char *dst_parent = NULL;
+  g_autoptr(GFile) dst_parent_root = NULL;
+  g_autoptr(GFile) src_ref_root = NULL;
+  g_autoptr(GVariant) src_commitv = NULL;
+  g_autoptr(GVariant) dst_commitv = NULL;
+  g_autoptr(GVariant) subsets_v = NULL;
+  g_autoptr(GFile) dst_root = NULL;
+  g_autoptr(GVariant) commitv_metadata = NULL;
+  g_autoptr(GVariant) metadata = NULL;
+  OstreeRepoCommitState src_commit_state;
+  const char *subject;
+  const char *body;
+  g_autofree char *commit_checksum = NULL;
+  GVariantBuilder metadata_builder;
+  guint64 timestamp;
+  gint j;
+  const char *dst_collection_id = NULL;
+  const char *main_collection_id = NULL;
+  g_autoptr(GPtrArray) collection_ids = NULL;
+
+  dst_collection_id = ostree_repo_get_collection_id (dst_repo);
+
+  if (!flatpak_repo_resolve_rev (dst_repo, dst_collection_id, NULL, dst_ref, TRUE,
+                                 &dst_parent, cancellable, error))
+    return FALSE;
+
+  if (dst_parent != NULL &&
+      !ostree_repo_read_commit (dst_repo, dst_parent, &dst_parent_root, NULL, cancellable, error))
+    return FALSE;
+
+  if (!ostree_repo_read_commit (dst_repo, resolved_ref, &src_ref_root, NULL, cancellable, error))
+    return FALSE;
+
+  if (!ostree_repo_load_commit (dst_repo, resolved_ref, &src_commitv, &src_commit_state, error))
+    return FALSE;
+
+  if (src_commit_state & OSTREE_REPO_COMMIT_STATE_PARTIAL)
+    return flatpak_fail (error, _("Can't commit from partial source commit"));
+
+  /* Don't create a new commit if this is the same tree */
+  if (!opt_force && dst_parent_root != NULL && g_file_equal (dst_parent_root, src_ref_root))
+    return TRUE;
+
+  dst_root = get_dst_root (commit_from, src_ref_root, cancellable, error);
+  if (dst_root == NULL)
+    return FALSE;
+
+  commitv_metadata = g_variant_get_child_value (src_commitv, 0);
+
+  g_variant_get_child (src_commitv, 3, "&s", &subject);
+  if (opt_subject)
+    subject = (const char *) opt_subject;
+  g_variant_get_child (src_commitv, 4, "&s", &body);
+  if (opt_body)
+    body = (const char *) opt_body;
+
+  collection_ids = g_ptr_array_new_with_free_func (g_free);
+  if (dst_collection_id)
+    {
+      main_collection_id = dst_collection_id;
+      g_ptr_array_add (collection_ids, g_strdup (dst_collection_id));
+    }
+
+  if (opt_extra_collection_ids != NULL)
+    {
+      for (j = 0; opt_extra_collection_ids[j] != NULL; j++)
+        {
+          const char *cid = opt_extra_collection_ids[j];
+          if (main_collection_id == NULL)
+            main_collection_id = cid; /* Fall back to first arg */
+
+          if (g_strcmp0 (cid, dst_collection_id) != 0)
+            g_ptr_array_add (collection_ids, g_strdup (cid));
+        }
+    }
+
+  g_ptr_array_sort (collection_ids, (GCompareFunc) flatpak_strcmp0_ptr);
+
+  /* Copy old metadata */
+  g_variant_builder_init (&metadata_builder, G_VARIANT_TYPE ("a{sv}"));
+
+  /* Bindings. xa.ref is deprecated but added anyway for backwards compatibility. */
+  g_variant_builder_add (&metadata_builder, "{sv}", "ostree.collection-binding",
+                         g_variant_new_string (main_collection_id ? main_collection_id : ""));
+  if (collection_ids->len > 0)
+    {
+      g_autoptr(GVariantBuilder) cr_builder = g_variant_builder_new (G_VARIANT_TYPE ("a(ss)"));
+
+      for (j = 0; j < collection_ids->len; j++)
+        g_variant_builder_add (cr_builder, "(ss)", g_ptr_array_index (collection_ids, j), dst_ref);
+
+      g_variant_builder_add (&metadata_builder, "{sv}", "ostree.collection-refs-binding",
+                             g_variant_builder_end (cr_builder));
+    }
+  g_variant_builder_add (&metadata_builder, "{sv}", "ostree.ref-binding",
+                         g_variant_new_strv (&dst_ref, 1));
+  g_variant_builder_add (&metadata_builder, "{sv}", "xa.ref", g_variant_new_string (dst_ref));
+
+  /* Record the source commit. This is nice to have, but it also
+     means the commit-from gets a different commit id, which
+     avoids problems with e.g.  sharing .commitmeta files
+     (signatures) */
+  g_variant_builder_add (&metadata_builder, "{sv}", "xa.from_commit", g_variant_new_string (resolved_ref));
+
+  if (opt_src_repo)
+    {
+      guint64 download_size;
+      if (!get_download_size (commit_from, src_ref_root, &download_size, error))
+        return FALSE;
+      g_variant_builder_add (&metadata_builder, "{sv}", "xa.download-size", g_variant_new_uint64 (GUINT64_TO_BE (download_size)));
+    }
+
+  for (j = 0; j < g_variant_n_children (commitv_metadata); j++)
+    {
+      g_autoptr(GVariant) child = g_variant_get_child_value (commitv_metadata, j);
+      g_autoptr(GVariant) keyv = g_variant_get_child_value (child, 0);
+      const char *key = g_variant_get_string (keyv, NULL);
+
+      if (strcmp (key, "xa.ref") == 0 ||
+          strcmp (key, "xa.from_commit") == 0 ||
+          strcmp (key, "ostree.collection-binding") == 0 ||
+          strcmp (key, "ostree.collection-refs-binding") == 0 ||
+          strcmp (key, "ostree.ref-binding") == 0)
+        continue;
+
+      if (opt_src_repo && strcmp (key, "xa.download-size") == 0)
+        continue;
+
+      if (opt_endoflife &&
+          strcmp (key, OSTREE_COMMIT_META_KEY_ENDOFLIFE) == 0)
+        continue;
+
+      if (opt_endoflife_rebase &&
+          strcmp (key, OSTREE_COMMIT_META_KEY_ENDOFLIFE_REBASE) == 0)
+        continue;
+
+      if (opt_token_type >= 0 && strcmp (key, "xa.token-type") == 0)
+        continue;
+
+      if (opt_subsets != NULL && strcmp (key, "xa.subsets") == 0)
+        continue;
+
+      g_variant_builder_add_value (&metadata_builder, child);
+    }
+
+  if (opt_endoflife && *opt_endoflife)
+    g_variant_builder_add (&metadata_builder, "{sv}", OSTREE_COMMIT_META_KEY_ENDOFLIFE,
+                           g_variant_new_string (opt_endoflife));
+
+  if (opt_endoflife_rebase)
+    {
+      g_auto(GStrv) dst_ref_parts = g_strsplit (dst_ref, "/", 0);
+
+      for (j = 0; opt_endoflife_rebase[j] != NULL; j++)
+        {
+          const char *old_prefix = opt_endoflife_rebase[j];
+
+          if (flatpak_has_name_prefix (dst_ref_parts[1], old_prefix))
+            {
+              g_autofree char *new_id = g_strconcat (opt_endoflife_rebase_new[j], dst_ref_parts[1] + strlen(old_prefix), NULL);
+              g_autofree char *rebased_ref = g_build_filename (dst_ref_parts[0], new_id, dst_ref_parts[2], dst_ref_parts[3], NULL);
+
+              g_variant_builder_add (&metadata_builder, "{sv}", OSTREE_COMMIT_META_KEY_ENDOFLIFE_REBASE,
+                                     g_variant_new_string (rebased_ref));
+              break;
+            }
+        }
+    }
+
+  if (opt_token_type >= 0)
+    g_variant_builder_add (&metadata_builder, "{sv}", "xa.token-type",
+                           g_variant_new_int32 (GINT32_TO_LE (opt_token_type)));
+
+  /* Skip "" subsets as they mean everything. This way --subsets= causes old subsets to be stripped from the original commit */
+  if (get_subsets (opt_subsets, &subsets_v))
+    g_variant_builder_add (&metadata_builder, "{sv}", "xa.subsets", subsets_v);
+
+  timestamp = ostree_commit_get_timestamp (src_commitv);
+  if (opt_timestamp)
+    timestamp = commit_from->ts->tv_sec;
+
+  metadata = g_variant_ref_sink (g_variant_builder_end (&metadata_builder));
+  if (!ostree_repo_write_commit_with_time (dst_repo, dst_parent, subject, body, metadata,
+                                           OSTREE_REPO_FILE (dst_root),
+                                           timestamp,
+                                           &commit_checksum, cancellable, error))
+    return FALSE;
+
+  if (!ostree_repo_load_commit (dst_repo, commit_checksum, &dst_commitv, NULL, error))
+    return FALSE;
+
+  /* This doesn't copy the detached metadata. I'm not sure if this is a problem.
+   * The main thing there is commit signatures, and we can't copy those, as the commit hash changes.
+   */
+
+  if (opt_gpg_key_ids)
+    {
+      char **iter;
+
+      for (iter = opt_gpg_key_ids; iter && *iter; iter++)
+        {
+          const char *keyid = *iter;
+          g_autoptr(GError) my_error = NULL;
+
+          if (!ostree_repo_sign_commit (dst_repo,
+                                        commit_checksum,
+                                        keyid,
+                                        opt_gpg_homedir,
+                                        cancellable,
+                                        &my_error) &&
+              !g_error_matches (my_error, G_IO_ERROR, G_IO_ERROR_EXISTS))
+            {
+              g_propagate_error (error, g_steal_pointer (&my_error));
+              return FALSE;
+            }
+        }
+    }
+
+  /* Copy + Rewrite any deltas */
+  {
+    const char *from[2];
+    gsize n_from = 0;
+
+    if (dst_parent != NULL)
+      from[n_from++] = dst_parent;
+    from[n_from++] = NULL;
+
+    for (j = 0; j < n_from; j++)
+      {
+        g_autoptr(GError) local_error = NULL;
+        if (!rewrite_delta (src_repo, resolved_ref, dst_repo, commit_checksum, dst_commitv, from[j], &local_error))
+          g_debug ("Failed to copy delta: %s", local_error->message);
+      }
+  }
+
+  ref_data->commit_checksum = g_steal_pointer (&commit_checksum);
+
+  return TRUE;
+}
+
+/* Sets the refs for a ref committed by commit_from_ref() */
+static void
+set_dst_refs (OstreeRepo    *dst_repo,
+              CommitFromRef *ref_data)
+{
+  const char *dst_collection_id = ostree_repo_get_collection_id (dst_repo);
+  const char *dst_ref = ref_data->dst_ref;
+  const char *commit_checksum = ref_data->commit_checksum;
+  int j;
+
+  if (dst_collection_id != NULL)
+    {
+      OstreeCollectionRef ref = { (char *) dst_collection_id, (char *) dst_ref };
+      ostree_repo_transaction_set_collection_ref (dst_repo, &ref, commit_checksum);
+    }
+  else
+    {
+      ostree_repo_transaction_set_ref (dst_repo, NULL, dst_ref, commit_checksum);
+    }
+
+  if (opt_extra_collection_ids)
+    {
+      for (j = 0; opt_extra_collection_ids[j] != NULL; j++)
+        {
+          OstreeCollectionRef ref = { (char *) opt_extra_collection_ids[j], (char *) dst_ref };
+          ostree_repo_transaction_set_collection_ref (dst_repo, &ref, commit_checksum);
+        }
+    }
+}
+
+static void
+parallel_commit_from_ref (gpointer data,
+                          gpointer user_data)
+{
+  CommitFromRef *ref_data = data;
+  CommitFrom *commit_from = user_data;
+  g_autoptr(GError) local_error = NULL;
+
+  g_mutex_lock (&commit_from->mutex);
+  if (commit_from->error != NULL)
+    {
+      g_mutex_unlock (&commit_from->mutex);
+      return;
+    }
+  g_mutex_unlock (&commit_from->mutex);
+
+  if (!commit_from_ref (commit_from, ref_data, commit_from->cancellable, &local_error))
+    {
+      g_prefix_error (&local_error, "%s: ", ref_data->dst_ref);
+
+      g_mutex_lock (&commit_from->mutex);
+      if (commit_from->error == NULL)
+        commit_from->error = g_steal_pointer (&local_error);
+      g_mutex_unlock (&commit_from->mutex);
+    }
+}
+
 
 gboolean
 flatpak_builtin_build_commit_from (int argc, char **argv, GCancellable *cancellable, GError **error)
@@ -268,9 +674,10 @@ flatpak_builtin_build_commit_from (int argc, char **argv, GCancellable *cancella
   g_autoptr(FlatpakRepoTransaction) transaction = NULL;
   g_autoptr(GPtrArray) src_refs = NULL;
   g_autoptr(GPtrArray) resolved_src_refs = NULL;
-  OstreeRepoCommitState src_commit_state;
+  CommitFrom commit_from = { NULL, };
+  CommitFromRef *ref_datas = NULL;
   struct timespec ts;
-  guint64 timestamp;
+  gboolean ret = TRUE;
   int i;
   const char *src_collection_id;
 
@@ -454,275 +861,71 @@ flatpak_builtin_build_commit_from (int argc, char **argv, GCancellable *cancella
   if (transaction == NULL)
     return FALSE;
 
+  commit_from.src_repo = src_repo;
+  commit_from.dst_repo = dst_repo;
+  commit_from.ts = &ts;
+  commit_from.cancellable = cancellable;
+  commit_from.download_sizes = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  g_mutex_init (&commit_from.mutex);
+
+  ref_datas = g_new0 (CommitFromRef, resolved_src_refs->len);
   for (i = 0; i < resolved_src_refs->len; i++)
     {
-      const char *dst_ref = dst_refs[i];
-      const char *resolved_ref = g_ptr_array_index (resolved_src_refs, i);
-      g_autofree char *dst_parent = NULL;
-      g_autoptr(GFile) dst_parent_root = NULL;
-      g_autoptr(GFile) src_ref_root = NULL;
-      g_autoptr(GVariant) src_commitv = NULL;
-      g_autoptr(GVariant) dst_commitv = NULL;
-      g_autoptr(GVariant) subsets_v = NULL;
-      g_autoptr(OstreeMutableTree) mtree = NULL;
-      g_autoptr(GFile) dst_root = NULL;
-      g_autoptr(GVariant) commitv_metadata = NULL;
-      g_autoptr(GVariant) metadata = NULL;
-      const char *subject;
-      const char *body;
-      g_autofree char *commit_checksum = NULL;
-      GVariantBuilder metadata_builder;
-      gint j;
-      const char *dst_collection_id = NULL;
-      const char *main_collection_id = NULL;
-      g_autoptr(GPtrArray) collection_ids = NULL;
-
-      dst_collection_id = ostree_repo_get_collection_id (dst_repo);
-
-      if (!flatpak_repo_resolve_rev (dst_repo, dst_collection_id, NULL, dst_ref, TRUE,
-                                     &dst_parent, cancellable, error))
-        return FALSE;
-
-      if (dst_parent != NULL &&
-          !ostree_repo_read_commit (dst_repo, dst_parent, &dst_parent_root, NULL, cancellable, error))
-        return FALSE;
-
-      if (!ostree_repo_read_commit (dst_repo, resolved_ref, &src_ref_root, NULL, cancellable, error))
-        return FALSE;
-
-      if (!ostree_repo_load_commit (dst_repo, resolved_ref, &src_commitv, &src_commit_state, error))
-        return FALSE;
-
-      if (src_commit_state & OSTREE_REPO_COMMIT_STATE_PARTIAL)
-        return flatpak_fail (error, _("Can't commit from partial source commit"));
-
-      /* Don't create a new commit if this is the same tree */
-      if (!opt_force && dst_parent_root != NULL && g_file_equal (dst_parent_root, src_ref_root))
-        {
-          g_print (_("%s: no change\n"), dst_ref);
-          continue;
-        }
-
-      mtree = ostree_mutable_tree_new ();
-      if (!ostree_repo_write_directory_to_mtree (dst_repo, src_ref_root, mtree, NULL,
-                                                 cancellable, error))
-        return FALSE;
-
-      if (!ostree_repo_write_mtree (dst_repo, mtree, &dst_root, cancellable, error))
-        return FALSE;
-
-      commitv_metadata = g_variant_get_child_value (src_commitv, 0);
-
-      g_variant_get_child (src_commitv, 3, "&s", &subject);
-      if (opt_subject)
-        subject = (const char *) opt_subject;
-      g_variant_get_child (src_commitv, 4, "&s", &body);
-      if (opt_body)
-        body = (const char *) opt_body;
-
-      collection_ids = g_ptr_array_new_with_free_func (g_free);
-      if (dst_collection_id)
-        {
-          main_collection_id = dst_collection_id;
-          g_ptr_array_add (collection_ids, g_strdup (dst_collection_id));
-        }
-
-      if (opt_extra_collection_ids != NULL)
-        {
-          for (j = 0; opt_extra_collection_ids[j] != NULL; j++)
-            {
-              const char *cid = opt_extra_collection_ids[j];
-              if (main_collection_id == NULL)
-                main_collection_id = cid; /* Fall back to first arg */
-
-              if (g_strcmp0 (cid, dst_collection_id) != 0)
-                g_ptr_array_add (collection_ids, g_strdup (cid));
-            }
-        }
-
-      g_ptr_array_sort (collection_ids, (GCompareFunc) flatpak_strcmp0_ptr);
-
-      /* Copy old metadata */
-      g_variant_builder_init (&metadata_builder, G_VARIANT_TYPE ("a{sv}"));
-
-      /* Bindings. xa.ref is deprecated but added anyway for backwards compatibility. */
-      g_variant_builder_add (&metadata_builder, "{sv}", "ostree.collection-binding",
-                             g_variant_new_string (main_collection_id ? main_collection_id : ""));
-      if (collection_ids->len > 0)
-        {
-          g_autoptr(GVariantBuilder) cr_builder = g_variant_builder_new (G_VARIANT_TYPE ("a(ss)"));
-
-          for (j = 0; j < collection_ids->len; j++)
-            g_variant_builder_add (cr_builder, "(ss)", g_ptr_array_index (collection_ids, j), dst_ref);
-
-          g_variant_builder_add (&metadata_builder, "{sv}", "ostree.collection-refs-binding",
-                                 g_variant_builder_end (cr_builder));
-        }
-      g_variant_builder_add (&metadata_builder, "{sv}", "ostree.ref-binding",
-                             g_variant_new_strv (&dst_ref, 1));
-      g_variant_builder_add (&metadata_builder, "{sv}", "xa.ref", g_variant_new_string (dst_ref));
+      ref_datas[i].dst_ref = dst_refs[i];
+      ref_datas[i].resolved_ref = g_ptr_array_index (resolved_src_refs, i);
+    }
 
-      /* Record the source commit. This is nice to have, but it also
-         means the commit-from gets a different commit id, which
-         avoids problems with e.g.  sharing .commitmeta files
-         (signatures) */
-      g_variant_builder_add (&metadata_builder, "{sv}", "xa.from_commit", g_variant_new_string (resolved_ref));
+  if (opt_parallel)
+    {
+      GThreadPool *pool;
 
-      if (opt_src_repo)
-        {
-          guint64 download_size;
-          if (!flatpak_repo_collect_sizes (dst_repo, src_ref_root, NULL, &download_size,
-                                           cancellable, error))
-            {
-              return FALSE;
-            }
-          g_variant_builder_add (&metadata_builder, "{sv}", "xa.download-size", g_variant_new_uint64 (GUINT64_TO_BE (download_size)));
-        }
+      pool = g_thread_pool_new (parallel_commit_from_ref, &commit_from, g_get_num_processors (), FALSE, NULL);
+      for (i = 0; i < resolved_src_refs->len; i++)
+        g_thread_pool_push (pool, &ref_datas[i], NULL);
+      g_thread_pool_free (pool, FALSE, TRUE);
 
-      for (j = 0; j < g_variant_n_children (commitv_metadata); j++)
+      if (commit_from.error != NULL)
         {
-          g_autoptr(GVariant) child = g_variant_get_child_value (commitv_metadata, j);
-          g_autoptr(GVariant) keyv = g_variant_get_child_value (child, 0);
-          const char *key = g_variant_get_string (keyv, NULL);
-
-          if (strcmp (key, "xa.ref") == 0 ||
-              strcmp (key, "xa.from_commit") == 0 ||
-              strcmp (key, "ostree.collection-binding") == 0 ||
-              strcmp (key, "ostree.collection-refs-binding") == 0 ||
-              strcmp (key, "ostree.ref-binding") == 0)
-            continue;
-
-          if (opt_src_repo && strcmp (key, "xa.download-size") == 0)
-            continue;
-
-          if (opt_endoflife &&
-              strcmp (key, OSTREE_COMMIT_META_KEY_ENDOFLIFE) == 0)
-            continue;
-
-          if (opt_endoflife_rebase &&
-              strcmp (key, OSTREE_COMMIT_META_KEY_ENDOFLIFE_REBASE) == 0)
-            continue;
-
-          if (opt_token_type >= 0 && strcmp (key, "xa.token-type") == 0)
-            continue;
-
-          if (opt_subsets != NULL && strcmp (key, "xa.subsets") == 0)
-            continue;
-
-          g_variant_builder_add_value (&metadata_builder, child);
+          g_propagate_error (error, g_steal_pointer (&commit_from.error));
+          ret = FALSE;
         }
-
-      if (opt_endoflife && *opt_endoflife)
-        g_variant_builder_add (&metadata_builder, "{sv}", OSTREE_COMMIT_META_KEY_ENDOFLIFE,
-                               g_variant_new_string (opt_endoflife));
-
-      if (opt_endoflife_rebase)
+    }
+  else
+    {
+      for (i = 0; i < resolved_src_refs->len; i++)
         {
-          g_auto(GStrv) dst_ref_parts = g_strsplit (dst_ref, "/", 0);
-
-          for (j = 0; opt_endoflife_rebase[j] != NULL; j++)
+          if (!commit_from_ref (&commit_from, &ref_datas[i], cancellable, error))
             {
-              const char *old_prefix = opt_endoflife_rebase[j];
-
-              if (flatpak_has_name_prefix (dst_ref_parts[1], old_prefix))
-                {
-                  g_autofree char *new_id = g_strconcat (opt_endoflife_rebase_new[j], dst_ref_parts[1] + strlen(old_prefix), NULL);
-                  g_autofree char *rebased_ref = g_build_filename (dst_ref_parts[0], new_id, dst_ref_parts[2], dst_ref_parts[3], NULL);
-
-                  g_variant_builder_add (&metadata_builder, "{sv}", OSTREE_COMMIT_META_KEY_ENDOFLIFE_REBASE,
-                                         g_variant_new_string (rebased_ref));
-                  break;
-                }
+              ret = FALSE;
+              break;
             }
         }
+    }
 
-      if (opt_token_type >= 0)
-        g_variant_builder_add (&metadata_builder, "{sv}", "xa.token-type",
-                               g_variant_new_int32 (GINT32_TO_LE (opt_token_type)));
-
-      /* Skip "" subsets as they mean everything. This way --subsets= causes old subsets to be stripped from the original commit */
-      if (get_subsets (opt_subsets, &subsets_v))
-        g_variant_builder_add (&metadata_builder, "{sv}", "xa.subsets", subsets_v);
-
-      timestamp = ostree_commit_get_timestamp (src_commitv);
-      if (opt_timestamp)
-        timestamp = ts.tv_sec;
-
-      metadata = g_variant_ref_sink (g_variant_builder_end (&metadata_builder));
-      if (!ostree_repo_write_commit_with_time (dst_repo, dst_parent, subject, body, metadata,
-                                               OSTREE_REPO_FILE (dst_root),
-                                               timestamp,
-                                               &commit_checksum, cancellable, error))
-        return FALSE;
-
-      g_print ("%s: %s\n", dst_ref, commit_checksum);
-
-      if (!ostree_repo_load_commit (dst_repo, commit_checksum, &dst_commitv, NULL, error))
-        return FALSE;
-
-      /* This doesn't copy the detached metadata. I'm not sure if this is a problem.
-       * The main thing there is commit signatures, and we can't copy those, as the commit hash changes.
-       */
+  /* All the refs go into the transaction together, in order, once
+   * every commit has been written */
+  for (i = 0; ret && i < resolved_src_refs->len; i++)
+    {
+      CommitFromRef *ref_data = &ref_datas[i];
 
-      if (opt_gpg_key_ids)
+      if (ref_data->commit_checksum == NULL)
         {
-          char **iter;
-
-          for (iter = opt_gpg_key_ids; iter && *iter; iter++)
-            {
-              const char *keyid = *iter;
-              g_autoptr(GError) my_error = NULL;
-
-              if (!ostree_repo_sign_commit (dst_repo,
-                                            commit_checksum,
-                                            keyid,
-                                            opt_gpg_homedir,
-                                            cancellable,
-                                            &my_error) &&
-                  !g_error_matches (my_error, G_IO_ERROR, G_IO_ERROR_EXISTS))
-                {
-                  g_propagate_error (error, g_steal_pointer (&my_error));
-                  return FALSE;
-                }
-            }
+          g_print (_("%s: no change\n"), ref_data->dst_ref);
+          continue;
         }
 
-      if (dst_collection_id != NULL)
-        {
-          OstreeCollectionRef ref = { (char *) dst_collection_id, (char *) dst_ref };
-          ostree_repo_transaction_set_collection_ref (dst_repo, &ref, commit_checksum);
-        }
-      else
-        {
-          ostree_repo_transaction_set_ref (dst_repo, NULL, dst_ref, commit_checksum);
-        }
+      g_print ("%s: %s\n", ref_data->dst_ref, ref_data->commit_checksum);
+      set_dst_refs (dst_repo, ref_data);
+    }
 
-      if (opt_extra_collection_ids)
-        {
-          for (j = 0; opt_extra_collection_ids[j] != NULL; j++)
-            {
-              OstreeCollectionRef ref = { (char *) opt_extra_collection_ids[j], (char *) dst_ref };
-              ostree_repo_transaction_set_collection_ref (dst_repo, &ref, commit_checksum);
-            }
-        }
+  for (i = 0; i < resolved_src_refs->len; i++)
+    g_free (ref_datas[i].commit_checksum);
+  g_free (ref_datas);
+  g_hash_table_unref (commit_from.download_sizes);
+  g_mutex_clear (&commit_from.mutex);
 
-      /* Copy + Rewrite any deltas */
-      {
-        const char *from[2];
-        gsize n_from = 0;
-
-        if (dst_parent != NULL)
-          from[n_from++] = dst_parent;
-        from[n_from++] = NULL;
-
-        for (j = 0; j < n_from; j++)
-          {
-            g_autoptr(GError) local_error = NULL;
-            if (!rewrite_delta (src_repo, resolved_ref, dst_repo, commit_checksum, dst_commitv, from[j], &local_error))
-              g_debug ("Failed to copy delta: %s", local_error->message);
-          }
-      }
-    }
+  if (!ret)
+    return FALSE;
 
   if (!ostree_repo_commit_transaction (dst_repo, NULL, cancellable, error))
     return FALSE;
@@ -48,6 +48,7 @@ static char *opt_base_version;
 static char **opt_base_extensions;
 static gboolean opt_writable_sdk;
 static gboolean opt_update;
+static gboolean opt_checkout;
 
 static GOptionEntry options[] = {
   { "arch", 0, 0, G_OPTION_ARG_STRING, &opt_arch, N_("Arch to use"), N_("ARCH") },
@@ -63,6 +64,7 @@ static GOptionEntry options[] = {
   { "extension", 0, 0, G_OPTION_ARG_STRING_ARRAY, &opt_extensions, N_("Add extension point info"),  N_("NAME=VARIABLE[=VALUE]") },
   { "sdk-dir", 0, 0, G_OPTION_ARG_STRING, &opt_sdk_dir, N_("Where to store sdk (defaults to 'usr')"), N_("DIR") },
   { "update", 0, 0, G_OPTION_ARG_NONE, &opt_update, N_("Re-initialize the sdk/var"), NULL },
+  { "checkout", 0, 0, G_OPTION_ARG_NONE, &opt_checkout, N_("Check out the sdk, var and base app from the local repository instead of copying them"), NULL },
   { NULL }
 };
 
@@ -70,6 +72,36 @@ static GOptionEntry options[] = {
   "# This file is autogenerated by flatpak build-init\n" \
   "*\n"
 
+/* Populates @dest with the files of @deploy, either by checking them
+ * out of the repo (with --checkout) or by copying @src_files */
+static gboolean
+populate_from_deploy (FlatpakDeploy *deploy,
+                      GFile         *src_files,
+                      GFile         *dest,
+                      FlatpakCpFlags flags,
+                      GCancellable  *cancellable,
+                      GError       **error)
+{
+  g_autoptr(GError) local_error = NULL;
+
+  if (opt_checkout && deploy != NULL)
+    {
+      if (flatpak_deploy_checkout_files (deploy, dest, cancellable, &local_error))
+        return TRUE;
+
+      if (!g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED))
+        {
+          g_propagate_error (error, g_steal_pointer (&local_error));
+          return FALSE;
+        }
+
+      g_debug ("Copying %s instead of checking it out: %s",
+               flatpak_file_get_path_cached (src_files), local_error->message);
+    }
+
+  return flatpak_cp_a (src_files, dest, flags, cancellable, error);
+}
+
 static gboolean
 ensure_extensions (FlatpakDeploy *src_deploy, const char *default_arch, const char *default_branch,
                    char *src_extensions[], GFile *top_dir, GCancellable *cancellable, GError **error)
@@ -99,6 +131,8 @@ ensure_extensions (FlatpakDeploy *src_deploy, const char *default_arch, const ch
           if (strcmp (ext->installed_id, requested_extension_name) == 0 ||
               strcmp (ext->id, requested_extension_name) == 0)
             {
+              g_autoptr(FlatpakDeploy) ext_deploy = NULL;
+
               if (!ext->is_unmaintained)
                 {
                   g_autoptr(FlatpakDir) src_dir = NULL;
@@ -116,6 +150,13 @@ ensure_extensions (FlatpakDeploy *src_deploy, const char *default_arch, const ch
                   subpaths = flatpak_deploy_data_get_subpaths (deploy_data);
                   if (subpaths[0] != NULL)
                     return flatpak_fail (error, _("Requested extension %s is only partially installed"), ext->installed_id);
+
+                  if (opt_checkout)
+                    {
+                      ext_deploy = flatpak_dir_load_deployed (src_dir, ext->ref, NULL, cancellable, error);
+                      if (ext_deploy == NULL)
+                        return FALSE;
+                    }
                 }
 
               if (top_dir)
@@ -131,9 +172,9 @@ ensure_extensions (FlatpakDeploy *src_deploy, const char *default_arch, const ch
                   if (!flatpak_rm_rf (target, cancellable, error))
                     return FALSE;
 
-                  if (!flatpak_cp_a (ext_deploy_files, target,
-                                     FLATPAK_CP_FLAGS_NO_CHOWN,
-                                     cancellable, error))
+                  if (!populate_from_deploy (ext_deploy, ext_deploy_files, target,
+                                             FLATPAK_CP_FLAGS_NO_CHOWN,
+                                             cancellable, error))
                     return FALSE;
                 }
 
@@ -181,6 +222,7 @@ flatpak_builtin_build_init (int argc, char **argv, GCancellable *cancellable, GE
   g_autoptr(GError) my_error = NULL;
   g_autoptr(FlatpakDeploy) runtime_deploy = NULL;
   g_autoptr(FlatpakDeploy) sdk_deploy = NULL;
+  g_autoptr(FlatpakDeploy) var_deploy = NULL;
   const char *app_id;
   const char *directory;
   const char *sdk_pref;
@@ -319,7 +361,7 @@ flatpak_builtin_build_init (int argc, char **argv, GCancellable *cancellable, GE
         }
 
       sdk_deploy_files = flatpak_deploy_get_files (sdk_deploy);
-      if (!flatpak_cp_a (sdk_deploy_files, usr_dir, FLATPAK_CP_FLAGS_NO_CHOWN, cancellable, error))
+      if (!populate_from_deploy (sdk_deploy, sdk_deploy_files, usr_dir, FLATPAK_CP_FLAGS_NO_CHOWN, cancellable, error))
         return FALSE;
     }
 
@@ -337,9 +379,20 @@ flatpak_builtin_build_init (int argc, char **argv, GCancellable *cancellable, GE
       if (var_ref == NULL)
         return FALSE;
 
-      var_deploy_files = flatpak_find_files_dir_for_ref (var_ref, cancellable, error);
-      if (var_deploy_files == NULL)
-        return FALSE;
+      if (opt_checkout)
+        {
+          var_deploy = flatpak_find_deploy_for_ref (flatpak_decomposed_get_ref (var_ref), NULL, NULL, cancellable, error);
+          if (var_deploy == NULL)
+            return FALSE;
+
+          var_deploy_files = flatpak_deploy_get_files (var_deploy);
+        }
+      else
+        {
+          var_deploy_files = flatpak_find_files_dir_for_ref (var_ref, cancellable, error);
+          if (var_deploy_files == NULL)
+            return FALSE;
+        }
     }
 
   if (opt_update)
@@ -361,9 +414,9 @@ flatpak_builtin_build_init (int argc, char **argv, GCancellable *cancellable, GE
         return FALSE;
 
       base_deploy_files = flatpak_deploy_get_files (base_deploy);
-      if (!flatpak_cp_a (base_deploy_files, files_dir,
-                         FLATPAK_CP_FLAGS_MERGE | FLATPAK_CP_FLAGS_NO_CHOWN,
-                         cancellable, error))
+      if (!populate_from_deploy (base_deploy, base_deploy_files, files_dir,
+                                 FLATPAK_CP_FLAGS_MERGE | FLATPAK_CP_FLAGS_NO_CHOWN,
+                                 cancellable, error))
         return FALSE;
 
 
@@ -375,7 +428,7 @@ flatpak_builtin_build_init (int argc, char **argv, GCancellable *cancellable, GE
 
   if (var_deploy_files)
     {
-      if (!flatpak_cp_a (var_deploy_files, var_dir, FLATPAK_CP_FLAGS_NONE, cancellable, error))
+      if (!populate_from_deploy (var_deploy, var_deploy_files, var_dir, FLATPAK_CP_FLAGS_NONE, cancellable, error))
         return FALSE;
     }
   else
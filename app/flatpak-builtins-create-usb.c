@@ -39,6 +39,7 @@ static char *opt_destination_repo;
 static gboolean opt_runtime;
 static gboolean opt_app;
 static gboolean opt_allow_partial;
+static gboolean opt_parallel;
 
 static GOptionEntry options[] = {
   { "app", 0, 0, G_OPTION_ARG_NONE, &opt_app, N_("Look for app with the specified name"), NULL },
@@ -46,6 +47,7 @@ static GOptionEntry options[] = {
   { "destination-repo", 0, 0, G_OPTION_ARG_FILENAME, &opt_destination_repo, "Use custom repository directory within the mount", N_("DEST") },
   { "runtime", 0, 0, G_OPTION_ARG_NONE, &opt_runtime, N_("Look for runtime with the specified name"), NULL },
   { "allow-partial", 0, 0, G_OPTION_ARG_NONE, &opt_allow_partial, N_("Allow partial commits in the created repo"), NULL },
+  { "parallel", 0, 0, G_OPTION_ARG_NONE, &opt_parallel, N_("Copy the objects of all refs at once, using several threads"), NULL },
   { NULL }
 };
 
@@ -287,6 +289,331 @@ add_runtime (GHashTable        *all_refs,
   return TRUE;
 }
 
+/* Whether @path (or, for directories, something below it) is part of
+ * the partial commit described by @subpaths */
+static gboolean
+subpaths_want_path (const char * const *subpaths,
+                    const char         *path,
+                    gboolean            is_dir)
+{
+  gsize i;
+
+  for (i = 0; subpaths[i] != NULL; i++)
+    {
+      if (flatpak_has_path_prefix (path, subpaths[i]))
+        return TRUE;
+
+      if (is_dir && flatpak_has_path_prefix (subpaths[i], path))
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+/* Adds the objects a pull of @subpaths would fetch from the dirtree
+ * @dirtree_checksum at @path to @reachable */
+static gboolean
+collect_subpath_objects (OstreeRepo         *repo,
+                         const char         *dirtree_checksum,
+                         const char         *dirmeta_checksum,
+                         const char         *path,
+                         const char * const *subpaths,
+                         GHashTable         *reachable,
+                         GCancellable       *cancellable,
+                         GError            **error)
+{
+  g_autoptr(GVariant) dirtree = NULL;
+  g_autoptr(GVariant) files = NULL;
+  g_autoptr(GVariant) dirs = NULL;
+  gsize i, n;
+
+  g_hash_table_add (reachable, g_variant_ref_sink (ostree_object_name_serialize (dirmeta_checksum, OSTREE_OBJECT_TYPE_DIR_META)));
+  g_hash_table_add (reachable, g_variant_ref_sink (ostree_object_name_serialize (dirtree_checksum, OSTREE_OBJECT_TYPE_DIR_TREE)));
+
+  if (!ostree_repo_load_variant (repo, OSTREE_OBJECT_TYPE_DIR_TREE, dirtree_checksum, &dirtree, error))
+    return FALSE;
+
+  files = g_variant_get_child_value (dirtree, 0);
+  n = g_variant_n_children (files);
+  for (i = 0; i < n; i++)
+    {
+      const char *name;
+      g_autoptr(GVariant) csum_v = NULL;
+      g_autofree char *child_path = NULL;
+      g_autofree char *checksum = NULL;
+
+      g_variant_get_child (files, i, "(&s@ay)", &name, &csum_v);
+
+      child_path = g_build_filename (path, name, NULL);
+      if (!subpaths_want_path (subpaths, child_path, FALSE))
+        continue;
+
+      checksum = ostree_checksum_from_bytes_v (csum_v);
+      g_hash_table_add (reachable, g_variant_ref_sink (ostree_object_name_serialize (checksum, OSTREE_OBJECT_TYPE_FILE)));
+    }
+
+  dirs = g_variant_get_child_value (dirtree, 1);
+  n = g_variant_n_children (dirs);
+  for (i = 0; i < n; i++)
+    {
+      const char *name;
+      g_autoptr(GVariant) tree_csum_v = NULL;
+      g_autoptr(GVariant) meta_csum_v = NULL;
+      g_autofree char *child_path = NULL;
+      g_autofree char *tree_checksum = NULL;
+      g_autofree char *meta_checksum = NULL;
+
+      g_variant_get_child (dirs, i, "(&s@ay@ay)", &name, &tree_csum_v, &meta_csum_v);
+
+      child_path = g_build_filename (path, name, NULL);
+      if (!subpaths_want_path (subpaths, child_path, TRUE))
+        continue;
+
+      tree_checksum = ostree_checksum_from_bytes_v (tree_csum_v);
+      meta_checksum = ostree_checksum_from_bytes_v (meta_csum_v);
+      if (!collect_subpath_objects (repo, tree_checksum, meta_checksum, child_path,
+                                    subpaths, reachable, cancellable, error))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+typedef struct
+{
+  OstreeRepo   *src_repo;
+  OstreeRepo   *dest_repo;
+  GCancellable *cancellable;
+  GMutex        mutex;
+  GError       *error;
+  guint64       bytes_copied;
+  guint         n_copied;
+} ParallelCopy;
+
+static void
+parallel_copy_object (gpointer data,
+                      gpointer user_data)
+{
+  g_autoptr(GVariant) object = data;
+  ParallelCopy *copy = user_data;
+  g_autoptr(GError) local_error = NULL;
+  const char *checksum;
+  OstreeObjectType objtype;
+  guint64 size = 0;
+
+  g_mutex_lock (&copy->mutex);
+  if (copy->error != NULL)
+    {
+      g_mutex_unlock (&copy->mutex);
+      return;
+    }
+  g_mutex_unlock (&copy->mutex);
+
+  ostree_object_name_deserialize (object, &checksum, &objtype);
+
+  if (!ostree_repo_query_object_storage_size (copy->src_repo, objtype, checksum, &size,
+                                              copy->cancellable, &local_error) ||
+      !ostree_repo_import_object_from_with_trust (copy->dest_repo, copy->src_repo,
+                                                  objtype, checksum, TRUE,
+                                                  copy->cancellable, &local_error))
+    {
+      g_mutex_lock (&copy->mutex);
+      if (copy->error == NULL)
+        copy->error = g_steal_pointer (&local_error);
+      g_mutex_unlock (&copy->mutex);
+      return;
+    }
+
+  g_mutex_lock (&copy->mutex);
+  copy->bytes_copied += size;
+  copy->n_copied++;
+  g_mutex_unlock (&copy->mutex);
+}
+
+static gboolean
+copy_objects_parallel (OstreeRepo   *src_repo,
+                       OstreeRepo   *dest_repo,
+                       GHashTable   *reachable,
+                       GHashTable   *commits,
+                       GHashTable   *partial_commits,
+                       GCancellable *cancellable,
+                       GError      **error)
+{
+  ParallelCopy copy = { src_repo, dest_repo, cancellable, };
+  GThreadPool *pool;
+  g_autofree char *size_str = NULL;
+  g_autofree char *rate_str = NULL;
+  gint64 start_time;
+  double elapsed;
+
+  start_time = g_get_monotonic_time ();
+
+  g_mutex_init (&copy.mutex);
+  pool = g_thread_pool_new (parallel_copy_object, &copy, g_get_num_processors (), FALSE, NULL);
+
+  GLNX_HASH_TABLE_FOREACH (reachable, GVariant *, object)
+  {
+    const char *checksum;
+    OstreeObjectType objtype;
+    gboolean has_object;
+    g_autoptr(GError) local_error = NULL;
+
+    /* Commits go in last, once everything they refer to is there */
+    ostree_object_name_deserialize (object, &checksum, &objtype);
+    if (objtype == OSTREE_OBJECT_TYPE_COMMIT)
+      continue;
+
+    if (!ostree_repo_has_object (dest_repo, objtype, checksum, &has_object, cancellable, &local_error))
+      {
+        /* The queued objects are freed by the workers, which skip
+         * them once an error is set */
+        g_mutex_lock (&copy.mutex);
+        if (copy.error == NULL)
+          copy.error = g_steal_pointer (&local_error);
+        g_mutex_unlock (&copy.mutex);
+        break;
+      }
+
+    if (!has_object)
+      g_thread_pool_push (pool, g_variant_ref (object), NULL);
+  }
+
+  g_thread_pool_free (pool, FALSE, TRUE);
+  g_mutex_clear (&copy.mutex);
+
+  if (copy.error != NULL)
+    {
+      g_propagate_error (error, copy.error);
+      return FALSE;
+    }
+
+  GLNX_HASH_TABLE_FOREACH_V (commits, const char *, commit)
+  {
+    g_autoptr(GVariant) detached_metadata = NULL;
+
+    if (!ostree_repo_import_object_from_with_trust (dest_repo, src_repo, OSTREE_OBJECT_TYPE_COMMIT,
+                                                    commit, TRUE, cancellable, error))
+      return FALSE;
+
+    if (!ostree_repo_read_commit_detached_metadata (src_repo, commit, &detached_metadata,
+                                                    cancellable, error))
+      return FALSE;
+
+    if (detached_metadata != NULL &&
+        !ostree_repo_write_commit_detached_metadata (dest_repo, commit, detached_metadata,
+                                                     cancellable, error))
+      return FALSE;
+
+    if (!ostree_repo_mark_commit_partial (dest_repo, commit,
+                                         g_hash_table_contains (partial_commits, commit),
+                                         error))
+      return FALSE;
+  }
+
+  if (!ostree_repo_commit_transaction (dest_repo, NULL, cancellable, error))
+    return FALSE;
+
+  /* Fsync is disabled for the transaction, so make all the objects
+   * durable in one go before any ref points to them. */
+  if (syncfs (ostree_repo_get_dfd (dest_repo)) < 0)
+    return glnx_throw_errno_prefix (error, "syncfs");
+
+  elapsed = (g_get_monotonic_time () - start_time) / (double) G_USEC_PER_SEC;
+  size_str = g_format_size (copy.bytes_copied);
+  rate_str = g_format_size (elapsed > 0 ? (guint64) (copy.bytes_copied / elapsed) : copy.bytes_copied);
+  g_print ("Copied %u objects (%s) in %.1f seconds, %s/s.\n",
+           copy.n_copied, size_str, elapsed, rate_str);
+
+  return TRUE;
+}
+
+/* Copies all of @all_refs into @dest_repo in one go, rather than pulling
+ * them one by one: the union of the objects needed by all refs is computed
+ * up front, the missing ones are copied by a pool of threads, and
+ * everything is synced once at the end before the refs are written. */
+static gboolean
+copy_refs_parallel (OstreeRepo   *src_repo,
+                    OstreeRepo   *dest_repo,
+                    GHashTable   *all_refs,
+                    GCancellable *cancellable,
+                    GError      **error)
+{
+  g_autoptr(GHashTable) reachable = ostree_repo_traverse_new_reachable ();
+  g_autoptr(GHashTable) commits = g_hash_table_new_full ((GHashFunc) ostree_collection_ref_hash,
+                                                         (GEqualFunc) ostree_collection_ref_equal,
+                                                         NULL, g_free);
+  g_autoptr(GHashTable) partial_commits = g_hash_table_new (g_str_hash, g_str_equal);
+
+  GLNX_HASH_TABLE_FOREACH_KV (all_refs, OstreeCollectionRef *, c_r, CommitAndSubpaths *, c_s)
+  {
+    g_autofree char *commit = g_strdup (c_s->commit);
+
+    if (commit == NULL &&
+        !ostree_repo_resolve_collection_ref (src_repo, c_r, FALSE,
+                                             OSTREE_REPO_RESOLVE_REV_EXT_NONE,
+                                             &commit, cancellable, error))
+      return FALSE;
+
+    if (c_s->subpaths == NULL)
+      {
+        if (!ostree_repo_traverse_commit_union (src_repo, commit, 0, reachable, cancellable, error))
+          return FALSE;
+      }
+    else
+      {
+        g_autoptr(GVariant) commit_v = NULL;
+        g_autoptr(GVariant) tree_csum_v = NULL;
+        g_autoptr(GVariant) meta_csum_v = NULL;
+        g_autofree char *tree_checksum = NULL;
+        g_autofree char *meta_checksum = NULL;
+
+        if (!ostree_repo_load_commit (src_repo, commit, &commit_v, NULL, error))
+          return FALSE;
+
+        tree_csum_v = g_variant_get_child_value (commit_v, 6);
+        meta_csum_v = g_variant_get_child_value (commit_v, 7);
+        tree_checksum = ostree_checksum_from_bytes_v (tree_csum_v);
+        meta_checksum = ostree_checksum_from_bytes_v (meta_csum_v);
+        if (!collect_subpath_objects (src_repo, tree_checksum, meta_checksum, "/",
+                                      (const char * const *) c_s->subpaths,
+                                      reachable, cancellable, error))
+          return FALSE;
+
+        g_hash_table_add (partial_commits, commit);
+      }
+
+    g_hash_table_insert (commits, c_r, g_steal_pointer (&commit));
+  }
+
+  ostree_repo_set_disable_fsync (dest_repo, TRUE);
+
+  if (!ostree_repo_prepare_transaction (dest_repo, NULL, cancellable, error))
+    {
+      ostree_repo_set_disable_fsync (dest_repo, FALSE);
+      return FALSE;
+    }
+
+  if (!copy_objects_parallel (src_repo, dest_repo, reachable, commits, partial_commits,
+                              cancellable, error))
+    {
+      ostree_repo_abort_transaction (dest_repo, cancellable, NULL);
+      ostree_repo_set_disable_fsync (dest_repo, FALSE);
+      return FALSE;
+    }
+
+  /* The objects have been synced, so the refs and everything written
+   * after them are fsynced as usual again */
+  ostree_repo_set_disable_fsync (dest_repo, FALSE);
+
+  GLNX_HASH_TABLE_FOREACH_KV (commits, OstreeCollectionRef *, c_r, const char *, commit)
+  {
+    if (!ostree_repo_set_collection_ref_immediate (dest_repo, c_r, commit, cancellable, error))
+      return FALSE;
+  }
+
+  return TRUE;
+}
+
 /* Copied from src/ostree/ot-builtin-create-usb.c in ostree.git, with slight modifications */
 static gboolean
 ostree_create_usb (GOptionContext *context,
@@ -337,56 +664,65 @@ ostree_create_usb (GOptionContext *context,
   if (!ostree_repo_is_writable (dest_repo, error))
     return glnx_prefix_error (error, "Cannot write to repository");
 
-  /* Copy across all of the collection–refs to the destination repo. We have to
-   * do it one ref at a time in order to get the subpaths right. */
+  if (opt_parallel)
+    {
+      if (!copy_refs_parallel (src_repo, dest_repo, all_refs, cancellable, error))
+        return FALSE;
 
-  GLNX_HASH_TABLE_FOREACH_KV (all_refs, OstreeCollectionRef *, c_r, CommitAndSubpaths *, c_s)
-  {
-    GVariantBuilder builder;
-    g_autoptr(GVariant) opts = NULL;
-    OstreeRepoPullFlags flags = OSTREE_REPO_PULL_FLAGS_MIRROR;
-    GVariantBuilder refs_builder;
+      num_refs = g_hash_table_size (all_refs);
+    }
+  else
+    {
+      /* Copy across all of the collection–refs to the destination repo. We have to
+       * do it one ref at a time in order to get the subpaths right. */
+      GLNX_HASH_TABLE_FOREACH_KV (all_refs, OstreeCollectionRef *, c_r, CommitAndSubpaths *, c_s)
+      {
+        GVariantBuilder builder;
+        g_autoptr(GVariant) opts = NULL;
+        OstreeRepoPullFlags flags = OSTREE_REPO_PULL_FLAGS_MIRROR;
+        GVariantBuilder refs_builder;
 
-    num_refs++;
+        num_refs++;
 
-    g_variant_builder_init (&refs_builder, G_VARIANT_TYPE ("a(sss)"));
-    g_variant_builder_add (&refs_builder, "(sss)",
-                           c_r->collection_id, c_r->ref_name,
-                           c_s->commit ? c_s->commit : "");
+        g_variant_builder_init (&refs_builder, G_VARIANT_TYPE ("a(sss)"));
+        g_variant_builder_add (&refs_builder, "(sss)",
+                               c_r->collection_id, c_r->ref_name,
+                               c_s->commit ? c_s->commit : "");
 
-    glnx_console_lock (&console);
+        glnx_console_lock (&console);
 
-    if (console.is_tty)
-      progress = ostree_async_progress_new_and_connect (ostree_repo_pull_default_console_progress_changed, &console);
+        if (console.is_tty)
+          progress = ostree_async_progress_new_and_connect (ostree_repo_pull_default_console_progress_changed, &console);
 
-    g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{sv}"));
+        g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{sv}"));
 
-    g_variant_builder_add (&builder, "{s@v}", "collection-refs",
-                           g_variant_new_variant (g_variant_builder_end (&refs_builder)));
-    if (c_s->subpaths != NULL)
-      {
-        g_variant_builder_add (&builder, "{s@v}", "subdirs",
-                               g_variant_new_variant (g_variant_new_strv ((const char * const *) c_s->subpaths, -1)));
-      }
-    g_variant_builder_add (&builder, "{s@v}", "flags",
-                           g_variant_new_variant (g_variant_new_int32 (flags)));
-    g_variant_builder_add (&builder, "{s@v}", "depth",
-                           g_variant_new_variant (g_variant_new_int32 (0)));
-    opts = g_variant_ref_sink (g_variant_builder_end (&builder));
-
-    g_autofree char *src_repo_uri = g_file_get_uri (ostree_repo_get_path (src_repo));
-
-    if (!ostree_repo_pull_with_options (dest_repo, src_repo_uri,
-                                        opts,
-                                        progress,
-                                        cancellable, error))
-      {
-        ostree_repo_abort_transaction (dest_repo, cancellable, NULL);
-        return FALSE;
-      }
+        g_variant_builder_add (&builder, "{s@v}", "collection-refs",
+                               g_variant_new_variant (g_variant_builder_end (&refs_builder)));
+        if (c_s->subpaths != NULL)
+          {
+            g_variant_builder_add (&builder, "{s@v}", "subdirs",
+                                   g_variant_new_variant (g_variant_new_strv ((const char * const *) c_s->subpaths, -1)));
+          }
+        g_variant_builder_add (&builder, "{s@v}", "flags",
+                               g_variant_new_variant (g_variant_new_int32 (flags)));
+        g_variant_builder_add (&builder, "{s@v}", "depth",
+                               g_variant_new_variant (g_variant_new_int32 (0)));
+        opts = g_variant_ref_sink (g_variant_builder_end (&builder));
+
+        g_autofree char *src_repo_uri = g_file_get_uri (ostree_repo_get_path (src_repo));
+
+        if (!ostree_repo_pull_with_options (dest_repo, src_repo_uri,
+                                            opts,
+                                            progress,
+                                            cancellable, error))
+          {
+            ostree_repo_abort_transaction (dest_repo, cancellable, NULL);
+            return FALSE;
+          }
 
-    glnx_console_unlock (&console);
-  }
+        glnx_console_unlock (&console);
+      }
+    }
 
   /* Ensure a summary file is present to make it easier to look up commit checksums. */
   /* FIXME: It should be possible to work without this, but find_remotes_cb() in
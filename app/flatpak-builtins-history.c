@@ -37,6 +37,7 @@
 
 #include "flatpak-builtins.h"
 #include "flatpak-builtins-utils.h"
+#include "flatpak-history-private.h"
 #include "flatpak-utils-private.h"
 #include "flatpak-table-printer.h"
 
@@ -95,48 +96,41 @@ get_field (sd_journal *j,
   return g_strndup (data + strlen (name) + 1, len - (strlen (name) + 1));
 }
 
-static GDateTime *
-get_time (sd_journal *j,
-          GError    **error)
-{
-  g_autofree char *value = NULL;
-  GError *local_error = NULL;
-  gint64 t;
-
-  value = get_field (j, "_SOURCE_REALTIME_TIMESTAMP", &local_error);
-
-  if (local_error)
-    {
-      g_propagate_error (error, local_error);
-      return NULL;
-    }
-
-  t = g_ascii_strtoll (value, NULL, 10) / 1000000;
-  return g_date_time_new_from_unix_local (t);
-}
+static const char *journal_fields[] = {
+  "FLATPAK_VERSION",
+  "INSTALLATION",
+  "OPERATION",
+  "REMOTE",
+  "REF",
+  "COMMIT",
+  "OLD_COMMIT",
+  "URL",
+  "_UID",
+  "_EXE",
+  "OBJECT_UID",
+  "OBJECT_EXE",
+};
 
+/* Adds the journal entries for @dirs from before the point where their
+ * history store starts (@cutoffs) to @entries */
 static gboolean
-print_history (GPtrArray    *dirs,
-               Column       *columns,
-               GDateTime    *since,
-               GDateTime    *until,
-               gboolean      reverse,
-               GCancellable *cancellable,
-               GError      **error)
+load_journal_history (GPtrArray  *dirs,
+                      gint64     *cutoffs,
+                      gint64      since,
+                      gint64      until,
+                      GPtrArray  *entries,
+                      GError    **error)
 {
-  g_autoptr(FlatpakTablePrinter) printer = NULL;
   sd_journal *j;
+  gint64 max_cutoff = 0;
   int r;
   int i;
-  int k;
-  int ret;
 
-  if (columns[0].name == NULL)
-    return TRUE;
+  for (i = 0; i < dirs->len; i++)
+    max_cutoff = MAX (max_cutoff, cutoffs[i]);
 
-  printer = flatpak_table_printer_new ();
-
-  flatpak_table_printer_set_columns (printer, columns, opt_cols == NULL);
+  if (until == 0 || until > max_cutoff)
+    until = max_cutoff;
 
   if ((r = sd_journal_open (&j, 0)) < 0)
     {
@@ -147,229 +141,195 @@ print_history (GPtrArray    *dirs,
 
   if ((r = sd_journal_add_match (j, "MESSAGE_ID=" FLATPAK_MESSAGE_ID, 0)) < 0)
     {
+      sd_journal_close (j);
       g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
                    _("Failed to add match to journal: %s"), strerror (-r));
       return FALSE;
     }
 
-  if (reverse)
-    ret = sd_journal_seek_tail (j);
+  /* Walk back from the point where the stores start, so we only read
+   * the part of the journal they don't cover */
+  if (until < G_MAXINT64)
+    r = sd_journal_seek_realtime_usec (j, until);
   else
-    ret = sd_journal_seek_head (j);
-  if (ret == 0)
-    while ((reverse && sd_journal_previous (j) > 0) ||
-           (!reverse && sd_journal_next (j) > 0))
-      {
-        g_autofree char *ref_str = NULL;
-        g_autofree char *remote = NULL;
-
-        /* determine whether to skip this entry */
+    r = sd_journal_seek_tail (j);
 
-        ref_str = get_field (j, "REF", error);
+  if (r == 0)
+    while (sd_journal_previous (j) > 0)
+      {
+        g_autoptr(FlatpakHistoryEntry) entry = NULL;
+        g_autofree char *timestamp = NULL;
+        g_autofree char *installation = NULL;
+        gboolean include = FALSE;
+        guint64 realtime;
+        gint64 t;
+        int k;
+
+        timestamp = get_field (j, "_SOURCE_REALTIME_TIMESTAMP", error);
         if (*error)
-          return FALSE;
+          break;
 
-        /* Appstream pulls are probably not interesting, and they are confusing
-         * since by default we include the Application column which shows up blank.
-         */
-        if (ref_str && ref_str[0] && g_str_has_prefix (ref_str, "appstream"))
+        if (timestamp)
+          t = g_ascii_strtoll (timestamp, NULL, 10);
+        else if (sd_journal_get_realtime_usec (j, &realtime) == 0)
+          t = realtime;
+        else
           continue;
 
-        remote = get_field (j, "REMOTE", error);
-        if (*error)
-          return FALSE;
-
-        /* Exclude pull to temp repo */
-        if (remote && remote[0] == '/')
+        if (t >= until)
           continue;
 
-        if (dirs)
-          {
-            gboolean include = FALSE;
-            g_autofree char *installation = get_field (j, "INSTALLATION", NULL);
-
-            for (i = 0; i < dirs->len && !include; i++)
-              {
-                g_autofree char *name = flatpak_dir_get_name (dirs->pdata[i]);
-                if (g_strcmp0 (name, installation) == 0)
-                  include = TRUE;
-              }
-            if (!include)
-              continue;
-          }
+        if (since > 0 && t <= since)
+          break;
 
-        if (since || until)
+        installation = get_field (j, "INSTALLATION", NULL);
+        for (i = 0; i < dirs->len && !include; i++)
           {
-            g_autoptr(GDateTime) time = get_time (j, NULL);
-
-            if (since && time && g_date_time_difference (since, time) >= 0)
-              continue;
-
-            if (until && time && g_date_time_difference (until, time) <= 0)
-              continue;
+            g_autofree char *name = flatpak_dir_get_name (dirs->pdata[i]);
+            if (g_strcmp0 (name, installation) == 0 && t < cutoffs[i])
+              include = TRUE;
           }
+        if (!include)
+          continue;
 
-        for (k = 0; columns[k].name; k++)
+        entry = g_new0 (FlatpakHistoryEntry, 1);
+        entry->time = t;
+        entry->fields = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+
+        for (k = 0; k < G_N_ELEMENTS (journal_fields); k++)
           {
-            if (strcmp (columns[k].name, "time") == 0)
-              {
-                g_autoptr(GDateTime) time = NULL;
-                g_autofree char *s = NULL;
-
-                time = get_time (j, error);
-                if (*error)
-                  return FALSE;
-
-                s = g_date_time_format (time, "%b %e %T");
-                flatpak_table_printer_add_column (printer, s);
-              }
-            else if (strcmp (columns[k].name, "change") == 0)
-              {
-                g_autofree char *op = get_field (j, "OPERATION", error);
-                if (*error)
-                  return FALSE;
-                flatpak_table_printer_add_column (printer, op);
-              }
-            else if (strcmp (columns[k].name, "ref") == 0 ||
-                     strcmp (columns[k].name, "application") == 0 ||
-                     strcmp (columns[k].name, "arch") == 0 ||
-                     strcmp (columns[k].name, "branch") == 0)
-              {
-                g_autofree char *value = NULL;
-
-                if (ref_str && ref_str[0] &&
-                    !flatpak_is_app_runtime_or_appstream_ref (ref_str) &&
-                    g_strcmp0 (ref_str, OSTREE_REPO_METADATA_REF) != 0)
-                  g_warning ("Unknown ref in history: %s", ref_str);
-
-                if (strcmp (columns[k].name, "ref") == 0)
-                  value = g_strdup (ref_str);
-                else if (ref_str && ref_str[0] &&
-                         (g_str_has_prefix (ref_str, "app/") ||
-                          g_str_has_prefix (ref_str, "runtime/")))
-                  {
-                    g_autoptr(FlatpakDecomposed) ref = NULL;
-                    ref = flatpak_decomposed_new_from_ref (ref_str, NULL);
-                    if (ref == NULL)
-                      g_warning ("Invalid ref in history: %s", ref_str);
-                    else
-                      {
-                        if (strcmp (columns[k].name, "application") == 0)
-                          value = flatpak_decomposed_dup_id (ref);
-                        else if (strcmp (columns[k].name, "arch") == 0)
-                          value = flatpak_decomposed_dup_arch (ref);
-                        else
-                          value = flatpak_decomposed_dup_branch (ref);
-                      }
-                  }
-
-                  flatpak_table_printer_add_column (printer, value);
-              }
-            else if (strcmp (columns[k].name, "installation") == 0)
-              {
-                g_autofree char *installation = get_field (j, "INSTALLATION", error);
-                if (*error)
-                  return FALSE;
-                flatpak_table_printer_add_column (printer, installation);
-              }
-            else if (strcmp (columns[k].name, "remote") == 0)
-              {
-                flatpak_table_printer_add_column (printer, remote);
-              }
-            else if (strcmp (columns[k].name, "commit") == 0)
-              {
-                g_autofree char *commit = get_field (j, "COMMIT", error);
-                if (*error)
-                  return FALSE;
-                flatpak_table_printer_add_column_len (printer, commit, 12);
-              }
-            else if (strcmp (columns[k].name, "old-commit") == 0)
-              {
-                g_autofree char *old_commit = get_field (j, "OLD_COMMIT", error);
-                if (*error)
-                  return FALSE;
-                flatpak_table_printer_add_column_len (printer, old_commit, 12);
-              }
-            else if (strcmp (columns[k].name, "url") == 0)
-              {
-                g_autofree char *url = get_field (j, "URL", error);
-                if (*error)
-                  return FALSE;
-                flatpak_table_printer_add_column (printer, url);
-              }
-            else if (strcmp (columns[k].name, "user") == 0)
-              {
-                g_autofree char *id = get_field (j, "_UID", error);
-                g_autofree char *oid = NULL;
-                int uid;
-                struct passwd *pwd;
-
-                if (*error)
-                  return FALSE;
-
-                uid = g_ascii_strtoll (id, NULL, 10);
-                pwd = getpwuid (uid);
-                if (pwd)
-                  {
-                    g_free (id);
-                    id = g_strdup (pwd->pw_name);
-                  }
-
-                oid = get_field (j, "OBJECT_UID", NULL);
-                if (oid)
-                  {
-                    /* flatpak-system-helper acting on behalf of sb else */
-                    g_autofree char *str = NULL;
-                    uid = g_ascii_strtoll (oid, NULL, 10);
-                    pwd = getpwuid (uid);
-                    str = g_strdup_printf ("%s (%s)", id, pwd ? pwd->pw_name : oid);
-                    flatpak_table_printer_add_column (printer, str);
-                  }
-                else
-                  flatpak_table_printer_add_column (printer, id);
-              }
-            else if (strcmp (columns[k].name, "tool") == 0)
-              {
-                g_autofree char *exe = get_field (j, "_EXE", error);
-                g_autofree char *oexe = NULL;
-                g_autofree char *tool = NULL;
-                if (*error)
-                  return FALSE;
-                tool = g_path_get_basename (exe);
-                oexe = get_field (j, "OBJECT_EXE", NULL);
-                if (oexe)
-                  {
-                    /* flatpak-system-helper acting on behalf of sb else */
-                    g_autofree char *otool = NULL;
-                    g_autofree char *str = NULL;
-
-                    otool = g_path_get_basename (oexe);
-                    str = g_strdup_printf ("%s (%s)", tool, otool);
-                    flatpak_table_printer_add_column (printer, str);
-                  }
-                else
-                  flatpak_table_printer_add_column (printer, tool);
-              }
-            else if (strcmp (columns[k].name, "version") == 0)
-              {
-                g_autofree char *version = get_field (j, "FLATPAK_VERSION", error);
-                if (*error)
-                  return FALSE;
-                flatpak_table_printer_add_column (printer, version);
-              }
+            char *value = get_field (j, journal_fields[k], error);
+            if (*error)
+              break;
+            if (value)
+              g_hash_table_replace (entry->fields, g_strdup (journal_fields[k]), value);
           }
+        if (*error)
+          break;
 
-        flatpak_table_printer_finish_row (printer);
+        g_ptr_array_add (entries, g_steal_pointer (&entry));
       }
 
-  flatpak_table_printer_print (printer);
-
   sd_journal_close (j);
 
-  return TRUE;
+  return *error == NULL;
+}
+
+#endif
+
+static gint64
+to_usec (GDateTime *time)
+{
+  if (time == NULL)
+    return 0;
+
+  return g_date_time_to_unix (time) * G_USEC_PER_SEC + g_date_time_get_microsecond (time);
 }
 
+static gint
+compare_entries (gconstpointer a,
+                 gconstpointer b)
+{
+  const FlatpakHistoryEntry *ea = *(const FlatpakHistoryEntry **) a;
+  const FlatpakHistoryEntry *eb = *(const FlatpakHistoryEntry **) b;
+
+  return ea->time < eb->time ? -1 : (ea->time > eb->time ? 1 : 0);
+}
+
+/* Returns the history of @dirs between @since and @until, oldest
+ * first. Each installation keeps its own history, which only goes
+ * back a limited time; anything older than that comes from the
+ * journal, if we have it. */
+static GPtrArray *
+load_history (GPtrArray    *dirs,
+              GDateTime    *since,
+              GDateTime    *until,
+              GCancellable *cancellable,
+              GError      **error)
+{
+  g_autoptr(GPtrArray) entries = g_ptr_array_new_with_free_func ((GDestroyNotify) flatpak_history_entry_free);
+  g_autofree gint64 *cutoffs = g_new0 (gint64, dirs->len);
+  gint64 since_usec = to_usec (since);
+  gint64 until_usec = to_usec (until);
+  gboolean need_journal = FALSE;
+  gboolean have_store = FALSE;
+  int i;
+
+  for (i = 0; i < dirs->len; i++)
+    {
+      FlatpakDir *dir = dirs->pdata[i];
+      g_autoptr(GFile) history_dir = flatpak_dir_get_history_dir (dir);
+      g_autoptr(GPtrArray) dir_entries = NULL;
+      g_autoptr(GError) local_error = NULL;
+      g_autofree char *name = flatpak_dir_get_name (dir);
+      int k;
+
+      dir_entries = flatpak_history_load (history_dir, since_usec, until_usec, &cutoffs[i],
+                                          cancellable, &local_error);
+      if (dir_entries == NULL)
+        {
+          /* The history is only readable by the owner of the installation */
+          if (!g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND) &&
+              !g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_PERMISSION_DENIED))
+            {
+              g_propagate_error (error, g_steal_pointer (&local_error));
+              return NULL;
+            }
+
+          cutoffs[i] = G_MAXINT64;
+        }
+      else
+        {
+          have_store = TRUE;
+
+          for (k = 0; k < dir_entries->len; k++)
+            {
+              FlatpakHistoryEntry *entry = dir_entries->pdata[k];
+
+              /* Pulls into a temporary child repo are logged with its path */
+              if (g_strcmp0 (g_hash_table_lookup (entry->fields, "INSTALLATION"), name) != 0)
+                continue;
+
+              g_ptr_array_add (entries, g_steal_pointer (&dir_entries->pdata[k]));
+            }
+        }
+
+      /* Without a store, or for a range that starts before it, the
+       * older entries can only come from the journal. Without --since
+       * that only applies if there's no store at all. */
+      if (cutoffs[i] == G_MAXINT64 ||
+          (since_usec > 0 && since_usec < cutoffs[i]))
+        need_journal = TRUE;
+    }
+
+  if (need_journal)
+    {
+#ifdef HAVE_LIBSYSTEMD
+      g_autoptr(GError) local_error = NULL;
+
+      if (!load_journal_history (dirs, cutoffs, since_usec, until_usec, entries, &local_error))
+        {
+          if (!have_store)
+            {
+              g_propagate_error (error, g_steal_pointer (&local_error));
+              return NULL;
+            }
+
+          g_debug ("Not using older history from the journal: %s", local_error->message);
+        }
 #else
+      if (!have_store)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED, "history not available without libsystemd");
+          return NULL;
+        }
+#endif
+    }
+
+  g_ptr_array_sort (entries, compare_entries);
+
+  return g_steal_pointer (&entries);
+}
 
 static gboolean
 print_history (GPtrArray    *dirs,
@@ -380,14 +340,167 @@ print_history (GPtrArray    *dirs,
                GCancellable *cancellable,
                GError      **error)
 {
+  g_autoptr(FlatpakTablePrinter) printer = NULL;
+  g_autoptr(GPtrArray) entries = NULL;
+  int i;
+  int k;
+
   if (columns[0].name == NULL)
     return TRUE;
 
-  g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED, "history not available without libsystemd");
-  return FALSE;
-}
+  entries = load_history (dirs, since, until, cancellable, error);
+  if (entries == NULL)
+    return FALSE;
 
-#endif
+  printer = flatpak_table_printer_new ();
+
+  flatpak_table_printer_set_columns (printer, columns, opt_cols == NULL);
+
+  for (i = 0; i < entries->len; i++)
+    {
+      FlatpakHistoryEntry *entry = entries->pdata[reverse ? entries->len - 1 - i : i];
+      const char *ref_str = g_hash_table_lookup (entry->fields, "REF");
+      const char *remote = g_hash_table_lookup (entry->fields, "REMOTE");
+
+      /* determine whether to skip this entry */
+
+      /* Appstream pulls are probably not interesting, and they are confusing
+       * since by default we include the Application column which shows up blank.
+       */
+      if (ref_str && ref_str[0] && g_str_has_prefix (ref_str, "appstream"))
+        continue;
+
+      /* Exclude pull to temp repo */
+      if (remote && remote[0] == '/')
+        continue;
+
+      for (k = 0; columns[k].name; k++)
+        {
+          if (strcmp (columns[k].name, "time") == 0)
+            {
+              g_autoptr(GDateTime) time = NULL;
+              g_autofree char *s = NULL;
+
+              time = g_date_time_new_from_unix_local (entry->time / G_USEC_PER_SEC);
+              s = g_date_time_format (time, "%b %e %T");
+              flatpak_table_printer_add_column (printer, s);
+            }
+          else if (strcmp (columns[k].name, "change") == 0)
+            {
+              flatpak_table_printer_add_column (printer, g_hash_table_lookup (entry->fields, "OPERATION"));
+            }
+          else if (strcmp (columns[k].name, "ref") == 0 ||
+                   strcmp (columns[k].name, "application") == 0 ||
+                   strcmp (columns[k].name, "arch") == 0 ||
+                   strcmp (columns[k].name, "branch") == 0)
+            {
+              g_autofree char *value = NULL;
+
+              if (ref_str && ref_str[0] &&
+                  !flatpak_is_app_runtime_or_appstream_ref (ref_str) &&
+                  g_strcmp0 (ref_str, OSTREE_REPO_METADATA_REF) != 0)
+                g_warning ("Unknown ref in history: %s", ref_str);
+
+              if (strcmp (columns[k].name, "ref") == 0)
+                value = g_strdup (ref_str);
+              else if (ref_str && ref_str[0] &&
+                       (g_str_has_prefix (ref_str, "app/") ||
+                        g_str_has_prefix (ref_str, "runtime/")))
+                {
+                  g_autoptr(FlatpakDecomposed) ref = NULL;
+                  ref = flatpak_decomposed_new_from_ref (ref_str, NULL);
+                  if (ref == NULL)
+                    g_warning ("Invalid ref in history: %s", ref_str);
+                  else
+                    {
+                      if (strcmp (columns[k].name, "application") == 0)
+                        value = flatpak_decomposed_dup_id (ref);
+                      else if (strcmp (columns[k].name, "arch") == 0)
+                        value = flatpak_decomposed_dup_arch (ref);
+                      else
+                        value = flatpak_decomposed_dup_branch (ref);
+                    }
+                }
+
+              flatpak_table_printer_add_column (printer, value);
+            }
+          else if (strcmp (columns[k].name, "installation") == 0)
+            {
+              flatpak_table_printer_add_column (printer, g_hash_table_lookup (entry->fields, "INSTALLATION"));
+            }
+          else if (strcmp (columns[k].name, "remote") == 0)
+            {
+              flatpak_table_printer_add_column (printer, remote);
+            }
+          else if (strcmp (columns[k].name, "commit") == 0)
+            {
+              flatpak_table_printer_add_column_len (printer, g_hash_table_lookup (entry->fields, "COMMIT"), 12);
+            }
+          else if (strcmp (columns[k].name, "old-commit") == 0)
+            {
+              flatpak_table_printer_add_column_len (printer, g_hash_table_lookup (entry->fields, "OLD_COMMIT"), 12);
+            }
+          else if (strcmp (columns[k].name, "url") == 0)
+            {
+              flatpak_table_printer_add_column (printer, g_hash_table_lookup (entry->fields, "URL"));
+            }
+          else if (strcmp (columns[k].name, "user") == 0)
+            {
+              const char *id = g_hash_table_lookup (entry->fields, "_UID");
+              const char *oid = g_hash_table_lookup (entry->fields, "OBJECT_UID");
+              struct passwd *pwd = NULL;
+              g_autofree char *user = NULL;
+
+              if (id)
+                pwd = getpwuid (g_ascii_strtoll (id, NULL, 10));
+              user = g_strdup (pwd ? pwd->pw_name : id);
+
+              if (oid)
+                {
+                  /* flatpak-system-helper acting on behalf of sb else */
+                  g_autofree char *str = NULL;
+                  pwd = getpwuid (g_ascii_strtoll (oid, NULL, 10));
+                  str = g_strdup_printf ("%s (%s)", user ? user : "", pwd ? pwd->pw_name : oid);
+                  flatpak_table_printer_add_column (printer, str);
+                }
+              else
+                flatpak_table_printer_add_column (printer, user);
+            }
+          else if (strcmp (columns[k].name, "tool") == 0)
+            {
+              const char *exe = g_hash_table_lookup (entry->fields, "_EXE");
+              const char *oexe = g_hash_table_lookup (entry->fields, "OBJECT_EXE");
+              g_autofree char *tool = NULL;
+
+              if (exe)
+                tool = g_path_get_basename (exe);
+
+              if (oexe)
+                {
+                  /* flatpak-system-helper acting on behalf of sb else */
+                  g_autofree char *otool = NULL;
+                  g_autofree char *str = NULL;
+
+                  otool = g_path_get_basename (oexe);
+                  str = g_strdup_printf ("%s (%s)", tool ? tool : "", otool);
+                  flatpak_table_printer_add_column (printer, str);
+                }
+              else
+                flatpak_table_printer_add_column (printer, tool);
+            }
+          else if (strcmp (columns[k].name, "version") == 0)
+            {
+              flatpak_table_printer_add_column (printer, g_hash_table_lookup (entry->fields, "FLATPAK_VERSION"));
+            }
+        }
+
+      flatpak_table_printer_finish_row (printer);
+    }
+
+  flatpak_table_printer_print (printer);
+
+  return TRUE;
+}
 
 static GDateTime *
 parse_time (const char *since_opt)
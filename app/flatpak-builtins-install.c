@@ -382,6 +382,9 @@ flatpak_builtin_install (int argc, char **argv, GCancellable *cancellable, GErro
            * doesn't distinguish between an exact match and a fuzzy match, but
            * that's okay because the user will be asked to confirm the remote
            */
+          if (!opt_no_pull)
+            prefetch_remote_states (dirs, FALSE, cancellable);
+
           for (i = 0; i < dirs->len; i++)
             {
               FlatpakDir *this_dir = g_ptr_array_index (dirs, i);
@@ -42,6 +42,7 @@ static gboolean opt_no_deps;
 static gboolean opt_if_not_exists;
 static gboolean opt_disable;
 static int opt_prio = -1;
+static int opt_summary_max_age = -1;
 static char *opt_filter;
 static char *opt_title;
 static char *opt_comment;
@@ -70,6 +71,7 @@ static GOptionEntry common_options[] = {
   { "no-enumerate", 0, 0, G_OPTION_ARG_NONE, &opt_no_enumerate, N_("Mark the remote as don't enumerate"), NULL },
   { "no-use-for-deps", 0, 0, G_OPTION_ARG_NONE, &opt_no_deps, N_("Mark the remote as don't use for deps"), NULL },
   { "prio", 0, 0, G_OPTION_ARG_INT, &opt_prio, N_("Set priority (default 1, higher is more prioritized)"), N_("PRIORITY") },
+  { "summary-max-age", 0, 0, G_OPTION_ARG_INT, &opt_summary_max_age, N_("Use the cached summary for up to SECONDS without checking for changes"), N_("SECONDS") },
   { "subset", 0, 0, G_OPTION_ARG_STRING, &opt_subset, N_("The named subset to use for this remote"), N_("SUBSET") },
   { "title", 0, 0, G_OPTION_ARG_STRING, &opt_title, N_("A nice name to use for this remote"), N_("TITLE") },
   { "comment", 0, 0, G_OPTION_ARG_STRING, &opt_comment, N_("A one-line comment for this remote"), N_("COMMENT") },
@@ -187,6 +189,12 @@ get_config_from_opts (GKeyFile *config,
       g_key_file_set_string (config, group, "xa.prio", prio_as_string);
     }
 
+  if (opt_summary_max_age >= 0)
+    {
+      g_autofree char *max_age_as_string = g_strdup_printf ("%d", opt_summary_max_age);
+      g_key_file_set_string (config, group, "xa.summary-max-age", max_age_as_string);
+    }
+
   if (opt_gpg_import != NULL)
     {
       g_clear_pointer (gpg_data, g_bytes_unref); /* Free if set from flatpakrepo file */
@@ -455,6 +455,9 @@ flatpak_builtin_remote_ls (int argc, char **argv, GCancellable *cancellable, GEr
     {
       int i;
 
+      if (!opt_cached && !opt_sideloaded)
+        prefetch_remote_states (dirs, TRUE, cancellable);
+
       for (i = 0; i < dirs->len; i++)
         {
           FlatpakDir *dir = g_ptr_array_index (dirs, i);
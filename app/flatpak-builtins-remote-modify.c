@@ -46,6 +46,7 @@ static gboolean opt_no_filter;
 static gboolean opt_do_follow_redirect;
 static gboolean opt_no_follow_redirect;
 static int opt_prio = -1;
+static int opt_summary_max_age = -1;
 static char *opt_filter;
 static char *opt_title;
 static char *opt_comment;
@@ -78,6 +79,7 @@ static GOptionEntry common_options[] = {
   { "no-enumerate", 0, 0, G_OPTION_ARG_NONE, &opt_no_enumerate, N_("Mark the remote as don't enumerate"), NULL },
   { "no-use-for-deps", 0, 0, G_OPTION_ARG_NONE, &opt_no_deps, N_("Mark the remote as don't use for deps"), NULL },
   { "prio", 0, 0, G_OPTION_ARG_INT, &opt_prio, N_("Set priority (default 1, higher is more prioritized)"), N_("PRIORITY") },
+  { "summary-max-age", 0, 0, G_OPTION_ARG_INT, &opt_summary_max_age, N_("Use the cached summary for up to SECONDS without checking for changes"), N_("SECONDS") },
   { "title", 0, 0, G_OPTION_ARG_STRING, &opt_title, N_("A nice name to use for this remote"), N_("TITLE") },
   { "comment", 0, 0, G_OPTION_ARG_STRING, &opt_comment, N_("A one-line comment for this remote"), N_("COMMENT") },
   { "description", 0, 0, G_OPTION_ARG_STRING, &opt_description, N_("A full-paragraph description for this remote"), N_("DESCRIPTION") },
@@ -240,6 +242,13 @@ get_config_from_opts (FlatpakDir *dir, const char *remote_name, gboolean *change
       *changed = TRUE;
     }
 
+  if (opt_summary_max_age >= 0)
+    {
+      g_autofree char *max_age_as_string = g_strdup_printf ("%d", opt_summary_max_age);
+      g_key_file_set_string (config, group, "xa.summary-max-age", max_age_as_string);
+      *changed = TRUE;
+    }
+
   if (opt_authenticator_name)
     {
       g_key_file_set_string (config, group, "xa.authenticator-name", opt_authenticator_name);
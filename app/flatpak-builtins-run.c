@@ -48,6 +48,7 @@ static gboolean opt_log_a11y_bus;
 static int opt_a11y_bus = -1;
 static int opt_session_bus = -1;
 static gboolean opt_no_documents_portal;
+static gboolean opt_share_dbus_proxy;
 static gboolean opt_file_forwarding;
 static gboolean opt_die_with_parent;
 static gboolean opt_sandbox;
@@ -77,6 +78,7 @@ static GOptionEntry options[] = {
   { "a11y-bus", 0, 0, G_OPTION_ARG_NONE, &opt_a11y_bus, N_("Proxy accessibility bus calls (default except when sandboxed)"), NULL },
   { "no-session-bus", 0, G_OPTION_FLAG_REVERSE, G_OPTION_ARG_NONE, &opt_session_bus, N_("Don't proxy session bus calls"), NULL },
   { "session-bus", 0, 0, G_OPTION_ARG_NONE, &opt_session_bus, N_("Proxy session bus calls (default except when sandboxed)"), NULL },
+  { "share-dbus-proxy", 0, 0, G_OPTION_ARG_NONE, &opt_share_dbus_proxy, N_("Share the D-Bus proxy with other instances that have the same bus policy"), NULL },
   { "no-documents-portal", 0, 0, G_OPTION_ARG_NONE, &opt_no_documents_portal, N_("Don't start portals"), NULL },
   { "file-forwarding", 0, 0, G_OPTION_ARG_NONE, &opt_file_forwarding, N_("Enable file forwarding"), NULL },
   { "commit", 0, 0, G_OPTION_ARG_STRING, &opt_commit, N_("Run specified commit"), NULL },
@@ -304,6 +306,8 @@ flatpak_builtin_run (int argc, char **argv, GCancellable *cancellable, GError **
     flags |= FLATPAK_RUN_FLAG_NO_A11Y_BUS_PROXY;
   if (!opt_session_bus)
     flags |= FLATPAK_RUN_FLAG_NO_SESSION_BUS_PROXY;
+  if (opt_share_dbus_proxy)
+    flags |= FLATPAK_RUN_FLAG_SHARE_DBUS_PROXY;
 
   if (!flatpak_run_app (app_deploy ? app_ref : runtime_ref,
                         app_deploy,
@@ -23,6 +23,7 @@
 #include <glib/gi18n.h>
 #include <appstream.h>
 
+#include "flatpak-appstream-index-private.h"
 #include "flatpak-builtins.h"
 #include "flatpak-builtins-utils.h"
 #include "flatpak-dir-private.h"
@@ -48,70 +49,40 @@ static Column all_columns[] = {
   { NULL }
 };
 
-static GPtrArray *
-get_remote_stores (GPtrArray *dirs, const char *arch, GCancellable *cancellable)
-{
-  GError *error = NULL;
-  GPtrArray *ret = g_ptr_array_new_with_free_func (g_object_unref);
-  guint i, j;
-
-  for (i = 0; i < dirs->len; ++i)
-    {
-      FlatpakDir *dir = g_ptr_array_index (dirs, i);
-      g_auto(GStrv) remotes = NULL;
-
-      flatpak_log_dir_access (dir);
-
-      remotes = flatpak_dir_list_enumerated_remotes (dir, cancellable, &error);
-      if (error)
-        {
-          g_warning ("%s", error->message);
-          g_clear_error (&error);
-          continue;
-        }
-      else if (remotes == NULL)
-        continue;
-
-      for (j = 0; remotes[j]; ++j)
-        {
-          g_autoptr(AsMetadata) mdata = as_metadata_new ();
-
-          flatpak_dir_load_appstream_store (dir, remotes[j], arch, mdata, cancellable, &error);
-
-          if (error)
-            {
-              g_warning ("%s", error->message);
-              g_clear_error (&error);
-            }
-
-          g_object_set_data_full (G_OBJECT (mdata), "remote-name", g_strdup (remotes[j]), g_free);
-          g_ptr_array_add (ret, g_steal_pointer (&mdata));
-        }
-    }
-  return ret;
-}
-
 typedef struct MatchResult
 {
-  AsComponent *app;
-  GPtrArray   *remotes;
-  guint        score;
+  FlatpakDecomposed *ref;
+  char              *name;
+  char              *summary;
+  char              *version;
+  GPtrArray         *remotes;
+  guint              score;
 } MatchResult;
 
 static void
 match_result_free (MatchResult *result)
 {
-  g_object_unref (result->app);
+  flatpak_decomposed_unref (result->ref);
+  g_free (result->name);
+  g_free (result->summary);
+  g_free (result->version);
   g_ptr_array_unref (result->remotes);
   g_free (result);
 }
 
 static MatchResult *
-match_result_new (AsComponent *app, guint score)
+match_result_new (FlatpakDecomposed *ref,
+                  const char        *name,
+                  const char        *summary,
+                  const char        *version,
+                  guint              score)
 {
   MatchResult *result = g_new (MatchResult, 1);
 
-  result->app = g_object_ref (app);
+  result->ref = flatpak_decomposed_ref (ref);
+  result->name = g_strdup (name);
+  result->summary = g_strdup (summary);
+  result->version = g_strdup (version);
   result->remotes = g_ptr_array_new_with_free_func (g_free);
   result->score = score;
 
@@ -133,76 +104,206 @@ match_result_add_remote (MatchResult *self, const char *remote)
 }
 
 static int
-compare_by_score (MatchResult *a, MatchResult *b, gpointer user_data)
+compare_by_score (gconstpointer a, gconstpointer b)
 {
+  const MatchResult *ra = *(const MatchResult **) a;
+  const MatchResult *rb = *(const MatchResult **) b;
+
   // Reverse order, higher score comes first
-  return (int) b->score - (int) a->score;
+  return (int) rb->score - (int) ra->score;
 }
 
-static gboolean
-as_app_equal (AsComponent *app1, AsComponent *app2)
+typedef struct
 {
-  if (app1 == app2)
-    return TRUE;
+  GPtrArray  *matches;
+  GHashTable *matches_by_key;
+} SearchResults;
 
-  FlatpakDecomposed *app1_decomposed = g_object_get_data (G_OBJECT (app1), "decomposed");
-  FlatpakDecomposed *app2_decomposed = g_object_get_data (G_OBJECT (app2), "decomposed");
+static void
+search_results_add (SearchResults     *results,
+                    FlatpakDecomposed *ref,
+                    const char        *name,
+                    const char        *summary,
+                    const char        *version,
+                    guint              score,
+                    const char        *remote)
+{
+  g_autofree char *id = flatpak_decomposed_dup_id (ref);
+  g_autofree char *key = NULL;
+  MatchResult *result;
 
   /* Ignore arch when comparing since it's not shown in the search output and
    * we don't want duplicate results for the same app with different arches.
    */
-  return flatpak_decomposed_equal_except_arch (app1_decomposed, app2_decomposed);
+  key = g_strdup_printf ("%s/%s/%s", flatpak_decomposed_get_kind_str (ref), id,
+                         flatpak_decomposed_get_branch (ref));
+
+  // Avoid duplicate entries, but show multiple remotes
+  result = g_hash_table_lookup (results->matches_by_key, key);
+  if (result == NULL)
+    {
+      result = match_result_new (ref, name, summary, version, score);
+      g_ptr_array_add (results->matches, result);
+      g_hash_table_insert (results->matches_by_key, g_steal_pointer (&key), result);
+    }
+  match_result_add_remote (result, remote);
 }
 
-static int
-compare_apps (MatchResult *a, AsComponent *b)
+static void
+search_index (SearchResults *results,
+              GVariant      *index,
+              const char    *remote_name,
+              const char    *search_text)
 {
-  return !as_app_equal (a->app, b);
+  g_autoptr(GArray) hits = flatpak_appstream_index_search (index, search_text);
+  guint i;
+
+  /* Only the matching components are looked at beyond the index */
+  for (i = 0; i < hits->len; i++)
+    {
+      FlatpakAppstreamIndexMatch *hit = &g_array_index (hits, FlatpakAppstreamIndexMatch, i);
+      g_autoptr(FlatpakDecomposed) decomposed = NULL;
+      const char *ref, *name, *summary, *version;
+
+      flatpak_appstream_index_get_component (index, hit->component,
+                                             &ref, &name, &summary, &version);
+
+      decomposed = flatpak_decomposed_new_from_ref (ref, NULL);
+      if (decomposed == NULL)
+        {
+          g_debug ("Ignoring invalid ref %s from remote %s", ref, remote_name);
+          continue;
+        }
+
+      search_results_add (results, decomposed, name, summary, version, hit->score, remote_name);
+    }
 }
 
-/* as_component_get_id() returns the appstream component ID which doesn't
- * necessarily match the flatpak app ID (e.g. sometimes there's a .desktop
- * suffix on the appstream ID) so this gets the flatpak app ID via the bundle
- * element
- */
-static char *
-component_get_flatpak_id (AsComponent *app)
+static void
+search_store (SearchResults *results,
+              AsMetadata    *mdata,
+              const char    *remote_name,
+              const char    *search_text)
 {
-  FlatpakDecomposed *app_decomposed = g_object_get_data (G_OBJECT (app), "decomposed");
-  return flatpak_decomposed_dup_id (app_decomposed);
+  GPtrArray *apps = as_metadata_get_components (mdata);
+  guint i;
+
+  for (i = 0; i < apps->len; ++i)
+    {
+      AsComponent *app = g_ptr_array_index (apps, i);
+      g_autoptr(FlatpakDecomposed) decomposed = NULL;
+      guint score;
+
+      AsBundle *bundle = as_component_get_bundle (app, AS_BUNDLE_KIND_FLATPAK);
+      if (bundle == NULL || as_bundle_get_id (bundle) == NULL ||
+          (decomposed = flatpak_decomposed_new_from_ref (as_bundle_get_id (bundle), NULL)) == NULL)
+        {
+          g_debug ("Ignoring app %s from remote %s as it lacks a flatpak bundle",
+                   as_component_get_id (app), remote_name);
+          continue;
+        }
+
+      score = as_component_search_matches (app, search_text);
+      if (score == 0)
+        {
+          /* as_component_get_id() returns the appstream component ID which doesn't
+           * necessarily match the flatpak app ID (e.g. sometimes there's a .desktop
+           * suffix on the appstream ID) so use the ID from the bundle element
+           */
+          g_autofree char *app_id = flatpak_decomposed_dup_id (decomposed);
+          if (strcasestr (app_id, search_text) != NULL)
+            score = 50;
+          else
+            continue;
+        }
+
+      search_results_add (results, decomposed,
+                          as_component_get_name (app),
+                          as_component_get_summary (app),
+                          as_app_get_version (app),
+                          score, remote_name);
+    }
 }
 
-/* as_component_get_branch() seems to return NULL in practice, so use the
- * bundle id to get the branch
- */
-static const char *
-component_get_branch (AsComponent *app)
+static void
+search_remotes (SearchResults *results,
+                GPtrArray     *dirs,
+                const char    *arch,
+                const char    *search_text,
+                GCancellable  *cancellable)
 {
-  FlatpakDecomposed *app_decomposed = g_object_get_data (G_OBJECT (app), "decomposed");
-  return flatpak_decomposed_get_branch (app_decomposed);
+  GError *error = NULL;
+  guint i, j;
+
+  for (i = 0; i < dirs->len; ++i)
+    {
+      FlatpakDir *dir = g_ptr_array_index (dirs, i);
+      g_auto(GStrv) remotes = NULL;
+
+      flatpak_log_dir_access (dir);
+
+      remotes = flatpak_dir_list_enumerated_remotes (dir, cancellable, &error);
+      if (error)
+        {
+          g_warning ("%s", error->message);
+          g_clear_error (&error);
+          continue;
+        }
+      else if (remotes == NULL)
+        continue;
+
+      // We search each remote separately so we keep the remote information
+      // as the appstream data doesn't contain that information
+      for (j = 0; remotes[j]; ++j)
+        {
+          g_autoptr(GVariant) index = NULL;
+          g_autoptr(AsMetadata) mdata = NULL;
+
+          index = flatpak_dir_load_appstream_index (dir, remotes[j], arch, &error);
+          if (error)
+            {
+              g_debug ("Failed to load search index for %s: %s", remotes[j], error->message);
+              g_clear_error (&error);
+            }
+
+          if (index != NULL)
+            {
+              search_index (results, index, remotes[j], search_text);
+              continue;
+            }
+
+          /* No index, e.g. the appstream was deployed by an older version */
+          mdata = as_metadata_new ();
+          flatpak_dir_load_appstream_store (dir, remotes[j], arch, mdata, cancellable, &error);
+          if (error)
+            {
+              g_warning ("%s", error->message);
+              g_clear_error (&error);
+            }
+
+          search_store (results, mdata, remotes[j], search_text);
+        }
+    }
 }
 
 static void
 print_app (Column *columns, MatchResult *res, FlatpakTablePrinter *printer)
 {
-  const char *version = as_app_get_version (res->app);
-  g_autofree char *id = component_get_flatpak_id (res->app);
-  const char *name = as_component_get_name (res->app);
-  const char *comment = as_component_get_summary (res->app);
+  g_autofree char *id = flatpak_decomposed_dup_id (res->ref);
   guint i;
 
   for (i = 0; columns[i].name; i++)
     {
       if (strcmp (columns[i].name, "name") == 0)
-        flatpak_table_printer_add_column (printer, name);
+        flatpak_table_printer_add_column (printer, res->name);
       if (strcmp (columns[i].name, "description") == 0)
-        flatpak_table_printer_add_column (printer, comment);
+        flatpak_table_printer_add_column (printer, res->summary);
       else if (strcmp (columns[i].name, "application") == 0)
         flatpak_table_printer_add_column (printer, id);
       else if (strcmp (columns[i].name, "version") == 0)
-        flatpak_table_printer_add_column (printer, version);
+        flatpak_table_printer_add_column (printer, res->version);
       else if (strcmp (columns[i].name, "branch") == 0)
-        flatpak_table_printer_add_column (printer, component_get_branch (res->app));
+        flatpak_table_printer_add_column (printer, flatpak_decomposed_get_branch (res->ref));
       else if (strcmp (columns[i].name, "remotes") == 0)
         {
           int j;
@@ -215,19 +316,19 @@ print_app (Column *columns, MatchResult *res, FlatpakTablePrinter *printer)
 }
 
 static void
-print_matches (Column *columns, GSList *matches)
+print_matches (Column *columns, GPtrArray *matches)
 {
   g_autoptr(FlatpakTablePrinter) printer = NULL;
   int rows, cols;
-  GSList *s;
+  guint i;
 
   printer = flatpak_table_printer_new ();
 
   flatpak_table_printer_set_columns (printer, columns, opt_cols != NULL);
 
-  for (s = matches; s; s = s->next)
+  for (i = 0; i < matches->len; i++)
     {
-      MatchResult *res = s->data;
+      MatchResult *res = g_ptr_array_index (matches, i);
       print_app (columns, res, printer);
     }
 
@@ -242,6 +343,9 @@ flatpak_builtin_search (int argc, char **argv, GCancellable *cancellable, GError
   g_autoptr(GPtrArray) dirs = NULL;
   g_autofree char *col_help = NULL;
   g_autofree Column *columns = NULL;
+  g_autoptr(GPtrArray) matches = NULL;
+  g_autoptr(GHashTable) matches_by_key = NULL;
+  SearchResults results;
   g_autoptr(GOptionContext) context = g_option_context_new (_("TEXT - Search remote apps/runtimes for text"));
   g_option_context_set_translation_domain (context, GETTEXT_PACKAGE);
   col_help = column_help (all_columns);
@@ -263,66 +367,19 @@ flatpak_builtin_search (int argc, char **argv, GCancellable *cancellable, GError
     return FALSE;
 
   const char *search_text = argv[1];
-  GSList *matches = NULL;
-  guint j;
 
-  // We want a store for each remote so we keep the remote information
-  // as AsComponent doesn't currently contain that information
-  g_autoptr(GPtrArray) remote_stores = get_remote_stores (dirs, opt_arch, cancellable);
-  for (j = 0; j < remote_stores->len; ++j)
-    {
-      AsMetadata *mdata = g_ptr_array_index (remote_stores, j);
-      GPtrArray *apps = as_metadata_get_components (mdata);
-      guint i;
-
-      for (i = 0; i < apps->len; ++i)
-        {
-          AsComponent *app = g_ptr_array_index (apps, i);
-          const char *remote_name = g_object_get_data (G_OBJECT (mdata), "remote-name");
-          g_autoptr(FlatpakDecomposed) decomposed = NULL;
-
-          AsBundle *bundle = as_component_get_bundle (app, AS_BUNDLE_KIND_FLATPAK);
-          if (bundle == NULL || as_bundle_get_id (bundle) == NULL ||
-              (decomposed = flatpak_decomposed_new_from_ref (as_bundle_get_id (bundle), NULL)) == NULL)
-            {
-              g_debug ("Ignoring app %s from remote %s as it lacks a flatpak bundle",
-                       as_component_get_id (app), remote_name);
-              continue;
-            }
-
-          g_object_set_data_full (G_OBJECT (app), "decomposed", g_steal_pointer (&decomposed),
-                                  (GDestroyNotify) flatpak_decomposed_unref);
+  matches = g_ptr_array_new_with_free_func ((GDestroyNotify) match_result_free);
+  matches_by_key = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  results.matches = matches;
+  results.matches_by_key = matches_by_key;
 
-          guint score = as_component_search_matches (app, search_text);
-          if (score == 0)
-            {
-              g_autofree char *app_id = component_get_flatpak_id (app);
-              if (strcasestr (app_id, search_text) != NULL)
-                score = 50;
-              else
-                continue;
-            }
-
-          // Avoid duplicate entries, but show multiple remotes
-          GSList *list_entry = g_slist_find_custom (matches, app,
-                                                    (GCompareFunc) compare_apps);
-          MatchResult *result = NULL;
-          if (list_entry != NULL)
-            result = list_entry->data;
-          else
-            {
-              result = match_result_new (app, score);
-              matches = g_slist_insert_sorted_with_data (matches, result,
-                                                         (GCompareDataFunc) compare_by_score, NULL);
-            }
-          match_result_add_remote (result, remote_name);
-        }
-    }
+  search_remotes (&results, dirs, opt_arch, search_text, cancellable);
 
-  if (matches != NULL)
+  if (matches->len > 0)
     {
+      /* This is a stable sort, so equal scores keep the remote order */
+      g_ptr_array_sort (matches, compare_by_score);
       print_matches (columns, matches);
-      g_slist_free_full (matches, (GDestroyNotify) match_result_free);
     }
   else
     {
@@ -51,6 +51,7 @@ static gboolean opt_app;
 static gboolean opt_appstream;
 static gboolean opt_yes;
 static gboolean opt_noninteractive;
+static gboolean opt_parallel;
 
 static GOptionEntry options[] = {
   { "arch", 0, 0, G_OPTION_ARG_STRING, &opt_arch, N_("Arch to update for"), N_("ARCH") },
@@ -67,11 +68,50 @@ static GOptionEntry options[] = {
   { "subpath", 0, 0, G_OPTION_ARG_FILENAME_ARRAY, &opt_subpaths, N_("Only update this subpath"), N_("PATH") },
   { "assumeyes", 'y', 0, G_OPTION_ARG_NONE, &opt_yes, N_("Automatically answer yes for all questions"), NULL },
   { "noninteractive", 0, 0, G_OPTION_ARG_NONE, &opt_noninteractive, N_("Produce minimal output and don't ask questions"), NULL },
+  { "parallel", 0, 0, G_OPTION_ARG_NONE, &opt_parallel, N_("Update all installations at the same time"), NULL },
   /* Translators: A sideload is when you install from a local USB drive rather than the Internet. */
   { "sideload-repo", 0, 0, G_OPTION_ARG_FILENAME_ARRAY, &opt_sideload_repos, N_("Use this local repo for sideloads"), N_("PATH") },
   { NULL }
 };
 
+/* Progress of one of the transactions of a parallel update. The other
+ * transactions may still be resolving, so there is no total over all
+ * of them. The signals are emitted in the thread of the transaction,
+ * and only that one touches its progress. */
+typedef struct
+{
+  guint n_ops;
+  guint n_done;
+} ParallelProgress;
+
+static gboolean
+parallel_ready (FlatpakTransaction *transaction,
+                ParallelProgress   *progress)
+{
+  GList *ops = flatpak_transaction_get_operations (transaction);
+
+  progress->n_ops = g_list_length (ops);
+  g_list_free_full (ops, g_object_unref);
+
+  return TRUE;
+}
+
+static void
+parallel_operation_done (FlatpakTransaction          *transaction,
+                         FlatpakTransactionOperation *op,
+                         const char                  *commit,
+                         FlatpakTransactionResult     details,
+                         ParallelProgress            *progress)
+{
+  FlatpakInstallation *installation = flatpak_transaction_get_installation (transaction);
+
+  progress->n_done++;
+
+  g_print (_("[%u/%u] Done with %s in %s\n"), progress->n_done, progress->n_ops,
+           flatpak_transaction_operation_get_ref (op),
+           flatpak_installation_get_display_name (installation));
+}
+
 gboolean
 flatpak_builtin_update (int           argc,
                         char        **argv,
@@ -85,6 +125,7 @@ flatpak_builtin_update (int           argc,
   const char *default_branch = NULL;
   FlatpakKinds kinds;
   g_autoptr(GPtrArray) transactions = NULL;
+  g_autofree ParallelProgress *parallel_progress = NULL;
   gboolean has_updates;
 
   context = g_option_context_new (_("[REF…] - Update applications or runtimes"));
@@ -103,6 +144,10 @@ flatpak_builtin_update (int           argc,
       return TRUE;
     }
 
+  /* The transactions can't share the terminal for questions */
+  if (opt_parallel)
+    opt_noninteractive = TRUE; /* Implied */
+
   if (opt_noninteractive)
     opt_yes = TRUE; /* Implied */
 
@@ -121,6 +166,7 @@ flatpak_builtin_update (int           argc,
     return usage_error (context, _("With --commit, only one REF may be specified"), error);
 
   transactions = g_ptr_array_new_with_free_func ((GDestroyNotify) g_object_unref);
+  parallel_progress = g_new0 (ParallelProgress, dirs->len);
 
   /* Walk through the array backwards so we can safely remove */
   for (k = dirs->len; k > 0; k--)
@@ -153,6 +199,12 @@ flatpak_builtin_update (int           argc,
       for (i = 0; opt_sideload_repos != NULL && opt_sideload_repos[i] != NULL; i++)
         flatpak_transaction_add_sideload_repo (transaction, opt_sideload_repos[i]);
 
+      if (opt_parallel)
+        {
+          g_signal_connect (transaction, "ready", G_CALLBACK (parallel_ready), &parallel_progress[k - 1]);
+          g_signal_connect (transaction, "operation-done", G_CALLBACK (parallel_operation_done), &parallel_progress[k - 1]);
+        }
+
       g_ptr_array_insert (transactions, 0, transaction);
     }
 
@@ -249,14 +301,19 @@ flatpak_builtin_update (int           argc,
 
   has_updates = FALSE;
 
-  for (k = 0; k < dirs->len; k++)
+  if (opt_parallel)
     {
-      FlatpakTransaction *transaction = g_ptr_array_index (transactions, k);
+      g_autoptr(GPtrArray) to_run = g_ptr_array_new ();
 
-      if (flatpak_transaction_is_empty (transaction))
-        continue;
+      for (k = 0; k < dirs->len; k++)
+        {
+          FlatpakTransaction *transaction = g_ptr_array_index (transactions, k);
+
+          if (!flatpak_transaction_is_empty (transaction))
+            g_ptr_array_add (to_run, transaction);
+        }
 
-      if (!flatpak_transaction_run (transaction, cancellable, error))
+      if (!flatpak_transaction_run_parallel (to_run, cancellable, error))
         {
           if (g_error_matches (*error, FLATPAK_ERROR, FLATPAK_ERROR_ABORTED))
             g_clear_error (error);  /* Don't report on stderr */
@@ -264,8 +321,30 @@ flatpak_builtin_update (int           argc,
           return FALSE;
         }
 
-      if (!flatpak_transaction_is_empty (transaction))
-        has_updates = TRUE;
+      for (k = 0; k < to_run->len; k++)
+        if (!flatpak_transaction_is_empty (g_ptr_array_index (to_run, k)))
+          has_updates = TRUE;
+    }
+  else
+    {
+      for (k = 0; k < dirs->len; k++)
+        {
+          FlatpakTransaction *transaction = g_ptr_array_index (transactions, k);
+
+          if (flatpak_transaction_is_empty (transaction))
+            continue;
+
+          if (!flatpak_transaction_run (transaction, cancellable, error))
+            {
+              if (g_error_matches (*error, FLATPAK_ERROR, FLATPAK_ERROR_ABORTED))
+                g_clear_error (error);  /* Don't report on stderr */
+
+              return FALSE;
+            }
+
+          if (!flatpak_transaction_is_empty (transaction))
+            has_updates = TRUE;
+        }
     }
 
   if (!has_updates)
@@ -24,6 +24,7 @@
 #include <glib/gprintf.h>
 
 #include <gio/gunixinputstream.h>
+#include "flatpak-appstream-index-private.h"
 #include "flatpak-chain-input-stream-private.h"
 
 #include "flatpak-ref.h"
@@ -660,6 +661,8 @@ update_appstream (GPtrArray    *dirs,
 
   if (remote == NULL)
     {
+      g_autoptr(GPtrArray) fetches = g_ptr_array_new_with_free_func ((GDestroyNotify) flatpak_remote_state_fetch_free);
+
       for (j = 0; j < dirs->len; j++)
         {
           FlatpakDir *dir = g_ptr_array_index (dirs, j);
@@ -671,7 +674,6 @@ update_appstream (GPtrArray    *dirs,
 
           for (i = 0; remotes[i] != NULL; i++)
             {
-              g_autoptr(GError) local_error = NULL;
               guint64 ts_file_age;
 
               ts_file_age = get_appstream_timestamp (dir, remotes[i], arch);
@@ -687,35 +689,47 @@ update_appstream (GPtrArray    *dirs,
                   flatpak_dir_get_remote_noenumerate (dir, remotes[i]))
                 continue;
 
-              if (flatpak_dir_is_user (dir))
-                {
-                  if (quiet)
-                    g_debug (_("Updating appstream data for user remote %s"), remotes[i]);
-                  else
-                    {
-                      g_print (_("Updating appstream data for user remote %s"), remotes[i]);
-                      g_print ("\n");
-                    }
-                }
+              g_ptr_array_add (fetches, flatpak_remote_state_fetch_new (dir, remotes[i]));
+            }
+        }
+
+      /* Get all the summaries at once, flatpak_dir_update_appstream()
+       * then finds them in the cache */
+      flatpak_remote_states_fetch_optional (fetches, FALSE, cancellable);
+
+      for (i = 0; i < fetches->len; i++)
+        {
+          FlatpakRemoteStateFetch *fetch = g_ptr_array_index (fetches, i);
+          g_autoptr(GError) local_error = NULL;
+
+          if (flatpak_dir_is_user (fetch->dir))
+            {
+              if (quiet)
+                g_debug (_("Updating appstream data for user remote %s"), fetch->remote);
               else
                 {
-                  if (quiet)
-                    g_debug (_("Updating appstream data for remote %s"), remotes[i]);
-                  else
-                    {
-                      g_print (_("Updating appstream data for remote %s"), remotes[i]);
-                      g_print ("\n");
-                    }
+                  g_print (_("Updating appstream data for user remote %s"), fetch->remote);
+                  g_print ("\n");
                 }
-              if (!flatpak_dir_update_appstream (dir, remotes[i], arch, &changed,
-                                                 NULL, cancellable, &local_error))
+            }
+          else
+            {
+              if (quiet)
+                g_debug (_("Updating appstream data for remote %s"), fetch->remote);
+              else
                 {
-                  if (quiet)
-                    g_debug ("%s: %s", _("Error updating"), local_error->message);
-                  else
-                    g_printerr ("%s: %s\n", _("Error updating"), local_error->message);
+                  g_print (_("Updating appstream data for remote %s"), fetch->remote);
+                  g_print ("\n");
                 }
             }
+          if (!flatpak_dir_update_appstream (fetch->dir, fetch->remote, arch, &changed,
+                                             NULL, cancellable, &local_error))
+            {
+              if (quiet)
+                g_debug ("%s: %s", _("Error updating"), local_error->message);
+              else
+                g_printerr ("%s: %s\n", _("Error updating"), local_error->message);
+            }
         }
     }
   else
@@ -1147,6 +1161,45 @@ flatpak_dir_load_appstream_store (FlatpakDir   *self,
   return success;
 }
 
+/**
+ * flatpak_dir_load_appstream_index:
+ * @self: a #FlatpakDir
+ * @remote_name: name of the remote to load the search index for
+ * @arch: (nullable): name of the architecture to load the search index for,
+ *    or %NULL to use the default
+ * @error: return location for a #GError
+ *
+ * Load the search index that was built when the AppStream data for
+ * @remote_name was deployed. If there is none, for instance because the
+ * data was deployed by an older version, %NULL is returned with no error
+ * set and the caller should fall back to flatpak_dir_load_appstream_store().
+ *
+ * Returns: (transfer full): the index, or %NULL
+ */
+GVariant *
+flatpak_dir_load_appstream_index (FlatpakDir  *self,
+                                  const gchar *remote_name,
+                                  const gchar *arch,
+                                  GError     **error)
+{
+  const char *install_path = flatpak_file_get_path_cached (flatpak_dir_get_path (self));
+  g_autofree char *index_path = NULL;
+
+  if (arch == NULL)
+    arch = flatpak_get_arch ();
+
+  if (flatpak_dir_get_remote_oci (self, remote_name))
+    index_path = g_build_filename (install_path, "appstream", remote_name,
+                                   arch, FLATPAK_APPSTREAM_INDEX_FILENAME,
+                                   NULL);
+  else
+    index_path = g_build_filename (install_path, "appstream", remote_name,
+                                   arch, "active", FLATPAK_APPSTREAM_INDEX_FILENAME,
+                                   NULL);
+
+  return flatpak_appstream_index_load_at (AT_FDCWD, index_path, error);
+}
+
 void
 print_aligned (int len, const char *title, const char *value)
 {
@@ -1316,6 +1369,37 @@ print_wrapped (int         cols,
     }
 }
 
+/* Downloads the summaries of the enabled remotes in @dirs in parallel, so
+ * that the get_remote_state() calls that follow are served from the
+ * in-memory summary cache rather than hitting the network one by one. */
+void
+prefetch_remote_states (GPtrArray    *dirs,
+                        gboolean      include_noenumerate,
+                        GCancellable *cancellable)
+{
+  g_autoptr(GPtrArray) fetches = g_ptr_array_new_with_free_func ((GDestroyNotify) flatpak_remote_state_fetch_free);
+  int i, j;
+
+  for (i = 0; i < dirs->len; i++)
+    {
+      FlatpakDir *dir = g_ptr_array_index (dirs, i);
+      g_auto(GStrv) remotes = flatpak_dir_list_remotes (dir, cancellable, NULL);
+
+      for (j = 0; remotes != NULL && remotes[j] != NULL; j++)
+        {
+          if (flatpak_dir_get_remote_disabled (dir, remotes[j]) ||
+              (!include_noenumerate && flatpak_dir_get_remote_noenumerate (dir, remotes[j])))
+            continue;
+
+          g_ptr_array_add (fetches, flatpak_remote_state_fetch_new (dir, remotes[j]));
+        }
+    }
+
+  /* A single remote gains nothing from this */
+  if (fetches->len > 1)
+    flatpak_remote_states_fetch_optional (fetches, FALSE, cancellable);
+}
+
 FlatpakRemoteState *
 get_remote_state (FlatpakDir   *dir,
                   const char   *remote,
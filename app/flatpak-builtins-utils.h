@@ -164,6 +164,10 @@ gboolean    flatpak_dir_load_appstream_store (FlatpakDir   *self,
                                               AsMetadata   *mdata,
                                               GCancellable *cancellable,
                                               GError      **error);
+GVariant   *flatpak_dir_load_appstream_index (FlatpakDir   *self,
+                                              const gchar  *remote_name,
+                                              const gchar  *arch,
+                                              GError      **error);
 
 int         cell_width (const char *text);
 const char *cell_advance (const char *text,
@@ -173,6 +177,9 @@ void print_wrapped (int         columns,
                     const char *text,
                     ...) G_GNUC_PRINTF (2, 3);
 
+void prefetch_remote_states (GPtrArray    *dirs,
+                             gboolean      include_noenumerate,
+                             GCancellable *cancellable);
 FlatpakRemoteState * get_remote_state (FlatpakDir   *dir,
                                        const char   *remote,
                                        gboolean      cached,
@@ -0,0 +1,50 @@
+/*
+ * Copyright © 2026 Flatpak contributors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __FLATPAK_APPSTREAM_INDEX_PRIVATE_H__
+#define __FLATPAK_APPSTREAM_INDEX_PRIVATE_H__
+
+#include "flatpak-utils-private.h"
+
+/* Stored next to appstream.xml.gz */
+#define FLATPAK_APPSTREAM_INDEX_FILENAME "search-index.gv"
+
+typedef struct
+{
+  guint32 component;
+  guint32 score;
+} FlatpakAppstreamIndexMatch;
+
+gboolean  flatpak_appstream_index_build_at (GInputStream *appstream_xml,
+                                            gboolean      compressed,
+                                            int           dfd,
+                                            const char   *name,
+                                            GCancellable *cancellable,
+                                            GError      **error);
+GVariant *flatpak_appstream_index_load_at  (int           dfd,
+                                            const char   *path,
+                                            GError      **error);
+GArray   *flatpak_appstream_index_search   (GVariant     *index,
+                                            const char   *text);
+void      flatpak_appstream_index_get_component (GVariant    *index,
+                                                 guint32      component,
+                                                 const char **out_ref,
+                                                 const char **out_name,
+                                                 const char **out_summary,
+                                                 const char **out_version);
+
+#endif /* __FLATPAK_APPSTREAM_INDEX_PRIVATE_H__ */
@@ -0,0 +1,585 @@
+/*
+ * Copyright © 2026 Flatpak contributors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#include "flatpak-appstream-index-private.h"
+#include "libglnx.h"
+
+/* The search index is a GVariant of this form:
+ *
+ *   u: format version
+ *   a(sa{ss}a{ss}s): components; the flatpak ref, the names and
+ *       summaries keyed by language ("C" for untranslated) and the
+ *       latest version
+ *   a(sa(uu)): tokens sorted by strcmp(), each with the components
+ *       (by index) it appears in and the fields it was found in
+ *
+ * This lets flatpak search avoid parsing the whole appstream XML.
+ */
+#define INDEX_VERSION 1
+#define INDEX_GVARIANT_FORMAT G_VARIANT_TYPE ("(ua(sa{ss}a{ss}s)a(sa(uu)))")
+
+#define MIN_TOKEN_CHARS 2
+#define MAX_TOKEN_BYTES 64
+
+/* Same weights as AsSearchTokenMatch in libappstream */
+typedef enum {
+  MATCH_MEDIATYPE   = 1 << 0,
+  MATCH_DESCRIPTION = 1 << 2,
+  MATCH_SUMMARY     = 1 << 3,
+  MATCH_KEYWORD     = 1 << 4,
+  MATCH_NAME        = 1 << 5,
+  MATCH_ID          = 1 << 6,
+} MatchWeight;
+
+/* Substring match on the app id, as flatpak search always did */
+#define ID_SUBSTRING_SCORE 50
+
+static GPtrArray *
+tokenize (const char *text)
+{
+  g_autofree char *lower = g_utf8_strdown (text, -1);
+  GPtrArray *tokens = g_ptr_array_new_with_free_func (g_free);
+  const char *start = NULL;
+  const char *p;
+
+  for (p = lower; ; p = g_utf8_next_char (p))
+    {
+      gunichar c = g_utf8_get_char (p);
+
+      if (c != 0 && g_unichar_isalnum (c))
+        {
+          if (start == NULL)
+            start = p;
+          continue;
+        }
+
+      if (start != NULL &&
+          p - start <= MAX_TOKEN_BYTES &&
+          g_utf8_strlen (start, p - start) >= MIN_TOKEN_CHARS)
+        g_ptr_array_add (tokens, g_strndup (start, p - start));
+      start = NULL;
+
+      if (c == 0)
+        break;
+    }
+
+  return tokens;
+}
+
+static void
+add_tokens (GHashTable *token_table,
+            const char *text,
+            guint32     component,
+            guint32     weight)
+{
+  g_autoptr(GPtrArray) tokens = NULL;
+  guint i;
+
+  if (text == NULL)
+    return;
+
+  tokens = tokenize (text);
+  for (i = 0; i < tokens->len; i++)
+    {
+      char *token = g_ptr_array_index (tokens, i);
+      GArray *postings = g_hash_table_lookup (token_table, token);
+      FlatpakAppstreamIndexMatch *last;
+
+      if (postings == NULL)
+        {
+          postings = g_array_new (FALSE, FALSE, sizeof (FlatpakAppstreamIndexMatch));
+          g_hash_table_insert (token_table, g_strdup (token), postings);
+        }
+
+      /* Components are added in order, so any earlier posting for this
+       * component is the last one */
+      last = postings->len > 0 ? &g_array_index (postings, FlatpakAppstreamIndexMatch, postings->len - 1) : NULL;
+      if (last != NULL && last->component == component)
+        last->score |= weight;
+      else
+        {
+          FlatpakAppstreamIndexMatch match = { component, weight };
+          g_array_append_val (postings, match);
+        }
+    }
+}
+
+static const char *
+xml_get_attribute (FlatpakXml *node,
+                   const char *name)
+{
+  int i;
+
+  for (i = 0; node->attribute_names != NULL && node->attribute_names[i] != NULL; i++)
+    {
+      if (strcmp (node->attribute_names[i], name) == 0)
+        return node->attribute_values[i];
+    }
+
+  return NULL;
+}
+
+static const char *
+xml_get_text (FlatpakXml *node)
+{
+  if (node->first_child != NULL && node->first_child->element_name == NULL)
+    return node->first_child->text;
+
+  return NULL;
+}
+
+static const char *
+xml_get_lang (FlatpakXml *node)
+{
+  const char *lang = xml_get_attribute (node, "xml:lang");
+
+  return lang != NULL ? lang : "C";
+}
+
+static void
+add_description_tokens (GHashTable *token_table,
+                        FlatpakXml *node,
+                        guint32     component)
+{
+  FlatpakXml *child;
+
+  for (child = node->first_child; child != NULL; child = child->next_sibling)
+    {
+      if (child->element_name == NULL)
+        add_tokens (token_table, child->text, component, MATCH_DESCRIPTION);
+      else if (strcmp (xml_get_lang (child), "C") == 0)
+        add_description_tokens (token_table, child, component);
+    }
+}
+
+static void
+add_translated (GVariantBuilder *builder,
+                GHashTable      *seen,
+                FlatpakXml      *node)
+{
+  const char *lang = xml_get_lang (node);
+  const char *text = xml_get_text (node);
+
+  if (text == NULL || g_hash_table_contains (seen, lang))
+    return;
+
+  g_hash_table_add (seen, (char *) lang);
+  g_variant_builder_add (builder, "{ss}", lang, text);
+}
+
+static const char *
+get_flatpak_bundle_ref (FlatpakXml *component)
+{
+  FlatpakXml *child;
+
+  for (child = component->first_child; child != NULL; child = child->next_sibling)
+    {
+      if (g_strcmp0 (child->element_name, "bundle") == 0 &&
+          g_strcmp0 (xml_get_attribute (child, "type"), "flatpak") == 0)
+        return xml_get_text (child);
+    }
+
+  return NULL;
+}
+
+static void
+add_component (GVariantBuilder *components_builder,
+               GHashTable      *token_table,
+               FlatpakXml      *component,
+               const char      *ref,
+               guint32          index)
+{
+  g_auto(GVariantBuilder) names_builder = G_VARIANT_BUILDER_INIT (G_VARIANT_TYPE ("a{ss}"));
+  g_auto(GVariantBuilder) summaries_builder = G_VARIANT_BUILDER_INIT (G_VARIANT_TYPE ("a{ss}"));
+  g_autoptr(GHashTable) seen_names = g_hash_table_new (g_str_hash, g_str_equal);
+  g_autoptr(GHashTable) seen_summaries = g_hash_table_new (g_str_hash, g_str_equal);
+  const char *version = NULL;
+  FlatpakXml *child;
+
+  for (child = component->first_child; child != NULL; child = child->next_sibling)
+    {
+      const char *element = child->element_name;
+
+      if (element == NULL)
+        continue;
+
+      if (strcmp (element, "id") == 0)
+        add_tokens (token_table, xml_get_text (child), index, MATCH_ID);
+      else if (strcmp (element, "name") == 0)
+        {
+          add_translated (&names_builder, seen_names, child);
+          add_tokens (token_table, xml_get_text (child), index, MATCH_NAME);
+        }
+      else if (strcmp (element, "summary") == 0)
+        {
+          add_translated (&summaries_builder, seen_summaries, child);
+          add_tokens (token_table, xml_get_text (child), index, MATCH_SUMMARY);
+        }
+      else if (strcmp (element, "description") == 0 &&
+               strcmp (xml_get_lang (child), "C") == 0)
+        add_description_tokens (token_table, child, index);
+      else if (strcmp (element, "keywords") == 0 ||
+               strcmp (element, "mimetypes") == 0 ||
+               strcmp (element, "provides") == 0)
+        {
+          FlatpakXml *item;
+
+          for (item = child->first_child; item != NULL; item = item->next_sibling)
+            {
+              if (g_strcmp0 (item->element_name, "keyword") == 0)
+                add_tokens (token_table, xml_get_text (item), index, MATCH_KEYWORD);
+              else if (g_strcmp0 (item->element_name, "mimetype") == 0 ||
+                       g_strcmp0 (item->element_name, "mediatype") == 0)
+                add_tokens (token_table, xml_get_text (item), index, MATCH_MEDIATYPE);
+            }
+        }
+      else if (strcmp (element, "releases") == 0 && version == NULL)
+        {
+          FlatpakXml *release = flatpak_xml_find (child, "release", NULL);
+
+          if (release != NULL)
+            version = xml_get_attribute (release, "version");
+        }
+    }
+
+  g_variant_builder_add (components_builder, "(s@a{ss}@a{ss}s)",
+                         ref,
+                         g_variant_builder_end (&names_builder),
+                         g_variant_builder_end (&summaries_builder),
+                         version ? version : "");
+}
+
+/* Builds the search index for the appstream data in @appstream_xml and
+ * writes it to @name in @dfd.
+ */
+gboolean
+flatpak_appstream_index_build_at (GInputStream *appstream_xml,
+                                  gboolean      compressed,
+                                  int           dfd,
+                                  const char   *name,
+                                  GCancellable *cancellable,
+                                  GError      **error)
+{
+  g_autoptr(FlatpakXml) appstream = NULL;
+  g_autoptr(GHashTable) token_table = NULL;
+  g_auto(GVariantBuilder) components_builder = G_VARIANT_BUILDER_INIT (G_VARIANT_TYPE ("a(sa{ss}a{ss}s)"));
+  g_auto(GVariantBuilder) tokens_builder = G_VARIANT_BUILDER_INIT (G_VARIANT_TYPE ("a(sa(uu))"));
+  g_autoptr(GVariant) index = NULL;
+  g_autofree const char **tokens = NULL;
+  FlatpakXml *components;
+  guint32 n_components = 0;
+  guint n_tokens, i;
+
+  appstream = flatpak_xml_parse (appstream_xml, compressed, cancellable, error);
+  if (appstream == NULL)
+    return FALSE;
+
+  token_table = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify) g_array_unref);
+
+  for (components = appstream->first_child; components != NULL; components = components->next_sibling)
+    {
+      FlatpakXml *component;
+
+      if (g_strcmp0 (components->element_name, "components") != 0)
+        continue;
+
+      for (component = components->first_child; component != NULL; component = component->next_sibling)
+        {
+          const char *ref;
+
+          if (g_strcmp0 (component->element_name, "component") != 0)
+            continue;
+
+          /* flatpak search ignores components without a flatpak bundle */
+          ref = get_flatpak_bundle_ref (component);
+          if (ref == NULL)
+            continue;
+
+          add_component (&components_builder, token_table, component, ref, n_components++);
+        }
+    }
+
+  tokens = (const char **) g_hash_table_get_keys_as_array (token_table, &n_tokens);
+  qsort (tokens, n_tokens, sizeof (char *), flatpak_strcmp0_ptr);
+
+  for (i = 0; i < n_tokens; i++)
+    {
+      GArray *postings = g_hash_table_lookup (token_table, tokens[i]);
+      g_auto(GVariantBuilder) postings_builder = G_VARIANT_BUILDER_INIT (G_VARIANT_TYPE ("a(uu)"));
+      guint j;
+
+      for (j = 0; j < postings->len; j++)
+        {
+          FlatpakAppstreamIndexMatch *match = &g_array_index (postings, FlatpakAppstreamIndexMatch, j);
+
+          g_variant_builder_add (&postings_builder, "(uu)", match->component, match->score);
+        }
+
+      g_variant_builder_add (&tokens_builder, "(s@a(uu))", tokens[i],
+                             g_variant_builder_end (&postings_builder));
+    }
+
+  index = g_variant_ref_sink (g_variant_new ("(u@a(sa{ss}a{ss}s)@a(sa(uu)))",
+                                             INDEX_VERSION,
+                                             g_variant_builder_end (&components_builder),
+                                             g_variant_builder_end (&tokens_builder)));
+
+  return glnx_file_replace_contents_at (dfd, name,
+                                        g_variant_get_data (index),
+                                        g_variant_get_size (index),
+                                        GLNX_FILE_REPLACE_NODATASYNC,
+                                        cancellable, error);
+}
+
+/* Returns %NULL without setting @error if there is no index, or it is
+ * in an unknown format.
+ */
+GVariant *
+flatpak_appstream_index_load_at (int         dfd,
+                                 const char *path,
+                                 GError    **error)
+{
+  glnx_autofd int fd = -1;
+  g_autoptr(GMappedFile) mfile = NULL;
+  g_autoptr(GBytes) bytes = NULL;
+  g_autoptr(GVariant) index = NULL;
+  guint32 version;
+
+  if (!glnx_openat_rdonly (dfd, path, TRUE, &fd, error))
+    {
+      if (error != NULL && g_error_matches (*error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+        g_clear_error (error);
+      return NULL;
+    }
+
+  mfile = g_mapped_file_new_from_fd (fd, FALSE, error);
+  if (mfile == NULL)
+    return NULL;
+
+  bytes = g_mapped_file_get_bytes (mfile);
+  index = g_variant_ref_sink (g_variant_new_from_bytes (INDEX_GVARIANT_FORMAT, bytes, FALSE));
+
+  g_variant_get_child (index, 0, "u", &version);
+  if (version != INDEX_VERSION)
+    return NULL;
+
+  return g_steal_pointer (&index);
+}
+
+static const char *
+get_token (GVariant *tokens,
+           gsize     i)
+{
+  g_autoptr(GVariant) entry = g_variant_get_child_value (tokens, i);
+  g_autoptr(GVariant) token = g_variant_get_child_value (entry, 0);
+
+  /* Points into the serialized data of @tokens */
+  return g_variant_get_string (token, NULL);
+}
+
+/* Sets @term_scores to the fields @term matches in for each component,
+ * on the same scale as as_component_search_matches(): an exact match
+ * on a token counts 4 times as much as the fields it prefixes, and
+ * overrides them. */
+static void
+add_term_matches (GVariant   *tokens,
+                  const char *term,
+                  guint32    *term_scores,
+                  gsize       n_components)
+{
+  gsize n_tokens = g_variant_n_children (tokens);
+  gsize lo = 0, hi = n_tokens;
+  g_autoptr(GVariant) exact_postings = NULL;
+  gsize i, j;
+
+  /* Find the first token >= term, then walk all tokens it prefixes */
+  while (lo < hi)
+    {
+      gsize mid = lo + (hi - lo) / 2;
+
+      if (strcmp (get_token (tokens, mid), term) < 0)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+
+  for (i = lo; i < n_tokens; i++)
+    {
+      g_autoptr(GVariant) entry = g_variant_get_child_value (tokens, i);
+      g_autoptr(GVariant) postings = NULL;
+      const char *token;
+      gsize n_postings;
+
+      g_variant_get (entry, "(&s@a(uu))", &token, &postings);
+      if (!g_str_has_prefix (token, term))
+        break;
+
+      if (i == lo && strcmp (token, term) == 0)
+        exact_postings = g_variant_ref (postings);
+
+      n_postings = g_variant_n_children (postings);
+      for (j = 0; j < n_postings; j++)
+        {
+          guint32 component, score;
+
+          g_variant_get_child (postings, j, "(uu)", &component, &score);
+          if (component < n_components)
+            term_scores[component] |= score;
+        }
+    }
+
+  if (exact_postings != NULL)
+    {
+      gsize n_postings = g_variant_n_children (exact_postings);
+
+      for (j = 0; j < n_postings; j++)
+        {
+          guint32 component, score;
+
+          g_variant_get_child (exact_postings, j, "(uu)", &component, &score);
+          if (component < n_components)
+            term_scores[component] = score << 2;
+        }
+    }
+}
+
+static gboolean
+ref_id_contains (const char *ref,
+                 const char *text)
+{
+  const char *id_start = strchr (ref, '/');
+  const char *id_end;
+  g_autofree char *id = NULL;
+
+  if (id_start == NULL)
+    return FALSE;
+  id_start++;
+
+  id_end = strchr (id_start, '/');
+  id = id_end ? g_strndup (id_start, id_end - id_start) : g_strdup (id_start);
+
+  return strcasestr (id, text) != NULL;
+}
+
+/* Returns the components matching @text, in index order. Every word of
+ * @text must prefix-match some token of the component. Like
+ * as_component_search_matches_all(), the score is the union of the
+ * scores of the words, so that it can be ranked together with the
+ * results of libappstream.
+ */
+GArray *
+flatpak_appstream_index_search (GVariant   *index,
+                                const char *text)
+{
+  g_autoptr(GVariant) components = g_variant_get_child_value (index, 1);
+  g_autoptr(GVariant) tokens = g_variant_get_child_value (index, 2);
+  gsize n_components = g_variant_n_children (components);
+  g_autoptr(GPtrArray) terms = tokenize (text);
+  g_autofree guint32 *scores = g_new0 (guint32, n_components);
+  g_autofree guint32 *term_scores = g_new0 (guint32, n_components);
+  GArray *matches = g_array_new (FALSE, FALSE, sizeof (FlatpakAppstreamIndexMatch));
+  gsize c;
+  guint i;
+
+  for (i = 0; i < terms->len; i++)
+    {
+      memset (term_scores, 0, n_components * sizeof (guint32));
+      add_term_matches (tokens, g_ptr_array_index (terms, i), term_scores, n_components);
+
+      for (c = 0; c < n_components; c++)
+        {
+          if (i == 0)
+            scores[c] = term_scores[c];
+          else if (scores[c] != 0 && term_scores[c] != 0)
+            scores[c] |= term_scores[c];
+          else
+            scores[c] = 0;
+        }
+    }
+
+  for (c = 0; c < n_components; c++)
+    {
+      FlatpakAppstreamIndexMatch match = { c, scores[c] };
+
+      if (match.score == 0)
+        {
+          g_autoptr(GVariant) component = g_variant_get_child_value (components, c);
+          const char *ref;
+
+          g_variant_get_child (component, 0, "&s", &ref);
+          if (!ref_id_contains (ref, text))
+            continue;
+
+          match.score = ID_SUBSTRING_SCORE;
+        }
+
+      g_array_append_val (matches, match);
+    }
+
+  return matches;
+}
+
+static const char *
+lookup_translated (GVariant *translations)
+{
+  const char * const *languages = g_get_language_names ();
+  const char *value;
+  int i;
+
+  for (i = 0; languages[i] != NULL; i++)
+    {
+      if (g_variant_lookup (translations, languages[i], "&s", &value))
+        return value;
+    }
+
+  if (g_variant_lookup (translations, "C", "&s", &value))
+    return value;
+
+  return NULL;
+}
+
+/* The returned strings point into @index, and are translated according
+ * to the current locale. */
+void
+flatpak_appstream_index_get_component (GVariant    *index,
+                                       guint32      component,
+                                       const char **out_ref,
+                                       const char **out_name,
+                                       const char **out_summary,
+                                       const char **out_version)
+{
+  g_autoptr(GVariant) components = g_variant_get_child_value (index, 1);
+  g_autoptr(GVariant) entry = g_variant_get_child_value (components, component);
+  g_autoptr(GVariant) names = NULL;
+  g_autoptr(GVariant) summaries = NULL;
+  const char *ref, *version;
+
+  g_variant_get (entry, "(&s@a{ss}@a{ss}&s)", &ref, &names, &summaries, &version);
+
+  if (out_ref)
+    *out_ref = ref;
+  if (out_name)
+    *out_name = lookup_translated (names);
+  if (out_summary)
+    *out_summary = lookup_translated (summaries);
+  if (out_version)
+    *out_version = *version != 0 ? version : NULL;
+}
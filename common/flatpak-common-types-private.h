@@ -49,6 +49,7 @@ typedef enum {
   FLATPAK_RUN_FLAG_NO_PROC            = (1 << 19),
   FLATPAK_RUN_FLAG_PARENT_EXPOSE_PIDS = (1 << 20),
   FLATPAK_RUN_FLAG_PARENT_SHARE_PIDS  = (1 << 21),
+  FLATPAK_RUN_FLAG_SHARE_DBUS_PROXY   = (1 << 22),
 } FlatpakRunFlags;
 
 typedef struct FlatpakDir          FlatpakDir;
@@ -56,5 +57,6 @@ typedef struct FlatpakDeploy       FlatpakDeploy;
 typedef struct FlatpakOciRegistry  FlatpakOciRegistry;
 typedef struct _FlatpakOciManifest FlatpakOciManifest;
 typedef struct _FlatpakOciImage    FlatpakOciImage;
+typedef struct _FlatpakBundleHeader FlatpakBundleHeader;
 
 #endif /* __FLATPAK_COMMON_TYPES_H__ */
@@ -115,6 +115,13 @@ typedef struct {
   GVariant   *summary;
 } FlatpakSideloadState;
 
+typedef struct {
+  FlatpakSideloadState *sideload_state;
+  char                 *checksum;
+  guint64               timestamp;
+  VarRefInfoRef         info;
+} FlatpakSideloadRef;
+
 /* The remote state represent the state of the remote at a particular
    time, including the summary file and the metadata (which may be from
    the summary or from a branch. We create this once per highlevel operation
@@ -144,8 +151,16 @@ typedef struct
   int       refcount;
   gint32    default_token_type;
   GPtrArray *sideload_repos;
+  /* Newest sideloaded commit of each ref, updated as sideload repos are added */
+  GHashTable *sideload_refs; /* ref -> FlatpakSideloadRef */
+  /* Sideload repo with a complete copy of a commit, filled in as they are looked up */
+  GHashTable *sideload_commits; /* checksum -> FlatpakSideloadState, or NULL */
+
+  /* All refs sorted by id, arch and branch, built on first lookup */
+  GPtrArray *ref_index;
 } FlatpakRemoteState;
 
+FlatpakRemoteState *flatpak_remote_state_new (void);
 FlatpakRemoteState *flatpak_remote_state_ref (FlatpakRemoteState *remote_state);
 void flatpak_remote_state_unref (FlatpakRemoteState *remote_state);
 gboolean flatpak_remote_state_ensure_summary (FlatpakRemoteState *self,
@@ -207,6 +222,27 @@ G_DEFINE_AUTOPTR_CLEANUP_FUNC (FlatpakDeploy, g_object_unref)
 G_DEFINE_AUTOPTR_CLEANUP_FUNC (FlatpakRelated, flatpak_related_free)
 G_DEFINE_AUTOPTR_CLEANUP_FUNC (FlatpakRemoteState, flatpak_remote_state_unref)
 
+/* One remote state to get with flatpak_remote_states_fetch_optional() */
+typedef struct
+{
+  FlatpakDir         *dir;
+  char               *remote;
+  FlatpakRemoteState *state; /* Result, or NULL with error set */
+  GError             *error;
+} FlatpakRemoteStateFetch;
+
+FlatpakRemoteStateFetch *flatpak_remote_state_fetch_new  (FlatpakDir              *dir,
+                                                          const char              *remote);
+void                     flatpak_remote_state_fetch_free (FlatpakRemoteStateFetch *fetch);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (FlatpakRemoteStateFetch, flatpak_remote_state_fetch_free)
+
+void flatpak_remote_states_fetch_optional (GPtrArray    *fetches,
+                                           gboolean      only_cached,
+                                           GCancellable *cancellable);
+void flatpak_dir_share_remote_caches (FlatpakDir *self,
+                                      FlatpakDir *other);
+
 typedef enum {
   FLATPAK_HELPER_DEPLOY_FLAGS_NONE = 0,
   FLATPAK_HELPER_DEPLOY_FLAGS_UPDATE = 1 << 0,
@@ -228,6 +264,13 @@ typedef enum {
                                          FLATPAK_HELPER_DEPLOY_FLAGS_INSTALL_HINT | \
                                          FLATPAK_HELPER_DEPLOY_FLAGS_UPDATE_PINNED)
 
+typedef enum {
+  FLATPAK_HELPER_DEPLOY_MANY_FLAGS_NONE = 0,
+  FLATPAK_HELPER_DEPLOY_MANY_FLAGS_NO_INTERACTION = 1 << 0,
+} FlatpakHelperDeployManyFlags;
+
+#define FLATPAK_HELPER_DEPLOY_MANY_FLAGS_ALL (FLATPAK_HELPER_DEPLOY_MANY_FLAGS_NO_INTERACTION)
+
 typedef enum {
   FLATPAK_HELPER_UNINSTALL_FLAGS_NONE = 0,
   FLATPAK_HELPER_UNINSTALL_FLAGS_KEEP_REF = 1 << 0,
@@ -445,6 +488,10 @@ GBytes *        flatpak_deploy_get_deploy_data (FlatpakDeploy      *deploy,
                                                 GCancellable       *cancellable,
                                                 GError            **error);
 GFile *         flatpak_deploy_get_files       (FlatpakDeploy      *deploy);
+gboolean        flatpak_deploy_checkout_files  (FlatpakDeploy      *deploy,
+                                                GFile              *dest,
+                                                GCancellable       *cancellable,
+                                                GError            **error);
 FlatpakContext *flatpak_deploy_get_overrides   (FlatpakDeploy      *deploy);
 GKeyFile *      flatpak_deploy_get_metadata    (FlatpakDeploy      *deploy);
 
@@ -465,6 +512,8 @@ void                  flatpak_dir_set_no_system_helper                      (Fla
 void                  flatpak_dir_set_no_interaction                        (FlatpakDir                    *self,
                                                                              gboolean                       no_interaction);
 gboolean              flatpak_dir_get_no_interaction                        (FlatpakDir                    *self);
+void                  flatpak_dir_set_revalidate_summaries                  (FlatpakDir                    *self,
+                                                                             gboolean                       revalidate_summaries);
 GFile *               flatpak_dir_get_path                                  (FlatpakDir                    *self);
 GFile *               flatpak_dir_get_changed_path                          (FlatpakDir                    *self);
 const char *          flatpak_dir_get_id                                    (FlatpakDir                    *self);
@@ -493,6 +542,7 @@ char *                flatpak_dir_get_origin                                (Fla
                                                                              GError                       **error);
 GFile *               flatpak_dir_get_exports_dir                           (FlatpakDir                    *self);
 GFile *               flatpak_dir_get_removed_dir                           (FlatpakDir                    *self);
+GFile *               flatpak_dir_get_history_dir                           (FlatpakDir                    *self);
 GFile *               flatpak_dir_get_sideload_repos_dir                    (FlatpakDir                    *self);
 GFile *               flatpak_dir_get_runtime_sideload_repos_dir            (FlatpakDir                    *self);
 GFile *               flatpak_dir_get_if_deployed                           (FlatpakDir                    *self,
@@ -629,6 +679,21 @@ gboolean              flatpak_dir_pull                                      (Fla
                                                                              FlatpakProgress               *progress,
                                                                              GCancellable                  *cancellable,
                                                                              GError                       **error);
+void                  flatpak_dir_begin_deploy_batch                        (FlatpakDir                    *self);
+void                  flatpak_dir_end_deploy_batch                          (FlatpakDir                    *self);
+guint                 flatpak_dir_get_n_queued_deploys                      (FlatpakDir                    *self);
+void                  flatpak_dir_drop_queued_deploy                        (FlatpakDir                    *self,
+                                                                             guint                          index);
+GPtrArray *           flatpak_dir_deploy_queued                             (FlatpakDir                    *self,
+                                                                             GCancellable                  *cancellable);
+gboolean              flatpak_dir_prefetch_commits                          (FlatpakDir                    *self,
+                                                                             FlatpakRemoteState            *state,
+                                                                             const char * const            *refs,
+                                                                             const char * const            *revs,
+                                                                             FlatpakPullFlags               flatpak_flags,
+                                                                             FlatpakProgress               *progress,
+                                                                             GCancellable                  *cancellable,
+                                                                             GError                       **error);
 gboolean              flatpak_dir_pull_untrusted_local                      (FlatpakDir                    *self,
                                                                              const char                    *src_path,
                                                                              const char                    *remote_name,
@@ -739,6 +804,7 @@ gboolean              flatpak_dir_install                                   (Fla
                                                                              GError                       **error);
 char *                flatpak_dir_ensure_bundle_remote                      (FlatpakDir                    *self,
                                                                              GFile                         *file,
+                                                                             FlatpakBundleHeader           *header,
                                                                              GBytes                        *extra_gpg_data,
                                                                              FlatpakDecomposed            **out_ref,
                                                                              char                         **out_commit,
@@ -748,8 +814,10 @@ char *                flatpak_dir_ensure_bundle_remote                      (Fla
                                                                              GError                       **error);
 gboolean              flatpak_dir_install_bundle                            (FlatpakDir                    *self,
                                                                              GFile                         *file,
+                                                                             FlatpakBundleHeader           *header,
                                                                              const char                    *remote,
                                                                              FlatpakDecomposed            **out_ref,
+                                                                             FlatpakProgress               *progress,
                                                                              GCancellable                  *cancellable,
                                                                              GError                       **error);
 gboolean              flatpak_dir_needs_update_for_commit_and_subpaths      (FlatpakDir                    *self,
@@ -913,6 +981,8 @@ gboolean              flatpak_dir_get_remote_oci                            (Fla
                                                                              const char                    *remote_name);
 char      *           flatpak_dir_get_remote_default_branch                 (FlatpakDir                    *self,
                                                                              const char                    *remote_name);
+guint64               flatpak_dir_get_remote_summary_max_age                (FlatpakDir                    *self,
+                                                                             const char                    *remote_name);
 int                   flatpak_dir_get_remote_prio                           (FlatpakDir                    *self,
                                                                              const char                    *remote_name);
 gboolean              flatpak_dir_get_remote_noenumerate                    (FlatpakDir                    *self,
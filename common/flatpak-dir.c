@@ -30,6 +30,7 @@
 #include <sys/file.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/xattr.h>
 #include <utime.h>
 
 #include <glib/gi18n-lib.h>
@@ -39,6 +40,8 @@
 #include <libxml/tree.h>
 
 #include <gio/gio.h>
+#include <gio/gunixinputstream.h>
+#include <gio/gunixoutputstream.h>
 #include <gio/gunixsocketaddress.h>
 #include <ostree.h>
 
@@ -47,8 +50,10 @@
 #endif
 
 #include "flatpak-appdata-private.h"
+#include "flatpak-appstream-index-private.h"
 #include "flatpak-dir-private.h"
 #include "flatpak-error.h"
+#include "flatpak-history-private.h"
 #include "flatpak-oci-registry-private.h"
 #include "flatpak-ref.h"
 #include "flatpak-run-private.h"
@@ -198,6 +203,7 @@ typedef struct
   GBytes *bytes_sig;
   char   *name;
   char   *url;
+  char   *verify_key;
   guint64 time;
 } CachedSummary;
 
@@ -229,6 +235,7 @@ struct FlatpakDir
   GFile           *cache_dir;
   gboolean         no_system_helper;
   gboolean         no_interaction;
+  gboolean         revalidate_summaries;
   pid_t            source_pid;
 
   GDBusConnection *system_helper_bus;
@@ -242,6 +249,10 @@ struct FlatpakDir
   GRegex          *pinned;
 
   SoupSession     *soup_session;
+
+  /* Deploys waiting for flatpak_dir_deploy_queued(), NULL unless a
+   * deploy batch is active */
+  GPtrArray       *queued_deploys;
 };
 
 G_LOCK_DEFINE_STATIC (config_cache);
@@ -333,6 +344,13 @@ flatpak_sideload_state_free (FlatpakSideloadState *sideload_state)
   g_free (sideload_state);
 }
 
+static void
+flatpak_sideload_ref_free (FlatpakSideloadRef *sideload_ref)
+{
+  g_free (sideload_ref->checksum);
+  g_free (sideload_ref);
+}
+
 static void
 variant_maybe_unref (GVariant *variant)
 {
@@ -340,13 +358,15 @@ variant_maybe_unref (GVariant *variant)
     g_variant_unref (variant);
 }
 
-static FlatpakRemoteState *
+FlatpakRemoteState *
 flatpak_remote_state_new (void)
 {
   FlatpakRemoteState *state = g_new0 (FlatpakRemoteState, 1);
 
   state->refcount = 1;
   state->sideload_repos = g_ptr_array_new_with_free_func ((GDestroyNotify)flatpak_sideload_state_free);
+  state->sideload_refs = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify)flatpak_sideload_ref_free);
+  state->sideload_commits = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
   state->subsummaries = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify)variant_maybe_unref);
   return state;
 }
@@ -379,7 +399,10 @@ flatpak_remote_state_unref (FlatpakRemoteState *remote_state)
       g_clear_error (&remote_state->summary_fetch_error);
       g_clear_pointer (&remote_state->allow_refs, g_regex_unref);
       g_clear_pointer (&remote_state->deny_refs, g_regex_unref);
+      g_clear_pointer (&remote_state->sideload_refs, g_hash_table_unref);
+      g_clear_pointer (&remote_state->sideload_commits, g_hash_table_unref);
       g_clear_pointer (&remote_state->sideload_repos, g_ptr_array_unref);
+      g_clear_pointer (&remote_state->ref_index, g_ptr_array_unref);
 
       g_free (remote_state);
     }
@@ -400,6 +423,53 @@ _validate_summary_for_collection_id (GVariant    *summary_v,
   return TRUE;
 }
 
+static guint64 get_timestamp_from_ref_info (VarRefInfoRef info);
+
+/* Adds the refs in the summary of @ss to the sideload ref index, so
+ * lookups don't have to go through every sideload repo */
+static void
+flatpak_remote_state_index_sideload_repo (FlatpakRemoteState   *self,
+                                          FlatpakSideloadState *ss)
+{
+  VarSummaryRef summary;
+  VarRefMapRef ref_map;
+  gsize n, i;
+
+  summary = var_summary_from_gvariant (ss->summary);
+  if (!flatpak_summary_find_ref_map (summary, self->collection_id, &ref_map))
+    return;
+
+  n = var_ref_map_get_length (ref_map);
+  for (i = 0; i < n; i++)
+    {
+      VarRefMapEntryRef entry = var_ref_map_get_at (ref_map, i);
+      const char *ref = var_ref_map_entry_get_ref (entry);
+      VarRefInfoRef info = var_ref_map_entry_get_info (entry);
+      FlatpakSideloadRef *existing;
+      FlatpakSideloadRef *sideload_ref;
+      const guchar *checksum_bytes;
+      gsize checksum_bytes_len;
+      guint64 timestamp;
+
+      checksum_bytes = var_ref_info_peek_checksum (info, &checksum_bytes_len);
+      if (G_UNLIKELY (checksum_bytes_len != OSTREE_SHA256_DIGEST_LEN))
+        continue;
+
+      /* On equal timestamps the repo added first wins */
+      timestamp = get_timestamp_from_ref_info (info);
+      existing = g_hash_table_lookup (self->sideload_refs, ref);
+      if (existing != NULL && existing->timestamp >= timestamp)
+        continue;
+
+      sideload_ref = g_new0 (FlatpakSideloadRef, 1);
+      sideload_ref->sideload_state = ss;
+      sideload_ref->checksum = ostree_checksum_from_bytes (checksum_bytes);
+      sideload_ref->timestamp = timestamp;
+      sideload_ref->info = info;
+      g_hash_table_replace (self->sideload_refs, g_strdup (ref), sideload_ref);
+    }
+}
+
 static void
 flatpak_remote_state_add_sideload_repo (FlatpakRemoteState *self,
                                         GFile *dir)
@@ -437,6 +507,10 @@ flatpak_remote_state_add_sideload_repo (FlatpakRemoteState *self,
       else
         {
           g_ptr_array_add (self->sideload_repos, ss);
+          flatpak_remote_state_index_sideload_repo (self, ss);
+          /* Commits not found before may be in the new repo */
+          g_hash_table_remove_all (self->sideload_commits);
+          g_clear_pointer (&self->ref_index, g_ptr_array_unref);
           g_debug ("Using sideloaded repo %s for remote %s", flatpak_file_get_path_cached (dir), self->remote_name);
         }
     }
@@ -580,6 +654,9 @@ flatpak_remote_state_ensure_subsummary (FlatpakRemoteState *self,
   subsummary = g_variant_ref_sink (g_variant_new_from_bytes (OSTREE_SUMMARY_GVARIANT_FORMAT, bytes, FALSE));
   g_hash_table_insert (self->subsummaries, g_strdup (arch), subsummary);
 
+  /* The new arch has refs that are not indexed yet */
+  g_clear_pointer (&self->ref_index, g_ptr_array_unref);
+
   return TRUE;
 }
 
@@ -628,10 +705,18 @@ get_timestamp_from_ref_info (VarRefInfoRef info)
  }
 
 
-GFile *
-flatpak_remote_state_lookup_sideload_checksum (FlatpakRemoteState *self,
-                                               char               *checksum)
+/* Returns the first sideload repo that has a complete copy of @checksum.
+ * The answer is remembered, so each commit is only looked for once. */
+static FlatpakSideloadState *
+flatpak_remote_state_find_sideload_commit (FlatpakRemoteState *self,
+                                           const char         *checksum)
 {
+  FlatpakSideloadState *found = NULL;
+  gpointer value;
+
+  if (g_hash_table_lookup_extended (self->sideload_commits, checksum, NULL, &value))
+    return value;
+
   for (int i = 0; i < self->sideload_repos->len; i++)
     {
       FlatpakSideloadState *ss = g_ptr_array_index (self->sideload_repos, i);
@@ -639,10 +724,27 @@ flatpak_remote_state_lookup_sideload_checksum (FlatpakRemoteState *self,
 
       if (ostree_repo_load_commit (ss->repo, checksum, NULL, &commit_state, NULL) &&
           commit_state == OSTREE_REPO_COMMIT_STATE_NORMAL)
-        return g_object_ref (ostree_repo_get_path (ss->repo));
+        {
+          found = ss;
+          break;
+        }
     }
 
-  return NULL;
+  g_hash_table_insert (self->sideload_commits, g_strdup (checksum), found);
+
+  return found;
+}
+
+GFile *
+flatpak_remote_state_lookup_sideload_checksum (FlatpakRemoteState *self,
+                                               char               *checksum)
+{
+  FlatpakSideloadState *ss = flatpak_remote_state_find_sideload_commit (self, checksum);
+
+  if (ss == NULL)
+    return NULL;
+
+  return g_object_ref (ostree_repo_get_path (ss->repo));
 }
 
 static gboolean
@@ -654,45 +756,22 @@ flatpak_remote_state_resolve_sideloaded_ref (FlatpakRemoteState *self,
                                              FlatpakSideloadState  **out_sideload_state,
                                              GError            **error)
 {
-  g_autofree char *latest_checksum = NULL;
-  guint64 latest_timestamp = 0;
-  FlatpakSideloadState *latest_ss = NULL;
-  VarRefInfoRef latest_sideload_info;
-
-  for (int i = 0; i < self->sideload_repos->len; i++)
-    {
-      FlatpakSideloadState *ss = g_ptr_array_index (self->sideload_repos, i);
-      g_autofree char *sideload_checksum = NULL;
-      VarRefInfoRef sideload_info;
-
-      if (flatpak_summary_lookup_ref (ss->summary, self->collection_id, ref, &sideload_checksum, &sideload_info))
-        {
-          guint64 timestamp = get_timestamp_from_ref_info (sideload_info);
-
-          if (latest_checksum == 0 || latest_timestamp < timestamp)
-            {
-              g_free (latest_checksum);
-              latest_checksum = g_steal_pointer (&sideload_checksum);
-              latest_timestamp = timestamp;
-              latest_sideload_info = sideload_info;
-              latest_ss = ss;
-            }
-        }
-    }
+  FlatpakSideloadRef *sideload_ref;
 
-  if (latest_checksum == NULL)
+  sideload_ref = g_hash_table_lookup (self->sideload_refs, ref);
+  if (sideload_ref == NULL)
     return flatpak_fail_error (error, FLATPAK_ERROR_REF_NOT_FOUND,
                                _("No such ref '%s' in remote %s"),
                                ref, self->remote_name);
 
   if (out_checksum)
-    *out_checksum = g_steal_pointer (&latest_checksum);
+    *out_checksum = g_strdup (sideload_ref->checksum);
   if (out_timestamp)
-    *out_timestamp = latest_timestamp;
+    *out_timestamp = sideload_ref->timestamp;
   if (out_info)
-    *out_info = latest_sideload_info;
+    *out_info = sideload_ref->info;
   if (out_sideload_state)
-    *out_sideload_state = latest_ss;
+    *out_sideload_state = sideload_ref->sideload_state;
 
   return TRUE;
 }
@@ -760,24 +839,7 @@ flatpak_remote_state_lookup_ref (FlatpakRemoteState *self,
       /* Even if its available in the summary we want to install it from a sideload repo if available */
 
       if (out_sideload_path)
-        {
-          g_autoptr(GFile) found_sideload_path = NULL;
-
-          for (int i = 0; i < self->sideload_repos->len; i++)
-            {
-              FlatpakSideloadState *ss = g_ptr_array_index (self->sideload_repos, i);
-              OstreeRepoCommitState commit_state;
-
-              if (ostree_repo_load_commit (ss->repo, checksum, NULL, &commit_state, NULL) &&
-                  commit_state == OSTREE_REPO_COMMIT_STATE_NORMAL)
-                {
-                  found_sideload_path = g_object_ref (ostree_repo_get_path (ss->repo));
-                  break;
-                }
-            }
-
-          *out_sideload_path = g_steal_pointer (&found_sideload_path);
-        }
+        *out_sideload_path = flatpak_remote_state_lookup_sideload_checksum (self, checksum);
 
       if (out_info)
         *out_info = info;
@@ -1022,8 +1084,74 @@ lookup_oci_registry_uri_from_summary (GVariant *summary,
   return g_steal_pointer (&registry_uri);
 }
 
+/* Partial downloads older than this are not worth resuming */
+#define PARTIAL_DOWNLOAD_MAX_AGE_SECS (7 * 24 * 60 * 60)
+
+/* Opens the directory where interrupted downloads are kept so that they
+ * can be resumed by a later operation. This lives in the cache dir, as
+ * that is writable by the user even for system installations.
+ */
+static gboolean
+flatpak_dir_open_downloads_dir (FlatpakDir   *self,
+                                int          *out_dfd,
+                                GCancellable *cancellable,
+                                GError      **error)
+{
+  g_autoptr(GFile) downloads_dir = flatpak_build_file (self->cache_dir, "downloads", NULL);
+  g_auto(GLnxDirFdIterator) iter = {0};
+  struct dirent *dent;
+  time_t now = time (NULL);
+
+  if (!flatpak_mkdir_p (downloads_dir, cancellable, error))
+    return FALSE;
+
+  if (!glnx_dirfd_iterator_init_at (AT_FDCWD, flatpak_file_get_path_cached (downloads_dir), FALSE, &iter, error))
+    return FALSE;
+
+  /* Expire old partial downloads so they don't accumulate */
+  while (TRUE)
+    {
+      struct stat stbuf;
+
+      if (!glnx_dirfd_iterator_next_dent (&iter, &dent, cancellable, error))
+        return FALSE;
+
+      if (dent == NULL)
+        break;
+
+      if (fstatat (iter.fd, dent->d_name, &stbuf, AT_SYMLINK_NOFOLLOW) == 0 &&
+          stbuf.st_mtime + PARTIAL_DOWNLOAD_MAX_AGE_SECS < now)
+        {
+          g_debug ("Removing stale partial download %s", dent->d_name);
+          (void) unlinkat (iter.fd, dent->d_name, 0);
+        }
+    }
+
+  return glnx_opendirat (AT_FDCWD, flatpak_file_get_path_cached (downloads_dir), TRUE, out_dfd, error);
+}
+
+/* Like flatpak_dir_open_downloads_dir(), but returns -1 if it can't be
+ * opened. The OCI registry then downloads to anonymous files in /var/tmp,
+ * without resuming. */
+static int
+flatpak_dir_try_open_downloads_dir (FlatpakDir   *self,
+                                    GCancellable *cancellable)
+{
+  g_autoptr(GError) local_error = NULL;
+  int dfd = -1;
+
+  if (!flatpak_dir_open_downloads_dir (self, &dfd, cancellable, &local_error))
+    {
+      g_debug ("Not resuming OCI downloads: %s", local_error->message);
+      return -1;
+    }
+
+  return dfd;
+}
+
 static FlatpakOciRegistry *
 flatpak_remote_state_new_oci_registry (FlatpakRemoteState *self,
+                                       int           tmp_dfd,
                                        const char   *token,
                                        GCancellable *cancellable,
                                        GError      **error)
@@ -1038,7 +1166,7 @@ flatpak_remote_state_new_oci_registry (FlatpakRemoteState *self,
   if (registry_uri == NULL)
     return NULL;
 
-  registry = flatpak_oci_registry_new (registry_uri, FALSE, -1, NULL, error);
+  registry = flatpak_oci_registry_new (registry_uri, FALSE, tmp_dfd, NULL, error);
   if (registry == NULL)
     return NULL;
 
@@ -1072,8 +1200,9 @@ flatpak_remote_state_fetch_commit_object_oci (FlatpakRemoteState *self,
   guint64 timestamp = 0;
   g_autoptr(GVariantBuilder) metadata_builder = g_variant_builder_new (G_VARIANT_TYPE ("a{sv}"));
   g_autoptr(GVariant) metadata_v = NULL;
+  glnx_autofd int downloads_dfd = flatpak_dir_try_open_downloads_dir (dir, cancellable);
 
-  registry = flatpak_remote_state_new_oci_registry (self, token, cancellable, error);
+  registry = flatpak_remote_state_new_oci_registry (self, downloads_dfd, token, cancellable, error);
   if (registry == NULL)
     return NULL;
 
@@ -1487,6 +1616,104 @@ flatpak_deploy_get_files (FlatpakDeploy *deploy)
   return g_file_get_child (deploy->dir, "files");
 }
 
+/* Files that flatpak_dir_deploy() adds to or changes in the files
+ * directory, so they differ from what's in the commit */
+static const char *deploy_added_files[] = {
+  ".ref",
+  "etc/passwd",
+  "etc/group",
+  "etc/machine-id",
+  "etc/resolv.conf",
+};
+
+/* Recreates the files directory of @deploy at @dest by checking it out
+ * of the repo again, merging with anything already at @dest. This is
+ * cheaper than copying the deployed files one by one. Files are always
+ * copied out of the repo rather than hardlinked, as the caller is
+ * expected to modify them; where the filesystem supports it the copies
+ * are reflinks.
+ *
+ * Fails with G_IO_ERROR_NOT_SUPPORTED if the deployed files can't be
+ * recreated from the repo, for instance for partial deploys or apps
+ * with extra data, in which case the caller should copy them instead.
+ */
+gboolean
+flatpak_deploy_checkout_files (FlatpakDeploy *deploy,
+                               GFile         *dest,
+                               GCancellable  *cancellable,
+                               GError       **error)
+{
+  g_autoptr(GBytes) deploy_data = NULL;
+  g_autofree const char **subpaths = NULL;
+  g_autoptr(GVariant) commit_data = NULL;
+  g_autoptr(GVariant) extra_data_sources = NULL;
+  g_autoptr(GFile) files = NULL;
+  OstreeRepoCommitState commit_state;
+  OstreeRepoCheckoutAtOptions options = { 0, };
+  const char *checksum;
+  int i;
+
+  deploy_data = flatpak_deploy_get_deploy_data (deploy, FLATPAK_DEPLOY_VERSION_ANY, cancellable, error);
+  if (deploy_data == NULL)
+    return FALSE;
+
+  subpaths = flatpak_deploy_data_get_subpaths (deploy_data);
+  if (subpaths[0] != NULL)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                   "%s is only partially deployed", flatpak_decomposed_get_ref (deploy->ref));
+      return FALSE;
+    }
+
+  checksum = flatpak_deploy_data_get_commit (deploy_data);
+  if (!ostree_repo_load_commit (deploy->repo, checksum, &commit_data, &commit_state, NULL) ||
+      (commit_state & OSTREE_REPO_COMMIT_STATE_PARTIAL) != 0)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                   "Commit %s of %s is not in the repo", checksum, flatpak_decomposed_get_ref (deploy->ref));
+      return FALSE;
+    }
+
+  extra_data_sources = flatpak_commit_get_extra_data_sources (commit_data, NULL);
+  if (extra_data_sources != NULL && g_variant_n_children (extra_data_sources) > 0)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                   "%s has extra data", flatpak_decomposed_get_ref (deploy->ref));
+      return FALSE;
+    }
+
+  options.mode = OSTREE_REPO_CHECKOUT_MODE_USER;
+  options.overwrite_mode = OSTREE_REPO_CHECKOUT_OVERWRITE_UNION_FILES;
+  options.enable_fsync = FALSE;
+  options.bareuseronly_dirs = TRUE;
+  options.force_copy = TRUE;
+  options.subpath = "/files";
+
+  if (!ostree_repo_checkout_at (deploy->repo, &options,
+                                AT_FDCWD, flatpak_file_get_path_cached (dest),
+                                checksum,
+                                cancellable, error))
+    return FALSE;
+
+  files = flatpak_deploy_get_files (deploy);
+  for (i = 0; i < G_N_ELEMENTS (deploy_added_files); i++)
+    {
+      g_autoptr(GFile) src_file = g_file_resolve_relative_path (files, deploy_added_files[i]);
+      g_autoptr(GFile) dest_file = g_file_resolve_relative_path (dest, deploy_added_files[i]);
+
+      if (g_file_query_file_type (src_file, G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                                  cancellable) == G_FILE_TYPE_UNKNOWN)
+        continue;
+
+      if (!g_file_copy (src_file, dest_file,
+                        G_FILE_COPY_OVERWRITE | G_FILE_COPY_NOFOLLOW_SYMLINKS,
+                        cancellable, NULL, NULL, error))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
 FlatpakContext *
 flatpak_deploy_get_overrides (FlatpakDeploy *deploy)
 {
@@ -2228,6 +2455,38 @@ flatpak_dir_system_helper_call_deploy (FlatpakDir         *self,
   return ret != NULL;
 }
 
+/* Deploys several refs with one DeployMany call. @arg_deploys is an
+ * a(ayussasas) with the repo path, flags, ref, origin, subpaths and
+ * previous ids of each ref, like the arguments of Deploy. Returns the
+ * a(ss) error name and message of each ref that was tried. */
+static GVariant *
+flatpak_dir_system_helper_call_deploy_many (FlatpakDir   *self,
+                                            GVariant     *arg_deploys,
+                                            guint         arg_flags,
+                                            const gchar  *arg_installation,
+                                            GCancellable *cancellable,
+                                            GError      **error)
+{
+  g_autoptr(GVariant) ret = NULL;
+  GVariant *errors;
+
+  if (flatpak_dir_get_no_interaction (self))
+    arg_flags |= FLATPAK_HELPER_DEPLOY_MANY_FLAGS_NO_INTERACTION;
+
+  ret = flatpak_dir_system_helper_call (self, "DeployMany",
+                                        g_variant_new ("(@a(ayussasas)us)",
+                                                       arg_deploys,
+                                                       arg_flags,
+                                                       arg_installation),
+                                        G_VARIANT_TYPE ("(a(ss))"), NULL,
+                                        cancellable, error);
+  if (ret == NULL)
+    return NULL;
+
+  g_variant_get (ret, "(@a(ss))", &errors);
+  return errors;
+}
+
 static gboolean
 flatpak_dir_system_helper_call_deploy_appstream (FlatpakDir   *self,
                                                  const gchar  *arg_repo_path,
@@ -2591,6 +2850,7 @@ flatpak_dir_finalize (GObject *object)
   g_clear_pointer (&self->remote_filters, g_hash_table_unref);
   g_clear_pointer (&self->masked, g_regex_unref);
   g_clear_pointer (&self->pinned, g_regex_unref);
+  g_clear_pointer (&self->queued_deploys, g_ptr_array_unref);
 
   G_OBJECT_CLASS (flatpak_dir_parent_class)->finalize (object);
 }
@@ -2705,6 +2965,17 @@ flatpak_dir_get_no_interaction (FlatpakDir *self)
   return self->no_interaction;
 }
 
+/* If set, the summary of a remote is always revalidated against the
+ * network, even when the cached copy is still within the xa.summary-max-age
+ * of the remote. This is for callers that need the latest state, like
+ * transactions, or that keep the cache fresh for others, like the portal. */
+void
+flatpak_dir_set_revalidate_summaries (FlatpakDir *self,
+                                      gboolean    revalidate_summaries)
+{
+  self->revalidate_summaries = revalidate_summaries;
+}
+
 GFile *
 flatpak_dir_get_path (FlatpakDir *self)
 {
@@ -3073,6 +3344,12 @@ flatpak_dir_get_removed_dir (FlatpakDir *self)
   return g_file_get_child (self->basedir, ".removed");
 }
 
+GFile *
+flatpak_dir_get_history_dir (FlatpakDir *self)
+{
+  return g_file_get_child (self->basedir, FLATPAK_HISTORY_DIRNAME);
+}
+
 GFile *
 flatpak_dir_get_sideload_repos_dir (FlatpakDir *self)
 {
@@ -4784,6 +5061,24 @@ flatpak_dir_deploy_appstream (FlatpakDir   *self,
         }
     }
 
+  /* Pre-index the (filtered) data for flatpak search, so it doesn't have
+   * to parse the whole appstream. Search falls back to that if this fails. */
+  {
+    g_autoptr(GFile) appstream_xml = g_file_get_child (checkout_dir, "appstream.xml");
+    g_autofree char *index_path = g_build_filename (tmpdir.path, FLATPAK_APPSTREAM_INDEX_FILENAME, NULL);
+    g_autoptr(GFileInputStream) in = g_file_read (appstream_xml, NULL, NULL);
+
+    if (in != NULL &&
+        !flatpak_appstream_index_build_at (G_INPUT_STREAM (in), FALSE,
+                                           AT_FDCWD, index_path,
+                                           cancellable, &tmp_error))
+      {
+        g_warning ("Unable to build appstream search index: %s", tmp_error->message);
+        g_clear_error (&tmp_error);
+        (void) unlink (index_path);
+      }
+  }
+
   glnx_gen_temp_name (tmpname);
   active_tmp_link = g_file_get_child (arch_dir, tmpname);
 
@@ -4957,10 +5252,97 @@ flatpak_dir_update_oci_index (FlatpakDir   *self,
 
       g_clear_error (&local_error);
     }
+  else
+    {
+      /* We got a new index, so any summary generated from the old one is stale */
+      if (!flatpak_dir_remove_oci_file (self, remote, ".summary", cancellable, error))
+        return NULL;
+    }
 
   return g_steal_pointer (&index_cache);
 }
 
+#define OCI_SUMMARY_INDEX_XATTR "user.flatpak.oci-index"
+
+/* Identifies the index file a summary is generated from. A new index
+ * is always renamed over the old one, so this changes with each
+ * download, but not when the server just confirms that it is current.
+ * The flatpak version is included because the summary format may
+ * change between versions. */
+static char *
+get_oci_index_key (GFile *index_cache)
+{
+  struct stat stbuf;
+
+  if (stat (flatpak_file_get_path_cached (index_cache), &stbuf) != 0)
+    return NULL;
+
+  return g_strdup_printf ("%s:%" G_GUINT64_FORMAT ":%" G_GUINT64_FORMAT ":%" G_GINT64_FORMAT ".%09ld",
+                          PACKAGE_VERSION, (guint64) stbuf.st_ino, (guint64) stbuf.st_size,
+                          (gint64) stbuf.st_mtim.tv_sec, (long) stbuf.st_mtim.tv_nsec);
+}
+
+static gboolean
+oci_summary_is_current (GFile        *summary_cache,
+                        GFile        *index_cache,
+                        GCancellable *cancellable)
+{
+  g_autofree char *index_key = get_oci_index_key (index_cache);
+  char summary_key[256];
+  ssize_t len;
+
+  if (index_key == NULL)
+    return FALSE;
+
+  len = TEMP_FAILURE_RETRY (getxattr (flatpak_file_get_path_cached (summary_cache),
+                                      OCI_SUMMARY_INDEX_XATTR, summary_key, sizeof (summary_key) - 1));
+  if (len < 0)
+    {
+      /* Without xattrs we can only compare the mtimes */
+      if (errno == ENOTSUP)
+        return check_destination_mtime (index_cache, summary_cache, cancellable);
+
+      return FALSE;
+    }
+
+  summary_key[len] = 0;
+  return strcmp (summary_key, index_key) == 0;
+}
+
+static gboolean
+write_oci_summary (GFile        *summary_cache,
+                   GBytes       *summary_bytes,
+                   const char   *index_key,
+                   GCancellable *cancellable,
+                   GError      **error)
+{
+  g_autofree char *dir = g_path_get_dirname (flatpak_file_get_path_cached (summary_cache));
+  g_autofree char *name = g_file_get_basename (summary_cache);
+  g_auto(GLnxTmpfile) tmpf = { 0 };
+  glnx_autofd int dfd = -1;
+
+  if (!glnx_opendirat (AT_FDCWD, dir, TRUE, &dfd, error))
+    return FALSE;
+
+  if (!glnx_open_tmpfile_linkable_at (dfd, ".", O_WRONLY, &tmpf, error))
+    return FALSE;
+
+  if (glnx_loop_write (tmpf.fd, g_bytes_get_data (summary_bytes, NULL),
+                       g_bytes_get_size (summary_bytes)) < 0)
+    return glnx_throw_errno_prefix (error, "write");
+
+  if (fchmod (tmpf.fd, 0644) != 0)
+    return glnx_throw_errno_prefix (error, "fchmod");
+
+  if (index_key != NULL &&
+      TEMP_FAILURE_RETRY (fsetxattr (tmpf.fd, OCI_SUMMARY_INDEX_XATTR,
+                                     index_key, strlen (index_key), 0)) != 0 &&
+      errno != ENOTSUP)
+    return glnx_throw_errno_prefix (error, "fsetxattr");
+
+  return glnx_link_tmpfile_at (&tmpf, GLNX_LINK_TMPFILE_REPLACE, dfd, name, error);
+}
+
 static gboolean
 replace_contents_compressed (GFile        *dest,
                              GBytes       *contents,
@@ -5059,6 +5441,22 @@ flatpak_dir_update_appstream_oci (FlatpakDir          *self,
   if (!replace_contents_compressed (new_appstream_file, appstream, cancellable, error))
     return FALSE;
 
+  {
+    g_autoptr(GInputStream) in = g_memory_input_stream_new_from_bytes (appstream);
+    g_autofree char *index_path = g_build_filename (flatpak_file_get_path_cached (arch_dir),
+                                                    FLATPAK_APPSTREAM_INDEX_FILENAME, NULL);
+    g_autoptr(GError) local_error = NULL;
+
+    /* Don't leave the index of the previous appstream data around, search
+     * would use it instead of the new data */
+    if (!flatpak_appstream_index_build_at (in, FALSE, AT_FDCWD, index_path,
+                                           cancellable, &local_error))
+      {
+        g_warning ("Unable to build appstream search index: %s", local_error->message);
+        (void) unlink (index_path);
+      }
+  }
+
   if (!g_file_replace_contents (timestamp_file, "", 0, NULL, FALSE,
                                 G_FILE_CREATE_REPLACE_DESTINATION, NULL, NULL, error))
     return FALSE;
@@ -5272,7 +5670,7 @@ repo_get_remote_collection_id (OstreeRepo *repo,
 static void
 get_common_pull_options (GVariantBuilder     *builder,
                          FlatpakRemoteState  *state,
-                         const char          *ref_to_fetch,
+                         const char * const  *refs_to_fetch,
                          const char          *token,
                          const gchar * const *dirs_to_pull,
                          const char          *current_local_checksum,
@@ -5312,7 +5710,8 @@ get_common_pull_options (GVariantBuilder     *builder,
 
 
   g_variant_builder_init (&hdr_builder, G_VARIANT_TYPE ("a(ss)"));
-  g_variant_builder_add (&hdr_builder, "(ss)", "Flatpak-Ref", ref_to_fetch);
+  for (int i = 0; refs_to_fetch[i] != NULL; i++)
+    g_variant_builder_add (&hdr_builder, "(ss)", "Flatpak-Ref", refs_to_fetch[i]);
   if (token)
     {
       g_autofree char *bearer_token = g_strdup_printf ("Bearer %s", token);
@@ -5390,9 +5789,12 @@ repo_pull (OstreeRepo                           *self,
       !ostree_repo_load_commit (self, current_checksum, &old_commit, NULL, error))
     return FALSE;
 
+  refs_to_fetch[0] = ref_to_fetch;
+  refs_to_fetch[1] = NULL;
+
   /* Pull options */
   g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{sv}"));
-  get_common_pull_options (&builder, state, ref_to_fetch, token, dirs_to_pull, current_checksum,
+  get_common_pull_options (&builder, state, refs_to_fetch, token, dirs_to_pull, current_checksum,
                            force_disable_deltas, flags, progress);
 
   if (sideload_repo)
@@ -5415,8 +5817,6 @@ repo_pull (OstreeRepo                           *self,
     }
   else
     {
-      refs_to_fetch[0] = ref_to_fetch;
-      refs_to_fetch[1] = NULL;
       g_variant_builder_add (&builder, "{s@v}", "refs",
                              g_variant_new_variant (g_variant_new_strv ((const char * const *) refs_to_fetch, -1)));
 
@@ -5488,15 +5888,6 @@ ensure_soup_session (FlatpakDir *self)
     }
 }
 
-static void
-extra_data_progress_report (guint64  downloaded_bytes,
-                            gpointer user_data)
-{
-  FlatpakProgress *progress = FLATPAK_PROGRESS (user_data);
-
-  flatpak_progress_update_extra_data (progress, downloaded_bytes);
-}
-
 static void
 compute_extra_data_download_size (GVariant *commitv,
                                   guint64 *out_n_extra_data,
@@ -5593,32 +5984,208 @@ flatpak_dir_setup_extra_data (FlatpakDir                           *self,
   return TRUE;
 }
 
-static gboolean
-flatpak_dir_pull_extra_data (FlatpakDir          *self,
-                             OstreeRepo          *repo,
-                             const char          *repository,
-                             const char          *ref,
-                             const char          *rev,
-                             FlatpakPullFlags     flatpak_flags,
-                             FlatpakProgress     *progress,
-                             GCancellable        *cancellable,
-                             GError             **error)
+/* How many extra-data sources are downloaded at the same time */
+#define MAX_PARALLEL_EXTRA_DATA_DOWNLOADS 4
+
+typedef struct ExtraDataDownload
 {
-  g_autoptr(GVariant) extra_data_sources = NULL;
-  g_autoptr(GVariant) detached_metadata = NULL;
-  g_auto(GVariantDict) new_metadata_dict = FLATPAK_VARIANT_DICT_INITIALIZER;
-  g_autoptr(GVariantBuilder) extra_data_builder = NULL;
-  g_autoptr(GVariant) new_detached_metadata = NULL;
-  g_autoptr(GVariant) extra_data = NULL;
-  g_autoptr(GFile) base_dir = NULL;
-  int i;
-  gsize n_extra_data;
+  const char *uri;
+  const char *name;
+  char       *sha256;
+  guint64     download_size;
+  GFile      *local_file;
+  /* An earlier source with the same checksum, which is the only one
+   * that gets downloaded */
+  struct ExtraDataDownload *same_as;
 
-  extra_data_sources = flatpak_repo_get_extra_data_sources (repo, rev, cancellable, NULL);
-  if (extra_data_sources == NULL)
-    return TRUE;
+  /* Protected by ExtraDataDownloads.mutex */
+  guint64     downloaded_bytes;
+  gboolean    done;
+  gboolean    accounted;
 
-  n_extra_data = g_variant_n_children (extra_data_sources);
+  /* Only valid once done */
+  GBytes     *bytes;
+  GError     *error;
+} ExtraDataDownload;
+
+typedef struct
+{
+  FlatpakDir   *dir;
+  int           downloads_dfd;
+  GCancellable *cancellable;
+  GMutex        mutex;
+  GCond         cond;
+} ExtraDataDownloads;
+
+static void
+extra_data_download_clear (ExtraDataDownload *download)
+{
+  g_free (download->sha256);
+  g_clear_object (&download->local_file);
+  g_clear_pointer (&download->bytes, g_bytes_unref);
+  g_clear_error (&download->error);
+}
+
+typedef struct
+{
+  ExtraDataDownloads *downloads;
+  ExtraDataDownload  *download;
+} ExtraDataDownloadProgress;
+
+static void
+extra_data_download_progress (guint64  downloaded_bytes,
+                              gpointer user_data)
+{
+  ExtraDataDownloadProgress *data = user_data;
+
+  g_mutex_lock (&data->downloads->mutex);
+  data->download->downloaded_bytes = downloaded_bytes;
+  g_mutex_unlock (&data->downloads->mutex);
+}
+
+static GBytes *
+extra_data_download_fetch (ExtraDataDownloads *downloads,
+                           ExtraDataDownload  *download,
+                           GError            **error)
+{
+  FlatpakDir *self = downloads->dir;
+  GCancellable *cancellable = downloads->cancellable;
+  g_autoptr(GBytes) bytes = NULL;
+  g_autoptr(GChecksum) checksum = g_checksum_new (G_CHECKSUM_SHA256);
+
+  if (g_file_query_exists (download->local_file, cancellable))
+    {
+      g_debug ("Loading extra-data from local file %s", flatpak_file_get_path_cached (download->local_file));
+      g_autoptr(GMappedFile) mfile = NULL;
+      g_autoptr(GError) my_error = NULL;
+
+      mfile = g_mapped_file_new (flatpak_file_get_path_cached (download->local_file), FALSE, &my_error);
+      if (mfile == NULL)
+        {
+          flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA, _("Failed to load local extra-data %s: %s"),
+                              flatpak_file_get_path_cached (download->local_file), my_error->message);
+          return NULL;
+        }
+      if (g_mapped_file_get_length (mfile) != download->download_size)
+        {
+          flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA, _("Wrong size for extra-data %s"), flatpak_file_get_path_cached (download->local_file));
+          return NULL;
+        }
+
+      bytes = g_mapped_file_get_bytes (mfile);
+      g_checksum_update (checksum, g_bytes_get_data (bytes, NULL), g_bytes_get_size (bytes));
+    }
+  else
+    {
+      g_autofree char *partial_name = g_strconcat ("extra-data-", download->sha256, ".partial", NULL);
+      glnx_autofd int extra_data_fd = -1;
+      ExtraDataDownloadProgress progress_data = { downloads, download };
+      g_autoptr(GMappedFile) mfile = NULL;
+
+      if (!flatpak_download_http_uri_resumable (self->soup_session, download->uri, 0,
+                                                downloads->downloads_dfd, partial_name, NULL,
+                                                extra_data_download_progress, &progress_data,
+                                                checksum, &extra_data_fd, cancellable, error))
+        {
+          g_prefix_error (error, _("While downloading %s: "), download->uri);
+          return NULL;
+        }
+
+      mfile = g_mapped_file_new_from_fd (extra_data_fd, FALSE, error);
+      if (mfile == NULL)
+        {
+          g_prefix_error (error, _("While downloading %s: "), download->uri);
+          return NULL;
+        }
+
+      /* The checksum was computed while downloading, so this mapping is
+       * only read again when the commitmeta is written */
+      bytes = g_mapped_file_get_bytes (mfile);
+    }
+
+  if (g_bytes_get_size (bytes) != download->download_size)
+    {
+      flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA, _("Wrong size for extra data %s"), download->uri);
+      return NULL;
+    }
+
+  if (strcmp (g_checksum_get_string (checksum), download->sha256) != 0)
+    {
+      flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA, _("Invalid checksum for extra data %s"), download->uri);
+      return NULL;
+    }
+
+  return g_steal_pointer (&bytes);
+}
+
+static void
+extra_data_download_thread (gpointer data,
+                            gpointer user_data)
+{
+  ExtraDataDownload *download = data;
+  ExtraDataDownloads *downloads = user_data;
+  g_autoptr(GError) local_error = NULL;
+  g_autoptr(GBytes) bytes = NULL;
+
+  if (!g_cancellable_set_error_if_cancelled (downloads->cancellable, &local_error))
+    bytes = extra_data_download_fetch (downloads, download, &local_error);
+
+  /* Make the other downloads stop early, we're going to fail anyway */
+  if (bytes == NULL)
+    g_cancellable_cancel (downloads->cancellable);
+
+  g_mutex_lock (&downloads->mutex);
+  download->bytes = g_steal_pointer (&bytes);
+  download->error = g_steal_pointer (&local_error);
+  download->downloaded_bytes = download->download_size;
+  download->done = TRUE;
+  g_cond_signal (&downloads->cond);
+  g_mutex_unlock (&downloads->mutex);
+}
+
+static void
+cancel_extra_data_downloads (GCancellable *cancellable,
+                             GCancellable *downloads_cancellable)
+{
+  g_cancellable_cancel (downloads_cancellable);
+}
+
+static gboolean
+flatpak_dir_pull_extra_data (FlatpakDir          *self,
+                             OstreeRepo          *repo,
+                             const char          *repository,
+                             const char          *ref,
+                             const char          *rev,
+                             FlatpakPullFlags     flatpak_flags,
+                             FlatpakProgress     *progress,
+                             GCancellable        *cancellable,
+                             GError             **error)
+{
+  g_autoptr(GVariant) extra_data_sources = NULL;
+  g_autoptr(GVariant) detached_metadata = NULL;
+  g_auto(GVariantDict) new_metadata_dict = FLATPAK_VARIANT_DICT_INITIALIZER;
+  g_autoptr(GVariantBuilder) extra_data_builder = NULL;
+  g_autoptr(GVariant) new_metadata = NULL;
+  g_autoptr(GVariant) new_detached_metadata = NULL;
+  g_auto(GLnxTmpfile) metadata_tmpf = { 0 };
+  g_autoptr(GVariant) extra_data = NULL;
+  g_autoptr(GFile) base_dir = NULL;
+  g_autoptr(GCancellable) downloads_cancellable = NULL;
+  glnx_autofd int downloads_dfd = -1;
+  g_autoptr(GArray) download_array = NULL;
+  ExtraDataDownloads downloads = { NULL };
+  GThreadPool *pool;
+  gulong cancelled_id = 0;
+  gsize n_done;
+  gsize n_downloads;
+  int i, j;
+  gsize n_extra_data;
+
+  extra_data_sources = flatpak_repo_get_extra_data_sources (repo, rev, cancellable, NULL);
+  if (extra_data_sources == NULL)
+    return TRUE;
+
+  n_extra_data = g_variant_n_children (extra_data_sources);
   if (n_extra_data == 0)
     return TRUE;
 
@@ -5627,22 +6194,21 @@ flatpak_dir_pull_extra_data (FlatpakDir          *self,
 
   extra_data_builder = g_variant_builder_new (G_VARIANT_TYPE ("a(ayay)"));
 
-  /* Other fields were already set in flatpak_dir_setup_extra_data() */
-  flatpak_progress_start_extra_data (progress);
-
   base_dir = flatpak_get_user_base_dir_location ();
 
+  download_array = g_array_sized_new (FALSE, TRUE, sizeof (ExtraDataDownload), n_extra_data);
+  g_array_set_clear_func (download_array, (GDestroyNotify) extra_data_download_clear);
+  g_array_set_size (download_array, n_extra_data);
+
+  /* Validate all sources before starting any download */
   for (i = 0; i < n_extra_data; i++)
     {
+      ExtraDataDownload *download = &g_array_index (download_array, ExtraDataDownload, i);
       const char *extra_data_uri = NULL;
-      g_autofree char *extra_data_sha256 = NULL;
       const char *extra_data_name = NULL;
       guint64 download_size;
       guint64 installed_size;
-      g_autofree char *sha256 = NULL;
       const guchar *sha256_bytes;
-      g_autoptr(GBytes) bytes = NULL;
-      g_autoptr(GFile) extra_local_file = NULL;
 
       flatpak_repo_parse_extra_data_sources (extra_data_sources, i,
                                              &extra_data_name,
@@ -5654,71 +6220,144 @@ flatpak_dir_pull_extra_data (FlatpakDir          *self,
       if (sha256_bytes == NULL)
         return flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA, _("Invalid checksum for extra data uri %s"), extra_data_uri);
 
-      extra_data_sha256 = ostree_checksum_from_bytes (sha256_bytes);
-
       if (*extra_data_name == 0)
         return flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA, _("Empty name for extra data uri %s"), extra_data_uri);
 
       /* Don't allow file uris here as that could read local files based on remote data */
       if (!g_str_has_prefix (extra_data_uri, "http:") &&
           !g_str_has_prefix (extra_data_uri, "https:"))
-        {
-          flatpak_progress_reset_extra_data (progress);
-          return flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA, _("Unsupported extra data uri %s"), extra_data_uri);
-        }
+        return flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA, _("Unsupported extra data uri %s"), extra_data_uri);
 
-      /* TODO: Download to disk to support resumed downloads on error */
+      download->uri = extra_data_uri;
+      download->name = extra_data_name;
+      download->sha256 = ostree_checksum_from_bytes (sha256_bytes);
+      download->download_size = download_size;
+      download->local_file = flatpak_build_file (base_dir, "extra-data", download->sha256, extra_data_name, NULL);
 
-      extra_local_file = flatpak_build_file (base_dir, "extra-data", extra_data_sha256, extra_data_name, NULL);
-      if (g_file_query_exists (extra_local_file, cancellable))
-        {
-          g_debug ("Loading extra-data from local file %s", flatpak_file_get_path_cached (extra_local_file));
-          gsize extra_local_size;
-          g_autofree char *extra_local_contents = NULL;
-          g_autoptr(GError) my_error = NULL;
-
-          if (!g_file_load_contents (extra_local_file, cancellable, &extra_local_contents, &extra_local_size, NULL, &my_error))
-            return flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA, _("Failed to load local extra-data %s: %s"),
-                                       flatpak_file_get_path_cached (extra_local_file), my_error->message);
-          if (extra_local_size != download_size)
-            return flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA, _("Wrong size for extra-data %s"), flatpak_file_get_path_cached (extra_local_file));
-
-          bytes = g_bytes_new (extra_local_contents, extra_local_size);
-        }
-      else
+      /* Sources with the same checksum would write the same partial file */
+      for (j = 0; j < i; j++)
         {
-          ensure_soup_session (self);
-          bytes = flatpak_load_uri (self->soup_session, extra_data_uri, 0, NULL,
-                                    extra_data_progress_report, progress, NULL,
-                                    cancellable, error);
-        }
+          ExtraDataDownload *other = &g_array_index (download_array, ExtraDataDownload, j);
 
-      if (bytes == NULL)
-        {
-          flatpak_progress_reset_extra_data (progress);
-          g_prefix_error (error, _("While downloading %s: "), extra_data_uri);
-          return FALSE;
+          if (other->same_as == NULL && strcmp (other->sha256, download->sha256) == 0)
+            {
+              if (other->download_size != download->download_size)
+                return flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA, _("Wrong size for extra data %s"), extra_data_uri);
+
+              download->same_as = other;
+              break;
+            }
         }
+    }
 
-      if (g_bytes_get_size (bytes) != download_size)
+  if (!flatpak_dir_open_downloads_dir (self, &downloads_dfd, cancellable, error))
+    return FALSE;
+
+  ensure_soup_session (self);
+
+  /* Other fields were already set in flatpak_dir_setup_extra_data() */
+  flatpak_progress_start_extra_data (progress);
+
+  downloads_cancellable = g_cancellable_new ();
+  if (cancellable)
+    cancelled_id = g_cancellable_connect (cancellable, G_CALLBACK (cancel_extra_data_downloads),
+                                          downloads_cancellable, NULL);
+
+  downloads.dir = self;
+  downloads.downloads_dfd = downloads_dfd;
+  downloads.cancellable = downloads_cancellable;
+  g_mutex_init (&downloads.mutex);
+  g_cond_init (&downloads.cond);
+
+  n_downloads = 0;
+  for (i = 0; i < n_extra_data; i++)
+    if (g_array_index (download_array, ExtraDataDownload, i).same_as == NULL)
+      n_downloads++;
+
+  pool = g_thread_pool_new (extra_data_download_thread, &downloads,
+                            MIN (n_downloads, MAX_PARALLEL_EXTRA_DATA_DOWNLOADS),
+                            FALSE, NULL);
+  for (i = 0; i < n_extra_data; i++)
+    {
+      ExtraDataDownload *download = &g_array_index (download_array, ExtraDataDownload, i);
+
+      if (download->same_as == NULL)
+        g_thread_pool_push (pool, download, NULL);
+    }
+
+  /* Progress is reported from this thread only, aggregated over all
+   * the downloads that are in flight */
+  g_mutex_lock (&downloads.mutex);
+  n_done = 0;
+  while (n_done < n_downloads)
+    {
+      guint64 in_flight_bytes = 0;
+      g_autoptr(GArray) completed = g_array_new (FALSE, FALSE, sizeof (guint64));
+
+      g_cond_wait_until (&downloads.cond, &downloads.mutex,
+                         g_get_monotonic_time () + flatpak_progress_get_update_interval (progress) * G_TIME_SPAN_MILLISECOND);
+
+      for (i = 0; i < n_extra_data; i++)
         {
-          flatpak_progress_reset_extra_data (progress);
-          return flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA, _("Wrong size for extra data %s"), extra_data_uri);
+          ExtraDataDownload *download = &g_array_index (download_array, ExtraDataDownload, i);
+          ExtraDataDownload *source = download->same_as ? download->same_as : download;
+
+          /* Duplicates come after their source, so they are accounted
+           * in the same pass as it */
+          if (source->done && !download->accounted)
+            {
+              download->accounted = TRUE;
+              if (download->same_as == NULL)
+                n_done++;
+              if (source->error == NULL)
+                g_array_append_val (completed, download->download_size);
+            }
+          else if (!download->done && download->same_as == NULL)
+            in_flight_bytes += download->downloaded_bytes;
         }
 
-      flatpak_progress_complete_extra_data_download (progress, download_size);
+      g_mutex_unlock (&downloads.mutex);
+
+      for (i = 0; i < completed->len; i++)
+        flatpak_progress_complete_extra_data_download (progress, g_array_index (completed, guint64, i));
+      flatpak_progress_update_extra_data (progress, in_flight_bytes);
+
+      g_mutex_lock (&downloads.mutex);
+    }
+  g_mutex_unlock (&downloads.mutex);
+
+  g_thread_pool_free (pool, FALSE, TRUE);
+
+  if (cancelled_id != 0)
+    g_cancellable_disconnect (cancellable, cancelled_id);
 
-      sha256 = g_compute_checksum_for_bytes (G_CHECKSUM_SHA256, bytes);
-      if (strcmp (sha256, extra_data_sha256) != 0)
+  g_mutex_clear (&downloads.mutex);
+  g_cond_clear (&downloads.cond);
+
+  /* Report the first real failure, not the cancellation it caused in the others */
+  for (i = 0; i < n_extra_data; i++)
+    {
+      GError *download_error = g_array_index (download_array, ExtraDataDownload, i).error;
+
+      if (download_error != NULL &&
+          (!g_error_matches (download_error, G_IO_ERROR, G_IO_ERROR_CANCELLED) ||
+           g_cancellable_is_cancelled (cancellable)))
         {
           flatpak_progress_reset_extra_data (progress);
-          return flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA, _("Invalid checksum for extra data %s"), extra_data_uri);
+          g_propagate_error (error, g_steal_pointer (&g_array_index (download_array, ExtraDataDownload, i).error));
+          return FALSE;
         }
+    }
+
+  for (i = 0; i < n_extra_data; i++)
+    {
+      ExtraDataDownload *download = &g_array_index (download_array, ExtraDataDownload, i);
+      ExtraDataDownload *source = download->same_as ? download->same_as : download;
 
       g_variant_builder_add (extra_data_builder,
                              "(^ay@ay)",
-                             extra_data_name,
-                             g_variant_new_from_bytes (G_VARIANT_TYPE ("ay"), bytes, TRUE));
+                             download->name,
+                             g_variant_new_from_bytes (G_VARIANT_TYPE ("ay"), source->bytes, TRUE));
     }
 
   extra_data = g_variant_ref_sink (g_variant_builder_end (extra_data_builder));
@@ -5731,22 +6370,34 @@ flatpak_dir_pull_extra_data (FlatpakDir          *self,
 
   g_variant_dict_init (&new_metadata_dict, detached_metadata);
   g_variant_dict_insert_value (&new_metadata_dict, "xa.extra-data", extra_data);
-  new_detached_metadata = g_variant_ref_sink (g_variant_dict_end (&new_metadata_dict));
+  new_metadata = g_variant_ref_sink (g_variant_dict_end (&new_metadata_dict));
+
+  /* The extra data is only mapped from the downloaded files, so serialize
+   * the new metadata straight into a file rather than into memory */
+  if (!glnx_open_tmpfile_linkable_at (ostree_repo_get_dfd (repo), ".", O_RDWR | O_CLOEXEC,
+                                      &metadata_tmpf, error))
+    return FALSE;
+
+  new_detached_metadata = flatpak_variant_store_to_fd (new_metadata, metadata_tmpf.fd, error);
+  if (new_detached_metadata == NULL)
+    return FALSE;
 
   /* There is a commitmeta size limit when pulling, so we have to side-load it
      when installing in the system repo */
   if (flatpak_flags & FLATPAK_PULL_FLAGS_SIDELOAD_EXTRA_DATA)
     {
-      int dfd =  ostree_repo_get_dfd (repo);
-      g_autoptr(GVariant) normalized = g_variant_get_normal_form (new_detached_metadata);
-      gsize normalized_size = g_variant_get_size (normalized);
-      const guint8 *data = g_variant_get_data (normalized);
       g_autofree char *filename = NULL;
 
       filename = g_strconcat (rev, ".commitmeta", NULL);
-      if (!glnx_file_replace_contents_at (dfd, filename,
-                                          data, normalized_size,
-                                          0, cancellable, error))
+      if (fchmod (metadata_tmpf.fd, 0644) != 0 ||
+          fdatasync (metadata_tmpf.fd) != 0)
+        {
+          glnx_throw_errno_prefix (error, "Unable to write sideloaded detached metadata");
+          return FALSE;
+        }
+
+      if (!glnx_link_tmpfile_at (&metadata_tmpf, GLNX_LINK_TMPFILE_REPLACE,
+                                 ostree_repo_get_dfd (repo), filename, error))
         {
           g_prefix_error (error, "Unable to write sideloaded detached metadata: ");
           return FALSE;
@@ -5784,6 +6435,7 @@ flatpak_dir_mirror_oci (FlatpakDir          *self,
                         GCancellable        *cancellable,
                         GError             **error)
 {
+  glnx_autofd int downloads_dfd = -1;
   g_autoptr(FlatpakOciRegistry) registry = NULL;
   g_autofree char *oci_digest = NULL;
   g_autofree char *latest_rev = NULL;
@@ -5817,7 +6469,9 @@ flatpak_dir_mirror_oci (FlatpakDir          *self,
 
   oci_digest = g_strconcat ("sha256:", rev, NULL);
 
-  registry = flatpak_remote_state_new_oci_registry (state, token, cancellable, error);
+  downloads_dfd = flatpak_dir_try_open_downloads_dir (self, cancellable);
+
+  registry = flatpak_remote_state_new_oci_registry (state, downloads_dfd, token, cancellable, error);
   if (registry == NULL)
     return FALSE;
 
@@ -5847,6 +6501,7 @@ flatpak_dir_pull_oci (FlatpakDir          *self,
                       GCancellable        *cancellable,
                       GError             **error)
 {
+  glnx_autofd int downloads_dfd = -1;
   g_autoptr(FlatpakOciRegistry) registry = NULL;
   g_autoptr(FlatpakOciVersioned) versioned = NULL;
   g_autoptr(FlatpakOciImage) image_config = NULL;
@@ -5880,7 +6535,10 @@ flatpak_dir_pull_oci (FlatpakDir          *self,
   if (latest_alt_commit != NULL && strcmp (oci_digest + strlen ("sha256:"), latest_alt_commit) == 0)
     return TRUE;
 
-  registry = flatpak_remote_state_new_oci_registry (state, token, cancellable, error);
+  if (!flatpak_dir_open_downloads_dir (self, &downloads_dfd, cancellable, error))
+    return FALSE;
+
+  registry = flatpak_remote_state_new_oci_registry (state, downloads_dfd, token, cancellable, error);
   if (registry == NULL)
     return FALSE;
 
@@ -6094,18 +6752,464 @@ flatpak_dir_pull (FlatpakDir                           *self,
       name = g_file_get_path (file);
     }
 
-  (flatpak_dir_log) (self, __FILE__, __LINE__, __FUNCTION__, name,
-                     "pull", state->remote_name, ref, rev, current_checksum, NULL,
-                     "Pulled %s from %s", ref, state->remote_name);
+  (flatpak_dir_log) (self, __FILE__, __LINE__, __FUNCTION__, name,
+                     "pull", state->remote_name, ref, rev, current_checksum, NULL,
+                     "Pulled %s from %s", ref, state->remote_name);
+
+out:
+  if (!ret)
+    {
+      ostree_repo_abort_transaction (repo, cancellable, NULL);
+      g_assert (error == NULL || *error != NULL);
+    }
+
+  return ret;
+}
+
+/* Pulls the commits @revs of @refs from the remote of @state in a
+ * single ostree pull, without updating any refs. This lets ostree
+ * fetch the objects of all of them in one go, and objects shared
+ * between them only once, rather than discovering the shared ones one
+ * pull at a time. The regular flatpak_dir_pull() of each ref then finds
+ * everything locally. Commits that are already complete locally are
+ * skipped. This doesn't handle subpaths, sideload repos, tokens or
+ * extra data, and only works on a repo we can write to directly.
+ */
+gboolean
+flatpak_dir_prefetch_commits (FlatpakDir          *self,
+                              FlatpakRemoteState  *state,
+                              const char * const  *refs,
+                              const char * const  *revs,
+                              FlatpakPullFlags     flatpak_flags,
+                              FlatpakProgress     *progress,
+                              GCancellable        *cancellable,
+                              GError             **error)
+{
+  g_auto(GLnxLockFile) lock = { 0, };
+  g_autoptr(GPtrArray) missing_refs = g_ptr_array_new ();
+  g_autoptr(GPtrArray) missing_revs = g_ptr_array_new ();
+  g_autoptr(GVariant) options = NULL;
+  g_autofree char *url = NULL;
+  GVariantBuilder builder;
+  int i;
+
+  if (!flatpak_dir_ensure_repo (self, cancellable, error))
+    return FALSE;
+
+  /* The system helper pulls from a per-op child repo instead */
+  if (flatpak_dir_use_system_helper (self, state->remote_name))
+    return TRUE;
+
+  /* Keep prunes from removing the objects until the refs point to them */
+  if (!flatpak_dir_repo_lock (self, &lock, LOCK_SH, cancellable, error))
+    return FALSE;
+
+  if (flatpak_dir_get_remote_oci (self, state->remote_name))
+    return TRUE;
+
+  if (!ostree_repo_remote_get_url (self->repo, state->remote_name, &url, error))
+    return FALSE;
+
+  if (*url == 0)
+    return TRUE;
+
+  for (i = 0; revs[i] != NULL; i++)
+    {
+      g_autoptr(GVariant) commit_data = NULL;
+      OstreeRepoCommitState commit_state = 0;
+      gboolean have_commit = FALSE;
+
+      if (!ostree_repo_has_object (self->repo, OSTREE_OBJECT_TYPE_COMMIT, revs[i], &have_commit, cancellable, error))
+        return FALSE;
+
+      if (have_commit)
+        {
+          if (!ostree_repo_load_commit (self->repo, revs[i], &commit_data, &commit_state, error))
+            return FALSE;
+
+          if ((commit_state & OSTREE_REPO_COMMIT_STATE_PARTIAL) == 0)
+            continue;
+        }
+      /* See the libostree workaround in flatpak_dir_pull() */
+      else if (!ostree_repo_mark_commit_partial (self->repo, revs[i], TRUE, error))
+        return FALSE;
+
+      g_ptr_array_add (missing_refs, (char *) refs[i]);
+      g_ptr_array_add (missing_revs, (char *) revs[i]);
+    }
+
+  if (missing_revs->len == 0)
+    return TRUE;
+
+  g_ptr_array_add (missing_refs, NULL);
+  g_ptr_array_add (missing_revs, NULL);
+
+  g_debug ("Prefetching %u commits from remote %s", missing_revs->len - 1, state->remote_name);
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{sv}"));
+  get_common_pull_options (&builder, state, (const char * const *) missing_refs->pdata, NULL, NULL, NULL,
+                           (flatpak_flags & FLATPAK_PULL_FLAGS_NO_STATIC_DELTAS) != 0,
+                           OSTREE_REPO_PULL_FLAGS_BAREUSERONLY_FILES, progress);
+
+  /* Pulling by checksum means no refs are written */
+  g_variant_builder_add (&builder, "{s@v}", "refs",
+                         g_variant_new_variant (g_variant_new_strv ((const char * const *) missing_revs->pdata, -1)));
+
+  if (state->sideload_repos->len > 0)
+    {
+      GVariantBuilder localcache_repos_builder;
+
+      g_variant_builder_init (&localcache_repos_builder, G_VARIANT_TYPE ("as"));
+      for (i = 0; i < state->sideload_repos->len; i++)
+        {
+          FlatpakSideloadState *ss = g_ptr_array_index (state->sideload_repos, i);
+          GFile *sideload_path = ostree_repo_get_path (ss->repo);
+
+          g_variant_builder_add (&localcache_repos_builder, "s",
+                                 flatpak_file_get_path_cached (sideload_path));
+        }
+      g_variant_builder_add (&builder, "{s@v}", "localcache-repos",
+                             g_variant_new_variant (g_variant_builder_end (&localcache_repos_builder)));
+    }
+
+  options = g_variant_ref_sink (g_variant_builder_end (&builder));
+
+  if (!ostree_repo_prepare_transaction (self->repo, NULL, cancellable, error))
+    return FALSE;
+
+  {
+    g_auto(FlatpakMainContext) context = FLATKPAK_MAIN_CONTEXT_INIT;
+    flatpak_progress_init_main_context (progress, &context);
+
+    if (!ostree_repo_pull_with_options (self->repo, state->remote_name,
+                                        options, context.ostree_progress, cancellable, error))
+      {
+        ostree_repo_abort_transaction (self->repo, cancellable, NULL);
+        return translate_ostree_repo_pull_errors (error);
+      }
+  }
+
+  if (!ostree_repo_commit_transaction (self->repo, NULL, cancellable, error))
+    {
+      ostree_repo_abort_transaction (self->repo, cancellable, NULL);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+typedef struct
+{
+  FlatpakDir         *dir;
+  OstreeRepo         *src_repo;
+  int                 src_objects_dfd;
+  OstreeRepo         *verified_repo;
+  const char * const *subdirs;
+  GHashTable         *seen;
+  gboolean            can_reflink;
+  guint64             bytes_linked;
+  guint64             bytes_copied;
+} ReflinkImport;
+
+/* Loads a metadata object from an untrusted repo. The data is copied
+ * before its checksum is verified, so it can't change afterwards. */
+static GVariant *
+load_verified_metadata (OstreeRepo       *repo,
+                        OstreeObjectType  type,
+                        const char       *checksum,
+                        GError          **error)
+{
+  g_autoptr(GVariant) variant = NULL;
+  g_autoptr(GBytes) bytes = NULL;
+  g_autofree char *actual = NULL;
+
+  if (!ostree_repo_load_variant (repo, type, checksum, &variant, error))
+    return NULL;
+
+  bytes = g_bytes_new (g_variant_get_data (variant), g_variant_get_size (variant));
+  actual = g_compute_checksum_for_bytes (G_CHECKSUM_SHA256, bytes);
+  if (strcmp (actual, checksum) != 0)
+    return glnx_null_throw (error, "Corrupted %s object %s",
+                            ostree_object_type_to_string (type), checksum);
+
+  return g_variant_ref_sink (g_variant_new_from_bytes (ostree_metadata_variant_type (type), bytes, FALSE));
+}
+
+/* Whether @path (or, for directories, something below it) is in the
+ * subset of the commit that is being pulled */
+static gboolean
+reflink_import_wants_path (ReflinkImport *import,
+                           const char    *path,
+                           gboolean       is_dir)
+{
+  int i;
+
+  if (import->subdirs == NULL)
+    return TRUE;
+
+  for (i = 0; import->subdirs[i] != NULL; i++)
+    {
+      const char *subdir = import->subdirs[i];
+
+      if (flatpak_has_path_prefix (path, subdir))
+        return TRUE;
+
+      if (is_dir && flatpak_has_path_prefix (subdir, path))
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+/* Imports a single file object by reflinking it into a temporary file
+ * of the destination repo and checksumming that, so the source can't
+ * change it after the verification. The verified clone is then
+ * imported through the staging dir of the current transaction.
+ * Objects that can't be handled this way are left to the pull, which
+ * copies them. */
+static gboolean
+reflink_import_file (ReflinkImport *import,
+                     const char    *checksum,
+                     GCancellable  *cancellable,
+                     GError       **error)
+{
+  OstreeRepo *repo = import->dir->repo;
+  int verified_dfd = ostree_repo_get_dfd (import->verified_repo);
+  g_autofree char *relpath = g_strdup_printf ("objects/%.2s/%s.file", checksum, checksum + 2);
+  g_autofree char *objdir = g_strndup (relpath, strlen ("objects/xx"));
+  g_auto(GLnxTmpfile) tmpf = { 0, };
+  g_autoptr(GFileInfo) file_info = NULL;
+  g_autoptr(GInputStream) input = NULL;
+  g_autofree guchar *csum = NULL;
+  g_autofree char *actual = NULL;
+  glnx_autofd int src_dir_fd = -1;
+  glnx_autofd int src_fd = -1;
+  struct stat stbuf;
+  gboolean have_object;
+  gboolean linked;
+
+  if (g_hash_table_contains (import->seen, checksum))
+    return TRUE;
+  g_hash_table_add (import->seen, g_strdup (checksum));
+
+  if (!ostree_repo_has_object (repo, OSTREE_OBJECT_TYPE_FILE, checksum,
+                               &have_object, cancellable, error))
+    return FALSE;
+
+  if (have_object)
+    return TRUE;
+
+  /* The source repo is owned by the user, so don't follow symlinks
+   * anywhere below its objects dir, and don't block on a fifo.
+   * Symlinks and missing objects are left to the pull. */
+  if (!glnx_opendirat (import->src_objects_dfd, objdir + strlen ("objects/"), FALSE, &src_dir_fd, NULL))
+    return TRUE;
+
+  src_fd = openat (src_dir_fd, relpath + strlen ("objects/xx/"),
+                   O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC | O_NOCTTY);
+  if (src_fd < 0)
+    return TRUE;
+
+  if (!glnx_fstat (src_fd, &stbuf, error))
+    return FALSE;
+
+  /* Same restrictions as OSTREE_REPO_PULL_FLAGS_BAREUSERONLY_FILES */
+  if (!S_ISREG (stbuf.st_mode) || (stbuf.st_mode & ~(S_IFMT | 0775)) != 0)
+    return TRUE;
+
+  if (!import->can_reflink)
+    {
+      import->bytes_copied += stbuf.st_size;
+      return TRUE;
+    }
+
+  if (!glnx_open_tmpfile_linkable_at (verified_dfd, "tmp", O_RDWR | O_CLOEXEC, &tmpf, error))
+    return FALSE;
+
+  if (!flatpak_reflink_fd (src_fd, tmpf.fd, &linked, error))
+    return FALSE;
+
+  if (!linked)
+    {
+      g_debug ("Reflinks not supported, copying objects from %s",
+               flatpak_file_get_path_cached (ostree_repo_get_path (import->src_repo)));
+      import->can_reflink = FALSE;
+      import->bytes_copied += stbuf.st_size;
+      return TRUE;
+    }
+
+  if (fchmod (tmpf.fd, stbuf.st_mode & ~S_IFMT) != 0)
+    return glnx_throw_errno_prefix (error, "fchmod");
+
+  /* Objects in bare-user-only repos are always owned by root */
+  file_info = g_file_info_new ();
+  g_file_info_set_file_type (file_info, G_FILE_TYPE_REGULAR);
+  g_file_info_set_size (file_info, stbuf.st_size);
+  g_file_info_set_attribute_uint32 (file_info, "unix::uid", 0);
+  g_file_info_set_attribute_uint32 (file_info, "unix::gid", 0);
+  g_file_info_set_attribute_uint32 (file_info, "unix::mode", stbuf.st_mode);
+
+  input = g_unix_input_stream_new (tmpf.fd, FALSE);
+  if (!ostree_checksum_file_from_input (file_info, NULL, input, OSTREE_OBJECT_TYPE_FILE,
+                                        &csum, cancellable, error))
+    return FALSE;
+
+  actual = ostree_checksum_from_bytes (csum);
+  if (strcmp (actual, checksum) != 0)
+    {
+      g_debug ("Object %s has checksum %s, leaving it to the pull", checksum, actual);
+      import->bytes_copied += stbuf.st_size;
+      return TRUE;
+    }
+
+  if (!glnx_shutil_mkdir_p_at (verified_dfd, objdir, 0755, cancellable, error))
+    return FALSE;
+
+  if (!glnx_link_tmpfile_at (&tmpf, GLNX_LINK_TMPFILE_NOREPLACE_IGNORE_EXIST,
+                             verified_dfd, relpath, error))
+    return FALSE;
+
+  /* Both repos are bare-user-only on the same filesystem, so this
+   * hardlinks the clone into the staging dir, and it only ends up in
+   * objects/ when the transaction is committed. */
+  if (!ostree_repo_import_object_from_with_trust (repo, import->verified_repo,
+                                                  OSTREE_OBJECT_TYPE_FILE, checksum, TRUE,
+                                                  cancellable, error))
+    return FALSE;
+
+  import->bytes_linked += stbuf.st_size;
+  return TRUE;
+}
+
+static gboolean
+reflink_import_dirtree (ReflinkImport *import,
+                        const char    *checksum,
+                        const char    *path,
+                        GCancellable  *cancellable,
+                        GError       **error)
+{
+  g_autoptr(GVariant) dirtree = NULL;
+  g_autoptr(GVariant) files = NULL;
+  g_autoptr(GVariant) dirs = NULL;
+  gsize i, n;
+
+  dirtree = load_verified_metadata (import->src_repo, OSTREE_OBJECT_TYPE_DIR_TREE, checksum, error);
+  if (dirtree == NULL)
+    return FALSE;
+
+  files = g_variant_get_child_value (dirtree, 0);
+  n = g_variant_n_children (files);
+  for (i = 0; i < n; i++)
+    {
+      const char *name;
+      g_autoptr(GVariant) csum_v = NULL;
+      g_autofree char *child_path = NULL;
+      g_autofree char *child_checksum = NULL;
+
+      g_variant_get_child (files, i, "(&s@ay)", &name, &csum_v);
+      if (!ostree_validate_filename (name, error) ||
+          !ostree_validate_structureof_csum_v (csum_v, error))
+        return FALSE;
+
+      child_path = g_build_filename (path, name, NULL);
+      if (!reflink_import_wants_path (import, child_path, FALSE))
+        continue;
+
+      child_checksum = ostree_checksum_from_bytes_v (csum_v);
+      if (!reflink_import_file (import, child_checksum, cancellable, error))
+        return FALSE;
+    }
+
+  dirs = g_variant_get_child_value (dirtree, 1);
+  n = g_variant_n_children (dirs);
+  for (i = 0; i < n; i++)
+    {
+      const char *name;
+      g_autoptr(GVariant) tree_csum_v = NULL;
+      g_autoptr(GVariant) meta_csum_v = NULL;
+      g_autofree char *child_path = NULL;
+      g_autofree char *child_checksum = NULL;
+
+      g_variant_get_child (dirs, i, "(&s@ay@ay)", &name, &tree_csum_v, &meta_csum_v);
+      if (!ostree_validate_filename (name, error) ||
+          !ostree_validate_structureof_csum_v (tree_csum_v, error))
+        return FALSE;
+
+      child_path = g_build_filename (path, name, NULL);
+      if (!reflink_import_wants_path (import, child_path, TRUE))
+        continue;
+
+      child_checksum = ostree_checksum_from_bytes_v (tree_csum_v);
+      if (!reflink_import_dirtree (import, child_checksum, child_path, cancellable, error))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Imports the file objects of @commit from the untrusted @src_repo by
+ * reflinking them, rather than having the pull write a second copy of
+ * all the data. The metadata is verified on the way down from the
+ * (already signature-checked) commit, and each file object is
+ * checksummed after it is reflinked, so nothing the owner of @src_repo
+ * changes later can affect what ends up in our repo. The pull that
+ * follows then only has to copy the metadata and whatever this
+ * couldn't handle. Must be called inside a transaction, the imported
+ * objects are only staged until it is committed. */
+static gboolean
+repo_reflink_import_untrusted (FlatpakDir          *self,
+                               OstreeRepo          *src_repo,
+                               const char          *commit,
+                               const char * const  *subdirs,
+                               GCancellable        *cancellable,
+                               GError             **error)
+{
+  g_autoptr(GHashTable) seen = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  ReflinkImport import = { self, src_repo, -1, NULL, subdirs, seen, TRUE, 0, 0 };
+  g_auto(GLnxTmpDir) tmpdir = { 0, };
+  g_autoptr(OstreeRepo) verified_repo = NULL;
+  glnx_autofd int src_objects_dfd = -1;
+  g_autoptr(GVariant) commit_v = NULL;
+  g_autoptr(GVariant) tree_csum_v = NULL;
+  g_autofree char *tree_checksum = NULL;
+
+  if (ostree_repo_get_mode (src_repo) != OSTREE_REPO_MODE_BARE_USER_ONLY ||
+      ostree_repo_get_mode (self->repo) != OSTREE_REPO_MODE_BARE_USER_ONLY)
+    return TRUE;
+
+  if (!glnx_opendirat (ostree_repo_get_dfd (src_repo), "objects", FALSE, &src_objects_dfd, error))
+    return FALSE;
+
+  /* The verified clones are collected in a private scratch repo next
+   * to our own objects, which they are imported from */
+  if (!glnx_mkdtempat (ostree_repo_get_dfd (self->repo), "tmp/flatpak-import-XXXXXX", 0700,
+                       &tmpdir, error))
+    return FALSE;
+
+  verified_repo = ostree_repo_create_at (tmpdir.fd, "repo", OSTREE_REPO_MODE_BARE_USER_ONLY,
+                                         NULL, cancellable, error);
+  if (verified_repo == NULL)
+    return FALSE;
+
+  import.src_objects_dfd = src_objects_dfd;
+  import.verified_repo = verified_repo;
+
+  commit_v = load_verified_metadata (src_repo, OSTREE_OBJECT_TYPE_COMMIT, commit, error);
+  if (commit_v == NULL)
+    return FALSE;
 
-out:
-  if (!ret)
-    {
-      ostree_repo_abort_transaction (repo, cancellable, NULL);
-      g_assert (error == NULL || *error != NULL);
-    }
+  tree_csum_v = g_variant_get_child_value (commit_v, 6);
+  if (!ostree_validate_structureof_csum_v (tree_csum_v, error))
+    return FALSE;
 
-  return ret;
+  tree_checksum = ostree_checksum_from_bytes_v (tree_csum_v);
+  if (!reflink_import_dirtree (&import, tree_checksum, "/", cancellable, error))
+    return FALSE;
+
+  g_debug ("Imported commit %s: %" G_GUINT64_FORMAT " bytes reflinked, %" G_GUINT64_FORMAT " bytes copied",
+           commit, import.bytes_linked, import.bytes_copied);
+
+  return TRUE;
 }
 
 static gboolean
@@ -6302,6 +7406,14 @@ flatpak_dir_pull_untrusted_local (FlatpakDir          *self,
 
   /* Past this we must use goto out, so we abort the transaction on error */
 
+  if (!repo_reflink_import_untrusted (self, src_repo, checksum,
+                                      subdirs_arg ? (const char * const *) subdirs_arg->pdata : NULL,
+                                      cancellable, error))
+    {
+      g_prefix_error (error, _("While pulling %s from remote %s: "), ref, remote_name);
+      goto out;
+    }
+
   if (!repo_pull_local_untrusted (self, self->repo, remote_name, url,
                                   subdirs_arg ? (const char **) subdirs_arg->pdata : NULL,
                                   ref, checksum, progress,
@@ -7445,6 +8557,148 @@ export_desktop_file (const char         *app,
   return TRUE;
 }
 
+#define EXPORT_REWRITE_XATTR "user.flatpak.export-rewrite"
+
+/* Lets a deploy reuse the rewritten export files of the previously
+ * active deploy when neither the source file (identified by its
+ * checksum in the commit) nor the parameters of the rewrite changed.
+ */
+typedef struct
+{
+  GFile *source_root;
+  int    previous_dfd;
+  char  *params_checksum;
+} ExportRewriteCache;
+
+static char *
+export_rewrite_params_checksum (const char         *app,
+                                const char         *branch,
+                                const char         *arch,
+                                GKeyFile           *metadata,
+                                const char * const *previous_ids)
+{
+  g_autoptr(GChecksum) checksum = g_checksum_new (G_CHECKSUM_SHA256);
+  g_autofree char *metadata_data = NULL;
+  gsize metadata_len = 0;
+  const char *flatpak;
+  int i;
+
+  if ((flatpak = g_getenv ("FLATPAK_BINARY")) == NULL)
+    flatpak = FLATPAK_BINDIR "/flatpak";
+
+  metadata_data = g_key_file_to_data (metadata, &metadata_len, NULL);
+
+  /* Include the version so changes to the rewriting invalidate old results */
+  g_checksum_update (checksum, (const guchar *) PACKAGE_VERSION, strlen (PACKAGE_VERSION) + 1);
+  g_checksum_update (checksum, (const guchar *) flatpak, strlen (flatpak) + 1);
+  g_checksum_update (checksum, (const guchar *) app, strlen (app) + 1);
+  g_checksum_update (checksum, (const guchar *) branch, strlen (branch) + 1);
+  g_checksum_update (checksum, (const guchar *) arch, strlen (arch) + 1);
+  for (i = 0; previous_ids != NULL && previous_ids[i] != NULL; i++)
+    g_checksum_update (checksum, (const guchar *) previous_ids[i], strlen (previous_ids[i]) + 1);
+  g_checksum_update (checksum, (const guchar *) "", 1);
+  if (metadata_data)
+    g_checksum_update (checksum, (const guchar *) metadata_data, metadata_len);
+
+  return g_strdup (g_checksum_get_string (checksum));
+}
+
+static char *
+export_rewrite_key (ExportRewriteCache *cache,
+                    const char         *relpath)
+{
+  g_autoptr(GFile) source = NULL;
+  const char *content_checksum;
+
+  if (cache == NULL || cache->source_root == NULL)
+    return NULL;
+
+  source = g_file_resolve_relative_path (cache->source_root, relpath);
+  if (!OSTREE_IS_REPO_FILE (source) ||
+      !ostree_repo_file_ensure_resolved (OSTREE_REPO_FILE (source), NULL))
+    return NULL;
+
+  content_checksum = ostree_repo_file_get_checksum (OSTREE_REPO_FILE (source));
+  if (content_checksum == NULL)
+    return NULL;
+
+  return g_strconcat (content_checksum, ":", cache->params_checksum, NULL);
+}
+
+/* If the previous deploy has a file rewritten from the same source and
+ * with the same parameters, hardlink it into @dfd under a temporary
+ * name, returned in @out_new_name. */
+static gboolean
+reuse_previous_export (ExportRewriteCache *cache,
+                       const char         *key,
+                       const char         *relpath,
+                       int                 dfd,
+                       char              **out_new_name,
+                       GError            **error)
+{
+  glnx_autofd int previous_fd = -1;
+  char previous_key[256];
+  ssize_t len;
+  g_autofree char *tmpfile_name = g_strdup (".export-reuse-XXXXXX");
+  g_autofree char *proc_path = NULL;
+  int count;
+
+  *out_new_name = NULL;
+
+  if (cache == NULL || cache->previous_dfd == -1 || key == NULL)
+    return TRUE;
+
+  previous_fd = openat (cache->previous_dfd, relpath, O_RDONLY | O_NOFOLLOW | O_CLOEXEC | O_NOCTTY);
+  if (previous_fd == -1)
+    return TRUE;
+
+  len = TEMP_FAILURE_RETRY (fgetxattr (previous_fd, EXPORT_REWRITE_XATTR, previous_key, sizeof (previous_key) - 1));
+  if (len < 0)
+    return TRUE;
+  previous_key[len] = 0;
+
+  if (strcmp (previous_key, key) != 0)
+    return TRUE;
+
+  proc_path = g_strdup_printf ("/proc/self/fd/%d", previous_fd);
+  for (count = 0; count < 100; count++)
+    {
+      glnx_gen_temp_name (tmpfile_name);
+
+      if (linkat (AT_FDCWD, proc_path, dfd, tmpfile_name, AT_SYMLINK_FOLLOW) == 0)
+        {
+          *out_new_name = g_steal_pointer (&tmpfile_name);
+          return TRUE;
+        }
+
+      if (errno != EEXIST)
+        break;
+    }
+
+  /* Not being able to reuse the old file is not fatal, we just rewrite it */
+  g_debug ("Failed to reuse previous export %s: %s", relpath, g_strerror (errno));
+  return TRUE;
+}
+
+static void
+remember_export_rewrite (int         dfd,
+                         const char *name,
+                         const char *key)
+{
+  glnx_autofd int fd = -1;
+
+  if (key == NULL)
+    return;
+
+  fd = openat (dfd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC | O_NOCTTY);
+  if (fd == -1)
+    return;
+
+  /* Failure just means the next deploy can't reuse the result */
+  if (TEMP_FAILURE_RETRY (fsetxattr (fd, EXPORT_REWRITE_XATTR, key, strlen (key), 0)) != 0)
+    g_debug ("Failed to set %s on %s: %s", EXPORT_REWRITE_XATTR, name, g_strerror (errno));
+}
+
 static gboolean
 rewrite_export_dir (const char         *app,
                     const char         *branch,
@@ -7452,6 +8706,7 @@ rewrite_export_dir (const char         *app,
                     GKeyFile           *metadata,
                     const char * const *previous_ids,
                     FlatpakContext     *context,
+                    ExportRewriteCache *cache,
                     int                 source_parent_fd,
                     const char         *source_name,
                     const char         *source_path,
@@ -7508,7 +8763,7 @@ rewrite_export_dir (const char         *app,
         {
           g_autofree char *path = g_build_filename (source_path, dent->d_name, NULL);
 
-          if (!rewrite_export_dir (app, branch, arch, metadata, previous_ids, context,
+          if (!rewrite_export_dir (app, branch, arch, metadata, previous_ids, context, cache,
                                    source_iter.fd, dent->d_name,
                                    path, cancellable, error))
             goto out;
@@ -7517,6 +8772,9 @@ rewrite_export_dir (const char         *app,
         {
           g_autofree gchar *name_without_extension = NULL;
           g_autofree gchar *new_name = NULL;
+          g_autofree gchar *relpath = NULL;
+          g_autofree gchar *rewrite_key = NULL;
+          gboolean rewrite_desktop, rewrite_ini, rewrite_mime;
           int i;
 
           for (i = 0; allowed_extensions[i] != NULL; i++)
@@ -7548,28 +8806,48 @@ rewrite_export_dir (const char         *app,
                 }
             }
 
-          if (g_str_has_suffix (dent->d_name, ".desktop") ||
-              g_str_has_suffix (dent->d_name, ".service"))
-            {
-              if (!export_desktop_file (app, branch, arch, metadata, previous_ids,
-                                        source_iter.fd, dent->d_name, &stbuf, &new_name, cancellable, error))
-                goto out;
-            }
+          rewrite_desktop = (g_str_has_suffix (dent->d_name, ".desktop") ||
+                             g_str_has_suffix (dent->d_name, ".service"));
+          rewrite_ini = (strcmp (source_name, "search-providers") == 0 &&
+                         g_str_has_suffix (dent->d_name, ".ini"));
+          rewrite_mime = (strcmp (source_name, "packages") == 0 &&
+                          g_str_has_suffix (dent->d_name, ".xml"));
 
-          if (strcmp (source_name, "search-providers") == 0 &&
-              g_str_has_suffix (dent->d_name, ".ini"))
+          if (rewrite_desktop || rewrite_ini || rewrite_mime)
             {
-              if (!export_ini_file (source_iter.fd, dent->d_name, INI_FILE_TYPE_SEARCH_PROVIDER,
-                                    &stbuf, &new_name, cancellable, error))
+              relpath = g_build_filename (source_path, dent->d_name, NULL);
+              rewrite_key = export_rewrite_key (cache, relpath);
+
+              if (!reuse_previous_export (cache, rewrite_key, relpath, source_iter.fd,
+                                          &new_name, error))
                 goto out;
             }
 
-          if (strcmp (source_name, "packages") == 0 &&
-              g_str_has_suffix (dent->d_name, ".xml"))
+          if (new_name == NULL)
             {
-              if (!export_mime_file (source_iter.fd, dent->d_name,
-                                     &stbuf, &new_name, cancellable, error))
-                goto out;
+              if (rewrite_desktop)
+                {
+                  if (!export_desktop_file (app, branch, arch, metadata, previous_ids,
+                                            source_iter.fd, dent->d_name, &stbuf, &new_name, cancellable, error))
+                    goto out;
+                }
+
+              if (rewrite_ini)
+                {
+                  if (!export_ini_file (source_iter.fd, dent->d_name, INI_FILE_TYPE_SEARCH_PROVIDER,
+                                        &stbuf, &new_name, cancellable, error))
+                    goto out;
+                }
+
+              if (rewrite_mime)
+                {
+                  if (!export_mime_file (source_iter.fd, dent->d_name,
+                                         &stbuf, &new_name, cancellable, error))
+                    goto out;
+                }
+
+              if (new_name)
+                remember_export_rewrite (source_iter.fd, new_name, rewrite_key);
             }
 
           if (new_name)
@@ -7607,10 +8885,14 @@ flatpak_rewrite_export_dir (const char         *app,
                             GKeyFile           *metadata,
                             const char * const *previous_ids,
                             GFile              *source,
+                            GFile              *source_root,
+                            int                 previous_dfd,
                             GCancellable       *cancellable,
                             GError            **error)
 {
   gboolean ret = FALSE;
+  g_autofree char *params_checksum = NULL;
+  ExportRewriteCache cache = { source_root, previous_dfd, NULL };
   g_autoptr(GFile) parent = g_file_get_parent (source);
   glnx_autofd int parentfd = -1;
   g_autofree char *name = g_file_get_basename (source);
@@ -7631,8 +8913,11 @@ flatpak_rewrite_export_dir (const char         *app,
                        error))
     return FALSE;
 
+  params_checksum = export_rewrite_params_checksum (app, branch, arch, metadata, previous_ids);
+  cache.params_checksum = params_checksum;
+
   /* The fds are closed by this call */
-  if (!rewrite_export_dir (app, branch, arch, metadata, previous_ids, context,
+  if (!rewrite_export_dir (app, branch, arch, metadata, previous_ids, context, &cache,
                            parentfd, name, source_path,
                            cancellable, error))
     goto out;
@@ -7828,7 +9113,15 @@ flatpak_dir_update_exports (FlatpakDir   *self,
         }
     }
 
-  if (!flatpak_remove_dangling_symlinks (exports, cancellable, error))
+  if (changed_app)
+    {
+      /* Only the links of the changed app can have become dangling */
+      g_autofree char *app_infix = g_strconcat ("/app/", changed_app, "/", NULL);
+
+      if (!flatpak_remove_dangling_symlinks_to (exports, app_infix, cancellable, error))
+        goto out;
+    }
+  else if (!flatpak_remove_dangling_symlinks (exports, cancellable, error))
     goto out;
 
   ret = TRUE;
@@ -7837,6 +9130,58 @@ out:
   return ret;
 }
 
+/* Writes the extra data to disk and verifies it in the same pass, so the
+ * (possibly very large) data is only read once. It only appears under its
+ * final name if the checksum matches.
+ */
+static gboolean
+write_extra_data_file (int           extradir_dfd,
+                       const char   *name,
+                       const guchar *data,
+                       gsize         len,
+                       const char   *expected_sha256,
+                       GCancellable *cancellable,
+                       GError      **error)
+{
+  g_auto(GLnxTmpfile) tmpf = { 0 };
+  g_autoptr(GOutputStream) out = NULL;
+  g_autoptr(GChecksum) checksum = g_checksum_new (G_CHECKSUM_SHA256);
+  gsize offset = 0;
+
+  if (!glnx_open_tmpfile_linkable_at (extradir_dfd, ".", O_WRONLY | O_CLOEXEC, &tmpf, error))
+    return FALSE;
+
+  out = g_unix_output_stream_new (tmpf.fd, FALSE);
+
+  while (offset < len)
+    {
+      gsize chunk = MIN (len - offset, 64 * 1024);
+
+      if (!flatpak_write_update_checksum (out, data + offset, chunk, NULL, checksum,
+                                          cancellable, error))
+        {
+          g_prefix_error (error, _("While writing extra data file '%s': "), name);
+          return FALSE;
+        }
+
+      offset += chunk;
+    }
+
+  if (strcmp (g_checksum_get_string (checksum), expected_sha256) != 0)
+    return flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA, _("Invalid checksum for extra data"));
+
+  if (fchmod (tmpf.fd, 0644) != 0)
+    return glnx_throw_errno_prefix (error, "fchmod");
+
+  if (!glnx_link_tmpfile_at (&tmpf, GLNX_LINK_TMPFILE_REPLACE, extradir_dfd, name, error))
+    {
+      g_prefix_error (error, _("While writing extra data file '%s': "), name);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
 static gboolean
 extract_extra_data (FlatpakDir   *self,
                     const char   *checksum,
@@ -7849,6 +9194,7 @@ extract_extra_data (FlatpakDir   *self,
   g_autoptr(GVariant) extra_data = NULL;
   g_autoptr(GVariant) extra_data_sources = NULL;
   g_autoptr(GError) local_error = NULL;
+  glnx_autofd int extradir_dfd = -1;
   gsize i, n_extra_data = 0;
   gsize n_extra_data_sources;
 
@@ -7898,6 +9244,9 @@ extract_extra_data (FlatpakDir   *self,
       return FALSE;
     }
 
+  if (!glnx_opendirat (AT_FDCWD, flatpak_file_get_path_cached (extradir), TRUE, &extradir_dfd, error))
+    return FALSE;
+
   for (i = 0; i < n_extra_data_sources; i++)
     {
       g_autofree char *extra_data_sha256 = NULL;
@@ -7927,8 +9276,6 @@ extract_extra_data (FlatpakDir   *self,
       for (j = 0; j < n_extra_data; j++)
         {
           g_autoptr(GVariant) content = NULL;
-          g_autoptr(GFile) dest = NULL;
-          g_autofree char *sha256 = NULL;
           const char *extra_data_name = NULL;
           const guchar *data;
           gsize len;
@@ -7946,20 +9293,10 @@ extract_extra_data (FlatpakDir   *self,
           if (len != download_size)
             return flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA, _("Wrong size for extra data"));
 
-          sha256 = g_compute_checksum_for_data (G_CHECKSUM_SHA256, data, len);
-          if (strcmp (sha256, extra_data_sha256) != 0)
-            return flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA, _("Invalid checksum for extra data"));
+          if (!write_extra_data_file (extradir_dfd, extra_data_name, data, len,
+                                      extra_data_sha256, cancellable, error))
+            return FALSE;
 
-          dest = g_file_get_child (extradir, extra_data_name);
-          if (!g_file_replace_contents (dest,
-                                        g_variant_get_data (content),
-                                        g_variant_get_size (content),
-                                        NULL, FALSE, G_FILE_CREATE_REPLACE_DESTINATION,
-                                        NULL, cancellable, error))
-            {
-              g_prefix_error (error, _("While writing extra data file '%s': "), extra_data_name);
-              return FALSE;
-            }
           found = TRUE;
         }
 
@@ -8689,13 +10026,27 @@ flatpak_dir_deploy (FlatpakDir          *self,
       g_autofree char *escaped_branch = maybe_quote (ref_branch);
       g_autofree char *escaped_arch = maybe_quote (ref_arch);
       g_autofree char *bin_data = NULL;
+      g_autoptr(GFile) export_root = g_file_get_child (root, "export");
+      g_autofree char *previous_active = NULL;
+      glnx_autofd int previous_export_dfd = -1;
       int r;
 
+      /* Let unchanged files be reused from the currently active deploy */
+      previous_active = flatpak_dir_read_active (self, ref, cancellable);
+      if (previous_active != NULL)
+        {
+          g_autofree char *previous_export = g_build_filename (flatpak_file_get_path_cached (deploy_base),
+                                                               previous_active, "export", NULL);
+          if (!glnx_opendirat (AT_FDCWD, previous_export, TRUE, &previous_export_dfd, NULL))
+            previous_export_dfd = -1;
+        }
+
       if (!flatpak_mkdir_p (bindir, cancellable, error))
         return FALSE;
 
       if (!flatpak_rewrite_export_dir (ref_id, ref_branch, ref_arch,
                                        keyfile, previous_ids, export,
+                                       export_root, previous_export_dfd,
                                        cancellable,
                                        error))
         return FALSE;
@@ -9473,18 +10824,302 @@ flatpak_dir_unmount_and_cancel_pull (FlatpakDir    *self,
   const char *installation = flatpak_dir_get_id (self);
   g_autoptr(GError) error = NULL;
 
-  if (mnt_dir &&
-      !flatpak_dir_revokefs_fuse_unmount (repo, lockfile, mnt_dir, &error))
-    g_warning ("Could not unmount revokefs-fuse filesystem at %s: %s", mnt_dir, error->message);
+  if (mnt_dir &&
+      !flatpak_dir_revokefs_fuse_unmount (repo, lockfile, mnt_dir, &error))
+    g_warning ("Could not unmount revokefs-fuse filesystem at %s: %s", mnt_dir, error->message);
+
+  g_clear_error (&error);
+
+  if (src_dir &&
+      !flatpak_dir_system_helper_call_cancel_pull (self,
+                                                   arg_flags,
+                                                   installation ? installation : "",
+                                                   src_dir, cancellable, &error))
+    g_warning ("Error cancelling ongoing pull at %s: %s", src_dir, error->message);
+}
+
+typedef struct
+{
+  char              *repo_path;
+  gboolean           remove_repo;
+  guint32            flags;
+  FlatpakDecomposed *ref;
+  char              *origin;
+  char             **subpaths;
+  char             **previous_ids;
+} QueuedDeploy;
+
+static void
+queued_deploy_free (QueuedDeploy *deploy)
+{
+  g_free (deploy->repo_path);
+  flatpak_decomposed_unref (deploy->ref);
+  g_free (deploy->origin);
+  g_strfreev (deploy->subpaths);
+  g_strfreev (deploy->previous_ids);
+  g_free (deploy);
+}
+
+static void
+queued_deploy_error_free (GError *error)
+{
+  if (error)
+    g_error_free (error);
+}
+
+/* The user side of a successful system helper deploy */
+static void
+finish_system_helper_deploy (const char         *child_repo_path,
+                             gboolean            remove_child_repo,
+                             FlatpakDecomposed  *ref,
+                             const char * const *previous_ids)
+{
+  if (child_repo_path && remove_child_repo)
+    (void) glnx_shutil_rm_rf_at (AT_FDCWD, child_repo_path, NULL, NULL);
+
+  /* In case the app is being renamed, rewrite any launchers made by
+   * xdg-desktop-portal. This has to be done as the user so can't be in the
+   * system helper.
+   */
+  if (previous_ids)
+    rewrite_dynamic_launchers (ref, previous_ids);
+}
+
+/* Hands a pulled ref to the system helper for deploying, or queues it if a
+ * deploy batch is active. @remove_child_repo is FALSE for revokefs pulls,
+ * whose child repo belongs to the system helper. */
+static gboolean
+flatpak_dir_system_helper_deploy (FlatpakDir         *self,
+                                  const char         *child_repo_path,
+                                  gboolean            remove_child_repo,
+                                  guint               helper_flags,
+                                  FlatpakDecomposed  *ref,
+                                  const char         *origin,
+                                  const char * const *subpaths,
+                                  const char * const *previous_ids,
+                                  GCancellable       *cancellable,
+                                  GError            **error)
+{
+  const char *installation = flatpak_dir_get_id (self);
+
+  if (self->queued_deploys != NULL &&
+      (helper_flags & FLATPAK_HELPER_DEPLOY_FLAGS_NO_DEPLOY) == 0)
+    {
+      QueuedDeploy *deploy = g_new0 (QueuedDeploy, 1);
+
+      deploy->repo_path = g_strdup (child_repo_path ? child_repo_path : "");
+      deploy->remove_repo = child_repo_path != NULL && remove_child_repo;
+      deploy->flags = helper_flags;
+      deploy->ref = flatpak_decomposed_ref (ref);
+      deploy->origin = g_strdup (origin);
+      deploy->subpaths = g_strdupv ((char **) subpaths);
+      deploy->previous_ids = g_strdupv ((char **) previous_ids);
+      g_ptr_array_add (self->queued_deploys, deploy);
+
+      return TRUE;
+    }
+
+  if (!flatpak_dir_system_helper_call_deploy (self,
+                                              child_repo_path ? child_repo_path : "",
+                                              helper_flags, flatpak_decomposed_get_ref (ref), origin,
+                                              subpaths, previous_ids,
+                                              installation ? installation : "",
+                                              cancellable,
+                                              error))
+    return FALSE;
+
+  finish_system_helper_deploy (child_repo_path, remove_child_repo, ref, previous_ids);
+
+  return TRUE;
+}
+
+/* Starts queueing the system helper deploys of flatpak_dir_install() and
+ * flatpak_dir_update(), so that flatpak_dir_deploy_queued() can do them
+ * with one DeployMany call, which needs only one polkit check for each
+ * action. Does nothing for installations that don't use the system
+ * helper. */
+void
+flatpak_dir_begin_deploy_batch (FlatpakDir *self)
+{
+  g_return_if_fail (self->queued_deploys == NULL);
+
+  if (flatpak_dir_use_system_helper (self, NULL))
+    self->queued_deploys = g_ptr_array_new_with_free_func ((GDestroyNotify) queued_deploy_free);
+}
+
+/* Throws away a queued deploy that will never be done, and the data
+ * pulled for it */
+static void
+flatpak_dir_discard_queued_deploy (FlatpakDir   *self,
+                                   QueuedDeploy *deploy)
+{
+  const char *installation = flatpak_dir_get_id (self);
+  g_autofree char *src_dir = NULL;
+  g_autoptr(GError) local_error = NULL;
+
+  if (*deploy->repo_path == '\0')
+    return;
+
+  if (deploy->remove_repo)
+    {
+      (void) glnx_shutil_rm_rf_at (AT_FDCWD, deploy->repo_path, NULL, NULL);
+      return;
+    }
+
+  /* A revokefs pull, which the system helper has to clean up */
+  src_dir = g_path_get_dirname (deploy->repo_path);
+  if (!flatpak_dir_system_helper_call_cancel_pull (self,
+                                                   FLATPAK_HELPER_CANCEL_PULL_FLAGS_NONE,
+                                                   installation ? installation : "",
+                                                   src_dir, NULL, &local_error))
+    g_warning ("Error cancelling ongoing pull at %s: %s", src_dir, local_error->message);
+}
+
+/* Stops the deploy batch, throwing away any deploys still queued */
+void
+flatpak_dir_end_deploy_batch (FlatpakDir *self)
+{
+  g_autoptr(GPtrArray) queued_deploys = g_steal_pointer (&self->queued_deploys);
+  guint i;
+
+  if (queued_deploys == NULL)
+    return;
+
+  for (i = 0; i < queued_deploys->len; i++)
+    flatpak_dir_discard_queued_deploy (self, g_ptr_array_index (queued_deploys, i));
+}
+
+guint
+flatpak_dir_get_n_queued_deploys (FlatpakDir *self)
+{
+  if (self->queued_deploys == NULL)
+    return 0;
+
+  return self->queued_deploys->len;
+}
+
+void
+flatpak_dir_drop_queued_deploy (FlatpakDir *self,
+                                guint       index)
+{
+  g_return_if_fail (index < flatpak_dir_get_n_queued_deploys (self));
+
+  flatpak_dir_discard_queued_deploy (self, g_ptr_array_index (self->queued_deploys, index));
+  g_ptr_array_remove_index (self->queued_deploys, index);
+}
+
+/* Deploys the first queued ref with a plain Deploy call */
+static GError *
+flatpak_dir_deploy_first_queued (FlatpakDir   *self,
+                                 GCancellable *cancellable)
+{
+  QueuedDeploy *deploy = g_ptr_array_index (self->queued_deploys, 0);
+  const char *installation = flatpak_dir_get_id (self);
+  GError *local_error = NULL;
+
+  if (flatpak_dir_system_helper_call_deploy (self, deploy->repo_path, deploy->flags,
+                                             flatpak_decomposed_get_ref (deploy->ref),
+                                             deploy->origin,
+                                             (const char * const *) deploy->subpaths,
+                                             (const char * const *) deploy->previous_ids,
+                                             installation ? installation : "",
+                                             cancellable, &local_error))
+    finish_system_helper_deploy (deploy->repo_path, deploy->remove_repo, deploy->ref,
+                                 (const char * const *) deploy->previous_ids);
+
+  g_ptr_array_remove_index (self->queued_deploys, 0);
+
+  return local_error;
+}
+
+/* Deploys the queued refs in order, stopping after the first one that
+ * fails other than by being already installed. Returns the error, or
+ * NULL, of each ref that was tried; these are removed from the queue,
+ * and there is always at least one. The rest stay queued. */
+GPtrArray *
+flatpak_dir_deploy_queued (FlatpakDir   *self,
+                           GCancellable *cancellable)
+{
+  g_autoptr(GPtrArray) results = g_ptr_array_new_with_free_func ((GDestroyNotify) queued_deploy_error_free);
+  g_autoptr(GVariant) errors = NULL;
+  g_autoptr(GError) local_error = NULL;
+  const char *installation = flatpak_dir_get_id (self);
+  GVariantBuilder builder;
+  gsize i, n_results;
+
+  g_return_val_if_fail (flatpak_dir_get_n_queued_deploys (self) > 0, NULL);
+
+  /* A single ref keeps the polkit details of a Deploy call */
+  if (self->queued_deploys->len == 1)
+    {
+      g_ptr_array_add (results, flatpak_dir_deploy_first_queued (self, cancellable));
+      return g_steal_pointer (&results);
+    }
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(ayussasas)"));
+  for (i = 0; i < self->queued_deploys->len; i++)
+    {
+      QueuedDeploy *deploy = g_ptr_array_index (self->queued_deploys, i);
+      const char *empty[] = { NULL };
+
+      g_variant_builder_add (&builder, "(^ayuss^as^as)",
+                             deploy->repo_path,
+                             deploy->flags,
+                             flatpak_decomposed_get_ref (deploy->ref),
+                             deploy->origin,
+                             deploy->subpaths ? (const char * const *) deploy->subpaths : empty,
+                             deploy->previous_ids ? (const char * const *) deploy->previous_ids : empty);
+    }
+
+  errors = flatpak_dir_system_helper_call_deploy_many (self, g_variant_builder_end (&builder), 0,
+                                                       installation ? installation : "",
+                                                       cancellable, &local_error);
+  if (errors == NULL)
+    {
+      /* An older system helper, deploy the refs one at a time */
+      if (g_error_matches (local_error, G_DBUS_ERROR, G_DBUS_ERROR_UNKNOWN_METHOD))
+        g_ptr_array_add (results, flatpak_dir_deploy_first_queued (self, cancellable));
+      else
+        {
+          g_ptr_array_add (results, g_steal_pointer (&local_error));
+          g_ptr_array_remove_index (self->queued_deploys, 0);
+        }
+
+      return g_steal_pointer (&results);
+    }
+
+  n_results = MIN (g_variant_n_children (errors), self->queued_deploys->len);
+  if (n_results == 0)
+    {
+      g_ptr_array_add (results, g_error_new_literal (G_IO_ERROR, G_IO_ERROR_FAILED,
+                                                     _("No result from the system helper")));
+      g_ptr_array_remove_index (self->queued_deploys, 0);
+      return g_steal_pointer (&results);
+    }
+
+  for (i = 0; i < n_results; i++)
+    {
+      QueuedDeploy *deploy = g_ptr_array_index (self->queued_deploys, i);
+      const char *error_name, *error_message;
+      GError *deploy_error;
 
-  g_clear_error (&error);
+      g_variant_get_child (errors, i, "(&s&s)", &error_name, &error_message);
+      if (*error_name == '\0')
+        {
+          finish_system_helper_deploy (deploy->repo_path, deploy->remove_repo, deploy->ref,
+                                       (const char * const *) deploy->previous_ids);
+          g_ptr_array_add (results, NULL);
+          continue;
+        }
 
-  if (src_dir &&
-      !flatpak_dir_system_helper_call_cancel_pull (self,
-                                                   arg_flags,
-                                                   installation ? installation : "",
-                                                   src_dir, cancellable, &error))
-    g_warning ("Error cancelling ongoing pull at %s: %s", src_dir, error->message);
+      deploy_error = g_dbus_error_new_for_dbus_error (error_name, error_message);
+      g_dbus_error_strip_remote_error (deploy_error);
+      g_ptr_array_add (results, deploy_error);
+    }
+
+  g_ptr_array_remove_range (self->queued_deploys, 0, n_results);
+
+  return g_steal_pointer (&results);
 }
 
 gboolean
@@ -9709,27 +11344,11 @@ flatpak_dir_install (FlatpakDir          *self,
 
       helper_flags |= FLATPAK_HELPER_DEPLOY_FLAGS_INSTALL_HINT;
 
-      if (!flatpak_dir_system_helper_call_deploy (self,
-                                                  child_repo_path ? child_repo_path : "",
-                                                  helper_flags, flatpak_decomposed_get_ref (ref), state->remote_name,
-                                                  (const char * const *) subpaths,
-                                                  (const char * const *) opt_previous_ids,
-                                                  installation ? installation : "",
-                                                  cancellable,
-                                                  error))
-        return FALSE;
-
-      if (child_repo_path && !is_revokefs_pull)
-        (void) glnx_shutil_rm_rf_at (AT_FDCWD, child_repo_path, NULL, NULL);
-
-      /* In case the app is being renamed, rewrite any launchers made by
-       * xdg-desktop-portal. This has to be done as the user so can't be in the
-       * system helper.
-       */
-      if (opt_previous_ids)
-        rewrite_dynamic_launchers (ref, opt_previous_ids);
-
-      return TRUE;
+      return flatpak_dir_system_helper_deploy (self, child_repo_path, !is_revokefs_pull,
+                                               helper_flags, ref, state->remote_name,
+                                               (const char * const *) subpaths,
+                                               (const char * const *) opt_previous_ids,
+                                               cancellable, error);
     }
 
   if (!no_pull)
@@ -9760,6 +11379,7 @@ flatpak_dir_install (FlatpakDir          *self,
 char *
 flatpak_dir_ensure_bundle_remote (FlatpakDir         *self,
                                   GFile              *file,
+                                  FlatpakBundleHeader *header,
                                   GBytes             *extra_gpg_data,
                                   FlatpakDecomposed **out_ref,
                                   char              **out_checksum,
@@ -9768,40 +11388,43 @@ flatpak_dir_ensure_bundle_remote (FlatpakDir         *self,
                                   GCancellable       *cancellable,
                                   GError            **error)
 {
+  g_autoptr(FlatpakBundleHeader) loaded_header = NULL;
   g_autoptr(FlatpakDecomposed) ref = NULL;
   gboolean created_remote = FALSE;
   g_autoptr(GBytes) deploy_data = NULL;
-  g_autoptr(GVariant) metadata = NULL;
-  g_autofree char *origin = NULL;
-  g_autofree char *fp_metadata = NULL;
   g_autofree char *basename = NULL;
-  g_autoptr(GBytes) included_gpg_data = NULL;
   GBytes *gpg_data = NULL;
-  g_autofree char *to_checksum = NULL;
   g_autofree char *remote = NULL;
-  g_autofree char *collection_id = NULL;
 
   if (!flatpak_dir_ensure_repo (self, cancellable, error))
     return NULL;
 
-  metadata = flatpak_bundle_load (file, &to_checksum,
-                                  &ref,
-                                  &origin,
-                                  NULL, &fp_metadata, NULL,
-                                  &included_gpg_data,
-                                  &collection_id,
-                                  error);
-  if (metadata == NULL)
+  if (header == NULL)
+    {
+      loaded_header = flatpak_bundle_header_load (file, error);
+      if (loaded_header == NULL)
+        return NULL;
+      header = loaded_header;
+    }
+
+  if (header->ref == NULL)
+    {
+      flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA, _("Invalid bundle, no ref in metadata"));
+      return NULL;
+    }
+
+  ref = flatpak_decomposed_new_from_ref (header->ref, error);
+  if (ref == NULL)
     return NULL;
 
   /* If we rely on metadata (to e.g. print permissions), check it exists before creating the remote */
-  if (out_metadata && fp_metadata == NULL)
+  if (out_metadata && header->app_metadata == NULL)
     {
       flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA, "No metadata in bundle header");
       return NULL;
     }
 
-  gpg_data = extra_gpg_data ? extra_gpg_data : included_gpg_data;
+  gpg_data = extra_gpg_data ? extra_gpg_data : header->gpg_keys;
 
   deploy_data = flatpak_dir_get_deploy_data (self, ref, FLATPAK_DEPLOY_VERSION_ANY, cancellable, NULL);
   if (deploy_data != NULL)
@@ -9826,12 +11449,12 @@ flatpak_dir_ensure_bundle_remote (FlatpakDir         *self,
       /* Add a remote for later updates */
       basename = g_file_get_basename (file);
       remote = flatpak_dir_create_origin_remote (self,
-                                                 origin,
+                                                 header->origin,
                                                  id,
                                                  basename,
                                                  flatpak_decomposed_get_ref (ref),
                                                  gpg_data,
-                                                 collection_id,
+                                                 header->collection_id,
                                                  &created_remote,
                                                  cancellable,
                                                  error);
@@ -9846,10 +11469,10 @@ flatpak_dir_ensure_bundle_remote (FlatpakDir         *self,
     *out_ref = g_steal_pointer (&ref);
 
   if (out_checksum)
-    *out_checksum = g_steal_pointer (&to_checksum);
+    *out_checksum = g_strdup (header->commit);
 
   if (out_metadata)
-    *out_metadata = g_steal_pointer (&fp_metadata);
+    *out_metadata = g_strdup (header->app_metadata);
 
 
   return g_steal_pointer (&remote);
@@ -9911,17 +11534,18 @@ flatpak_dir_check_add_remotes_config_dir (FlatpakDir *self,
 gboolean
 flatpak_dir_install_bundle (FlatpakDir         *self,
                             GFile              *file,
+                            FlatpakBundleHeader *header,
                             const char         *remote,
                             FlatpakDecomposed **out_ref,
+                            FlatpakProgress    *progress,
                             GCancellable       *cancellable,
                             GError            **error)
 {
+  g_autoptr(FlatpakBundleHeader) loaded_header = NULL;
   g_autofree char *ref_str = NULL;
   g_autoptr(FlatpakDecomposed) ref = NULL;
   g_autoptr(GBytes) deploy_data = NULL;
-  g_autoptr(GVariant) metadata = NULL;
-  g_autofree char *origin = NULL;
-  g_autofree char *to_checksum = NULL;
+  const char *origin;
   gboolean gpg_verify;
 
   if (!flatpak_dir_check_add_remotes_config_dir (self, error))
@@ -9954,19 +11578,27 @@ flatpak_dir_install_bundle (FlatpakDir         *self,
   if (!flatpak_dir_ensure_repo (self, cancellable, error))
     return FALSE;
 
-  metadata = flatpak_bundle_load (file, &to_checksum,
-                                  &ref,
-                                  &origin,
-                                  NULL, NULL,
-                                  NULL, NULL, NULL,
-                                  error);
-  if (metadata == NULL)
+  if (header == NULL)
+    {
+      loaded_header = flatpak_bundle_header_load (file, error);
+      if (loaded_header == NULL)
+        return FALSE;
+      header = loaded_header;
+    }
+
+  if (header->ref == NULL)
+    return flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA, _("Invalid bundle, no ref in metadata"));
+
+  ref = flatpak_decomposed_new_from_ref (header->ref, error);
+  if (ref == NULL)
     return FALSE;
 
+  origin = header->origin;
+
   deploy_data = flatpak_dir_get_deploy_data (self, ref, FLATPAK_DEPLOY_VERSION_ANY, cancellable, NULL);
   if (deploy_data != NULL)
     {
-      if (strcmp (flatpak_deploy_data_get_commit (deploy_data), to_checksum) == 0)
+      if (strcmp (flatpak_deploy_data_get_commit (deploy_data), header->commit) == 0)
         {
           g_autofree char *id = flatpak_decomposed_dup_id (ref);
           g_set_error (error, FLATPAK_ERROR, FLATPAK_ERROR_ALREADY_INSTALLED,
@@ -9986,13 +11618,15 @@ flatpak_dir_install_bundle (FlatpakDir         *self,
                                           &gpg_verify, error))
     return FALSE;
 
-  if (!flatpak_pull_from_bundle (self->repo,
-                                 file,
-                                 remote,
-                                 flatpak_decomposed_get_ref (ref),
-                                 gpg_verify,
-                                 cancellable,
-                                 error))
+  if (!flatpak_pull_from_bundle_header (self->repo,
+                                        file,
+                                        header,
+                                        remote,
+                                        flatpak_decomposed_get_ref (ref),
+                                        gpg_verify,
+                                        progress,
+                                        cancellable,
+                                        error))
     return FALSE;
 
   if (deploy_data != NULL)
@@ -10400,26 +12034,10 @@ flatpak_dir_update (FlatpakDir                           *self,
       if (install_hint)
         helper_flags |= FLATPAK_HELPER_DEPLOY_FLAGS_INSTALL_HINT;
 
-      if (!flatpak_dir_system_helper_call_deploy (self,
-                                                  child_repo_path ? child_repo_path : "",
-                                                  helper_flags, flatpak_decomposed_get_ref (ref), state->remote_name,
-                                                  subpaths, opt_previous_ids,
-                                                  installation ? installation : "",
-                                                  cancellable,
-                                                  error))
-        return FALSE;
-
-      if (child_repo_path && !is_revokefs_pull)
-        (void) glnx_shutil_rm_rf_at (AT_FDCWD, child_repo_path, NULL, NULL);
-
-      /* In case the app is being renamed, rewrite any launchers made by
-       * xdg-desktop-portal. This has to be done as the user so can't be in the
-       * system helper.
-       */
-      if (opt_previous_ids)
-        rewrite_dynamic_launchers (ref, opt_previous_ids);
-
-      return TRUE;
+      return flatpak_dir_system_helper_deploy (self, child_repo_path, !is_revokefs_pull,
+                                               helper_flags, ref, state->remote_name,
+                                               subpaths, opt_previous_ids,
+                                               cancellable, error);
     }
 
   if (!no_pull)
@@ -11480,6 +13098,7 @@ cached_summary_free (CachedSummary *summary)
     g_bytes_unref (summary->bytes_sig);
   g_free (summary->name);
   g_free (summary->url);
+  g_free (summary->verify_key);
   g_free (summary);
 }
 
@@ -11487,7 +13106,8 @@ static CachedSummary *
 cached_summary_new (GBytes     *bytes,
                     GBytes     *bytes_sig,
                     const char *name,
-                    const char *url)
+                    const char *url,
+                    const char *verify_key)
 {
   CachedSummary *summary = g_new0 (CachedSummary, 1);
 
@@ -11496,16 +13116,58 @@ cached_summary_new (GBytes     *bytes,
     summary->bytes_sig = g_bytes_ref (bytes_sig);
   summary->url = g_strdup (url);
   summary->name = g_strdup (name);
+  summary->verify_key = g_strdup (verify_key);
   summary->time = g_get_monotonic_time ();
   return summary;
 }
 
+/* Describes how the summary of @remote is verified, so that a summary
+ * cached for a remote of another installation that is shared with
+ * flatpak_dir_share_remote_caches() is only used if it would have
+ * passed the same checks here.
+ */
+static char *
+flatpak_dir_get_summary_verify_key (FlatpakDir *self,
+                                    const char *remote)
+{
+  gboolean gpg_verify_summary = FALSE;
+  g_autofree char *collection_id = NULL;
+  g_autofree char *gpgkeypath = NULL;
+  g_autofree char *keyring_name = NULL;
+  g_autofree char *keyring_checksum = NULL;
+  glnx_autofd int keyring_fd = -1;
+
+  if (!ostree_repo_remote_get_gpg_verify_summary (self->repo, remote, &gpg_verify_summary, NULL))
+    gpg_verify_summary = FALSE;
+
+  repo_get_remote_collection_id (self->repo, remote, &collection_id, NULL);
+  ostree_repo_get_remote_option (self->repo, remote, "gpgkeypath", NULL, &gpgkeypath, NULL);
+
+  keyring_name = g_strconcat (remote, ".trustedkeys.gpg", NULL);
+  if (glnx_openat_rdonly (ostree_repo_get_dfd (self->repo), keyring_name, TRUE, &keyring_fd, NULL))
+    {
+      g_autoptr(GBytes) keyring = glnx_fd_readall_bytes (keyring_fd, NULL, NULL);
+
+      if (keyring != NULL)
+        keyring_checksum = g_compute_checksum_for_bytes (G_CHECKSUM_SHA256, keyring);
+    }
+
+  return g_strdup_printf ("gpg-verify-summary=%d;collection-id=%s;gpgkeypath=%s;keyring=%s",
+                          gpg_verify_summary,
+                          collection_id ? collection_id : "",
+                          gpgkeypath ? gpgkeypath : "",
+                          keyring_checksum ? keyring_checksum : "");
+}
+
+/* @verify_key is from flatpak_dir_get_summary_verify_key(), or %NULL for
+ * content addressed entries */
 static gboolean
 flatpak_dir_lookup_cached_summary (FlatpakDir *self,
                                    GBytes    **bytes_out,
                                    GBytes    **bytes_sig_out,
                                    const char *name,
-                                   const char *url)
+                                   const char *url,
+                                   const char *verify_key)
 {
   CachedSummary *summary;
   gboolean res = FALSE;
@@ -11520,7 +13182,8 @@ flatpak_dir_lookup_cached_summary (FlatpakDir *self,
     {
       guint64 now = g_get_monotonic_time ();
       if ((now - summary->time) / G_USEC_PER_SEC < SUMMARY_CACHE_TIMEOUT_SEC &&
-          strcmp (url, summary->url) == 0)
+          strcmp (url, summary->url) == 0 &&
+          g_strcmp0 (verify_key, summary->verify_key) == 0)
         {
           /* g_debug ("Using cached summary for remote %s", name); */
           *bytes_out = g_bytes_ref (summary->bytes);
@@ -11538,7 +13201,7 @@ flatpak_dir_lookup_cached_summary (FlatpakDir *self,
         }
       else
         {
-          /* Timed out or URL has changed; remove the entry */
+          /* Timed out, or URL or verification has changed; remove the entry */
           g_hash_table_remove (self->summary_cache, name);
           res = FALSE;
         }
@@ -11554,7 +13217,8 @@ flatpak_dir_cache_summary (FlatpakDir *self,
                            GBytes     *bytes,
                            GBytes     *bytes_sig,
                            const char *name,
-                           const char *url)
+                           const char *url,
+                           const char *verify_key)
 {
   CachedSummary *summary;
 
@@ -11567,12 +13231,43 @@ flatpak_dir_cache_summary (FlatpakDir *self,
   /* This was already initialized in the cache-miss lookup */
   g_assert (self->summary_cache != NULL);
 
-  summary = cached_summary_new (bytes, bytes_sig, name, url);
+  summary = cached_summary_new (bytes, bytes_sig, name, url, verify_key);
   g_hash_table_replace (self->summary_cache, summary->name, summary);
 
   G_UNLOCK (cache);
 }
 
+/* Makes @self use the in-memory summary cache and the HTTP session of
+ * @other, so that summaries of remotes that both installations use
+ * (i.e. with the same URL) are only downloaded once. The cache entries
+ * are validated against the URL and the summary verification config
+ * (see flatpak_dir_get_summary_verify_key()), and subsummaries are keyed
+ * by their checksum, so remotes that only share the name don't mix up,
+ * and a summary is never used without the checks of this remote. This must
+ * be called before either dir is used from another thread.
+ */
+void
+flatpak_dir_share_remote_caches (FlatpakDir *self,
+                                 FlatpakDir *other)
+{
+  if (self == other)
+    return;
+
+  G_LOCK (cache);
+
+  if (other->summary_cache == NULL)
+    other->summary_cache = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, (GDestroyNotify) cached_summary_free);
+
+  g_clear_pointer (&self->summary_cache, g_hash_table_unref);
+  self->summary_cache = g_hash_table_ref (other->summary_cache);
+
+  G_UNLOCK (cache);
+
+  ensure_soup_session (other);
+  g_clear_object (&self->soup_session);
+  self->soup_session = g_object_ref (other->soup_session);
+}
+
 gboolean
 flatpak_dir_remote_make_oci_summary (FlatpakDir   *self,
                                      const char   *remote,
@@ -11590,14 +13285,19 @@ flatpak_dir_remote_make_oci_summary (FlatpakDir   *self,
   g_autoptr(GBytes) cache_bytes = NULL;
   g_autoptr(GBytes) summary_bytes = NULL;
 
-  if (flatpak_dir_use_system_helper (self, NULL))
+  if (only_cached)
+    {
+      /* Nothing needs to be written, so read the cache directly without
+       * revalidating the index, even for system installations */
+      summary_cache = flatpak_dir_get_oci_summary_location (self, remote, error);
+      if (summary_cache == NULL)
+        return FALSE;
+    }
+  else if (flatpak_dir_use_system_helper (self, NULL))
     {
       const char *installation = flatpak_dir_get_id (self);
       FlatpakHelperGenerateOciSummaryFlags flags = FLATPAK_HELPER_GENERATE_OCI_SUMMARY_FLAGS_NONE;
 
-      if (only_cached)
-        flags |= FLATPAK_HELPER_GENERATE_OCI_SUMMARY_FLAGS_ONLY_CACHED;
-
       if (!flatpak_dir_system_helper_call_generate_oci_summary (self,
                                                                 flags,
                                                                 remote,
@@ -11619,8 +13319,11 @@ flatpak_dir_remote_make_oci_summary (FlatpakDir   *self,
       if (summary_cache == NULL)
         return FALSE;
 
-      if (!only_cached && !check_destination_mtime (index_cache, summary_cache, cancellable))
+      /* Only regenerate the summary if the index changed since it was written */
+      if (!oci_summary_is_current (summary_cache, index_cache, cancellable))
         {
+          g_autofree char *index_key = get_oci_index_key (index_cache);
+
           summary = flatpak_oci_index_make_summary (index_cache, index_uri, cancellable, &local_error);
           if (summary == NULL)
             {
@@ -11630,10 +13333,7 @@ flatpak_dir_remote_make_oci_summary (FlatpakDir   *self,
 
           summary_bytes = g_variant_get_data_as_bytes (summary);
 
-          if (!g_file_replace_contents (summary_cache,
-                                        g_bytes_get_data (summary_bytes, NULL),
-                                        g_bytes_get_size (summary_bytes),
-                                        NULL, FALSE, 0, NULL, cancellable, error))
+          if (!write_oci_summary (summary_cache, summary_bytes, index_key, cancellable, error))
             {
               g_prefix_error (error, _("Failed to write summary cache: "));
               return FALSE;
@@ -11915,6 +13615,48 @@ flatpak_dir_remote_load_cached_summary (FlatpakDir   *self,
   return TRUE;
 }
 
+/* Whether the cached summary of @remote can be used without revalidating
+ * it, because it was last validated within the xa.summary-max-age of the
+ * remote. The cached copy was signature-verified before it was written. */
+static gboolean
+flatpak_dir_remote_cached_summary_is_fresh (FlatpakDir *self,
+                                            const char *remote,
+                                            const char *main_ext)
+{
+  g_autofree char *main_file_name = g_strconcat (remote, main_ext, NULL);
+  g_autoptr(GFile) main_cache_file = flatpak_build_file (self->cache_dir, "summaries", main_file_name, NULL);
+  guint64 max_age;
+  gint64 now;
+  struct stat stbuf;
+
+  if (self->revalidate_summaries)
+    return FALSE;
+
+  max_age = flatpak_dir_get_remote_summary_max_age (self, remote);
+  if (max_age == 0)
+    return FALSE;
+
+  if (stat (flatpak_file_get_path_cached (main_cache_file), &stbuf) != 0)
+    return FALSE;
+
+  /* Don't trust a cache that was validated in the future */
+  now = g_get_real_time () / G_USEC_PER_SEC;
+  return stbuf.st_mtime <= now && (guint64) (now - stbuf.st_mtime) < max_age;
+}
+
+/* Marks the cached summary of @remote as just validated */
+static void
+flatpak_dir_remote_touch_cached_summary (FlatpakDir *self,
+                                         const char *remote,
+                                         const char *main_ext)
+{
+  g_autofree char *main_file_name = g_strconcat (remote, main_ext, NULL);
+  g_autoptr(GFile) main_cache_file = flatpak_build_file (self->cache_dir, "summaries", main_file_name, NULL);
+
+  if (utimensat (AT_FDCWD, flatpak_file_get_path_cached (main_cache_file), NULL, 0) != 0)
+    g_debug ("Failed to update the time of cached summary for remote ‘%s’: %s", remote, g_strerror (errno));
+}
+
 static gboolean
 flatpak_dir_remote_fetch_summary (FlatpakDir   *self,
                                   const char   *name_or_uri,
@@ -11981,7 +13723,8 @@ flatpak_dir_remote_fetch_summary (FlatpakDir   *self,
   if (!is_local && !only_cached)
     {
       g_autofree char *cache_key = g_strconcat ("summary-", name_or_uri, NULL);
-      flatpak_dir_cache_summary (self, summary, summary_sig, cache_key, url);
+      g_autofree char *verify_key = flatpak_dir_get_summary_verify_key (self, name_or_uri);
+      flatpak_dir_cache_summary (self, summary, summary_sig, cache_key, url, verify_key);
     }
 
   *out_summary = g_steal_pointer (&summary);
@@ -12128,6 +13871,16 @@ flatpak_dir_remote_fetch_summary_index (FlatpakDir   *self,
         }
       g_debug ("Loaded summary index from cache for remote ‘%s’", name_or_uri);
 
+      index = g_steal_pointer (&cached_index);
+      if (gpg_verify_summary)
+        index_sig = g_steal_pointer (&cached_index_sig);
+    }
+  else if (!is_local && cached_index != NULL &&
+           (!gpg_verify_summary || cached_index_sig != NULL) &&
+           flatpak_dir_remote_cached_summary_is_fresh (self, name_or_uri, ".idx"))
+    {
+      g_debug ("Using summary index from cache for remote ‘%s’, validated within its max age", name_or_uri);
+
       index = g_steal_pointer (&cached_index);
       if (gpg_verify_summary)
         index_sig = g_steal_pointer (&cached_index_sig);
@@ -12200,13 +13953,18 @@ flatpak_dir_remote_fetch_summary_index (FlatpakDir   *self,
           !flatpak_dir_remote_save_cached_summary (self, name_or_uri, ".idx", ".idx.sig",
                                                    index, index_sig, cancellable, error))
         return FALSE;
+
+      /* Otherwise the cache is still current, so restart its max age */
+      if (!used_download && !is_local)
+        flatpak_dir_remote_touch_cached_summary (self, name_or_uri, ".idx");
     }
 
   /* Cache in memory */
   if (!is_local && !only_cached)
     {
       g_autofree char *cache_key = g_strconcat ("index-", name_or_uri, NULL);
-      flatpak_dir_cache_summary (self, index, index_sig, cache_key, url);
+      g_autofree char *verify_key = flatpak_dir_get_summary_verify_key (self, name_or_uri);
+      flatpak_dir_cache_summary (self, index, index_sig, cache_key, url, verify_key);
     }
 
   *out_index = g_steal_pointer (&index);
@@ -12260,7 +14018,7 @@ flatpak_dir_remote_fetch_indexed_summary (FlatpakDir   *self,
   /* No in-memory caching for local files */
   if (!is_local)
     {
-      if (flatpak_dir_lookup_cached_summary (self, out_summary, NULL, checksum, url))
+      if (flatpak_dir_lookup_cached_summary (self, out_summary, NULL, checksum, url, NULL))
         return TRUE;
     }
 
@@ -12372,7 +14130,7 @@ flatpak_dir_remote_fetch_indexed_summary (FlatpakDir   *self,
 
   /* Cache in memory */
   if (!is_local && !only_cached)
-    flatpak_dir_cache_summary (self, summary, NULL, checksum, url);
+    flatpak_dir_cache_summary (self, summary, NULL, checksum, url, NULL);
 
   *out_summary = g_steal_pointer (&summary);
 
@@ -12468,21 +14226,16 @@ _flatpak_dir_get_remote_state (FlatpakDir   *self,
     }
 
   /* First try the memory cache. Note: No in-memory caching for local files. */
-  if (!is_local)
+  if (!is_local && !got_summary)
     {
-      if (!got_summary)
-        {
-          g_autofree char *index_cache_key = g_strconcat ("index-", remote_or_uri, NULL);
-          if (flatpak_dir_lookup_cached_summary (self, &index_bytes, &index_sig_bytes, index_cache_key, url))
-            got_summary = TRUE;
-        }
+      g_autofree char *verify_key = flatpak_dir_get_summary_verify_key (self, remote_or_uri);
+      g_autofree char *index_cache_key = g_strconcat ("index-", remote_or_uri, NULL);
+      g_autofree char *summary_cache_key = g_strconcat ("summary-", remote_or_uri, NULL);
 
-      if (!got_summary)
-        {
-          g_autofree char *summary_cache_key = g_strconcat ("summary-", remote_or_uri, NULL);
-          if (flatpak_dir_lookup_cached_summary (self, &summary_bytes, &summary_sig_bytes, summary_cache_key, url))
-            got_summary = TRUE;
-        }
+      if (flatpak_dir_lookup_cached_summary (self, &index_bytes, &index_sig_bytes, index_cache_key, url, verify_key))
+        got_summary = TRUE;
+      else if (flatpak_dir_lookup_cached_summary (self, &summary_bytes, &summary_sig_bytes, summary_cache_key, url, verify_key))
+        got_summary = TRUE;
     }
 
   /* Then look for an indexed summary on disk/network */
@@ -12700,6 +14453,100 @@ flatpak_dir_get_remote_state_local_only (FlatpakDir   *self,
   return _flatpak_dir_get_remote_state (self, remote, TRUE, TRUE, FALSE, FALSE, NULL, NULL, cancellable, error);
 }
 
+FlatpakRemoteStateFetch *
+flatpak_remote_state_fetch_new (FlatpakDir *dir,
+                                const char *remote)
+{
+  FlatpakRemoteStateFetch *fetch = g_new0 (FlatpakRemoteStateFetch, 1);
+
+  fetch->dir = g_object_ref (dir);
+  fetch->remote = g_strdup (remote);
+
+  return fetch;
+}
+
+void
+flatpak_remote_state_fetch_free (FlatpakRemoteStateFetch *fetch)
+{
+  g_object_unref (fetch->dir);
+  g_free (fetch->remote);
+  g_clear_pointer (&fetch->state, flatpak_remote_state_unref);
+  g_clear_error (&fetch->error);
+  g_free (fetch);
+}
+
+#define MAX_PARALLEL_REMOTE_STATE_FETCHES 6
+
+typedef struct
+{
+  gboolean      only_cached;
+  GCancellable *cancellable;
+} RemoteStateFetches;
+
+static void
+remote_state_fetch_thread (gpointer data,
+                           gpointer user_data)
+{
+  FlatpakRemoteStateFetch *fetch = data;
+  RemoteStateFetches *fetches = user_data;
+
+  fetch->state = flatpak_dir_get_remote_state_optional (fetch->dir, fetch->remote,
+                                                        fetches->only_cached,
+                                                        fetches->cancellable,
+                                                        &fetch->error);
+}
+
+/* Like calling flatpak_dir_get_remote_state_optional() on each of the
+ * #FlatpakRemoteStateFetch in @fetches, which may be for different
+ * installations, but with the summary downloads done in parallel. Each
+ * installation uses a single HTTP session for all its remotes, so the
+ * HTTP helpers must only change per-message settings. As a side
+ * effect the summaries end up in the in-memory cache, so later calls for
+ * the same remotes are cheap.
+ */
+void
+flatpak_remote_states_fetch_optional (GPtrArray    *fetches,
+                                      gboolean      only_cached,
+                                      GCancellable *cancellable)
+{
+  RemoteStateFetches data = { only_cached, cancellable };
+  GThreadPool *pool;
+  guint i;
+
+  if (fetches->len == 0)
+    return;
+
+  if (fetches->len == 1)
+    {
+      remote_state_fetch_thread (g_ptr_array_index (fetches, 0), &data);
+      return;
+    }
+
+  /* Set up the shared, lazily initialized, parts of the dirs before
+   * using them from multiple threads */
+  for (i = 0; i < fetches->len; i++)
+    {
+      FlatpakRemoteStateFetch *fetch = g_ptr_array_index (fetches, i);
+
+      if (flatpak_dir_ensure_repo (fetch->dir, cancellable, &fetch->error))
+        ensure_soup_session (fetch->dir);
+    }
+
+  pool = g_thread_pool_new (remote_state_fetch_thread, &data,
+                            MIN (fetches->len, MAX_PARALLEL_REMOTE_STATE_FETCHES),
+                            FALSE, NULL);
+  for (i = 0; i < fetches->len; i++)
+    {
+      FlatpakRemoteStateFetch *fetch = g_ptr_array_index (fetches, i);
+
+      if (fetch->error == NULL)
+        g_thread_pool_push (pool, fetch, NULL);
+    }
+
+  /* Wait for all the fetches to finish */
+  g_thread_pool_free (pool, FALSE, TRUE);
+}
+
 static void
 populate_hash_table_from_refs_map (GHashTable         *ret_all_refs,
                                    GHashTable         *ref_timestamps,
@@ -12859,6 +14706,119 @@ flatpak_dir_list_all_remote_refs (FlatpakDir         *self,
   return TRUE;
 }
 
+static int
+compare_parts (const char *a,
+               gsize       a_len,
+               const char *b,
+               gsize       b_len)
+{
+  int res = memcmp (a, b, MIN (a_len, b_len));
+
+  if (res != 0)
+    return res;
+
+  return a_len < b_len ? -1 : (a_len > b_len ? 1 : 0);
+}
+
+static int
+compare_ref_id (FlatpakDecomposed *ref,
+                const char        *id,
+                gsize              id_len)
+{
+  gsize ref_id_len;
+  const char *ref_id = flatpak_decomposed_peek_id (ref, &ref_id_len);
+
+  return compare_parts (ref_id, ref_id_len, id, id_len);
+}
+
+static int
+compare_refs_for_index (gconstpointer a,
+                        gconstpointer b)
+{
+  FlatpakDecomposed *ref_a = *(FlatpakDecomposed **) a;
+  FlatpakDecomposed *ref_b = *(FlatpakDecomposed **) b;
+  const char *part_a, *part_b;
+  gsize part_a_len, part_b_len;
+  int res;
+
+  part_a = flatpak_decomposed_peek_id (ref_a, &part_a_len);
+  part_b = flatpak_decomposed_peek_id (ref_b, &part_b_len);
+  res = compare_parts (part_a, part_a_len, part_b, part_b_len);
+  if (res != 0)
+    return res;
+
+  part_a = flatpak_decomposed_peek_arch (ref_a, &part_a_len);
+  part_b = flatpak_decomposed_peek_arch (ref_b, &part_b_len);
+  res = compare_parts (part_a, part_a_len, part_b, part_b_len);
+  if (res != 0)
+    return res;
+
+  part_a = flatpak_decomposed_peek_branch (ref_a, &part_a_len);
+  part_b = flatpak_decomposed_peek_branch (ref_b, &part_b_len);
+  return compare_parts (part_a, part_a_len, part_b, part_b_len);
+}
+
+/* Returns the refs of the remote with the id @name. The sorted index of
+ * all refs is built once per remote state, so that resolving several
+ * partial refs against a large remote doesn't have to decompose and
+ * compare every ref each time. */
+static GHashTable *
+flatpak_remote_state_lookup_refs (FlatpakRemoteState *self,
+                                  FlatpakDir         *dir,
+                                  const char         *name,
+                                  GCancellable       *cancellable,
+                                  GError            **error)
+{
+  g_autoptr(GHashTable) refs = NULL;
+  gsize name_len = strlen (name);
+  guint lo, hi, start;
+
+  if (self->ref_index == NULL)
+    {
+      g_autoptr(GHashTable) all_refs = NULL;
+      g_autoptr(GPtrArray) ref_index = NULL;
+
+      if (!flatpak_dir_list_all_remote_refs (dir, self, &all_refs, cancellable, error))
+        return NULL;
+
+      ref_index = g_ptr_array_new_full (g_hash_table_size (all_refs), (GDestroyNotify)flatpak_decomposed_unref);
+      GLNX_HASH_TABLE_FOREACH (all_refs, FlatpakDecomposed *, ref)
+        g_ptr_array_add (ref_index, flatpak_decomposed_ref (ref));
+      g_ptr_array_sort (ref_index, compare_refs_for_index);
+
+      self->ref_index = g_steal_pointer (&ref_index);
+    }
+
+  /* Find the first ref with the id */
+  lo = 0;
+  hi = self->ref_index->len;
+  while (lo < hi)
+    {
+      guint mid = lo + (hi - lo) / 2;
+
+      if (compare_ref_id (g_ptr_array_index (self->ref_index, mid), name, name_len) < 0)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+  start = lo;
+
+  refs = g_hash_table_new_full ((GHashFunc)flatpak_decomposed_hash, (GEqualFunc)flatpak_decomposed_equal,
+                                (GDestroyNotify)flatpak_decomposed_unref, g_free);
+
+  for (guint i = start; i < self->ref_index->len; i++)
+    {
+      FlatpakDecomposed *ref = g_ptr_array_index (self->ref_index, i);
+
+      if (compare_ref_id (ref, name, name_len) != 0)
+        break;
+
+      g_hash_table_insert (refs, flatpak_decomposed_ref (ref), NULL);
+    }
+
+  return g_steal_pointer (&refs);
+}
+
 static GPtrArray *
 find_matching_refs (GHashTable           *refs,
                     const char           *opt_name,
@@ -13082,8 +15042,14 @@ flatpak_dir_find_remote_refs (FlatpakDir           *self,
   if (opt_arch != NULL)
     valid_arches = opt_arches;
 
-  if (!flatpak_dir_list_all_remote_refs (self, state,
-                                         &remote_refs, cancellable, error))
+  /* Fuzzy matching has to look at every id, but exact ones are indexed */
+  if (name != NULL && !(flags & FIND_MATCHING_REFS_FLAGS_FUZZY))
+    remote_refs = flatpak_remote_state_lookup_refs (state, self, name, cancellable, error);
+  else if (!flatpak_dir_list_all_remote_refs (self, state,
+                                              &remote_refs, cancellable, error))
+    return NULL;
+
+  if (remote_refs == NULL)
     return NULL;
 
   matched_refs = find_matching_refs (remote_refs,
@@ -13179,8 +15145,13 @@ flatpak_dir_find_remote_ref (FlatpakDir   *self,
   if (opt_branch != NULL && opt_arch != NULL && (kinds == FLATPAK_KINDS_APP || kinds == FLATPAK_KINDS_RUNTIME))
     return flatpak_decomposed_new_from_parts (kinds, name, opt_arch, opt_branch, error);
 
-  if (!flatpak_dir_list_all_remote_refs (self, state,
-                                         &remote_refs, cancellable, error))
+  if (name != NULL)
+    remote_refs = flatpak_remote_state_lookup_refs (state, self, name, cancellable, error);
+  else if (!flatpak_dir_list_all_remote_refs (self, state,
+                                              &remote_refs, cancellable, error))
+    return NULL;
+
+  if (remote_refs == NULL)
     return NULL;
 
   remote_ref = find_ref_for_refs_set (remote_refs, name, opt_branch,
@@ -13341,6 +15312,38 @@ flatpak_dir_get_all_installed_refs (FlatpakDir  *self,
   return g_steal_pointer (&local_refs);
 }
 
+/* Like flatpak_dir_get_all_installed_refs(), but if @opt_name is an exact
+ * id this only lists the refs with that id, as the deploy directories
+ * are already laid out by id, arch and branch. */
+static GHashTable *
+flatpak_dir_get_installed_refs_for_name (FlatpakDir           *self,
+                                         FlatpakKinds          kinds,
+                                         const char           *opt_name,
+                                         FindMatchingRefsFlags flags,
+                                         GError              **error)
+{
+  g_autoptr(GHashTable) local_refs = NULL;
+  g_autoptr(GPtrArray) refs = NULL;
+
+  /* Invalid names are reported by find_matching_refs() */
+  if (opt_name == NULL || (flags & FIND_MATCHING_REFS_FLAGS_FUZZY) ||
+      !flatpak_is_valid_name (opt_name, -1, NULL))
+    return flatpak_dir_get_all_installed_refs (self, kinds, error);
+
+  if (!flatpak_dir_maybe_ensure_repo (self, NULL, error))
+    return NULL;
+
+  refs = flatpak_dir_list_refs_for_name (self, kinds, opt_name, NULL, error);
+  if (refs == NULL)
+    return NULL;
+
+  local_refs = g_hash_table_new_full ((GHashFunc)flatpak_decomposed_hash, (GEqualFunc)flatpak_decomposed_equal, (GDestroyNotify)flatpak_decomposed_unref, NULL);
+  for (int i = 0; i < refs->len; i++)
+    g_hash_table_add (local_refs, flatpak_decomposed_ref (g_ptr_array_index (refs, i)));
+
+  return g_steal_pointer (&local_refs);
+}
+
 /* This tries to find a all installed refs based on the specfied name/branch/arch
  * triplet. Matches on all arches.
 */
@@ -13361,7 +15364,7 @@ flatpak_dir_find_installed_refs (FlatpakDir           *self,
   if (opt_arch != NULL)
     valid_arches = opt_arches;
 
-  local_refs = flatpak_dir_get_all_installed_refs (self, kinds, error);
+  local_refs = flatpak_dir_get_installed_refs_for_name (self, kinds, opt_name, flags, error);
   if (local_refs == NULL)
     return NULL;
 
@@ -13402,7 +15405,8 @@ flatpak_dir_find_installed_ref (FlatpakDir   *self,
   if (opt_arch != NULL)
     valid_arches = opt_arches;
 
-  local_refs = flatpak_dir_get_all_installed_refs (self, kinds, error);
+  local_refs = flatpak_dir_get_installed_refs_for_name (self, kinds, opt_name,
+                                                        FIND_MATCHING_REFS_FLAGS_NONE, error);
   if (local_refs == NULL)
     return NULL;
 
@@ -13547,6 +15551,7 @@ flatpak_dir_clone (FlatpakDir *self)
 
   flatpak_dir_set_no_system_helper (clone, self->no_system_helper);
   flatpak_dir_set_no_interaction (clone, self->no_interaction);
+  flatpak_dir_set_revalidate_summaries (clone, self->revalidate_summaries);
 
   return clone;
 }
@@ -13883,6 +15888,21 @@ flatpak_dir_get_remote_prio (FlatpakDir *self,
   return 1;
 }
 
+/* Returns the number of seconds a validated summary of the remote may be
+ * used from the cache without checking the network, or 0 to always check */
+guint64
+flatpak_dir_get_remote_summary_max_age (FlatpakDir *self,
+                                        const char *remote_name)
+{
+  GKeyFile *config = flatpak_dir_get_repo_config (self);
+  g_autofree char *group = get_group (remote_name);
+
+  if (config && g_key_file_has_key (config, group, "xa.summary-max-age", NULL))
+    return g_key_file_get_uint64 (config, group, "xa.summary-max-age", NULL);
+
+  return 0;
+}
+
 gboolean
 flatpak_dir_get_remote_noenumerate (FlatpakDir *self,
                                     const char *remote_name)
@@ -16143,9 +18163,16 @@ static void
                      const char *format,
                      ...)
 {
-#ifdef HAVE_LIBSYSTEMD
   const char *installation = source ? source : flatpak_dir_get_name_cached (self);
   pid_t source_pid = flatpak_dir_get_source_pid (self);
+  g_autoptr(GFile) history_dir = NULL;
+  g_autoptr(GError) local_error = NULL;
+  g_autofree char *uid = NULL;
+  g_autofree char *exe = NULL;
+  g_autofree char *object_uid = NULL;
+  g_autofree char *object_exe = NULL;
+  const char *fields[32];
+  int n_fields = 0;
   char message[1024];
   int len;
   va_list args;
@@ -16156,6 +18183,71 @@ static void
   g_vsnprintf (message + len, sizeof (message) - len, format, args);
   va_end (args);
 
+  /* Record the change in the installation's own history, using the
+   * same field names as the journal, so that flatpak history can do time
+   * range lookups without scanning the whole journal. The user and tool
+   * fields are the ones journald would add for us. This is written before
+   * the journal entry so that flatpak history can tell which journal
+   * entries predate the history.
+   */
+  uid = g_strdup_printf ("%d", (int) getuid ());
+  exe = g_file_read_link ("/proc/self/exe", NULL);
+
+  if (source_pid > 0)
+    {
+      g_autofree char *proc_dir = g_strdup_printf ("/proc/%d", source_pid);
+      g_autofree char *proc_exe = g_strdup_printf ("/proc/%d/exe", source_pid);
+      struct stat stbuf;
+
+      if (stat (proc_dir, &stbuf) == 0)
+        object_uid = g_strdup_printf ("%d", (int) stbuf.st_uid);
+      object_exe = g_file_read_link (proc_exe, NULL);
+    }
+
+  fields[n_fields++] = "MESSAGE";
+  fields[n_fields++] = message;
+  fields[n_fields++] = "FLATPAK_VERSION";
+  fields[n_fields++] = PACKAGE_VERSION;
+  fields[n_fields++] = "INSTALLATION";
+  fields[n_fields++] = installation;
+  fields[n_fields++] = "OPERATION";
+  fields[n_fields++] = change;
+  fields[n_fields++] = "REMOTE";
+  fields[n_fields++] = remote ? remote : "";
+  fields[n_fields++] = "REF";
+  fields[n_fields++] = ref ? ref : "";
+  fields[n_fields++] = "COMMIT";
+  fields[n_fields++] = commit ? commit : "";
+  fields[n_fields++] = "OLD_COMMIT";
+  fields[n_fields++] = old_commit ? old_commit : "";
+  fields[n_fields++] = "URL";
+  fields[n_fields++] = url ? url : "";
+  fields[n_fields++] = "_UID";
+  fields[n_fields++] = uid;
+  if (exe)
+    {
+      fields[n_fields++] = "_EXE";
+      fields[n_fields++] = exe;
+    }
+  if (object_uid)
+    {
+      fields[n_fields++] = "OBJECT_UID";
+      fields[n_fields++] = object_uid;
+    }
+  if (object_exe)
+    {
+      fields[n_fields++] = "OBJECT_EXE";
+      fields[n_fields++] = object_exe;
+    }
+  fields[n_fields] = NULL;
+
+  /* This is best effort, e.g. we can't write to a system installation
+   * if we're not root, in which case the system helper logs it */
+  history_dir = flatpak_dir_get_history_dir (self);
+  if (!flatpak_history_append (history_dir, g_get_real_time (), fields, &local_error))
+    g_debug ("Failed to write to history: %s", local_error->message);
+
+#ifdef HAVE_LIBSYSTEMD
   /* See systemd.journal-fields(7) for the meaning of the
    * standard fields we use, in particular OBJECT_PID
    */
@@ -0,0 +1,47 @@
+/*
+ * Copyright © 2026 Flatpak contributors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __FLATPAK_HISTORY_PRIVATE_H__
+#define __FLATPAK_HISTORY_PRIVATE_H__
+
+#include <gio/gio.h>
+
+/* Stored in the installation directory */
+#define FLATPAK_HISTORY_DIRNAME "history"
+
+typedef struct
+{
+  gint64      time;   /* Microseconds since the epoch */
+  GHashTable *fields; /* Same names as the journal fields */
+} FlatpakHistoryEntry;
+
+void       flatpak_history_entry_free (FlatpakHistoryEntry *entry);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (FlatpakHistoryEntry, flatpak_history_entry_free)
+
+gboolean   flatpak_history_append (GFile              *history_dir,
+                                   gint64              timestamp,
+                                   const char * const *fields,
+                                   GError            **error);
+GPtrArray *flatpak_history_load   (GFile              *history_dir,
+                                   gint64              since,
+                                   gint64              until,
+                                   gint64             *out_oldest,
+                                   GCancellable       *cancellable,
+                                   GError            **error);
+
+#endif /* __FLATPAK_HISTORY_PRIVATE_H__ */
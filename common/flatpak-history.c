@@ -0,0 +1,387 @@
+/*
+ * Copyright © 2026 Flatpak contributors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.	 See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "flatpak-history-private.h"
+#include "flatpak-utils-private.h"
+#include "libglnx.h"
+
+/* The history is a directory of append-only segment files, each named
+ * after the time (in microseconds) of its first entry:
+ *
+ *   history/00001700000000000000.log
+ *
+ * This way a time range lookup only needs to read the segments that
+ * overlap it, and retention is done by deleting the oldest segments.
+ *
+ * A segment is a sequence of records, each a RecordHeader followed by
+ * a serialized (xa{ss}) GVariant with the time and the fields of the
+ * entry, padded to 8 bytes. Records are written with a single
+ * O_APPEND write, so concurrent writers don't need any locking. If a
+ * record is damaged, e.g. by a crash during the write, the records
+ * after it are no longer aligned, so readers resync by scanning byte
+ * by byte for the next record header.
+ *
+ * The entries include the UIDs and executables of the callers and the
+ * URLs of the remotes, so the history is only readable by its owner.
+ */
+
+#define SEGMENT_SUFFIX ".log"
+#define SEGMENT_TIME_DIGITS 20
+
+/* This keeps at most 4 MiB of history per installation */
+#define MAX_SEGMENT_SIZE (256 * 1024)
+#define MAX_SEGMENTS 16
+
+#define RECORD_MAGIC 0x52485046 /* "FPHR" */
+#define RECORD_ALIGN 8
+#define RECORD_PADDED_SIZE(size) (((size) + RECORD_ALIGN - 1) & ~(RECORD_ALIGN - 1))
+#define RECORD_GVARIANT_FORMAT G_VARIANT_TYPE ("(xa{ss})")
+
+typedef struct
+{
+  guint32 magic;
+  guint32 size;
+} RecordHeader;
+
+void
+flatpak_history_entry_free (FlatpakHistoryEntry *entry)
+{
+  if (entry == NULL)
+    return;
+
+  g_hash_table_unref (entry->fields);
+  g_free (entry);
+}
+
+static char *
+segment_name (gint64 start)
+{
+  return g_strdup_printf ("%0*" G_GINT64_FORMAT SEGMENT_SUFFIX, SEGMENT_TIME_DIGITS, start);
+}
+
+/* Returns the start time, or -1 if @name is not a segment */
+static gint64
+parse_segment_name (const char *name)
+{
+  int i;
+
+  if (strlen (name) != SEGMENT_TIME_DIGITS + strlen (SEGMENT_SUFFIX) ||
+      !g_str_has_suffix (name, SEGMENT_SUFFIX))
+    return -1;
+
+  for (i = 0; i < SEGMENT_TIME_DIGITS; i++)
+    if (!g_ascii_isdigit (name[i]))
+      return -1;
+
+  return g_ascii_strtoll (name, NULL, 10);
+}
+
+static gint
+compare_segments (gconstpointer a,
+                  gconstpointer b)
+{
+  gint64 sa = *(const gint64 *) a;
+  gint64 sb = *(const gint64 *) b;
+
+  return sa < sb ? -1 : (sa > sb ? 1 : 0);
+}
+
+/* Returns the start times of all segments, oldest first */
+static GArray *
+list_segments (int      dfd,
+               GError **error)
+{
+  g_auto(GLnxDirFdIterator) iter = { 0 };
+  g_autoptr(GArray) segments = g_array_new (FALSE, FALSE, sizeof (gint64));
+
+  if (!glnx_dirfd_iterator_init_at (dfd, ".", FALSE, &iter, error))
+    return NULL;
+
+  while (TRUE)
+    {
+      struct dirent *dent;
+      gint64 start;
+
+      if (!glnx_dirfd_iterator_next_dent (&iter, &dent, NULL, error))
+        return NULL;
+
+      if (dent == NULL)
+        break;
+
+      start = parse_segment_name (dent->d_name);
+      if (start >= 0)
+        g_array_append_val (segments, start);
+    }
+
+  g_array_sort (segments, compare_segments);
+
+  return g_steal_pointer (&segments);
+}
+
+static GBytes *
+make_record (gint64              timestamp,
+             const char * const *fields)
+{
+  g_auto(GVariantBuilder) builder = G_VARIANT_BUILDER_INIT (G_VARIANT_TYPE ("a{ss}"));
+  g_autoptr(GVariant) record = NULL;
+  RecordHeader header;
+  gsize size;
+  guint8 *data;
+  int i;
+
+  for (i = 0; fields[i] != NULL && fields[i + 1] != NULL; i += 2)
+    g_variant_builder_add (&builder, "{ss}", fields[i], fields[i + 1]);
+
+  record = g_variant_ref_sink (g_variant_new ("(xa{ss})", timestamp, &builder));
+  size = g_variant_get_size (record);
+
+  data = g_malloc0 (sizeof (header) + RECORD_PADDED_SIZE (size));
+  header.magic = GUINT32_TO_LE (RECORD_MAGIC);
+  header.size = GUINT32_TO_LE (size);
+  memcpy (data, &header, sizeof (header));
+  g_variant_store (record, data + sizeof (header));
+
+  return g_bytes_new_take (data, sizeof (header) + RECORD_PADDED_SIZE (size));
+}
+
+/* Deletes the oldest segments that are over the limit */
+static gboolean
+expire_segments (int      dfd,
+                 GError **error)
+{
+  g_autoptr(GArray) segments = list_segments (dfd, error);
+  guint i;
+
+  if (segments == NULL)
+    return FALSE;
+
+  for (i = 0; i + MAX_SEGMENTS < segments->len; i++)
+    {
+      g_autofree char *name = segment_name (g_array_index (segments, gint64, i));
+
+      if (unlinkat (dfd, name, 0) != 0 && errno != ENOENT)
+        return glnx_throw_errno_prefix (error, "unlinkat(%s)", name);
+    }
+
+  return TRUE;
+}
+
+/* Appends an entry with @fields, a NULL terminated list of alternating
+ * field names and values, to the history in @history_dir. */
+gboolean
+flatpak_history_append (GFile              *history_dir,
+                        gint64              timestamp,
+                        const char * const *fields,
+                        GError            **error)
+{
+  const char *path = flatpak_file_get_path_cached (history_dir);
+  g_autoptr(GBytes) record = NULL;
+  g_autoptr(GArray) segments = NULL;
+  glnx_autofd int dfd = -1;
+  glnx_autofd int fd = -1;
+  gboolean new_segment = FALSE;
+
+  if (!glnx_shutil_mkdir_p_at (AT_FDCWD, path, 0700, NULL, error) ||
+      !glnx_opendirat (AT_FDCWD, path, TRUE, &dfd, error))
+    return FALSE;
+
+  segments = list_segments (dfd, error);
+  if (segments == NULL)
+    return FALSE;
+
+  record = make_record (timestamp, fields);
+
+  if (segments->len > 0)
+    {
+      gint64 last = g_array_index (segments, gint64, segments->len - 1);
+      g_autofree char *name = segment_name (last);
+      struct stat stbuf;
+
+      fd = openat (dfd, name, O_WRONLY | O_APPEND | O_CLOEXEC | O_NOCTTY);
+      if (fd < 0 && errno != ENOENT)
+        return glnx_throw_errno_prefix (error, "openat(%s)", name);
+
+      if (fd >= 0)
+        {
+          if (!glnx_fstat (fd, &stbuf, error))
+            return FALSE;
+
+          if (stbuf.st_size + g_bytes_get_size (record) > MAX_SEGMENT_SIZE)
+            glnx_close_fd (&fd);
+        }
+
+      /* Keep the segment names ordered, even if the clock went backwards */
+      timestamp = MAX (timestamp, last + 1);
+    }
+
+  if (fd < 0)
+    {
+      g_autofree char *name = segment_name (timestamp);
+
+      fd = openat (dfd, name, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC | O_NOCTTY, 0600);
+      if (fd < 0)
+        return glnx_throw_errno_prefix (error, "openat(%s)", name);
+
+      new_segment = TRUE;
+    }
+
+  if (glnx_loop_write (fd, g_bytes_get_data (record, NULL), g_bytes_get_size (record)) < 0)
+    return glnx_throw_errno_prefix (error, "write");
+
+  if (new_segment && !expire_segments (dfd, error))
+    return FALSE;
+
+  return TRUE;
+}
+
+static gboolean
+load_segment (int           dfd,
+              gint64        start,
+              gint64        since,
+              gint64        until,
+              GPtrArray    *entries,
+              GCancellable *cancellable,
+              GError      **error)
+{
+  g_autofree char *name = segment_name (start);
+  g_autoptr(GBytes) bytes = NULL;
+  glnx_autofd int fd = -1;
+  const guint8 *data;
+  gsize len, offset;
+
+  fd = openat (dfd, name, O_RDONLY | O_CLOEXEC | O_NOCTTY);
+  if (fd < 0)
+    {
+      /* Expired while we were reading */
+      if (errno == ENOENT)
+        return TRUE;
+      return glnx_throw_errno_prefix (error, "openat(%s)", name);
+    }
+
+  bytes = glnx_fd_readall_bytes (fd, cancellable, error);
+  if (bytes == NULL)
+    return FALSE;
+
+  data = g_bytes_get_data (bytes, &len);
+  offset = 0;
+  while (offset + sizeof (RecordHeader) <= len)
+    {
+      g_autoptr(GBytes) record_bytes = NULL;
+      g_autoptr(GVariant) record = NULL;
+      g_autoptr(GVariant) dict = NULL;
+      RecordHeader header;
+      GVariantIter iter;
+      const char *key, *value;
+      gint64 timestamp;
+      gsize size;
+
+      memcpy (&header, data + offset, sizeof (header));
+      size = GUINT32_FROM_LE (header.size);
+      if (GUINT32_FROM_LE (header.magic) != RECORD_MAGIC || size == 0 ||
+          size > len - offset - sizeof (header))
+        {
+          offset++;
+          continue;
+        }
+
+      record_bytes = g_bytes_new_from_bytes (bytes, offset + sizeof (header), size);
+      record = g_variant_ref_sink (g_variant_new_from_bytes (RECORD_GVARIANT_FORMAT, record_bytes, FALSE));
+
+      /* A torn record runs into the one written after it, which then
+       * doesn't serialize to a valid variant */
+      if (!g_variant_is_normal_form (record))
+        {
+          offset++;
+          continue;
+        }
+
+      offset += sizeof (header) + RECORD_PADDED_SIZE (size);
+      g_variant_get (record, "(x@a{ss})", &timestamp, &dict);
+
+      if ((since > 0 && timestamp <= since) ||
+          (until > 0 && timestamp >= until))
+        continue;
+
+      {
+        FlatpakHistoryEntry *entry = g_new0 (FlatpakHistoryEntry, 1);
+
+        entry->time = timestamp;
+        entry->fields = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+
+        g_variant_iter_init (&iter, dict);
+        while (g_variant_iter_next (&iter, "{&s&s}", &key, &value))
+          g_hash_table_replace (entry->fields, g_strdup (key), g_strdup (value));
+
+        g_ptr_array_add (entries, entry);
+      }
+    }
+
+  return TRUE;
+}
+
+/* Returns the entries in @history_dir that are newer than @since and
+ * older than @until (either may be 0 for no limit), in the order they
+ * were added. @out_oldest is set to the earliest time the history
+ * covers. */
+GPtrArray *
+flatpak_history_load (GFile        *history_dir,
+                      gint64        since,
+                      gint64        until,
+                      gint64       *out_oldest,
+                      GCancellable *cancellable,
+                      GError      **error)
+{
+  g_autoptr(GPtrArray) entries = g_ptr_array_new_with_free_func ((GDestroyNotify) flatpak_history_entry_free);
+  g_autoptr(GArray) segments = NULL;
+  glnx_autofd int dfd = -1;
+  guint i;
+
+  if (!glnx_opendirat (AT_FDCWD, flatpak_file_get_path_cached (history_dir), TRUE, &dfd, error))
+    return NULL;
+
+  segments = list_segments (dfd, error);
+  if (segments == NULL)
+    return NULL;
+
+  if (out_oldest)
+    *out_oldest = segments->len > 0 ? g_array_index (segments, gint64, 0) : G_MAXINT64;
+
+  for (i = 0; i < segments->len; i++)
+    {
+      gint64 start = g_array_index (segments, gint64, i);
+      gint64 next = i + 1 < segments->len ? g_array_index (segments, gint64, i + 1) : G_MAXINT64;
+
+      /* Everything in this segment is older than the next one */
+      if (since > 0 && next <= since)
+        continue;
+
+      if (until > 0 && start >= until)
+        break;
+
+      if (!load_segment (dfd, start, since, until, entries, cancellable, error))
+        return NULL;
+    }
+
+  return g_steal_pointer (&entries);
+}
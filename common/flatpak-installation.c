@@ -1759,7 +1759,7 @@ flatpak_installation_install_bundle (FlatpakInstallation    *self,
   if (dir == NULL)
     return NULL;
 
-  remote = flatpak_dir_ensure_bundle_remote (dir, file, NULL, &ref, NULL, NULL, &created_remote, cancellable, error);
+  remote = flatpak_dir_ensure_bundle_remote (dir, file, NULL, NULL, &ref, NULL, NULL, &created_remote, cancellable, error);
   if (remote == NULL)
     return NULL;
 
@@ -1772,7 +1772,7 @@ flatpak_installation_install_bundle (FlatpakInstallation    *self,
   if (!flatpak_dir_ensure_repo (dir_clone, cancellable, error))
     return NULL;
 
-  if (!flatpak_dir_install_bundle (dir_clone, file, remote, NULL,
+  if (!flatpak_dir_install_bundle (dir_clone, file, NULL, remote, NULL, NULL,
                                    cancellable, error))
     return NULL;
 
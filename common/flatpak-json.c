@@ -21,6 +21,8 @@
 #include "config.h"
 #include "string.h"
 
+#include <errno.h>
+
 #include "flatpak-json-private.h"
 #include "flatpak-utils-private.h"
 #include "libglnx.h"
@@ -370,25 +372,910 @@ flatpak_json_from_bytes (GBytes  *bytes,
   return flatpak_json_from_node (root, type, error);
 }
 
+/* The streaming parser below demarshals directly from the input into
+ * the destination structs, without building a JsonNode tree for the
+ * whole document first. This matters for large documents like the OCI
+ * registry index. It follows the same rules as demarshal() above. */
+
+#define STREAM_BUFFER_SIZE (64 * 1024)
+#define STREAM_MAX_DEPTH 512
+
+typedef struct
+{
+  GInputStream *stream;
+  GCancellable *cancellable;
+  guchar       *buf;
+  gsize         pos;
+  gsize         len;
+  gboolean      eof;
+  guint         line;
+  guint         depth;
+  GString      *str;
+} JsonStream;
+
+typedef struct
+{
+  const FlatpakJsonProp *prop;
+  gpointer               dest;
+  gboolean               seen;
+} JsonStreamField;
+
+static gboolean stream_demarshal (JsonStream            *js,
+                                  const FlatpakJsonProp *prop,
+                                  gpointer               dest,
+                                  GError               **error);
+
+static gboolean
+stream_fail (JsonStream *js,
+             GError    **error,
+             const char *fmt,
+             ...) G_GNUC_PRINTF (3, 4);
+
+static gboolean
+stream_fail (JsonStream *js,
+             GError    **error,
+             const char *fmt,
+             ...)
+{
+  g_autofree char *msg = NULL;
+  va_list args;
+
+  va_start (args, fmt);
+  msg = g_strdup_vprintf (fmt, args);
+  va_end (args);
+
+  g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+               "Invalid JSON at line %u: %s", js->line, msg);
+  return FALSE;
+}
+
+/* Returns the next byte without consuming it, or -1 at the end of the input */
+static gboolean
+stream_peek_raw (JsonStream *js,
+                 int        *out_c,
+                 GError    **error)
+{
+  if (js->pos == js->len && !js->eof)
+    {
+      gssize n = g_input_stream_read (js->stream, js->buf, STREAM_BUFFER_SIZE,
+                                      js->cancellable, error);
+      if (n < 0)
+        return FALSE;
+      js->pos = 0;
+      js->len = n;
+      js->eof = n == 0;
+    }
+
+  *out_c = js->pos < js->len ? js->buf[js->pos] : -1;
+  return TRUE;
+}
+
+/* Like stream_peek_raw(), but skips whitespace first */
+static gboolean
+stream_peek (JsonStream *js,
+             int        *out_c,
+             GError    **error)
+{
+  while (TRUE)
+    {
+      if (!stream_peek_raw (js, out_c, error))
+        return FALSE;
+
+      switch (*out_c)
+        {
+        case '\n':
+          js->line++;
+          js->pos++;
+          break;
+
+        case ' ':
+        case '\t':
+        case '\r':
+          js->pos++;
+          break;
+
+        default:
+          return TRUE;
+        }
+    }
+}
+
+static gboolean
+stream_expect (JsonStream *js,
+               char        expected,
+               GError    **error)
+{
+  int c;
+
+  if (!stream_peek (js, &c, error))
+    return FALSE;
+
+  if (c != expected)
+    return stream_fail (js, error, "Expected '%c'", expected);
+
+  js->pos++;
+  return TRUE;
+}
+
+static gboolean
+stream_read_literal (JsonStream *js,
+                     const char *literal,
+                     GError    **error)
+{
+  const char *l;
+  int c;
+
+  for (l = literal; *l != 0; l++)
+    {
+      if (!stream_peek_raw (js, &c, error))
+        return FALSE;
+      if (c != *l)
+        return stream_fail (js, error, "Invalid literal, expected %s", literal);
+      js->pos++;
+    }
+
+  return TRUE;
+}
+
+static gboolean
+stream_read_hex4 (JsonStream *js,
+                  gunichar   *out,
+                  GError    **error)
+{
+  gunichar v = 0;
+  int i, c;
+
+  for (i = 0; i < 4; i++)
+    {
+      if (!stream_peek_raw (js, &c, error))
+        return FALSE;
+      if (c < 0 || !g_ascii_isxdigit (c))
+        return stream_fail (js, error, "Invalid unicode escape");
+      v = (v << 4) | g_ascii_xdigit_value (c);
+      js->pos++;
+    }
+
+  *out = v;
+  return TRUE;
+}
+
+static gboolean
+stream_read_escape (JsonStream *js,
+                    GError    **error)
+{
+  gunichar u, low;
+  int c;
+
+  if (!stream_peek_raw (js, &c, error))
+    return FALSE;
+  js->pos++;
+
+  switch (c)
+    {
+    case '"':
+    case '\\':
+    case '/':
+      g_string_append_c (js->str, c);
+      return TRUE;
+
+    case 'b':
+      g_string_append_c (js->str, '\b');
+      return TRUE;
+
+    case 'f':
+      g_string_append_c (js->str, '\f');
+      return TRUE;
+
+    case 'n':
+      g_string_append_c (js->str, '\n');
+      return TRUE;
+
+    case 'r':
+      g_string_append_c (js->str, '\r');
+      return TRUE;
+
+    case 't':
+      g_string_append_c (js->str, '\t');
+      return TRUE;
+
+    case 'u':
+      if (!stream_read_hex4 (js, &u, error))
+        return FALSE;
+
+      if (u >= 0xdc00 && u <= 0xdfff)
+        return stream_fail (js, error, "Invalid unicode surrogate pair");
+
+      if (u >= 0xd800 && u <= 0xdbff)
+        {
+          if (!stream_read_literal (js, "\\u", error) ||
+              !stream_read_hex4 (js, &low, error))
+            return FALSE;
+          if (low < 0xdc00 || low > 0xdfff)
+            return stream_fail (js, error, "Invalid unicode surrogate pair");
+          u = 0x10000 + ((u - 0xd800) << 10) + (low - 0xdc00);
+        }
+
+      if (u == 0)
+        return stream_fail (js, error, "Embedded nul character in string");
+
+      g_string_append_unichar (js->str, u);
+      return TRUE;
+
+    default:
+      return stream_fail (js, error, "Invalid escape sequence in string");
+    }
+}
+
+/* Reads a string into js->str, the returned value is only valid until
+ * the next read */
+static const char *
+stream_read_string (JsonStream *js,
+                    GError    **error)
+{
+  if (!stream_expect (js, '"', error))
+    return NULL;
+
+  g_string_truncate (js->str, 0);
+
+  while (TRUE)
+    {
+      gsize start;
+      int c;
+
+      if (!stream_peek_raw (js, &c, error))
+        return NULL;
+      if (c < 0)
+        {
+          stream_fail (js, error, "Unterminated string");
+          return NULL;
+        }
+
+      /* Copy the unescaped run in one go */
+      start = js->pos;
+      while (js->pos < js->len &&
+             js->buf[js->pos] != '"' && js->buf[js->pos] != '\\' && js->buf[js->pos] >= 0x20)
+        js->pos++;
+      g_string_append_len (js->str, (const char *) js->buf + start, js->pos - start);
+
+      if (js->pos == js->len)
+        continue;
+
+      c = js->buf[js->pos++];
+      if (c == '"')
+        break;
+
+      if (c != '\\')
+        {
+          stream_fail (js, error, "Invalid control character in string");
+          return NULL;
+        }
+
+      if (!stream_read_escape (js, error))
+        return NULL;
+    }
+
+  if (!g_utf8_validate (js->str->str, js->str->len, NULL))
+    {
+      stream_fail (js, error, "Invalid UTF-8 in string");
+      return NULL;
+    }
+
+  return js->str->str;
+}
+
+/* Reads a number into js->str and validates it */
+static gboolean
+stream_read_number (JsonStream *js,
+                    gboolean   *out_is_int,
+                    GError    **error)
+{
+  const char *p;
+  gboolean is_int = TRUE;
+  int c;
+
+  g_string_truncate (js->str, 0);
+
+  while (TRUE)
+    {
+      if (!stream_peek_raw (js, &c, error))
+        return FALSE;
+      if (c < 0 || !(g_ascii_isdigit (c) || c == '-' || c == '+' || c == '.' || c == 'e' || c == 'E'))
+        break;
+      g_string_append_c (js->str, c);
+      js->pos++;
+    }
+
+  p = js->str->str;
+  if (*p == '-')
+    p++;
+  if (*p == '0')
+    p++;
+  else if (*p >= '1' && *p <= '9')
+    while (g_ascii_isdigit (*p))
+      p++;
+  else
+    return stream_fail (js, error, "Invalid number");
+
+  if (*p == '.')
+    {
+      is_int = FALSE;
+      p++;
+      if (!g_ascii_isdigit (*p))
+        return stream_fail (js, error, "Invalid number");
+      while (g_ascii_isdigit (*p))
+        p++;
+    }
+
+  if (*p == 'e' || *p == 'E')
+    {
+      is_int = FALSE;
+      p++;
+      if (*p == '+' || *p == '-')
+        p++;
+      if (!g_ascii_isdigit (*p))
+        return stream_fail (js, error, "Invalid number");
+      while (g_ascii_isdigit (*p))
+        p++;
+    }
+
+  if (*p != 0)
+    return stream_fail (js, error, "Invalid number");
+
+  *out_is_int = is_int;
+  return TRUE;
+}
+
+static gboolean
+stream_enter (JsonStream *js,
+              char        open,
+              GError    **error)
+{
+  if (js->depth >= STREAM_MAX_DEPTH)
+    return stream_fail (js, error, "Maximum nesting depth reached");
+
+  if (!stream_expect (js, open, error))
+    return FALSE;
+
+  js->depth++;
+  return TRUE;
+}
+
+/* Call after each array element or object member, returns with
+ * *out_done set if the container ended */
+static gboolean
+stream_next (JsonStream *js,
+             char        close,
+             gboolean   *out_done,
+             GError    **error)
+{
+  int c;
+
+  if (!stream_peek (js, &c, error))
+    return FALSE;
+
+  if (c != close && c != ',')
+    return stream_fail (js, error, "Expected ',' or '%c'", close);
+
+  js->pos++;
+  *out_done = c == close;
+  if (*out_done)
+    js->depth--;
+
+  return TRUE;
+}
+
+/* Call after entering a container, returns with *out_done set if it
+ * was empty */
+static gboolean
+stream_first (JsonStream *js,
+              char        close,
+              gboolean   *out_done,
+              GError    **error)
+{
+  int c;
+
+  if (!stream_peek (js, &c, error))
+    return FALSE;
+
+  *out_done = c == close;
+  if (*out_done)
+    {
+      js->pos++;
+      js->depth--;
+    }
+
+  return TRUE;
+}
+
+/* Reads an object member name and the following colon */
+static const char *
+stream_read_member_name (JsonStream *js,
+                         GError    **error)
+{
+  const char *name = stream_read_string (js, error);
+
+  if (name == NULL || !stream_expect (js, ':', error))
+    return NULL;
+
+  return name;
+}
+
+static gboolean
+stream_skip_value (JsonStream *js,
+                   GError    **error)
+{
+  gboolean done, is_int;
+  int c;
+
+  if (!stream_peek (js, &c, error))
+    return FALSE;
+
+  switch (c)
+    {
+    case '{':
+      if (!stream_enter (js, '{', error) ||
+          !stream_first (js, '}', &done, error))
+        return FALSE;
+      while (!done)
+        {
+          if (stream_read_member_name (js, error) == NULL ||
+              !stream_skip_value (js, error) ||
+              !stream_next (js, '}', &done, error))
+            return FALSE;
+        }
+      return TRUE;
+
+    case '[':
+      if (!stream_enter (js, '[', error) ||
+          !stream_first (js, ']', &done, error))
+        return FALSE;
+      while (!done)
+        {
+          if (!stream_skip_value (js, error) ||
+              !stream_next (js, ']', &done, error))
+            return FALSE;
+        }
+      return TRUE;
+
+    case '"':
+      return stream_read_string (js, error) != NULL;
+
+    case 't':
+      return stream_read_literal (js, "true", error);
+
+    case 'f':
+      return stream_read_literal (js, "false", error);
+
+    case 'n':
+      return stream_read_literal (js, "null", error);
+
+    default:
+      if (c == '-' || (c >= '0' && c <= '9'))
+        return stream_read_number (js, &is_int, error);
+      if (c < 0)
+        return stream_fail (js, error, "Unexpected end of data");
+      return stream_fail (js, error, "Unexpected character '%c'", c);
+    }
+}
+
+/* Adds the destinations of all the @props, with the parent props
+ * flattened, as they are read from the same object */
+static void
+stream_collect_fields (GArray                *fields,
+                       const FlatpakJsonProp *props,
+                       gpointer               base)
+{
+  int i;
+
+  for (i = 0; props[i].name != NULL; i++)
+    {
+      if (props[i].type == FLATPAK_JSON_PROP_TYPE_PARENT)
+        stream_collect_fields (fields, props[i].type_data,
+                               G_STRUCT_MEMBER_P (base, props[i].offset));
+      else
+        {
+          JsonStreamField field = { &props[i], G_STRUCT_MEMBER_P (base, props[i].offset), FALSE };
+          g_array_append_val (fields, field);
+        }
+    }
+}
+
+static gboolean
+stream_demarshal_object (JsonStream *js,
+                         GArray     *fields,
+                         gboolean    strict,
+                         GError    **error)
+{
+  gboolean done;
+  guint i;
+
+  if (!stream_enter (js, '{', error) ||
+      !stream_first (js, '}', &done, error))
+    return FALSE;
+
+  while (!done)
+    {
+      const char *member_name = stream_read_member_name (js, error);
+      JsonStreamField *field = NULL;
+
+      if (member_name == NULL)
+        return FALSE;
+
+      for (i = 0; i < fields->len; i++)
+        {
+          JsonStreamField *f = &g_array_index (fields, JsonStreamField, i);
+          if (strcmp (f->prop->name, member_name) == 0)
+            {
+              field = f;
+              break;
+            }
+        }
+
+      if (field == NULL)
+        {
+          if (strict)
+            return flatpak_fail (error, "Unknown property named %s", member_name);
+
+          if (!stream_skip_value (js, error))
+            return FALSE;
+        }
+      else
+        {
+          /* We can't replace an already demarshalled value without knowing how to free it */
+          if (field->seen)
+            return flatpak_fail (error, "Duplicate property named %s", member_name);
+          field->seen = TRUE;
+
+          if (!stream_demarshal (js, field->prop, field->dest, error))
+            return FALSE;
+        }
+
+      if (!stream_next (js, '}', &done, error))
+        return FALSE;
+    }
+
+  for (i = 0; i < fields->len; i++)
+    {
+      JsonStreamField *f = &g_array_index (fields, JsonStreamField, i);
+
+      if (!f->seen && (f->prop->flags & FLATPAK_JSON_PROP_FLAGS_MANDATORY) != 0)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "No value for mandatory property %s", f->prop->name);
+          return FALSE;
+        }
+    }
+
+  return TRUE;
+}
+
+static gboolean
+stream_demarshal_struct (JsonStream            *js,
+                         const FlatpakJsonProp *struct_props,
+                         gpointer               dest,
+                         GError               **error)
+{
+  g_autoptr(GArray) fields = g_array_sized_new (FALSE, FALSE, sizeof (JsonStreamField), 16);
+
+  stream_collect_fields (fields, struct_props, dest);
+
+  return stream_demarshal_object (js, fields,
+                                  (struct_props->flags & FLATPAK_JSON_PROP_FLAGS_STRICT) != 0,
+                                  error);
+}
+
+static gboolean
+stream_demarshal (JsonStream            *js,
+                  const FlatpakJsonProp *prop,
+                  gpointer               dest,
+                  GError               **error)
+{
+  const char *name = prop->name;
+  gboolean done, is_int;
+  int c;
+
+  if (!stream_peek (js, &c, error))
+    return FALSE;
+
+  if (c == 'n')
+    return stream_read_literal (js, "null", error);
+
+  switch (prop->type)
+    {
+    case FLATPAK_JSON_PROP_TYPE_STRING:
+      {
+        const char *str;
+
+        if (c != '"')
+          {
+            g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                         "Expecting string for property %s", name);
+            return FALSE;
+          }
+
+        str = stream_read_string (js, error);
+        if (str == NULL)
+          return FALSE;
+        *(char **) dest = g_strdup (str);
+      }
+      break;
+
+    case FLATPAK_JSON_PROP_TYPE_INT64:
+      {
+        gint64 val;
+
+        if (!(c == '-' || (c >= '0' && c <= '9')))
+          {
+            g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                         "Expecting int64 for property %s", name);
+            return FALSE;
+          }
+
+        if (!stream_read_number (js, &is_int, error))
+          return FALSE;
+
+        errno = 0;
+        val = g_ascii_strtoll (js->str->str, NULL, 10);
+        if (!is_int || errno != 0)
+          {
+            g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                         "Expecting int64 for property %s", name);
+            return FALSE;
+          }
+        *(gint64 *) dest = val;
+      }
+      break;
+
+    case FLATPAK_JSON_PROP_TYPE_BOOL:
+      if (c == 't')
+        {
+          if (!stream_read_literal (js, "true", error))
+            return FALSE;
+          *(gboolean *) dest = TRUE;
+        }
+      else if (c == 'f')
+        {
+          if (!stream_read_literal (js, "false", error))
+            return FALSE;
+          *(gboolean *) dest = FALSE;
+        }
+      else
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "Expecting bool for property %s", name);
+          return FALSE;
+        }
+      break;
+
+    case FLATPAK_JSON_PROP_TYPE_STRV:
+      if (c != '[')
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "Expecting array for property %s", name);
+          return FALSE;
+        }
+      {
+        g_autoptr(GPtrArray) str_array = g_ptr_array_new_with_free_func (g_free);
+
+        if (!stream_enter (js, '[', error) ||
+            !stream_first (js, ']', &done, error))
+          return FALSE;
+
+        while (!done)
+          {
+            if (!stream_peek (js, &c, error))
+              return FALSE;
+
+            /* Like demarshal(), ignore any non-string elements */
+            if (c == '"')
+              {
+                const char *str = stream_read_string (js, error);
+                if (str == NULL)
+                  return FALSE;
+                g_ptr_array_add (str_array, g_strdup (str));
+              }
+            else if (!stream_skip_value (js, error))
+              return FALSE;
+
+            if (!stream_next (js, ']', &done, error))
+              return FALSE;
+          }
+
+        g_ptr_array_add (str_array, NULL);
+        *(char ***) dest = (char **) g_ptr_array_free (g_steal_pointer (&str_array), FALSE);
+      }
+      break;
+
+    case FLATPAK_JSON_PROP_TYPE_STRUCT:
+      if (c != '{')
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "Expecting object for property %s", name);
+          return FALSE;
+        }
+
+      return stream_demarshal_struct (js, prop->type_data, dest, error);
+
+    case FLATPAK_JSON_PROP_TYPE_STRUCTV:
+      if (c != '[')
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "Expecting array for property %s", name);
+          return FALSE;
+        }
+      {
+        g_autoptr(GPtrArray) obj_array = g_ptr_array_new ();
+        gboolean res = TRUE;
+
+        if (!stream_enter (js, '[', error) ||
+            !stream_first (js, ']', &done, error))
+          return FALSE;
+
+        while (res && !done)
+          {
+            gpointer new_element;
+
+            if (!stream_peek (js, &c, error))
+              res = FALSE;
+            else if (c != '{')
+              {
+                g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                             "Expecting object element for property %s", name);
+                res = FALSE;
+              }
+            else
+              {
+                new_element = g_malloc0 ((gsize) prop->type_data2);
+                g_ptr_array_add (obj_array, new_element);
+
+                res = stream_demarshal_struct (js, prop->type_data, new_element, error) &&
+                      stream_next (js, ']', &done, error);
+              }
+          }
+
+        /* NULL terminate */
+        g_ptr_array_add (obj_array, NULL);
+
+        /* We always set the array, even if it is partial, because we don't know how
+           to free what we demarshalled so far */
+        *(gpointer *) dest = (gpointer *) g_ptr_array_free (g_steal_pointer (&obj_array), FALSE);
+        return res;
+      }
+      break;
+
+    case FLATPAK_JSON_PROP_TYPE_STRMAP:
+      if (c != '{')
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "Expecting object for property %s", name);
+          return FALSE;
+        }
+      {
+        g_autoptr(GHashTable) h = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+
+        if (!stream_enter (js, '{', error) ||
+            !stream_first (js, '}', &done, error))
+          return FALSE;
+
+        while (!done)
+          {
+            g_autofree char *member_name = NULL;
+            const char *val_str;
+
+            if (stream_read_member_name (js, error) == NULL)
+              return FALSE;
+            member_name = g_strdup (js->str->str);
+
+            if (!stream_peek (js, &c, error))
+              return FALSE;
+            if (c != '"')
+              {
+                g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                             "Wrong type for string member %s", member_name);
+                return FALSE;
+              }
+
+            val_str = stream_read_string (js, error);
+            if (val_str == NULL)
+              return FALSE;
+
+            g_hash_table_insert (h, g_steal_pointer (&member_name), g_strdup (val_str));
+
+            if (!stream_next (js, '}', &done, error))
+              return FALSE;
+          }
+
+        *(GHashTable **) dest = g_steal_pointer (&h);
+      }
+      break;
+
+    case FLATPAK_JSON_PROP_TYPE_BOOLMAP:
+      if (c != '{')
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "Expecting object for property %s", name);
+          return FALSE;
+        }
+      {
+        g_autoptr(GPtrArray) res = g_ptr_array_new_with_free_func (g_free);
+
+        if (!stream_enter (js, '{', error) ||
+            !stream_first (js, '}', &done, error))
+          return FALSE;
+
+        while (!done)
+          {
+            if (stream_read_member_name (js, error) == NULL)
+              return FALSE;
+            g_ptr_array_add (res, g_strdup (js->str->str));
+
+            if (!stream_skip_value (js, error) ||
+                !stream_next (js, '}', &done, error))
+              return FALSE;
+          }
+
+        g_ptr_array_add (res, NULL);
+        *(char ***) dest =  (char **) g_ptr_array_free (g_steal_pointer (&res), FALSE);
+      }
+      break;
+
+    case FLATPAK_JSON_PROP_TYPE_PARENT:
+    default:
+      g_assert_not_reached ();
+    }
+
+  return TRUE;
+}
+
+/* This parses @stream incrementally, demarshalling into the
+ * @type object as it goes, so unlike flatpak_json_from_bytes() it
+ * never keeps a tree for the whole document in memory. */
 FlatpakJson *
 flatpak_json_from_stream (GInputStream *stream,
                           GType         type,
                           GCancellable *cancellable,
                           GError      **error)
 {
-  g_autoptr(JsonParser) parser = NULL;
-  JsonNode *root = NULL;
+  g_autoptr(FlatpakJson) json = NULL;
+  g_autoptr(GArray) fields = g_array_sized_new (FALSE, FALSE, sizeof (JsonStreamField), 16);
+  g_autofree guchar *buf = g_malloc (STREAM_BUFFER_SIZE);
+  g_autoptr(GString) str = g_string_new ("");
+  JsonStream js = { stream, cancellable, buf, 0, 0, FALSE, 1, 0, str };
+  gpointer class;
+  int c;
 
-  parser = json_parser_new ();
-  if (!json_parser_load_from_stream (parser,
-                                     stream,
-                                     cancellable,
-                                     error))
+  if (!stream_peek (&js, &c, error))
     return NULL;
 
-  root = json_parser_get_root (parser);
+  if (c != '{')
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Expecting a JSON object");
+      return NULL;
+    }
 
-  return flatpak_json_from_node (root, type, error);
+  json = g_object_new (type, NULL);
+
+  class = FLATPAK_JSON_GET_CLASS (json);
+  while (FLATPAK_JSON_CLASS (class)->props != NULL)
+    {
+      stream_collect_fields (fields, FLATPAK_JSON_CLASS (class)->props, json);
+      class = g_type_class_peek_parent (class);
+    }
+
+  if (!stream_demarshal_object (&js, fields, FALSE, error))
+    return NULL;
+
+  if (!stream_peek (&js, &c, error))
+    return NULL;
+
+  if (c >= 0)
+    {
+      stream_fail (&js, error, "Unexpected data after the end of the document");
+      return NULL;
+    }
+
+  return g_steal_pointer (&json);
 }
 
 static JsonNode *
@@ -61,6 +61,7 @@ struct FlatpakOciRegistry
   gboolean is_docker;
   char    *uri;
   int      tmp_dfd;
+  gboolean resume_downloads;
   char    *token;
 
   /* Local repos */
@@ -564,6 +565,11 @@ flatpak_oci_registry_initable_init (GInitable    *initable,
   FlatpakOciRegistry *self = FLATPAK_OCI_REGISTRY (initable);
   gboolean res;
 
+  /* Partial downloads are only kept, and resumed, in a directory the
+   * caller gave us, which is private to the user. In a shared one like
+   * /var/tmp other users could plant files under the predictable names. */
+  self->resume_downloads = self->tmp_dfd != -1;
+
   if (self->tmp_dfd == -1 &&
       !glnx_opendirat (AT_FDCWD, "/var/tmp", TRUE, &self->tmp_dfd, error))
     return FALSE;
@@ -785,12 +791,15 @@ flatpak_oci_registry_download_blob (FlatpakOciRegistry    *self,
     {
       g_autoptr(SoupURI) uri = NULL;
       g_autofree char *uri_s = NULL;
-      g_autofree char *checksum = NULL;
-      g_autofree char *tmpfile_name = g_strdup_printf ("oci-layer-XXXXXX");
-      g_autoptr(GOutputStream) out_stream = NULL;
+      g_autoptr(GChecksum) checksum = g_checksum_new (G_CHECKSUM_SHA256);
+      const char *checksum_str;
+      g_autofree char *partial_name = NULL;
 
       /* remote case, download and verify */
 
+      if (!ostree_validate_checksum_string (digest + strlen ("sha256:"), error))
+        return -1;
+
       uri_s = choose_alt_uri (self->base_uri, alt_uris);
       if (uri_s == NULL)
         {
@@ -805,40 +814,27 @@ flatpak_oci_registry_download_blob (FlatpakOciRegistry    *self,
           uri_s = soup_uri_to_string (uri, FALSE);
         }
 
-
-      if (!flatpak_open_in_tmpdir_at (self->tmp_dfd, 0600, tmpfile_name,
-                                      &out_stream, cancellable, error))
-        return -1;
-
-      fd = local_open_file (self->tmp_dfd, tmpfile_name, NULL, cancellable, error);
-      (void) unlinkat (self->tmp_dfd, tmpfile_name, 0);
-
-      if (fd == -1)
+      /* Keyed by digest so that an interrupted download of the same
+       * blob can be resumed later */
+      if (self->resume_downloads)
+        partial_name = g_strconcat ("oci-blob-", digest + strlen ("sha256:"), ".partial", NULL);
+
+      if (!flatpak_download_http_uri_resumable (self->soup_session, uri_s,
+                                                FLATPAK_HTTP_FLAGS_ACCEPT_OCI,
+                                                self->tmp_dfd, partial_name,
+                                                self->token,
+                                                progress_cb, user_data,
+                                                checksum, &fd, cancellable, error))
         return -1;
 
-      if (!flatpak_download_http_uri (self->soup_session, uri_s,
-                                      FLATPAK_HTTP_FLAGS_ACCEPT_OCI,
-                                      out_stream,
-                                      self->token,
-                                      progress_cb, user_data,
-                                      cancellable, error))
-        return -1;
-
-      if (!g_output_stream_close (out_stream, cancellable, error))
-        return -1;
-
-      checksum = checksum_fd (fd, cancellable, error);
-      if (checksum == NULL)
-        return -1;
-
-      if (strcmp (checksum, digest + strlen ("sha256:")) != 0)
+      /* The checksum was computed while downloading */
+      checksum_str = g_checksum_get_string (checksum);
+      if (strcmp (checksum_str, digest + strlen ("sha256:")) != 0)
         {
           g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
-                       "Checksum digest did not match (%s != %s)", digest, checksum);
+                       "Checksum digest did not match (%s != %s)", digest, checksum_str);
           return -1;
         }
-
-      lseek (fd, 0, SEEK_SET);
     }
 
   return glnx_steal_fd (&fd);
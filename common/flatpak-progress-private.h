@@ -67,6 +67,11 @@ void flatpak_progress_update_oci_pull (FlatpakProgress *self,
                                        guint32          n_layers,
                                        guint32          pulled_layers);
 
+void flatpak_progress_start_bundle (FlatpakProgress *self,
+                                    guint64          total_size,
+                                    guint32          n_parts);
+void flatpak_progress_complete_bundle (FlatpakProgress *self);
+
 guint32 flatpak_progress_get_update_interval (FlatpakProgress *self);
 void flatpak_progress_set_update_interval (FlatpakProgress *self,
                                            guint32          interval);
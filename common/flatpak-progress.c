@@ -392,12 +392,9 @@ flatpak_progress_complete_extra_data_download (FlatpakProgress *self,
   update_status_progress_and_estimating (self);
 }
 
-void
-flatpak_progress_start_oci_pull (FlatpakProgress *self)
+static void
+reset_pull_progress (FlatpakProgress *self)
 {
-  if (self == NULL)
-    return;
-
   self->start_time = g_get_monotonic_time () - 2;
   self->outstanding_fetches = 0;
   self->outstanding_writes = 0;
@@ -424,6 +421,38 @@ flatpak_progress_start_oci_pull (FlatpakProgress *self)
   update_status_progress_and_estimating (self);
 }
 
+/* OCI layers and bundle delta parts are both reported as delta parts */
+static void
+update_parts_progress (FlatpakProgress *self,
+                       guint64          total_size,
+                       guint64          done_size,
+                       guint32          n_parts,
+                       guint32          done_parts)
+{
+  self->requested = n_parts; /* Need to set this to trigger start of progress reporting, see update_status_progress_and_estimating() */
+  self->outstanding_fetches = n_parts - done_parts;
+  self->fetched_delta_parts = done_parts;
+  self->total_delta_parts = n_parts;
+  self->fetched_delta_fallbacks = 0;
+  self->total_delta_fallbacks = 0;
+  self->bytes_transferred = done_size;
+  self->total_delta_part_size = total_size;
+  self->total_delta_part_usize = total_size;
+  self->total_delta_superblocks = 0;
+  update_status_progress_and_estimating (self);
+
+  self->callback (self->status, self->progress, self->estimating, self->user_data);
+}
+
+void
+flatpak_progress_start_oci_pull (FlatpakProgress *self)
+{
+  if (self == NULL)
+    return;
+
+  reset_pull_progress (self);
+}
+
 void
 flatpak_progress_update_oci_pull (FlatpakProgress *self,
                                   guint64          total_size,
@@ -434,19 +463,31 @@ flatpak_progress_update_oci_pull (FlatpakProgress *self,
   if (self == NULL)
     return;
 
-  self->requested = n_layers; /* Need to set this to trigger start of progress reporting, see update_status_progress_and_estimating() */
-  self->outstanding_fetches = n_layers - pulled_layers;
-  self->fetched_delta_parts = pulled_layers;
-  self->total_delta_parts = n_layers;
-  self->fetched_delta_fallbacks = 0;
-  self->total_delta_fallbacks = 0;
-  self->bytes_transferred = pulled_size;
-  self->total_delta_part_size = total_size;
-  self->total_delta_part_usize = total_size;
-  self->total_delta_superblocks = 0;
-  update_status_progress_and_estimating (self);
+  update_parts_progress (self, total_size, pulled_size, n_layers, pulled_layers);
+}
 
-  self->callback (self->status, self->progress, self->estimating, self->user_data);
+/* libostree applies the delta of a bundle in a single call, so the
+ * only progress there is to report is its start and its end */
+void
+flatpak_progress_start_bundle (FlatpakProgress *self,
+                               guint64          total_size,
+                               guint32          n_parts)
+{
+  if (self == NULL)
+    return;
+
+  reset_pull_progress (self);
+  update_parts_progress (self, total_size, 0, n_parts, 0);
+}
+
+void
+flatpak_progress_complete_bundle (FlatpakProgress *self)
+{
+  if (self == NULL)
+    return;
+
+  update_parts_progress (self, self->total_delta_part_size, self->total_delta_part_size,
+                         self->total_delta_parts, self->total_delta_parts);
 }
 
 guint32
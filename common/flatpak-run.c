@@ -29,6 +29,7 @@
 #include <sys/utsname.h>
 #include <sys/socket.h>
 #include <sys/ioctl.h>
+#include <sys/file.h>
 #include <sys/vfs.h>
 #include <sys/wait.h>
 #include <sys/personality.h>
@@ -1270,21 +1271,27 @@ add_bwrap_wrapper (FlatpakBwrap *bwrap,
   return TRUE;
 }
 
+/* Spawns xdg-dbus-proxy with the arguments in proxy_arg_bwrap and waits
+   until it is listening. sync_write_fd is handed to the proxy (and
+   closed here), the proxy exits when all readers of it are gone. */
 static gboolean
-start_dbus_proxy (FlatpakBwrap *app_bwrap,
-                  FlatpakBwrap *proxy_arg_bwrap,
+spawn_dbus_proxy (FlatpakBwrap *proxy_arg_bwrap,
                   const char   *app_info_path,
+                  int           sync_read_fd,
+                  int           sync_write_fd,
                   GError      **error)
 {
   char x = 'x';
   const char *proxy;
   g_autofree char *commandline = NULL;
   g_autoptr(FlatpakBwrap) proxy_bwrap = NULL;
-  int sync_fds[2] = {-1, -1};
   int proxy_start_index;
 
   proxy_bwrap = flatpak_bwrap_new (NULL);
 
+  /* write end goes to proxy */
+  flatpak_bwrap_add_fd (proxy_bwrap, sync_write_fd);
+
   if (!add_bwrap_wrapper (proxy_bwrap, app_info_path, error))
     return FALSE;
 
@@ -1296,19 +1303,7 @@ start_dbus_proxy (FlatpakBwrap *app_bwrap,
 
   proxy_start_index = proxy_bwrap->argv->len;
 
-  if (pipe2 (sync_fds, O_CLOEXEC) < 0)
-    {
-      g_set_error_literal (error, G_IO_ERROR, g_io_error_from_errno (errno),
-                           _("Unable to create sync pipe"));
-      return FALSE;
-    }
-
-  /* read end goes to app */
-  flatpak_bwrap_add_args_data_fd (app_bwrap, "--sync-fd", sync_fds[0], NULL);
-
-  /* write end goes to proxy */
-  flatpak_bwrap_add_fd (proxy_bwrap, sync_fds[1]);
-  flatpak_bwrap_add_arg_printf (proxy_bwrap, "--fd=%d", sync_fds[1]);
+  flatpak_bwrap_add_arg_printf (proxy_bwrap, "--fd=%d", sync_write_fd);
 
   /* Note: This steals the fds from proxy_arg_bwrap */
   flatpak_bwrap_append_bwrap (proxy_bwrap, proxy_arg_bwrap);
@@ -1335,7 +1330,7 @@ start_dbus_proxy (FlatpakBwrap *app_bwrap,
   g_clear_pointer (&proxy_bwrap, flatpak_bwrap_free);
 
   /* Sync with proxy, i.e. wait until its listening on the sockets */
-  if (read (sync_fds[0], &x, 1) != 1)
+  if (read (sync_read_fd, &x, 1) != 1)
     {
       g_set_error_literal (error, G_IO_ERROR, g_io_error_from_errno (errno),
                            _("Failed to sync with dbus proxy"));
@@ -1345,6 +1340,239 @@ start_dbus_proxy (FlatpakBwrap *app_bwrap,
   return TRUE;
 }
 
+static void
+replace_bwrap_arg (FlatpakBwrap *bwrap,
+                   const char   *from,
+                   const char   *to)
+{
+  guint i;
+
+  for (i = 0; i < bwrap->argv->len; i++)
+    {
+      char *arg = g_ptr_array_index (bwrap->argv, i);
+
+      if (arg != NULL && strcmp (arg, from) == 0)
+        {
+          g_free (arg);
+          bwrap->argv->pdata[i] = g_strdup (to);
+        }
+    }
+}
+
+/* Removes the fifo and sockets of shared proxies that have exited, i.e.
+ * whose fifo has no writer anymore. Must be called with the proxy socket
+ * dir locked. */
+static void
+remove_stale_shared_dbus_proxies (int dfd)
+{
+  g_auto(GLnxDirFdIterator) iter = { 0, };
+  g_autoptr(GPtrArray) stale = g_ptr_array_new_with_free_func (g_free);
+  struct dirent *dent;
+  guint i;
+
+  if (!glnx_dirfd_iterator_init_at (dfd, ".", FALSE, &iter, NULL))
+    return;
+
+  while (glnx_dirfd_iterator_next_dent (&iter, &dent, NULL, NULL) && dent != NULL)
+    {
+      glnx_autofd int fd = -1;
+      char x;
+
+      if (!g_str_has_prefix (dent->d_name, "shared-") ||
+          !g_str_has_suffix (dent->d_name, ".fifo"))
+        continue;
+
+      fd = openat (dfd, dent->d_name, O_RDONLY | O_NONBLOCK | O_CLOEXEC | O_NOFOLLOW);
+      if (fd == -1)
+        continue;
+
+      /* EOF means there is no proxy holding the write end */
+      if (read (fd, &x, 1) == 0)
+        g_ptr_array_add (stale, g_strndup (dent->d_name, strlen (dent->d_name) - strlen (".fifo")));
+    }
+
+  if (stale->len == 0)
+    return;
+
+  glnx_dirfd_iterator_clear (&iter);
+  if (!glnx_dirfd_iterator_init_at (dfd, ".", FALSE, &iter, NULL))
+    return;
+
+  while (glnx_dirfd_iterator_next_dent (&iter, &dent, NULL, NULL) && dent != NULL)
+    {
+      for (i = 0; i < stale->len; i++)
+        {
+          const char *prefix = g_ptr_array_index (stale, i);
+          const char *rest;
+
+          if (!g_str_has_prefix (dent->d_name, prefix))
+            continue;
+
+          rest = dent->d_name + strlen (prefix);
+          if (strcmp (rest, ".fifo") == 0 || rest[0] == '-')
+            {
+              g_debug ("Removing stale shared dbus proxy file %s", dent->d_name);
+              (void) unlinkat (dfd, dent->d_name, 0);
+            }
+          break;
+        }
+    }
+}
+
+/* Instances of the same app with identical proxy arguments can share
+ * one xdg-dbus-proxy. The proxy is keyed on a checksum of its arguments
+ * (with the per-instance socket paths masked out) and of the
+ * .flatpak-info it runs with (without the instance id), and listens on
+ * fixed sockets derived from that key. Its sync fd is the write end of
+ * a fifo, and every sandbox using the proxy keeps a read end open via
+ * --sync-fd, so the proxy lives until the last of them exits. The files
+ * of exited proxies are removed the next time a shared proxy is started.
+ *
+ * Note that the proxy runs in the cgroup of the instance that started it.
+ */
+static gboolean
+start_shared_dbus_proxy (FlatpakBwrap *app_bwrap,
+                         FlatpakBwrap *proxy_arg_bwrap,
+                         const char   *app_info_path,
+                         const char   *app_id,
+                         GError      **error)
+{
+  g_autofree char *user_runtime_dir = flatpak_get_real_xdg_runtime_dir ();
+  g_autofree char *proxy_socket_dir = g_build_filename (user_runtime_dir, ".dbus-proxy", NULL);
+  g_autofree char *proxy_socket_prefix = g_strconcat (proxy_socket_dir, "/", NULL);
+  g_autoptr(GChecksum) checksum = g_checksum_new (G_CHECKSUM_SHA256);
+  g_autoptr(GPtrArray) sockets = g_ptr_array_new_with_free_func (g_free);
+  g_autoptr(GKeyFile) app_info = g_key_file_new ();
+  g_autofree char *app_info_data = NULL;
+  gsize app_info_len;
+  g_autofree char *key = NULL;
+  g_autofree char *fifo_name = NULL;
+  const char *proxy;
+  glnx_autofd int dfd = -1;
+  glnx_autofd int sync_read_fd = -1;
+  glnx_autofd int sync_write_fd = -1;
+  int fd_flags;
+  ssize_t res;
+  char x;
+  guint i;
+
+  proxy = g_getenv ("FLATPAK_DBUSPROXY");
+  if (proxy == NULL)
+    proxy = DBUSPROXY;
+
+  g_checksum_update (checksum, (const guchar *) proxy, strlen (proxy) + 1);
+  g_checksum_update (checksum, (const guchar *) app_id, strlen (app_id) + 1);
+
+  /* The proxy sees the app info of the instance that started it, so
+   * that has to match too, apart from the instance id */
+  if (!g_key_file_load_from_file (app_info, app_info_path, G_KEY_FILE_NONE, error))
+    return FALSE;
+  g_key_file_remove_key (app_info, FLATPAK_METADATA_GROUP_INSTANCE,
+                         FLATPAK_METADATA_KEY_INSTANCE_ID, NULL);
+  app_info_data = g_key_file_to_data (app_info, &app_info_len, NULL);
+  g_checksum_update (checksum, (const guchar *) app_info_data, app_info_len + 1);
+
+  for (i = 0; i < proxy_arg_bwrap->argv->len; i++)
+    {
+      const char *arg = g_ptr_array_index (proxy_arg_bwrap->argv, i);
+
+      if (g_str_has_prefix (arg, proxy_socket_prefix))
+        {
+          g_ptr_array_add (sockets, g_strdup (arg));
+          arg = "";
+        }
+
+      g_checksum_update (checksum, (const guchar *) arg, strlen (arg) + 1);
+    }
+
+  key = g_strndup (g_checksum_get_string (checksum), 16);
+
+  if (!glnx_opendirat (AT_FDCWD, proxy_socket_dir, TRUE, &dfd, error))
+    return FALSE;
+
+  /* Serialize instances racing to start or clean up proxies. The lock
+   * is released when dfd is closed. */
+  if (TEMP_FAILURE_RETRY (flock (dfd, LOCK_EX)) != 0)
+    return glnx_throw_errno_prefix (error, "flock(%s)", proxy_socket_dir);
+
+  remove_stale_shared_dbus_proxies (dfd);
+
+  for (i = 0; i < sockets->len; i++)
+    {
+      const char *tmp_socket = g_ptr_array_index (sockets, i);
+      g_autofree char *shared_socket = g_strdup_printf ("%sshared-%s-%u", proxy_socket_prefix, key, i);
+
+      replace_bwrap_arg (proxy_arg_bwrap, tmp_socket, shared_socket);
+      replace_bwrap_arg (app_bwrap, tmp_socket, shared_socket);
+      (void) unlink (tmp_socket);
+    }
+
+  fifo_name = g_strdup_printf ("shared-%s.fifo", key);
+  if (mkfifoat (dfd, fifo_name, 0600) < 0 && errno != EEXIST)
+    return glnx_throw_errno_prefix (error, "mkfifoat(%s)", fifo_name);
+
+  sync_read_fd = openat (dfd, fifo_name, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+  if (sync_read_fd == -1)
+    return glnx_throw_errno_prefix (error, "openat(%s)", fifo_name);
+
+  /* With a running proxy holding the write end this is EAGAIN, if
+   * there is no writer we get EOF and have to start a new proxy. */
+  res = read (sync_read_fd, &x, 1);
+  if (res == 1 || (res < 0 && errno == EAGAIN))
+    {
+      g_debug ("Reusing shared dbus proxy %s", key);
+      flatpak_bwrap_add_args_data_fd (app_bwrap, "--sync-fd", glnx_steal_fd (&sync_read_fd), NULL);
+      return TRUE;
+    }
+
+  /* We hold a read end, so this doesn't block */
+  sync_write_fd = openat (dfd, fifo_name, O_WRONLY | O_CLOEXEC);
+  if (sync_write_fd == -1)
+    return glnx_throw_errno_prefix (error, "openat(%s)", fifo_name);
+
+  fd_flags = fcntl (sync_read_fd, F_GETFL);
+  if (fd_flags == -1 || fcntl (sync_read_fd, F_SETFL, fd_flags & ~O_NONBLOCK) == -1)
+    return glnx_throw_errno_prefix (error, "fcntl");
+
+  g_debug ("Starting shared dbus proxy %s", key);
+
+  if (!spawn_dbus_proxy (proxy_arg_bwrap, app_info_path, sync_read_fd,
+                         glnx_steal_fd (&sync_write_fd), error))
+    return FALSE;
+
+  flatpak_bwrap_add_args_data_fd (app_bwrap, "--sync-fd", glnx_steal_fd (&sync_read_fd), NULL);
+
+  return TRUE;
+}
+
+static gboolean
+start_dbus_proxy (FlatpakBwrap   *app_bwrap,
+                  FlatpakBwrap   *proxy_arg_bwrap,
+                  const char     *app_info_path,
+                  const char     *app_id,
+                  FlatpakRunFlags flags,
+                  GError        **error)
+{
+  int sync_fds[2] = {-1, -1};
+
+  /* Arguments referring to fds can't be compared between instances */
+  if ((flags & FLATPAK_RUN_FLAG_SHARE_DBUS_PROXY) != 0 &&
+      app_id != NULL && proxy_arg_bwrap->fds->len == 0)
+    return start_shared_dbus_proxy (app_bwrap, proxy_arg_bwrap, app_info_path, app_id, error);
+
+  if (pipe2 (sync_fds, O_CLOEXEC) < 0)
+    {
+      g_set_error_literal (error, G_IO_ERROR, g_io_error_from_errno (errno),
+                           _("Unable to create sync pipe"));
+      return FALSE;
+    }
+
+  /* read end goes to app */
+  flatpak_bwrap_add_args_data_fd (app_bwrap, "--sync-fd", sync_fds[0], NULL);
+
+  return spawn_dbus_proxy (proxy_arg_bwrap, app_info_path, sync_fds[0], sync_fds[1], error);
+}
+
 static int
 flatpak_extension_compare_by_path (gconstpointer _a,
                                    gconstpointer _b)
@@ -1806,7 +2034,7 @@ flatpak_run_add_environment_args (FlatpakBwrap    *bwrap,
     }
 
   if (!flatpak_bwrap_is_empty (proxy_arg_bwrap) &&
-      !start_dbus_proxy (bwrap, proxy_arg_bwrap, app_info_path, error))
+      !start_dbus_proxy (bwrap, proxy_arg_bwrap, app_info_path, app_id, flags, error))
     return FALSE;
 
   if (exports_out)
@@ -108,6 +108,7 @@ struct _FlatpakTransactionOperation
   gboolean                        skip;
   gboolean                        update_only_deploy;
   gboolean                        pin_on_deploy;
+  gboolean                        prefetched;
 
   gboolean                        resolved;
   char                           *resolved_commit;
@@ -141,8 +142,9 @@ typedef struct _BundleData                BundleData;
 
 struct _BundleData
 {
-  GFile  *file;
-  GBytes *gpg_data;
+  GFile               *file;
+  GBytes              *gpg_data;
+  FlatpakBundleHeader *header; /* Loaded when resolving */
 };
 
 typedef struct {
@@ -166,6 +168,7 @@ struct _FlatpakTransactionPrivate
   GPtrArray                   *extra_sideload_repos;
   GList                       *ops;
   GPtrArray                   *added_origin_remotes;
+  GPtrArray                   *queued_deploy_ops; /* Ops whose deploy is queued in dir, in order */
 
   GList                       *flatpakrefs; /* GKeyFiles */
   GList                       *bundles; /* BundleData */
@@ -258,6 +261,7 @@ bundle_data_free (BundleData *data)
 {
   g_clear_object (&data->file);
   g_clear_object (&data->gpg_data);
+  g_clear_pointer (&data->header, flatpak_bundle_header_free);
   g_free (data);
 }
 
@@ -1009,6 +1013,7 @@ flatpak_transaction_finalize (GObject *object)
   g_clear_object (&priv->dir);
 
   g_ptr_array_unref (priv->added_origin_remotes);
+  g_ptr_array_unref (priv->queued_deploy_ops);
 
   g_ptr_array_free (priv->extra_dependency_dirs, TRUE);
   g_ptr_array_free (priv->extra_sideload_repos, TRUE);
@@ -1208,6 +1213,10 @@ flatpak_transaction_class_init (FlatpakTransactionClass *klass)
    *
    * The ::operation-done signal gets emitted during the execution of
    * the transaction when an operation is finished.
+   *
+   * For system installations, the installs and updates are deployed
+   * together, so this can come after #FlatpakTransaction::new-operation
+   * has been emitted for later operations.
    */
   signals[OPERATION_DONE] =
     g_signal_new ("operation-done",
@@ -1484,6 +1493,7 @@ flatpak_transaction_init (FlatpakTransaction *self)
   priv->last_op_for_ref = g_hash_table_new_full ((GHashFunc)flatpak_decomposed_hash, (GEqualFunc)flatpak_decomposed_equal, (GDestroyNotify) flatpak_decomposed_unref, NULL);
   priv->remote_states = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, (GDestroyNotify) flatpak_remote_state_unref);
   priv->added_origin_remotes = g_ptr_array_new_with_free_func (g_free);
+  priv->queued_deploy_ops = g_ptr_array_new ();
   priv->extra_dependency_dirs = g_ptr_array_new_with_free_func (g_object_unref);
   priv->extra_sideload_repos = g_ptr_array_new_with_free_func (g_free);
   priv->can_run = TRUE;
@@ -1506,6 +1516,9 @@ initable_init (GInitable    *initable,
   if (dir == NULL)
     return FALSE;
 
+  /* Never resolve operations against a summary that may be outdated */
+  flatpak_dir_set_revalidate_summaries (dir, TRUE);
+
   priv->dir = g_steal_pointer (&dir);
 
   return TRUE;
@@ -2031,6 +2044,79 @@ kind_to_str (FlatpakTransactionOperationType kind)
     }
 }
 
+static void
+cache_remote_state (FlatpakTransaction *self,
+                    FlatpakRemoteState *state)
+{
+  FlatpakTransactionPrivate *priv = flatpak_transaction_get_instance_private (self);
+
+  g_hash_table_insert (priv->remote_states, state->remote_name, flatpak_remote_state_ref (state));
+
+  for (int i = 0; i < priv->extra_sideload_repos->len; i++)
+    {
+      const char *path = g_ptr_array_index (priv->extra_sideload_repos, i);
+      g_autoptr(GFile) f = g_file_new_for_path (path);
+      flatpak_remote_state_add_sideload_dir (state, f);
+    }
+}
+
+/* Gets the state of @remote, and at the same time of all other remotes
+ * that the queued ops will need, so that their summaries are downloaded
+ * in parallel rather than one after the other. */
+static FlatpakRemoteState *
+fetch_remote_states (FlatpakTransaction *self,
+                     const char         *remote,
+                     GError            **error)
+{
+  FlatpakTransactionPrivate *priv = flatpak_transaction_get_instance_private (self);
+  g_autoptr(GPtrArray) fetches = g_ptr_array_new_with_free_func ((GDestroyNotify) flatpak_remote_state_fetch_free);
+  g_autoptr(GHashTable) seen = g_hash_table_new (g_str_hash, g_str_equal);
+  FlatpakRemoteStateFetch *requested;
+  GList *l;
+
+  requested = flatpak_remote_state_fetch_new (priv->dir, remote);
+  g_ptr_array_add (fetches, requested);
+  g_hash_table_add (seen, (char *) remote);
+
+  for (l = priv->ops; l != NULL; l = l->next)
+    {
+      FlatpakTransactionOperation *op = l->data;
+
+      if (op->remote == NULL ||
+          op->kind == FLATPAK_TRANSACTION_OPERATION_UNINSTALL ||
+          op->kind == FLATPAK_TRANSACTION_OPERATION_INSTALL_BUNDLE ||
+          g_hash_table_contains (seen, op->remote) ||
+          g_hash_table_contains (priv->remote_states, op->remote))
+        continue;
+
+      g_hash_table_add (seen, op->remote);
+      g_ptr_array_add (fetches, flatpak_remote_state_fetch_new (priv->dir, op->remote));
+    }
+
+  if (fetches->len > 1)
+    g_debug ("Fetching state of %u remotes in parallel", fetches->len);
+
+  flatpak_remote_states_fetch_optional (fetches, FALSE, NULL);
+
+  /* Failures for the other remotes are reported if and when the ops
+   * that need them ask for the state */
+  for (guint i = 0; i < fetches->len; i++)
+    {
+      FlatpakRemoteStateFetch *fetch = g_ptr_array_index (fetches, i);
+
+      if (fetch->state != NULL)
+        cache_remote_state (self, fetch->state);
+    }
+
+  if (requested->state == NULL)
+    {
+      g_propagate_error (error, g_steal_pointer (&requested->error));
+      return NULL;
+    }
+
+  return flatpak_remote_state_ref (requested->state);
+}
+
 FlatpakRemoteState *
 flatpak_transaction_ensure_remote_state (FlatpakTransaction             *self,
                                          FlatpakTransactionOperationType kind,
@@ -2051,18 +2137,9 @@ flatpak_transaction_ensure_remote_state (FlatpakTransaction             *self,
     state = flatpak_remote_state_ref (cached_state);
   else
     {
-      state = flatpak_dir_get_remote_state_optional (priv->dir, remote, FALSE, NULL, error);
+      state = fetch_remote_states (self, remote, error);
       if (state == NULL)
         return NULL;
-
-      g_hash_table_insert (priv->remote_states, state->remote_name, flatpak_remote_state_ref (state));
-
-      for (int i = 0; i < priv->extra_sideload_repos->len; i++)
-        {
-          const char *path = g_ptr_array_index (priv->extra_sideload_repos, i);
-          g_autoptr(GFile) f = g_file_new_for_path (path);
-          flatpak_remote_state_add_sideload_dir (state, f);
-        }
     }
 
   if (opt_arch != NULL &&
@@ -3109,6 +3186,36 @@ emit_op_done (FlatpakTransaction          *self,
   g_signal_emit (self, signals[OPERATION_DONE], 0, op, commit, details);
 }
 
+/* Reports a finished install or update op */
+static void
+emit_deploy_op_done (FlatpakTransaction          *self,
+                     FlatpakTransactionOperation *op,
+                     FlatpakTransactionResult     details,
+                     gboolean                    *out_needs_prune,
+                     gboolean                    *out_needs_triggers,
+                     gboolean                    *out_needs_cache_drop)
+{
+  FlatpakTransactionPrivate *priv = flatpak_transaction_get_instance_private (self);
+
+  emit_op_done (self, op, details);
+
+  if (op->kind == FLATPAK_TRANSACTION_OPERATION_INSTALL)
+    {
+      /* Normally we don't need to prune after install, because it makes no old objects
+         stale. However if we reinstall, that is not true. */
+      if (!priv->no_pull && priv->reinstall)
+        *out_needs_prune = TRUE;
+
+      if (op->pin_on_deploy)
+        *out_needs_cache_drop = TRUE;
+    }
+  else if (!priv->no_pull)
+    *out_needs_prune = TRUE;
+
+  if (flatpak_decomposed_is_app (op->ref))
+    *out_needs_triggers = TRUE;
+}
+
 static GBytes *
 load_deployed_metadata (FlatpakTransaction *self, FlatpakDecomposed *ref, char **out_commit, char **out_remote)
 {
@@ -3333,16 +3440,102 @@ op_may_need_token (FlatpakTransactionOperation *op)
      op->kind == FLATPAK_TRANSACTION_OPERATION_INSTALL_OR_UPDATE);
 }
 
+#define MAX_PARALLEL_COMMIT_FETCHES 6
+#define MAX_PARALLEL_TRANSACTIONS 4
+
+/* An op that is missing from the summary, so resolve_ops() needs to
+ * load its commit object */
+typedef struct
+{
+  FlatpakTransactionOperation *op;
+  FlatpakRemoteState *state;
+  char *checksum;
+  GFile *sideload_path;
+  GVariant *commit_data;
+  GError *error;
+} CommitFetch;
+
+static void
+commit_fetch_free (CommitFetch *fetch)
+{
+  flatpak_remote_state_unref (fetch->state);
+  g_free (fetch->checksum);
+  g_clear_object (&fetch->sideload_path);
+  g_clear_pointer (&fetch->commit_data, g_variant_unref);
+  g_clear_error (&fetch->error);
+  g_free (fetch);
+}
+
+typedef struct
+{
+  FlatpakDir   *dir;
+  GCancellable *cancellable;
+} CommitFetches;
+
+static void
+commit_fetch_thread (gpointer data,
+                     gpointer user_data)
+{
+  CommitFetch *fetch = data;
+  CommitFetches *fetches = user_data;
+
+  /* Note, we don't have a token here, so this will not work for authenticated apps.
+   * The caller handles this by catching the 401 http status and retrying. */
+  fetch->commit_data = flatpak_remote_state_load_ref_commit (fetch->state, fetches->dir,
+                                                             flatpak_decomposed_get_ref (fetch->op->ref),
+                                                             fetch->checksum, /* initially NULL */ fetch->op->resolved_token,
+                                                             NULL, fetches->cancellable, &fetch->error);
+}
+
+/* Loads the commit objects for all the @fetches. Most of them are
+ * typically not available locally, and each download is a separate
+ * round-trip to the remote, so they are done in parallel rather than
+ * one op at a time. */
+static void
+fetch_commits (FlatpakTransaction *self,
+               GPtrArray          *fetches,
+               GCancellable       *cancellable)
+{
+  FlatpakTransactionPrivate *priv = flatpak_transaction_get_instance_private (self);
+  CommitFetches data = { priv->dir, cancellable };
+  GThreadPool *pool;
+  guint i;
+
+  if (fetches->len == 0)
+    return;
+
+  g_debug ("Fetching %u commit objects", fetches->len);
+
+  if (fetches->len == 1)
+    {
+      commit_fetch_thread (g_ptr_array_index (fetches, 0), &data);
+      return;
+    }
+
+  pool = g_thread_pool_new (commit_fetch_thread, &data,
+                            MIN (fetches->len, MAX_PARALLEL_COMMIT_FETCHES),
+                            FALSE, NULL);
+  for (i = 0; i < fetches->len; i++)
+    g_thread_pool_push (pool, g_ptr_array_index (fetches, i), NULL);
+
+  /* Wait for all the fetches to finish */
+  g_thread_pool_free (pool, FALSE, TRUE);
+}
+
 /* Resolving an operation means figuring out the target commit
    checksum and the metadata for that commit, so that we can handle
-   dependencies from it, and verify versions. */
+   dependencies from it, and verify versions. Ops that need their
+   commit object downloaded are collected and fetched together at the
+   end. */
 static gboolean
 resolve_ops (FlatpakTransaction *self,
              GCancellable       *cancellable,
              GError            **error)
 {
   FlatpakTransactionPrivate *priv = flatpak_transaction_get_instance_private (self);
+  g_autoptr(GPtrArray) fetches = g_ptr_array_new_with_free_func ((GDestroyNotify) commit_fetch_free);
   GList *l;
+  guint i;
 
   for (l = priv->ops; l != NULL; l = l->next)
     {
@@ -3486,10 +3679,8 @@ resolve_ops (FlatpakTransaction *self,
                   return FALSE;
                 }
 
-              /* Missing from summary, try to load the commit object.
-               * Note, we don't have a token here, so this will not work for authenticated apps.
-               * We handle this by catching the 401 http status and retrying. */
-              g_autoptr(GVariant) commit_data = NULL;
+              /* Missing from summary, load the commit object below */
+              CommitFetch *fetch;
               VarRefInfoRef ref_info;
 
               /* OCI needs this to get the oci repository for the ref to request the token, so lets always set it here */
@@ -3498,34 +3689,42 @@ resolve_ops (FlatpakTransaction *self,
                                                    NULL, NULL, &ref_info, NULL, NULL))
                 op->summary_metadata = var_metadata_dup_to_gvariant (var_ref_info_get_metadata (ref_info));
 
-              commit_data = flatpak_remote_state_load_ref_commit (state, priv->dir,
-                                                                  flatpak_decomposed_get_ref (op->ref),
-                                                                  checksum, /* initially NULL */ op->resolved_token,
-                                                                  NULL, NULL, &local_error);
-              if (commit_data == NULL)
-                {
-                  if (g_error_matches (local_error, FLATPAK_HTTP_ERROR, FLATPAK_HTTP_ERROR_UNAUTHORIZED) && !op->requested_token)
-                    {
+              fetch = g_new0 (CommitFetch, 1);
+              fetch->op = op;
+              fetch->state = flatpak_remote_state_ref (state);
+              fetch->checksum = g_steal_pointer (&checksum);
+              fetch->sideload_path = g_steal_pointer (&sideload_path);
+              g_ptr_array_add (fetches, fetch);
+            }
+        }
+    }
 
-                      g_debug ("Unauthorized access during resolve by commit of %s, retrying with token", flatpak_decomposed_get_ref (op->ref));
-                      priv->needs_resolve = TRUE;
-                      priv->needs_tokens = TRUE;
+  fetch_commits (self, fetches, cancellable);
 
-                      /* Token type maxint32 means we don't know the type */
-                      op->token_type = G_MAXINT32;
-                      op->resolved_commit = g_strdup (checksum);
+  for (i = 0; i < fetches->len; i++)
+    {
+      CommitFetch *fetch = g_ptr_array_index (fetches, i);
+      FlatpakTransactionOperation *op = fetch->op;
 
-                      g_clear_error (&local_error);
-                      continue;
-                    }
-                  g_propagate_error (error, g_steal_pointer (&local_error));
-                  return FALSE;
-                }
+      if (fetch->commit_data == NULL)
+        {
+          if (g_error_matches (fetch->error, FLATPAK_HTTP_ERROR, FLATPAK_HTTP_ERROR_UNAUTHORIZED) && !op->requested_token)
+            {
+              g_debug ("Unauthorized access during resolve by commit of %s, retrying with token", flatpak_decomposed_get_ref (op->ref));
+              priv->needs_resolve = TRUE;
+              priv->needs_tokens = TRUE;
 
-              if (!resolve_op_from_commit (self, op, checksum, sideload_path, commit_data, error))
-                return FALSE;
+              /* Token type maxint32 means we don't know the type */
+              op->token_type = G_MAXINT32;
+              op->resolved_commit = g_strdup (fetch->checksum);
+              continue;
             }
+          g_propagate_error (error, g_steal_pointer (&fetch->error));
+          return FALSE;
         }
+
+      if (!resolve_op_from_commit (self, op, fetch->checksum, fetch->sideload_path, fetch->commit_data, error))
+        return FALSE;
     }
 
   return TRUE;
@@ -4409,33 +4608,25 @@ flatpak_transaction_resolve_flatpakrefs (FlatpakTransaction *self,
 }
 
 static gboolean
-handle_runtime_repo_deps_from_bundle (FlatpakTransaction *self,
-                                      GFile              *file,
-                                      GCancellable       *cancellable,
-                                      GError            **error)
+handle_runtime_repo_deps_from_bundle (FlatpakTransaction  *self,
+                                      FlatpakBundleHeader *header,
+                                      GCancellable        *cancellable,
+                                      GError             **error)
 {
   FlatpakTransactionPrivate *priv = flatpak_transaction_get_instance_private (self);
-  g_autofree char *dep_url = NULL;
+  const char *dep_url = header->runtime_repo;
   g_autoptr(FlatpakDecomposed) ref = NULL;
-  g_autoptr(GVariant) metadata = NULL;
   g_autoptr(GKeyFile) runtime_repo_keyfile = NULL;
   g_autofree char *id = NULL;
 
   if (priv->disable_deps)
     return TRUE;
 
-  metadata = flatpak_bundle_load (file,
-                                  NULL,
-                                  &ref,
-                                  NULL,
-                                  &dep_url,
-                                  NULL,
-                                  NULL,
-                                  NULL,
-                                  NULL,
-                                  NULL);
-
-  if (metadata == NULL || dep_url == NULL || ref == NULL)
+  if (dep_url == NULL || header->ref == NULL)
+    return TRUE;
+
+  ref = flatpak_decomposed_new_from_ref (header->ref, NULL);
+  if (ref == NULL)
     return TRUE;
 
   id = flatpak_decomposed_dup_id (ref);
@@ -4463,13 +4654,21 @@ flatpak_transaction_resolve_bundles (FlatpakTransaction *self,
       g_autoptr(FlatpakDecomposed) ref = NULL;
       gboolean created_remote;
 
-      if (!handle_runtime_repo_deps_from_bundle (self, data->file, cancellable, error))
+      /* Parse the bundle header once; it is reused when installing */
+      if (data->header == NULL)
+        {
+          data->header = flatpak_bundle_header_load (data->file, error);
+          if (data->header == NULL)
+            return FALSE;
+        }
+
+      if (!handle_runtime_repo_deps_from_bundle (self, data->header, cancellable, error))
         return FALSE;
 
       if (!flatpak_dir_ensure_repo (priv->dir, cancellable, error))
         return FALSE;
 
-      remote = flatpak_dir_ensure_bundle_remote (priv->dir, data->file, data->gpg_data,
+      remote = flatpak_dir_ensure_bundle_remote (priv->dir, data->file, data->header, data->gpg_data,
                                                  &ref, &commit, &metadata, &created_remote,
                                                  NULL, error);
       if (remote == NULL)
@@ -4516,6 +4715,302 @@ flatpak_transaction_run (FlatpakTransaction *transaction,
   return FLATPAK_TRANSACTION_GET_CLASS (transaction)->run (transaction, cancellable, error);
 }
 
+typedef struct
+{
+  FlatpakTransaction *transaction;
+  GPtrArray          *waits_for; /* (element-type ParallelRun) */
+  gboolean            scheduled;
+  gboolean            done;
+  gboolean            res;
+  GError             *error;
+} ParallelRun;
+
+typedef struct
+{
+  GMutex        lock;
+  GCond         cond;
+  GCancellable *cancellable;
+} ParallelRuns;
+
+static void
+parallel_run_free (ParallelRun *run)
+{
+  g_ptr_array_unref (run->waits_for);
+  g_clear_error (&run->error);
+  g_free (run);
+}
+
+/* Whether @self uses the installation of @other as a dependency source */
+static gboolean
+transaction_depends_on (FlatpakTransaction *self,
+                        FlatpakTransaction *other)
+{
+  FlatpakTransactionPrivate *priv = flatpak_transaction_get_instance_private (self);
+  FlatpakTransactionPrivate *other_priv = flatpak_transaction_get_instance_private (other);
+  GFile *other_path = flatpak_dir_get_path (other_priv->dir);
+  guint i;
+
+  for (i = 0; i < priv->extra_dependency_dirs->len; i++)
+    {
+      FlatpakDir *dependency_dir = g_ptr_array_index (priv->extra_dependency_dirs, i);
+
+      if (g_file_equal (flatpak_dir_get_path (dependency_dir), other_path))
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+static void
+parallel_run_thread (gpointer data,
+                     gpointer user_data)
+{
+  ParallelRun *run = data;
+  ParallelRuns *runs = user_data;
+  g_autoptr(GMainContextPopDefault) context = NULL;
+  guint i;
+
+  g_mutex_lock (&runs->lock);
+  for (i = 0; i < run->waits_for->len; i++)
+    {
+      ParallelRun *other = g_ptr_array_index (run->waits_for, i);
+
+      while (!other->done)
+        g_cond_wait (&runs->cond, &runs->lock);
+    }
+  g_mutex_unlock (&runs->lock);
+
+  /* Keep any sources the transaction adds away from the caller's context */
+  context = flatpak_main_context_new_default ();
+
+  run->res = flatpak_transaction_run (run->transaction, runs->cancellable, &run->error);
+
+  g_mutex_lock (&runs->lock);
+  run->done = TRUE;
+  g_cond_broadcast (&runs->cond);
+  g_mutex_unlock (&runs->lock);
+}
+
+/**
+ * flatpak_transaction_run_parallel:
+ * @transactions: (element-type FlatpakTransaction): the transactions to run
+ * @cancellable: (nullable): a #GCancellable
+ * @error: return location for an error
+ *
+ * Executes several transactions, typically for different installations,
+ * at the same time. Each transaction is run in its own thread, as if by
+ * flatpak_transaction_run(), so its signals are emitted in that thread.
+ *
+ * A transaction that uses the installation of another one as a
+ * dependency source (see flatpak_transaction_add_dependency_source())
+ * is only started once that one is done, so it sees the result of it.
+ * Installations that are dependency sources of each other, such as
+ * several system-wide installations, are updated concurrently.
+ *
+ * The transactions share the downloaded summaries and HTTP connections
+ * of the remotes they have in common.
+ *
+ * All transactions are executed even if some of them fail, in which
+ * case the error of the first failing one is returned.
+ *
+ * Returns: %TRUE if all transactions succeeded, %FALSE otherwise
+ *
+ * Since: 1.13.3
+ */
+gboolean
+flatpak_transaction_run_parallel (GPtrArray    *transactions,
+                                  GCancellable *cancellable,
+                                  GError      **error)
+{
+  g_autoptr(GPtrArray) runs = g_ptr_array_new_with_free_func ((GDestroyNotify) parallel_run_free);
+  g_autoptr(GPtrArray) order = g_ptr_array_new ();
+  g_autoptr(GError) first_error = NULL;
+  ParallelRuns data = { { 0 }, };
+  FlatpakTransactionPrivate *first_priv;
+  GThreadPool *pool;
+  gboolean res = TRUE;
+  guint i, j;
+
+  if (transactions->len == 0)
+    return TRUE;
+
+  if (transactions->len == 1)
+    return flatpak_transaction_run (g_ptr_array_index (transactions, 0), cancellable, error);
+
+  first_priv = flatpak_transaction_get_instance_private (g_ptr_array_index (transactions, 0));
+
+  for (i = 0; i < transactions->len; i++)
+    {
+      FlatpakTransaction *transaction = g_ptr_array_index (transactions, i);
+      FlatpakTransactionPrivate *priv = flatpak_transaction_get_instance_private (transaction);
+      ParallelRun *run = g_new0 (ParallelRun, 1);
+
+      run->transaction = transaction;
+      run->waits_for = g_ptr_array_new ();
+      g_ptr_array_add (runs, run);
+
+      flatpak_dir_share_remote_caches (priv->dir, first_priv->dir);
+    }
+
+  /* Only one-way dependencies are ordered, mutual ones just mean that
+   * the installations can use each other's runtimes */
+  for (i = 0; i < runs->len; i++)
+    {
+      ParallelRun *run = g_ptr_array_index (runs, i);
+
+      for (j = 0; j < runs->len; j++)
+        {
+          ParallelRun *other = g_ptr_array_index (runs, j);
+
+          if (i != j &&
+              transaction_depends_on (run->transaction, other->transaction) &&
+              !transaction_depends_on (other->transaction, run->transaction))
+            g_ptr_array_add (run->waits_for, other);
+        }
+    }
+
+  /* Queue the transactions so that the ones waited for come first, that
+   * way a waiting thread never holds up one it waits for */
+  while (order->len < runs->len)
+    {
+      gboolean progress = FALSE;
+
+      for (i = 0; i < runs->len; i++)
+        {
+          ParallelRun *run = g_ptr_array_index (runs, i);
+          gboolean ready = TRUE;
+
+          if (run->scheduled)
+            continue;
+
+          for (j = 0; j < run->waits_for->len && ready; j++)
+            ready = ((ParallelRun *) g_ptr_array_index (run->waits_for, j))->scheduled;
+
+          if (ready)
+            {
+              run->scheduled = TRUE;
+              g_ptr_array_add (order, run);
+              progress = TRUE;
+            }
+        }
+
+      /* A dependency loop, just run the rest in any order */
+      if (!progress)
+        for (i = 0; i < runs->len; i++)
+          {
+            ParallelRun *run = g_ptr_array_index (runs, i);
+
+            if (!run->scheduled)
+              {
+                g_ptr_array_set_size (run->waits_for, 0);
+                run->scheduled = TRUE;
+                g_ptr_array_add (order, run);
+              }
+          }
+    }
+
+  g_mutex_init (&data.lock);
+  g_cond_init (&data.cond);
+  data.cancellable = cancellable;
+
+  pool = g_thread_pool_new (parallel_run_thread, &data,
+                            MIN (runs->len, MAX_PARALLEL_TRANSACTIONS),
+                            FALSE, NULL);
+  for (i = 0; i < order->len; i++)
+    g_thread_pool_push (pool, g_ptr_array_index (order, i), NULL);
+
+  /* Wait for all the transactions to finish */
+  g_thread_pool_free (pool, FALSE, TRUE);
+
+  g_mutex_clear (&data.lock);
+  g_cond_clear (&data.cond);
+
+  for (i = 0; i < runs->len; i++)
+    {
+      ParallelRun *run = g_ptr_array_index (runs, i);
+
+      if (run->res)
+        continue;
+
+      /* Some transactions report errors themselves and return none */
+      if (first_error == NULL)
+        first_error = g_steal_pointer (&run->error);
+      res = FALSE;
+    }
+
+  if (first_error != NULL)
+    g_propagate_error (error, g_steal_pointer (&first_error));
+
+  return res;
+}
+
+/* Whether @op can be part of a combined pull, see flatpak_dir_prefetch_commits() */
+static gboolean
+op_can_prefetch (FlatpakTransactionOperation *op)
+{
+  return op->kind == FLATPAK_TRANSACTION_OPERATION_INSTALL &&
+         !op->skip &&
+         !op->prefetched &&
+         op->remote != NULL &&
+         op->resolved_commit != NULL &&
+         op->resolved_sideload_path == NULL &&
+         op->resolved_token == NULL &&
+         (op->subpaths == NULL || op->subpaths[0] == NULL);
+}
+
+/* Installing an app typically also installs its runtime and a few
+ * extensions from the same remote, which often have many files in
+ * common. Rather than pulling them one by one, the first of them pulls
+ * the objects of all of them at once, with its progress covering the
+ * whole download, and the later ops then find everything locally.
+ * Failures are ignored, the regular pulls will report them. */
+static void
+prefetch_install_ops (FlatpakTransaction          *self,
+                      FlatpakTransactionOperation *first_op,
+                      FlatpakRemoteState          *state,
+                      FlatpakTransactionProgress  *progress,
+                      GCancellable                *cancellable)
+{
+  FlatpakTransactionPrivate *priv = flatpak_transaction_get_instance_private (self);
+  g_autoptr(GPtrArray) refs = NULL;
+  g_autoptr(GPtrArray) revs = NULL;
+  g_autoptr(GError) local_error = NULL;
+  GList *l;
+
+  if (priv->no_pull || !op_can_prefetch (first_op))
+    return;
+
+  refs = g_ptr_array_new ();
+  revs = g_ptr_array_new ();
+
+  for (l = g_list_find (priv->ops, first_op); l != NULL; l = l->next)
+    {
+      FlatpakTransactionOperation *op = l->data;
+
+      if (!op_can_prefetch (op) || strcmp (op->remote, first_op->remote) != 0)
+        continue;
+
+      op->prefetched = TRUE;
+      g_ptr_array_add (refs, (char *) flatpak_decomposed_get_ref (op->ref));
+      g_ptr_array_add (revs, op->resolved_commit);
+    }
+
+  /* A single op gains nothing over its own pull */
+  if (revs->len < 2)
+    return;
+
+  g_ptr_array_add (refs, NULL);
+  g_ptr_array_add (revs, NULL);
+
+  if (!flatpak_dir_prefetch_commits (priv->dir, state,
+                                     (const char * const *) refs->pdata,
+                                     (const char * const *) revs->pdata,
+                                     priv->disable_static_deltas ? FLATPAK_PULL_FLAGS_NO_STATIC_DELTAS : FLATPAK_PULL_FLAGS_NONE,
+                                     progress->progress_obj,
+                                     cancellable, &local_error))
+    g_debug ("Failed to prefetch commits from %s: %s", first_op->remote, local_error->message);
+}
+
 static gboolean
 _run_op_kind (FlatpakTransaction           *self,
               FlatpakTransactionOperation  *op,
@@ -4536,31 +5031,38 @@ _run_op_kind (FlatpakTransaction           *self,
       g_autoptr(FlatpakTransactionProgress) progress = flatpak_transaction_progress_new ();
       FlatpakTransactionResult result_details = 0;
       g_autoptr(GError) local_error = NULL;
+      guint n_queued;
 
       emit_new_op (self, op, progress);
 
       g_assert (op->resolved_commit != NULL); /* We resolved this before */
 
+      n_queued = flatpak_dir_get_n_queued_deploys (priv->dir);
+
       if (op->resolved_metakey && !flatpak_check_required_version (flatpak_decomposed_get_ref (op->ref),
                                                                    op->resolved_metakey, &local_error))
         res = FALSE;
       else
-        res = flatpak_dir_install (priv->dir,
-                                   priv->no_pull,
-                                   priv->no_deploy,
-                                   priv->disable_static_deltas,
-                                   priv->reinstall,
-                                   priv->max_op >= APP_UPDATE,
-                                   op->pin_on_deploy,
-                                   remote_state, op->ref,
-                                   op->resolved_commit,
-                                   (const char **) op->subpaths,
-                                   (const char **) op->previous_ids,
-                                   op->resolved_sideload_path,
-                                   op->resolved_metadata,
-                                   op->resolved_token,
-                                   progress->progress_obj,
-                                   cancellable, &local_error);
+        {
+          prefetch_install_ops (self, op, remote_state, progress, cancellable);
+
+          res = flatpak_dir_install (priv->dir,
+                                     priv->no_pull,
+                                     priv->no_deploy,
+                                     priv->disable_static_deltas,
+                                     priv->reinstall,
+                                     priv->max_op >= APP_UPDATE,
+                                     op->pin_on_deploy,
+                                     remote_state, op->ref,
+                                     op->resolved_commit,
+                                     (const char **) op->subpaths,
+                                     (const char **) op->previous_ids,
+                                     op->resolved_sideload_path,
+                                     op->resolved_metadata,
+                                     op->resolved_token,
+                                     progress->progress_obj,
+                                     cancellable, &local_error);
+        }
 
       flatpak_transaction_progress_done (progress);
 
@@ -4578,21 +5080,12 @@ _run_op_kind (FlatpakTransaction           *self,
           g_propagate_error (error, g_steal_pointer (&local_error));
         }
 
-      if (res)
-        {
-          emit_op_done (self, op, result_details);
-
-          /* Normally we don't need to prune after install, because it makes no old objects
-             stale. However if we reinstall, that is not true. */
-          if (!priv->no_pull && priv->reinstall)
-            *out_needs_prune = TRUE;
-
-          if (flatpak_decomposed_is_app (op->ref))
-            *out_needs_triggers = TRUE;
-
-          if (op->pin_on_deploy)
-            *out_needs_cache_drop = TRUE;
-        }
+      /* The deploy was queued, it is reported by flush_queued_deploys() */
+      if (res && flatpak_dir_get_n_queued_deploys (priv->dir) > n_queued)
+        g_ptr_array_add (priv->queued_deploy_ops, op);
+      else if (res)
+        emit_deploy_op_done (self, op, result_details,
+                             out_needs_prune, out_needs_triggers, out_needs_cache_drop);
     }
   else if (op->kind == FLATPAK_TRANSACTION_OPERATION_UPDATE)
     {
@@ -4604,6 +5097,7 @@ _run_op_kind (FlatpakTransaction           *self,
           g_autoptr(FlatpakTransactionProgress) progress = flatpak_transaction_progress_new ();
           FlatpakTransactionResult result_details = 0;
           g_autoptr(GError) local_error = NULL;
+          guint n_queued = flatpak_dir_get_n_queued_deploys (priv->dir);
 
           emit_new_op (self, op, progress);
 
@@ -4649,16 +5143,11 @@ _run_op_kind (FlatpakTransaction           *self,
               g_propagate_error (error, g_steal_pointer (&local_error));
             }
 
-          if (res)
-            {
-              emit_op_done (self, op, result_details);
-
-              if (!priv->no_pull)
-                *out_needs_prune = TRUE;
-
-              if (flatpak_decomposed_is_app (op->ref))
-                *out_needs_triggers = TRUE;
-            }
+          if (res && flatpak_dir_get_n_queued_deploys (priv->dir) > n_queued)
+            g_ptr_array_add (priv->queued_deploy_ops, op);
+          else if (res)
+            emit_deploy_op_done (self, op, result_details,
+                                 out_needs_prune, out_needs_triggers, out_needs_cache_drop);
         }
       else
         g_debug ("%s need no update", flatpak_decomposed_get_ref (op->ref));
@@ -4666,13 +5155,28 @@ _run_op_kind (FlatpakTransaction           *self,
   else if (op->kind == FLATPAK_TRANSACTION_OPERATION_INSTALL_BUNDLE)
     {
       g_autoptr(FlatpakTransactionProgress) progress = flatpak_transaction_progress_new ();
+      FlatpakBundleHeader *header = NULL;
+      GList *l;
+
+      for (l = priv->bundles; l != NULL; l = l->next)
+        {
+          BundleData *data = l->data;
+
+          if (g_file_equal (data->file, op->bundle))
+            {
+              header = data->header;
+              break;
+            }
+        }
+
       emit_new_op (self, op, progress);
       if (op->resolved_metakey && !flatpak_check_required_version (flatpak_decomposed_get_ref (op->ref),
                                                                    op->resolved_metakey, error))
         res = FALSE;
       else
-        res = flatpak_dir_install_bundle (priv->dir, op->bundle,
+        res = flatpak_dir_install_bundle (priv->dir, op->bundle, header,
                                           op->remote, NULL,
+                                          progress->progress_obj,
                                           cancellable, error);
       flatpak_transaction_progress_done (progress);
 
@@ -4876,6 +5380,155 @@ add_uninstall_unused_ops (FlatpakTransaction  *self,
   return TRUE;
 }
 
+static gboolean
+op_is_skipped_by_failure (FlatpakTransactionOperation *op)
+{
+  return op->fail_if_op_fails && op->fail_if_op_fails->failed &&
+         /* Allow installing an app if the runtime failed to update (i.e. is installed) because
+          * the app should still run, and otherwise you could never install the app until the runtime
+          * remote is fixed. */
+         !(op->fail_if_op_fails->kind == FLATPAK_TRANSACTION_OPERATION_UPDATE &&
+           flatpak_decomposed_is_app (op->ref));
+}
+
+static void
+emit_eol_if_needed (FlatpakTransaction          *self,
+                    FlatpakTransactionOperation *op)
+{
+  FlatpakTransactionPrivate *priv = flatpak_transaction_get_instance_private (self);
+  g_autoptr(GBytes) deploy_data = NULL;
+
+  /* deploy v4 guarantees eol/eolr info */
+  deploy_data = flatpak_dir_get_deploy_data (priv->dir, op->ref, 4, NULL, NULL);
+
+  if (deploy_data)
+    {
+      const char *eol =  flatpak_deploy_data_get_eol (deploy_data);
+      const char *eol_rebase = flatpak_deploy_data_get_eol_rebase (deploy_data);
+
+      if (eol || eol_rebase)
+        g_signal_emit (self, signals[END_OF_LIFED], 0,
+                       flatpak_decomposed_get_ref (op->ref), eol, eol_rebase);
+    }
+}
+
+/* Reports a failed op, returns FALSE if the transaction should stop */
+static gboolean
+handle_op_error (FlatpakTransaction          *self,
+                 FlatpakTransactionOperation *op,
+                 GError                      *op_error,
+                 GCancellable                *cancellable,
+                 GError                     **error)
+{
+  gboolean do_cont = FALSE;
+  FlatpakTransactionErrorDetails error_details = 0;
+
+  op->failed = TRUE;
+
+  if (op->non_fatal)
+    error_details |= FLATPAK_TRANSACTION_ERROR_DETAILS_NON_FATAL;
+
+  g_signal_emit (self, signals[OPERATION_ERROR], 0, op,
+                 op_error, error_details,
+                 &do_cont);
+
+  if (!do_cont)
+    {
+      if (g_cancellable_set_error_if_cancelled (cancellable, error))
+        return FALSE;
+
+      return flatpak_fail_error (error, FLATPAK_ERROR_ABORTED, _("Aborted due to failure (%s)"), op_error->message);
+    }
+
+  return TRUE;
+}
+
+/* Throws away the queued deploys after the transaction was aborted */
+static void
+drop_queued_deploys (FlatpakTransaction *self)
+{
+  FlatpakTransactionPrivate *priv = flatpak_transaction_get_instance_private (self);
+
+  while (priv->queued_deploy_ops->len > 0)
+    {
+      flatpak_dir_drop_queued_deploy (priv->dir, 0);
+      g_ptr_array_remove_index (priv->queued_deploy_ops, 0);
+    }
+}
+
+/* Deploys the queued ops and reports them, in order. Returns FALSE if
+ * the transaction should stop, and then nothing stays queued. */
+static gboolean
+flush_queued_deploys (FlatpakTransaction *self,
+                      gboolean           *out_needs_prune,
+                      gboolean           *out_needs_triggers,
+                      gboolean           *out_needs_cache_drop,
+                      GCancellable       *cancellable,
+                      GError            **error)
+{
+  FlatpakTransactionPrivate *priv = flatpak_transaction_get_instance_private (self);
+
+  g_assert (priv->queued_deploy_ops->len == flatpak_dir_get_n_queued_deploys (priv->dir));
+
+  while (priv->queued_deploy_ops->len > 0)
+    {
+      FlatpakTransactionOperation *op = g_ptr_array_index (priv->queued_deploy_ops, 0);
+      g_autoptr(GPtrArray) results = NULL;
+      guint i;
+
+      priv->current_op = op;
+
+      /* A deploy that this op needs failed */
+      if (op_is_skipped_by_failure (op))
+        {
+          g_autoptr(GError) local_error = NULL;
+
+          flatpak_dir_drop_queued_deploy (priv->dir, 0);
+          g_ptr_array_remove_index (priv->queued_deploy_ops, 0);
+
+          flatpak_fail_error (&local_error, FLATPAK_ERROR_SKIPPED,
+                              _("Skipping %s due to previous error"),
+                              flatpak_decomposed_get_pref (op->ref));
+          if (!handle_op_error (self, op, local_error, cancellable, error))
+            {
+              drop_queued_deploys (self);
+              return FALSE;
+            }
+
+          continue;
+        }
+
+      results = flatpak_dir_deploy_queued (priv->dir, cancellable);
+
+      for (i = 0; i < results->len; i++)
+        {
+          GError *deploy_error = g_ptr_array_index (results, i);
+
+          op = g_ptr_array_index (priv->queued_deploy_ops, i);
+          priv->current_op = op;
+
+          if (deploy_error == NULL ||
+              g_error_matches (deploy_error, FLATPAK_ERROR, FLATPAK_ERROR_ALREADY_INSTALLED))
+            {
+              emit_deploy_op_done (self, op,
+                                   deploy_error != NULL ? FLATPAK_TRANSACTION_RESULT_NO_CHANGE : 0,
+                                   out_needs_prune, out_needs_triggers, out_needs_cache_drop);
+              emit_eol_if_needed (self, op);
+            }
+          else if (!handle_op_error (self, op, deploy_error, cancellable, error))
+            {
+              g_ptr_array_remove_range (priv->queued_deploy_ops, 0, results->len);
+              drop_queued_deploys (self);
+              return FALSE;
+            }
+        }
+
+      g_ptr_array_remove_range (priv->queued_deploy_ops, 0, results->len);
+    }
+
+  return TRUE;
+}
+
 static gboolean
 flatpak_transaction_real_run (FlatpakTransaction *self,
                               GCancellable       *cancellable,
@@ -5013,30 +5666,39 @@ flatpak_transaction_real_run (FlatpakTransaction *self,
   if (!ready_res)
     return flatpak_fail_error (error, FLATPAK_ERROR_ABORTED, _("Aborted by user"));
 
+  /* System installations deploy through the system helper; queue the
+   * deploys so that consecutive ones are done with a single call, and
+   * authorized once. */
+  flatpak_dir_begin_deploy_batch (priv->dir);
+
   for (l = priv->ops; l != NULL; l = l->next)
     {
       FlatpakTransactionOperation *op = l->data;
       g_autoptr(GError) local_error = NULL;
       gboolean res = TRUE;
-      const char *pref;
       g_autoptr(FlatpakRemoteState) state = NULL;
 
       if (op->skip)
         continue;
 
-      priv->current_op = op;
+      /* Only installs and updates can be queued, anything else has to see
+       * the earlier deploys done */
+      if (!(op->kind == FLATPAK_TRANSACTION_OPERATION_INSTALL ||
+            (op->kind == FLATPAK_TRANSACTION_OPERATION_UPDATE && !op->update_only_deploy)) &&
+          !flush_queued_deploys (self, &needs_prune, &needs_triggers, &needs_cache_drop,
+                                 cancellable, error))
+        {
+          succeeded = FALSE;
+          break;
+        }
 
-      pref = flatpak_decomposed_get_pref (op->ref);
+      priv->current_op = op;
 
-      if (op->fail_if_op_fails && (op->fail_if_op_fails->failed) &&
-          /* Allow installing an app if the runtime failed to update (i.e. is installed) because
-           * the app should still run, and otherwise you could never install the app until the runtime
-           * remote is fixed. */
-          !(op->fail_if_op_fails->kind == FLATPAK_TRANSACTION_OPERATION_UPDATE &&
-            flatpak_decomposed_is_app (op->ref)))
+      if (op_is_skipped_by_failure (op))
         {
           flatpak_fail_error (&local_error, FLATPAK_ERROR_SKIPPED,
-                              _("Skipping %s due to previous error"), pref);
+                              _("Skipping %s due to previous error"),
+                              flatpak_decomposed_get_pref (op->ref));
           res = FALSE;
         }
       else if (op->kind != FLATPAK_TRANSACTION_OPERATION_UNINSTALL &&
@@ -5053,49 +5715,38 @@ flatpak_transaction_real_run (FlatpakTransaction *self,
 
       if (res)
         {
-          g_autoptr(GBytes) deploy_data = NULL;
-          /* deploy v4 guarantees eol/eolr info */
-          deploy_data = flatpak_dir_get_deploy_data (priv->dir, op->ref, 4, NULL, NULL);
-
-          if (deploy_data)
-            {
-              const char *eol =  flatpak_deploy_data_get_eol (deploy_data);
-              const char *eol_rebase = flatpak_deploy_data_get_eol_rebase (deploy_data);
-
-              if (eol || eol_rebase)
-                g_signal_emit (self, signals[END_OF_LIFED], 0,
-                               flatpak_decomposed_get_ref (op->ref), eol, eol_rebase);
-            }
+          /* Queued ops are reported when they are deployed */
+          if (priv->queued_deploy_ops->len == 0 ||
+              g_ptr_array_index (priv->queued_deploy_ops, priv->queued_deploy_ops->len - 1) != op)
+            emit_eol_if_needed (self, op);
         }
-
-      if (!res)
+      else if (!handle_op_error (self, op, local_error, cancellable, error))
         {
-          gboolean do_cont = FALSE;
-          FlatpakTransactionErrorDetails error_details = 0;
-
-          op->failed = TRUE;
+          succeeded = FALSE;
+          break;
+        }
+    }
 
-          if (op->non_fatal)
-            error_details |= FLATPAK_TRANSACTION_ERROR_DETAILS_NON_FATAL;
+  if (succeeded)
+    {
+      if (!flush_queued_deploys (self, &needs_prune, &needs_triggers, &needs_cache_drop,
+                                 cancellable, error))
+        succeeded = FALSE;
+    }
+  else if (!g_cancellable_is_cancelled (cancellable))
+    {
+      g_autoptr(GError) flush_error = NULL;
 
-          g_signal_emit (self, signals[OPERATION_ERROR], 0, op,
-                         local_error, error_details,
-                         &do_cont);
+      /* The ops that were pulled before the failure still get deployed,
+       * as they would have been without the batch */
+      flush_queued_deploys (self, &needs_prune, &needs_triggers, &needs_cache_drop,
+                            cancellable, &flush_error);
+    }
 
-          if (!do_cont)
-            {
-              if (g_cancellable_set_error_if_cancelled (cancellable, error))
-                {
-                  succeeded = FALSE;
-                  break;
-                }
+  /* Anything still queued was aborted */
+  flatpak_dir_end_deploy_batch (priv->dir);
+  g_ptr_array_set_size (priv->queued_deploy_ops, 0);
 
-              flatpak_fail_error (error, FLATPAK_ERROR_ABORTED, _("Aborted due to failure (%s)"), local_error->message);
-              succeeded = FALSE;
-              break;
-            }
-        }
-    }
   priv->current_op = NULL;
 
   if (needs_triggers)
@@ -278,6 +278,10 @@ gboolean            flatpak_transaction_run (FlatpakTransaction *transaction,
                                              GCancellable       *cancellable,
                                              GError            **error);
 FLATPAK_EXTERN
+gboolean            flatpak_transaction_run_parallel (GPtrArray    *transactions,
+                                                      GCancellable *cancellable,
+                                                      GError      **error);
+FLATPAK_EXTERN
 FlatpakTransactionOperation *flatpak_transaction_get_current_operation (FlatpakTransaction *self);
 FLATPAK_EXTERN
 FlatpakInstallation *flatpak_transaction_get_installation (FlatpakTransaction *self);
@@ -28,6 +28,7 @@
 typedef enum {
   FLATPAK_HTTP_ERROR_NOT_CHANGED = 0,
   FLATPAK_HTTP_ERROR_UNAUTHORIZED = 1,
+  FLATPAK_HTTP_ERROR_RANGE_NOT_SATISFIABLE = 2,
 } FlatpakHttpErrorEnum;
 
 #define FLATPAK_HTTP_ERROR flatpak_http_error_quark ()
@@ -64,6 +65,18 @@ gboolean flatpak_download_http_uri (SoupSession           *soup_session,
                                     gpointer               user_data,
                                     GCancellable          *cancellable,
                                     GError               **error);
+gboolean flatpak_download_http_uri_resumable (SoupSession           *soup_session,
+                                              const char            *uri,
+                                              FlatpakHTTPFlags       flags,
+                                              int                    partial_dfd,
+                                              const char            *partial_name,
+                                              const char            *token,
+                                              FlatpakLoadUriProgress progress,
+                                              gpointer               user_data,
+                                              GChecksum             *checksum,
+                                              int                   *out_fd,
+                                              GCancellable          *cancellable,
+                                              GError               **error);
 gboolean flatpak_cache_http_uri (SoupSession           *soup_session,
                                  const char            *uri,
                                  FlatpakHTTPFlags       flags,
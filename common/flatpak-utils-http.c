@@ -25,6 +25,7 @@
 #include <libsoup/soup.h>
 #include "libglnx.h"
 
+#include <sys/file.h>
 #include <sys/types.h>
 #include <sys/xattr.h>
 
@@ -61,6 +62,16 @@ typedef struct
   guint64                last_progress_time;
   CacheHttpData         *cache_data;
   char                 **content_type_out;
+
+  guint64                range_start;
+  gboolean               content_encoded;
+  GChecksum             *checksum;
+  guint64                checksummed_bytes;
+  gboolean               out_partial;
+  int                    out_partial_fd;
+  int                    out_partial_dfd;
+  const char            *out_partial_name;
+  gboolean               out_partial_no_xattr;
 } LoadUriData;
 
 #define CACHE_HTTP_XATTR "user.flatpak.http"
@@ -330,6 +341,37 @@ save_cache_http_data_to_file (int           dfd,
   return TRUE;
 }
 
+/* Range requests are only safe if we can tell the server which version
+ * of the resource we have the start of. Weak etags are not allowed in
+ * If-Range (RFC 7233, section 3.2).
+ */
+static gboolean
+cache_http_data_has_validator (CacheHttpData *data)
+{
+  if (data->etag && data->etag[0] && !g_str_has_prefix (data->etag, "W/"))
+    return TRUE;
+
+  return data->last_modified != 0;
+}
+
+static void
+set_range_request_headers (SoupMessage   *m,
+                           CacheHttpData *cache_data,
+                           guint64        range_start)
+{
+  soup_message_headers_set_range (m->request_headers, range_start, -1);
+
+  if (cache_data->etag && cache_data->etag[0] && !g_str_has_prefix (cache_data->etag, "W/"))
+    soup_message_headers_replace (m->request_headers, "If-Range", cache_data->etag);
+  else
+    {
+      SoupDate *date = soup_date_new_from_time_t (cache_data->last_modified);
+      g_autofree char *date_str = soup_date_to_string (date, SOUP_DATE_HTTP);
+      soup_message_headers_replace (m->request_headers, "If-Range", date_str);
+      soup_date_free (date);
+    }
+}
+
 static void
 stream_closed (GObject *source, GAsyncResult *res, gpointer user_data)
 {
@@ -340,7 +382,7 @@ stream_closed (GObject *source, GAsyncResult *res, gpointer user_data)
   if (!g_input_stream_close_finish (stream, res, &error))
     g_warning ("Error closing http stream: %s", error->message);
 
-  if (data->out_tmpfile)
+  if (data->out_tmpfile || data->out_partial)
     {
       if (!g_output_stream_close (data->out, data->cancellable, &error))
         {
@@ -378,8 +420,8 @@ load_uri_read_cb (GObject *source, GAsyncResult *res, gpointer user_data)
     {
       gsize n_written;
 
-      if (!g_output_stream_write_all (data->out, data->buffer, nread, &n_written,
-                                      NULL, &data->error))
+      if (!flatpak_write_update_checksum (data->out, data->buffer, nread, &n_written,
+                                          data->checksum, NULL, &data->error))
         {
           data->downloaded_bytes += n_written;
           g_input_stream_close_async (stream,
@@ -389,6 +431,7 @@ load_uri_read_cb (GObject *source, GAsyncResult *res, gpointer user_data)
         }
 
       data->downloaded_bytes += n_written;
+      data->checksummed_bytes += n_written;
     }
   else
     {
@@ -416,6 +459,7 @@ load_uri_callback (GObject      *source_object,
   SoupRequestHTTP *request = SOUP_REQUEST_HTTP (source_object);
   g_autoptr(GInputStream) in = NULL;
   LoadUriData *data = user_data;
+  const char *content_encoding;
 
   in = soup_request_send_finish (SOUP_REQUEST (request), res, &data->error);
   if (in == NULL)
@@ -456,6 +500,11 @@ load_uri_callback (GObject      *source_object,
           code = G_IO_ERROR_TIMED_OUT;
           break;
 
+        case 416:
+          domain = FLATPAK_HTTP_ERROR;
+          code = FLATPAK_HTTP_ERROR_RANGE_NOT_SATISFIABLE;
+          break;
+
         case SOUP_STATUS_CANCELLED:
           code = G_IO_ERROR_CANCELLED;
           break;
@@ -493,6 +542,42 @@ load_uri_callback (GObject      *source_object,
   if (data->cache_data)
     set_cache_http_data_from_headers (data->cache_data, msg);
 
+  content_encoding = soup_message_headers_get_one (msg->response_headers, "Content-Encoding");
+  data->content_encoded = content_encoding != NULL && g_ascii_strcasecmp (content_encoding, "identity") != 0;
+
+  if (data->range_start > 0 && msg->status_code == SOUP_STATUS_PARTIAL_CONTENT)
+    {
+      goffset start, end, total_length;
+
+      if (!soup_message_headers_get_content_range (msg->response_headers, &start, &end, &total_length) ||
+          start != data->range_start)
+        {
+          data->error = g_error_new (G_IO_ERROR, G_IO_ERROR_FAILED,
+                                     "Server returned unexpected range for resumed download");
+          g_main_context_wakeup (data->context);
+          return;
+        }
+
+      g_debug ("Resuming download at offset %" G_GUINT64_FORMAT, data->range_start);
+    }
+  else if (data->range_start > 0 && !data->out_partial)
+    {
+      /* The earlier data was already written to the output stream, so
+       * there is no way to start over */
+      data->error = g_error_new (G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                                 "Server does not support resuming the download");
+      g_main_context_wakeup (data->context);
+      return;
+    }
+  else if (data->range_start > 0)
+    {
+      g_debug ("Server ignored range request, restarting download");
+      data->downloaded_bytes = 0;
+      if (data->checksum)
+        g_checksum_reset (data->checksum);
+      data->checksummed_bytes = 0;
+    }
+
   if (data->content_type_out)
     *data->content_type_out = g_strdup (soup_message_headers_get_content_type (msg->response_headers, NULL));
 
@@ -523,6 +608,41 @@ load_uri_callback (GObject      *source_object,
         }
     }
 
+  if (data->out_partial)
+    {
+      g_autoptr(GBytes) cache_bytes = NULL;
+
+      g_assert (data->out == NULL);
+
+      if (data->downloaded_bytes == 0 &&
+          ftruncate (data->out_partial_fd, 0) != 0)
+        {
+          glnx_throw_errno_prefix (&data->error, "ftruncate");
+          g_main_context_wakeup (data->context);
+          return;
+        }
+
+      if (lseek (data->out_partial_fd, data->downloaded_bytes, SEEK_SET) < 0)
+        {
+          glnx_throw_errno_prefix (&data->error, "lseek");
+          g_main_context_wakeup (data->context);
+          return;
+        }
+
+      /* Store the validator before any data so that an interrupted
+       * download can be resumed by a later process */
+      cache_bytes = serialize_cache_http_data (data->cache_data);
+      if (!save_cache_http_data_to_file (data->out_partial_dfd, (char *) data->out_partial_name,
+                                         cache_bytes, data->out_partial_no_xattr,
+                                         data->cancellable, &data->error))
+        {
+          g_main_context_wakeup (data->context);
+          return;
+        }
+
+      data->out = g_unix_output_stream_new (data->out_partial_fd, FALSE);
+    }
+
   g_input_stream_read_async (in, data->buffer, sizeof (data->buffer),
                              G_PRIORITY_DEFAULT, data->cancellable,
                              load_uri_read_cb, data);
@@ -721,9 +841,12 @@ flatpak_download_http_uri_once (SoupSession           *soup_session,
                                 FlatpakHTTPFlags       flags,
                                 GOutputStream         *out,
                                 const char            *token,
+                                CacheHttpData         *cache_data,
+                                guint64                range_start,
                                 FlatpakLoadUriProgress progress,
                                 gpointer               user_data,
                                 guint64               *out_bytes_written,
+                                gboolean              *out_content_encoded,
                                 GCancellable          *cancellable,
                                 GError               **error)
 {
@@ -738,6 +861,9 @@ flatpak_download_http_uri_once (SoupSession           *soup_session,
 
   data.context = context;
   data.out = out;
+  data.cache_data = cache_data;
+  data.range_start = range_start;
+  data.downloaded_bytes = range_start;
   data.progress = progress;
   data.cancellable = cancellable;
   data.user_data = user_data;
@@ -759,6 +885,14 @@ flatpak_download_http_uri_once (SoupSession           *soup_session,
       soup_message_headers_replace (m->request_headers, "Authorization", bearer_token);
     }
 
+  /* Byte ranges refer to the encoded content, and we only resume
+   * downloads that weren't encoded */
+  if (range_start > 0)
+    {
+      soup_message_headers_replace (m->request_headers, "Accept-Encoding", "identity");
+      set_range_request_headers (m, cache_data, range_start);
+    }
+
   soup_request_send_async (SOUP_REQUEST (request),
                            cancellable,
                            load_uri_callback, &data);
@@ -768,6 +902,8 @@ flatpak_download_http_uri_once (SoupSession           *soup_session,
 
   if (out_bytes_written)
     *out_bytes_written = data.downloaded_bytes;
+  if (out_content_encoded)
+    *out_content_encoded = data.content_encoded;
 
   if (data.error)
     {
@@ -794,34 +930,40 @@ flatpak_download_http_uri (SoupSession           *soup_session,
   g_autoptr(GError) local_error = NULL;
   guint n_retries_remaining = DEFAULT_N_NETWORK_RETRIES;
   g_autoptr(GMainContextPopDefault) main_context = NULL;
+  g_autoptr(CacheHttpData) cache_data = g_new0 (CacheHttpData, 1);
+  guint64 bytes_written = 0;
+  gboolean content_encoded = FALSE;
 
   main_context = flatpak_main_context_new_default ();
 
   do
     {
-      guint64 bytes_written = 0;
-
       if (n_retries_remaining < DEFAULT_N_NETWORK_RETRIES)
         {
           g_clear_error (&local_error);
 
-          if (progress)
+          if (progress && bytes_written == 0)
             progress (0, user_data); /* Reset the progress */
         }
 
       if (flatpak_download_http_uri_once (soup_session, uri, flags,
                                           out, token,
+                                          cache_data, bytes_written,
                                           progress, user_data,
-                                          &bytes_written,
+                                          &bytes_written, &content_encoded,
                                           cancellable, &local_error))
         {
           g_assert (local_error == NULL);
           return TRUE;
         }
 
-      /* If the output stream has already been written to we can't retry.
-       * TODO: use a range request to resume the download */
-      if (bytes_written > 0)
+      /* If the output stream has already been written to we can only
+       * continue with a range request, which needs a validator to make
+       * sure the resource didn't change in between. The ranges are in
+       * the encoded content, so the decoded data we have of an encoded
+       * response can't be continued. */
+      if (bytes_written > 0 &&
+          (content_encoded || !cache_http_data_has_validator (cache_data)))
         break;
     }
   while (flatpak_http_should_retry_request (local_error, n_retries_remaining--));
@@ -831,6 +973,352 @@ flatpak_download_http_uri (SoupSession           *soup_session,
   return FALSE;
 }
 
+static gboolean
+flatpak_download_http_uri_partial_once (SoupSession           *soup_session,
+                                        const char            *uri,
+                                        FlatpakHTTPFlags       flags,
+                                        int                    partial_dfd,
+                                        const char            *partial_name,
+                                        int                    partial_fd,
+                                        gboolean               no_xattr,
+                                        const char            *token,
+                                        CacheHttpData         *cache_data,
+                                        guint64                range_start,
+                                        GChecksum             *checksum,
+                                        guint64               *inout_checksummed_bytes,
+                                        FlatpakLoadUriProgress progress,
+                                        gpointer               user_data,
+                                        GCancellable          *cancellable,
+                                        GError               **error)
+{
+  g_autoptr(SoupRequestHTTP) request = NULL;
+  g_autoptr(GMainContext) context = NULL;
+  LoadUriData data = { NULL };
+  SoupMessage *m;
+
+  g_debug ("Loading %s using libsoup", uri);
+
+  context = g_main_context_ref_thread_default ();
+
+  data.context = context;
+  data.cache_data = cache_data;
+  data.range_start = range_start;
+  data.downloaded_bytes = range_start;
+  data.out_partial = TRUE;
+  data.out_partial_fd = partial_fd;
+  data.out_partial_dfd = partial_dfd;
+  data.out_partial_name = partial_name;
+  data.out_partial_no_xattr = no_xattr;
+  data.checksum = checksum;
+  data.checksummed_bytes = *inout_checksummed_bytes;
+  data.progress = progress;
+  data.cancellable = cancellable;
+  data.user_data = user_data;
+  data.last_progress_time = g_get_monotonic_time ();
+
+  request = soup_session_request_http (soup_session, "GET",
+                                       uri, error);
+  if (request == NULL)
+    return FALSE;
+
+  m = soup_request_http_get_message (request);
+  if (flags & FLATPAK_HTTP_FLAGS_ACCEPT_OCI)
+    soup_message_headers_replace (m->request_headers, "Accept",
+                                  FLATPAK_OCI_MEDIA_TYPE_IMAGE_MANIFEST ", " FLATPAK_DOCKER_MEDIA_TYPE_IMAGE_MANIFEST2);
+
+  if (token)
+    {
+      g_autofree char *bearer_token = g_strdup_printf ("Bearer %s", token);
+      soup_message_headers_replace (m->request_headers, "Authorization", bearer_token);
+    }
+
+  /* Byte ranges refer to the encoded content, so make sure that is the
+   * same for all requests */
+  soup_message_headers_replace (m->request_headers, "Accept-Encoding", "identity");
+
+  if (range_start > 0)
+    set_range_request_headers (m, cache_data, range_start);
+
+  soup_request_send_async (SOUP_REQUEST (request),
+                           cancellable,
+                           load_uri_callback, &data);
+
+  while (data.error == NULL && !data.done)
+    g_main_context_iteration (data.context, TRUE);
+
+  *inout_checksummed_bytes = data.checksummed_bytes;
+
+  if (data.error)
+    {
+      g_propagate_error (error, data.error);
+      return FALSE;
+    }
+
+  g_debug ("Received %" G_GUINT64_FORMAT " bytes (%" G_GUINT64_FORMAT " resumed)",
+           data.downloaded_bytes, data.range_start);
+
+  return TRUE;
+}
+
+static gboolean
+checksum_fd_prefix (int        fd,
+                    guint64    len,
+                    GChecksum *checksum,
+                    GError   **error)
+{
+  char buf[32 * 1024];
+  guint64 offset = 0;
+
+  while (offset < len)
+    {
+      gssize n = TEMP_FAILURE_RETRY (pread (fd, buf, MIN (sizeof buf, len - offset), offset));
+
+      if (n < 0)
+        return glnx_throw_errno_prefix (error, "pread");
+      if (n == 0)
+        return glnx_throw (error, "Unexpected end of partial download");
+
+      g_checksum_update (checksum, (const guchar *) buf, n);
+      offset += n;
+    }
+
+  return TRUE;
+}
+
+static void
+remove_partial_download (int         partial_dfd,
+                         const char *partial_name)
+{
+  g_autofree char *fallback_name = g_strconcat (partial_name, CACHE_HTTP_SUFFIX, NULL);
+
+  (void) unlinkat (partial_dfd, partial_name, 0);
+  (void) unlinkat (partial_dfd, fallback_name, 0);
+}
+
+/* Opens the partial download @name and locks it, so that two downloads
+ * of the same resource don't write into the same file. Sets @out_fd to
+ * -1 if another download holds the lock. */
+static gboolean
+open_locked_partial_download (int         dfd,
+                              const char *name,
+                              int        *out_fd,
+                              GError    **error)
+{
+  while (TRUE)
+    {
+      glnx_autofd int fd = -1;
+      struct stat fd_stbuf, path_stbuf;
+
+      fd = openat (dfd, name, O_RDWR | O_CREAT | O_CLOEXEC | O_NOFOLLOW | O_NOCTTY | O_NONBLOCK, 0600);
+      if (fd < 0)
+        return glnx_throw_errno_prefix (error, "Opening %s", name);
+
+      if (!glnx_fstat (fd, &fd_stbuf, error))
+        return FALSE;
+
+      if (!S_ISREG (fd_stbuf.st_mode))
+        return glnx_throw (error, "%s is not a regular file", name);
+
+      if (flock (fd, LOCK_EX | LOCK_NB) != 0)
+        {
+          if (errno == EWOULDBLOCK)
+            {
+              *out_fd = -1;
+              return TRUE;
+            }
+
+          return glnx_throw_errno_prefix (error, "Locking %s", name);
+        }
+
+      /* The download that held the lock may have finished and removed
+       * the file in between, then we have to lock the new one */
+      if (fstatat (dfd, name, &path_stbuf, AT_SYMLINK_NOFOLLOW) == 0 &&
+          path_stbuf.st_dev == fd_stbuf.st_dev &&
+          path_stbuf.st_ino == fd_stbuf.st_ino)
+        {
+          *out_fd = glnx_steal_fd (&fd);
+          return TRUE;
+        }
+    }
+}
+
+/* Downloads @uri into an anonymous file in @dfd, which is not kept if
+ * the download fails */
+static gboolean
+download_http_uri_to_tmpfile (SoupSession           *soup_session,
+                              const char            *uri,
+                              FlatpakHTTPFlags       flags,
+                              int                    dfd,
+                              const char            *token,
+                              FlatpakLoadUriProgress progress,
+                              gpointer               user_data,
+                              GChecksum             *checksum,
+                              int                   *out_fd,
+                              GCancellable          *cancellable,
+                              GError               **error)
+{
+  g_auto(GLnxTmpfile) tmpf = { 0 };
+  g_autoptr(GOutputStream) out = NULL;
+  struct stat stbuf;
+
+  if (!glnx_open_tmpfile_linkable_at (dfd, ".", O_RDWR | O_CLOEXEC, &tmpf, error))
+    return FALSE;
+
+  out = g_unix_output_stream_new (tmpf.fd, FALSE);
+  if (!flatpak_download_http_uri (soup_session, uri, flags, out, token,
+                                  progress, user_data, cancellable, error))
+    return FALSE;
+
+  if (!g_output_stream_close (out, cancellable, error))
+    return FALSE;
+
+  if (!glnx_fstat (tmpf.fd, &stbuf, error))
+    return FALSE;
+
+  if (checksum != NULL)
+    {
+      g_checksum_reset (checksum);
+      if (!checksum_fd_prefix (tmpf.fd, stbuf.st_size, checksum, error))
+        return FALSE;
+    }
+
+  if (lseek (tmpf.fd, 0, SEEK_SET) < 0)
+    return glnx_throw_errno_prefix (error, "lseek");
+
+  *out_fd = glnx_steal_fd (&tmpf.fd);
+  return TRUE;
+}
+
+/* Downloads @uri into the file @partial_name in @partial_dfd, resuming
+ * from whatever an earlier (possibly interrupted) download left there if
+ * the server still has the same version of the resource. On success the
+ * partial file is removed again and @out_fd is set to an fd for the
+ * complete download, positioned at the start. On failure the partial
+ * file is kept so that the next attempt can continue from it.
+ *
+ * @partial_dfd must be private to the user. If @partial_name is %NULL,
+ * or another download of it is running, this downloads to an anonymous
+ * file in @partial_dfd instead, which can't be resumed.
+ *
+ * If @checksum is given it is updated with the content as it is
+ * written, so that on success it covers the whole download without
+ * having to read it back. The caller is responsible for verifying it.
+ */
+gboolean
+flatpak_download_http_uri_resumable (SoupSession           *soup_session,
+                                     const char            *uri,
+                                     FlatpakHTTPFlags       flags,
+                                     int                    partial_dfd,
+                                     const char            *partial_name,
+                                     const char            *token,
+                                     FlatpakLoadUriProgress progress,
+                                     gpointer               user_data,
+                                     GChecksum             *checksum,
+                                     int                   *out_fd,
+                                     GCancellable          *cancellable,
+                                     GError               **error)
+{
+  g_autoptr(GError) local_error = NULL;
+  guint n_retries_remaining = DEFAULT_N_NETWORK_RETRIES;
+  g_autoptr(GMainContextPopDefault) main_context = NULL;
+  g_autoptr(CacheHttpData) cache_data = NULL;
+  glnx_autofd int fd = -1;
+  gboolean no_xattr = FALSE;
+  guint64 checksummed_bytes = 0;
+
+  if (partial_name != NULL &&
+      !open_locked_partial_download (partial_dfd, partial_name, &fd, error))
+    return FALSE;
+
+  if (fd == -1)
+    {
+      if (partial_name != NULL)
+        g_debug ("%s is being downloaded by another process, not resuming", partial_name);
+
+      return download_http_uri_to_tmpfile (soup_session, uri, flags, partial_dfd, token,
+                                           progress, user_data, checksum, out_fd,
+                                           cancellable, error);
+    }
+
+  main_context = flatpak_main_context_new_default ();
+
+  cache_data = load_cache_http_data (partial_dfd, (char *) partial_name, &no_xattr,
+                                     cancellable, &local_error);
+  if (cache_data == NULL)
+    {
+      g_debug ("Ignoring partial download %s: %s", partial_name, local_error->message);
+      g_clear_error (&local_error);
+      cache_data = g_new0 (CacheHttpData, 1);
+    }
+
+  if (g_strcmp0 (cache_data->uri, uri) != 0)
+    {
+      clear_cache_http_data (cache_data, TRUE);
+      cache_data->uri = g_strdup (uri);
+    }
+
+  while (TRUE)
+    {
+      struct stat stbuf;
+      guint64 range_start = 0;
+
+      if (!glnx_fstat (fd, &stbuf, error))
+        return FALSE;
+
+      if (cache_http_data_has_validator (cache_data))
+        range_start = stbuf.st_size;
+
+      if (n_retries_remaining < DEFAULT_N_NETWORK_RETRIES && progress)
+        progress (range_start, user_data);
+
+      /* Bring the checksum up to where we resume, this only has to
+       * read back data if it comes from an earlier process */
+      if (checksum != NULL && checksummed_bytes != range_start)
+        {
+          g_checksum_reset (checksum);
+          if (!checksum_fd_prefix (fd, range_start, checksum, error))
+            return FALSE;
+        }
+      checksummed_bytes = range_start;
+
+      if (flatpak_download_http_uri_partial_once (soup_session, uri, flags,
+                                                  partial_dfd, partial_name, fd, no_xattr,
+                                                  token, cache_data, range_start,
+                                                  checksum, &checksummed_bytes,
+                                                  progress, user_data,
+                                                  cancellable, &local_error))
+        break;
+
+      if (range_start > 0 &&
+          g_error_matches (local_error, FLATPAK_HTTP_ERROR, FLATPAK_HTTP_ERROR_RANGE_NOT_SATISFIABLE))
+        {
+          /* Whatever we have doesn't match the resource, start over */
+          g_debug ("Discarding unusable partial download %s", partial_name);
+          clear_cache_http_data (cache_data, FALSE);
+          if (ftruncate (fd, 0) != 0)
+            return glnx_throw_errno_prefix (error, "ftruncate");
+          g_clear_error (&local_error);
+          continue;
+        }
+
+      if (!flatpak_http_should_retry_request (local_error, n_retries_remaining--))
+        {
+          g_propagate_error (error, g_steal_pointer (&local_error));
+          return FALSE;
+        }
+
+      g_clear_error (&local_error);
+    }
+
+  remove_partial_download (partial_dfd, partial_name);
+
+  if (lseek (fd, 0, SEEK_SET) < 0)
+    return glnx_throw_errno_prefix (error, "lseek");
+
+  *out_fd = glnx_steal_fd (&fd);
+  return TRUE;
+}
+
 static gboolean
 sync_and_rename_tmpfile (GLnxTmpfile *tmpfile,
                          const char  *dest_name,
@@ -952,15 +1440,15 @@ flatpak_cache_http_uri_once (SoupSession           *soup_session,
     soup_message_headers_replace (m->request_headers, "Accept",
                                   FLATPAK_OCI_MEDIA_TYPE_IMAGE_MANIFEST ", " FLATPAK_DOCKER_MEDIA_TYPE_IMAGE_MANIFEST2);
 
+  /* The session may be shared between threads, so only ever disable
+   * the content decoder on the message itself */
   if (flags & FLATPAK_HTTP_FLAGS_STORE_COMPRESSED)
     {
-      soup_session_remove_feature_by_type (soup_session, SOUP_TYPE_CONTENT_DECODER);
+      soup_message_disable_feature (m, SOUP_TYPE_CONTENT_DECODER);
       soup_message_headers_replace (m->request_headers, "Accept-Encoding",
                                     "gzip");
       data.store_compressed = TRUE;
     }
-  else if (!soup_session_has_feature (soup_session, SOUP_TYPE_CONTENT_DECODER))
-    soup_session_add_feature_by_type (soup_session, SOUP_TYPE_CONTENT_DECODER);
 
   soup_request_send_async (SOUP_REQUEST (request),
                            cancellable,
@@ -173,6 +173,9 @@ gboolean flatpak_variant_save (GFile        *dest,
                                GVariant     *variant,
                                GCancellable *cancellable,
                                GError      **error);
+GVariant *flatpak_variant_store_to_fd (GVariant *variant,
+                                       int       fd,
+                                       GError  **error);
 GVariant *flatpak_repo_load_summary (OstreeRepo *repo,
                                      GError    **error);
 GVariant *flatpak_repo_load_summary_index (OstreeRepo *repo,
@@ -241,6 +244,10 @@ char ** flatpak_list_unmaintained_refs (const char   *name_prefix,
 gboolean flatpak_remove_dangling_symlinks (GFile        *dir,
                                            GCancellable *cancellable,
                                            GError      **error);
+gboolean flatpak_remove_dangling_symlinks_to (GFile        *dir,
+                                              const char   *target_infix,
+                                              GCancellable *cancellable,
+                                              GError      **error);
 
 gboolean flatpak_utils_ascii_string_to_unsigned (const gchar *str,
                                                  guint        base,
@@ -523,6 +530,27 @@ gboolean flatpak_mtree_create_dir (OstreeRepo         *repo,
                                    OstreeMutableTree **dir_out,
                                    GError            **error);
 
+struct _FlatpakBundleHeader
+{
+  char     *commit;
+  char     *ref;
+  char     *origin;
+  char     *runtime_repo;
+  char     *app_metadata;
+  char     *collection_id;
+  GBytes   *gpg_keys;
+  guint64   installed_size;
+  guint     n_parts;
+  guint64   parts_size;
+  GVariant *metadata;
+};
+
+FlatpakBundleHeader *flatpak_bundle_header_load (GFile   *file,
+                                                 GError **error);
+void flatpak_bundle_header_free (FlatpakBundleHeader *header);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (FlatpakBundleHeader, flatpak_bundle_header_free)
+
 GVariant *flatpak_bundle_load (GFile              *file,
                                char              **commit,
                                FlatpakDecomposed **ref,
@@ -541,6 +569,15 @@ gboolean flatpak_pull_from_bundle (OstreeRepo   *repo,
                                    gboolean      require_gpg_signature,
                                    GCancellable *cancellable,
                                    GError      **error);
+gboolean flatpak_pull_from_bundle_header (OstreeRepo          *repo,
+                                          GFile               *file,
+                                          FlatpakBundleHeader *header,
+                                          const char          *remote,
+                                          const char          *ref,
+                                          gboolean             require_gpg_signature,
+                                          FlatpakProgress     *progress,
+                                          GCancellable        *cancellable,
+                                          GError             **error);
 
 typedef void (*FlatpakOciPullProgress) (guint64  total_size,
                                         guint64  pulled_size,
@@ -634,6 +671,11 @@ gboolean   flatpak_cp_a (GFile         *src,
                          GCancellable  *cancellable,
                          GError       **error);
 
+gboolean flatpak_reflink_fd (int       src_fd,
+                             int       dest_fd,
+                             gboolean *out_linked,
+                             GError  **error);
+
 gboolean flatpak_mkdir_p (GFile        *dir,
                           GCancellable *cancellable,
                           GError      **error);
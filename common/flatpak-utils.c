@@ -37,7 +37,9 @@
 #include <sys/types.h>
 #include <sys/utsname.h>
 #include <sys/ioctl.h>
+#include <sys/xattr.h>
 #include <termios.h>
+#include <linux/fs.h>
 
 #include <glib.h>
 #include <gio/gunixoutputstream.h>
@@ -1344,6 +1346,7 @@ flatpak_find_deploy_for_ref (const char   *ref,
 static gboolean
 remove_dangling_symlinks (int           parent_fd,
                           const char   *name,
+                          const char   *target_infix,
                           GCancellable *cancellable,
                           GError      **error)
 {
@@ -1364,12 +1367,23 @@ remove_dangling_symlinks (int           parent_fd,
 
       if (dent->d_type == DT_DIR)
         {
-          if (!remove_dangling_symlinks (iter.fd, dent->d_name, cancellable, error))
+          if (!remove_dangling_symlinks (iter.fd, dent->d_name, target_infix, cancellable, error))
             goto out;
         }
       else if (dent->d_type == DT_LNK)
         {
           struct stat stbuf;
+
+          /* Only links into the given location can have become dangling,
+           * so skip resolving all the others */
+          if (target_infix != NULL)
+            {
+              g_autofree char *target = glnx_readlinkat_malloc (iter.fd, dent->d_name, NULL, NULL);
+
+              if (target != NULL && strstr (target, target_infix) == NULL)
+                continue;
+            }
+
           if (fstatat (iter.fd, dent->d_name, &stbuf, 0) != 0 && errno == ENOENT)
             {
               if (unlinkat (iter.fd, dent->d_name, 0) != 0)
@@ -1396,7 +1410,7 @@ flatpak_remove_dangling_symlinks (GFile        *dir,
 
   /* The fd is closed by this call */
   if (!remove_dangling_symlinks (AT_FDCWD, flatpak_file_get_path_cached (dir),
-                                 cancellable, error))
+                                 NULL, cancellable, error))
     goto out;
 
   ret = TRUE;
@@ -1405,6 +1419,18 @@ out:
   return ret;
 }
 
+/* Like flatpak_remove_dangling_symlinks(), but only checks symlinks
+ * whose target contains @target_infix. */
+gboolean
+flatpak_remove_dangling_symlinks_to (GFile        *dir,
+                                     const char   *target_infix,
+                                     GCancellable *cancellable,
+                                     GError      **error)
+{
+  return remove_dangling_symlinks (AT_FDCWD, flatpak_file_get_path_cached (dir),
+                                   target_infix, cancellable, error);
+}
+
 /* This atomically replaces a symlink with a new value, removing the
  * existing symlink target, if it exstis and is different from
  * @target. This is atomic in the sense that we're guaranteed to
@@ -1626,6 +1652,322 @@ flatpak_openat_noatime (int           dfd,
     }
 }
 
+typedef enum {
+  FLATPAK_CP_METHOD_REFLINK = 1,
+  FLATPAK_CP_METHOD_COPY_FILE_RANGE,
+  FLATPAK_CP_METHOD_FALLBACK,
+} FlatpakCpMethod;
+
+static const char *
+cp_method_to_string (FlatpakCpMethod method)
+{
+  switch (method)
+    {
+    case FLATPAK_CP_METHOD_REFLINK:
+      return "reflink";
+    case FLATPAK_CP_METHOD_COPY_FILE_RANGE:
+      return "copy_file_range";
+    default:
+      return "read/write";
+    }
+}
+
+/* The best copy method that worked between two filesystems, keyed by
+ * "srcdev:destdev". Once a method fails for a pair we don't try it again. */
+G_LOCK_DEFINE_STATIC (cp_methods);
+static GHashTable *cp_methods = NULL;
+
+static FlatpakCpMethod
+cp_method_lookup (dev_t src_dev,
+                  dev_t dest_dev)
+{
+  g_autofree char *key = g_strdup_printf ("%" G_GUINT64_FORMAT ":%" G_GUINT64_FORMAT,
+                                          (guint64) src_dev, (guint64) dest_dev);
+  FlatpakCpMethod method = FLATPAK_CP_METHOD_REFLINK;
+
+  G_LOCK (cp_methods);
+  if (cp_methods != NULL && g_hash_table_contains (cp_methods, key))
+    method = GPOINTER_TO_INT (g_hash_table_lookup (cp_methods, key));
+  G_UNLOCK (cp_methods);
+
+  return method;
+}
+
+static void
+cp_method_record (dev_t           src_dev,
+                  dev_t           dest_dev,
+                  FlatpakCpMethod method)
+{
+  char *key = g_strdup_printf ("%" G_GUINT64_FORMAT ":%" G_GUINT64_FORMAT,
+                               (guint64) src_dev, (guint64) dest_dev);
+  FlatpakCpMethod old_method;
+
+  G_LOCK (cp_methods);
+  if (cp_methods == NULL)
+    cp_methods = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+  old_method = GPOINTER_TO_INT (g_hash_table_lookup (cp_methods, key));
+  if (old_method != method)
+    {
+      g_debug ("Copying files from device %s using %s", key, cp_method_to_string (method));
+      g_hash_table_replace (cp_methods, key, GINT_TO_POINTER (method));
+    }
+  else
+    g_free (key);
+  G_UNLOCK (cp_methods);
+}
+
+static gboolean
+copy_user_xattrs (int      src_fd,
+                  int      dest_fd,
+                  GError **error)
+{
+  g_autofree char *names = NULL;
+  ssize_t names_size;
+  const char *name;
+
+  names_size = TEMP_FAILURE_RETRY (flistxattr (src_fd, NULL, 0));
+  if (names_size < 0)
+    {
+      if (errno == ENOTSUP)
+        return TRUE;
+      return glnx_throw_errno_prefix (error, "flistxattr");
+    }
+  if (names_size == 0)
+    return TRUE;
+
+  names = g_malloc (names_size);
+  names_size = TEMP_FAILURE_RETRY (flistxattr (src_fd, names, names_size));
+  if (names_size < 0)
+    return glnx_throw_errno_prefix (error, "flistxattr");
+
+  /* Like g_file_copy() with G_FILE_COPY_ALL_METADATA, only the user
+   * namespace is copied */
+  for (name = names; name < names + names_size; name += strlen (name) + 1)
+    {
+      g_autofree char *value = NULL;
+      ssize_t value_size;
+
+      if (!g_str_has_prefix (name, "user."))
+        continue;
+
+      value_size = TEMP_FAILURE_RETRY (fgetxattr (src_fd, name, NULL, 0));
+      if (value_size < 0)
+        return glnx_throw_errno_prefix (error, "fgetxattr");
+
+      value = g_malloc (MAX (value_size, 1));
+      value_size = TEMP_FAILURE_RETRY (fgetxattr (src_fd, name, value, value_size));
+      if (value_size < 0)
+        return glnx_throw_errno_prefix (error, "fgetxattr");
+
+      if (TEMP_FAILURE_RETRY (fsetxattr (dest_fd, name, value, value_size, 0)) < 0)
+        return glnx_throw_errno_prefix (error, "fsetxattr");
+    }
+
+  return TRUE;
+}
+
+/* Copies the data of the regular file @src_fd to @dest_fd, preferring
+ * a reflink, then copy_file_range(). Returns with *@out_copied set to
+ * FALSE if neither works between these filesystems, in which case
+ * nothing has been written.
+ */
+static gboolean
+cp_regfile_data_fast (int           src_fd,
+                      struct stat  *src_stbuf,
+                      int           dest_fd,
+                      gboolean     *out_copied,
+                      GError      **error)
+{
+  struct stat dest_stbuf;
+  FlatpakCpMethod method;
+
+  *out_copied = FALSE;
+
+  if (!glnx_fstat (dest_fd, &dest_stbuf, error))
+    return FALSE;
+
+  method = cp_method_lookup (src_stbuf->st_dev, dest_stbuf.st_dev);
+
+#ifdef FICLONE
+  if (method == FLATPAK_CP_METHOD_REFLINK)
+    {
+      if (ioctl (dest_fd, FICLONE, src_fd) == 0)
+        {
+          cp_method_record (src_stbuf->st_dev, dest_stbuf.st_dev, method);
+          *out_copied = TRUE;
+          return TRUE;
+        }
+
+      if (errno != EXDEV && errno != EOPNOTSUPP && errno != ENOTTY &&
+          errno != EINVAL && errno != ENOSYS && errno != EPERM)
+        return glnx_throw_errno_prefix (error, "ioctl(FICLONE)");
+
+      method = FLATPAK_CP_METHOD_COPY_FILE_RANGE;
+    }
+#else
+  if (method == FLATPAK_CP_METHOD_REFLINK)
+    method = FLATPAK_CP_METHOD_COPY_FILE_RANGE;
+#endif
+
+#if HAVE_DECL_COPY_FILE_RANGE
+  if (method == FLATPAK_CP_METHOD_COPY_FILE_RANGE)
+    {
+      off_t remaining = src_stbuf->st_size;
+      gboolean first = TRUE;
+
+      while (remaining > 0)
+        {
+          ssize_t n = copy_file_range (src_fd, NULL, dest_fd, NULL, remaining, 0);
+
+          if (n < 0 && errno == EINTR)
+            continue;
+
+          if (n < 0 && first &&
+              (errno == EXDEV || errno == EOPNOTSUPP || errno == EINVAL ||
+               errno == ENOSYS || errno == EPERM))
+            {
+              method = FLATPAK_CP_METHOD_FALLBACK;
+              break;
+            }
+
+          if (n < 0)
+            return glnx_throw_errno_prefix (error, "copy_file_range");
+
+          /* The file shrank under us, let the fallback deal with it */
+          if (n == 0)
+            break;
+
+          first = FALSE;
+          remaining -= n;
+        }
+
+      if (method == FLATPAK_CP_METHOD_COPY_FILE_RANGE)
+        {
+          cp_method_record (src_stbuf->st_dev, dest_stbuf.st_dev, method);
+          *out_copied = remaining == 0;
+          return TRUE;
+        }
+    }
+#else
+  method = FLATPAK_CP_METHOD_FALLBACK;
+#endif
+
+  cp_method_record (src_stbuf->st_dev, dest_stbuf.st_dev, method);
+  return TRUE;
+}
+
+/* Makes @dest_fd share the data of the regular file @src_fd using a
+ * reflink. Returns with *@out_linked set to FALSE if reflinks don't
+ * work between these filesystems, in which case nothing has been
+ * written and the caller has to copy the data instead.
+ */
+gboolean
+flatpak_reflink_fd (int       src_fd,
+                    int       dest_fd,
+                    gboolean *out_linked,
+                    GError  **error)
+{
+  struct stat src_stbuf;
+  struct stat dest_stbuf;
+
+  *out_linked = FALSE;
+
+  if (!glnx_fstat (src_fd, &src_stbuf, error) ||
+      !glnx_fstat (dest_fd, &dest_stbuf, error))
+    return FALSE;
+
+  if (cp_method_lookup (src_stbuf.st_dev, dest_stbuf.st_dev) != FLATPAK_CP_METHOD_REFLINK)
+    return TRUE;
+
+#ifdef FICLONE
+  if (ioctl (dest_fd, FICLONE, src_fd) == 0)
+    {
+      cp_method_record (src_stbuf.st_dev, dest_stbuf.st_dev, FLATPAK_CP_METHOD_REFLINK);
+      *out_linked = TRUE;
+      return TRUE;
+    }
+
+  if (errno != EXDEV && errno != EOPNOTSUPP && errno != ENOTTY &&
+      errno != EINVAL && errno != ENOSYS && errno != EPERM)
+    return glnx_throw_errno_prefix (error, "ioctl(FICLONE)");
+#endif
+
+  cp_method_record (src_stbuf.st_dev, dest_stbuf.st_dev, FLATPAK_CP_METHOD_COPY_FILE_RANGE);
+  return TRUE;
+}
+
+/* Fast path for copying a regular file in flatpak_cp_a(). Sets
+ * *@out_copied to FALSE if the caller should use g_file_copy() instead,
+ * e.g. for symlinks or when the kernel can't do the copy for us.
+ */
+static gboolean
+cp_regfile_fast (GFile        *src,
+                 GFile        *dest,
+                 gboolean      copy_all_metadata,
+                 gboolean     *out_copied,
+                 GCancellable *cancellable,
+                 GError      **error)
+{
+  glnx_autofd int src_fd = -1;
+  glnx_autofd int dest_fd = -1;
+  struct stat stbuf;
+  gboolean copied = FALSE;
+
+  *out_copied = FALSE;
+
+  src_fd = open (flatpak_file_get_path_cached (src), O_RDONLY | O_NOFOLLOW | O_CLOEXEC | O_NOCTTY);
+  if (src_fd < 0)
+    return TRUE; /* E.g. a symlink, let g_file_copy() handle it */
+
+  if (!glnx_fstat (src_fd, &stbuf, error))
+    return FALSE;
+
+  if (!S_ISREG (stbuf.st_mode))
+    return TRUE;
+
+  /* Match G_FILE_COPY_OVERWRITE when merging into an existing tree */
+  if (unlink (flatpak_file_get_path_cached (dest)) != 0 && errno != ENOENT)
+    return TRUE;
+
+  dest_fd = open (flatpak_file_get_path_cached (dest), O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC | O_NOCTTY, 0600);
+  if (dest_fd < 0)
+    return glnx_throw_errno_prefix (error, "Creating %s", flatpak_file_get_path_cached (dest));
+
+  if (!cp_regfile_data_fast (src_fd, &stbuf, dest_fd, &copied, error))
+    {
+      (void) unlink (flatpak_file_get_path_cached (dest));
+      return FALSE;
+    }
+
+  if (!copied)
+    {
+      (void) unlink (flatpak_file_get_path_cached (dest));
+      return TRUE;
+    }
+
+  if (copy_all_metadata)
+    {
+      struct timespec ts[2] = { stbuf.st_atim, stbuf.st_mtim };
+
+      /* Like g_file_copy(), failing to copy the owner is not fatal */
+      if (fchown (dest_fd, stbuf.st_uid, stbuf.st_gid) != 0)
+        g_debug ("Failed to chown %s: %s", flatpak_file_get_path_cached (dest), g_strerror (errno));
+
+      if (futimens (dest_fd, ts) != 0)
+        return glnx_throw_errno_prefix (error, "futimens");
+
+      if (!copy_user_xattrs (src_fd, dest_fd, error))
+        return FALSE;
+    }
+
+  if (fchmod (dest_fd, stbuf.st_mode & 07777) != 0)
+    return glnx_throw_errno_prefix (error, "fchmod");
+
+  *out_copied = TRUE;
+  return TRUE;
+}
+
 gboolean
 flatpak_cp_a (GFile         *src,
               GFile         *dest,
@@ -1725,7 +2067,14 @@ flatpak_cp_a (GFile         *src,
             }
           else
             {
-              if (!g_file_copy (src_child, dest_child, copyflags,
+              gboolean copied = FALSE;
+
+              if (!cp_regfile_fast (src_child, dest_child, !no_chown, &copied,
+                                    cancellable, error))
+                goto out;
+
+              if (!copied &&
+                  !g_file_copy (src_child, dest_child, copyflags,
                                 cancellable, NULL, NULL, error))
                 goto out;
             }
@@ -2069,6 +2418,44 @@ flatpak_variant_save (GFile        *dest,
   return TRUE;
 }
 
+/* Serializes @variant into the empty file @fd through a shared mapping,
+ * rather than into a heap buffer like g_variant_get_data() does, so that
+ * large (e.g. mapped) children are never copied into anonymous memory.
+ * Returns a variant of the same type backed by a read-only mapping of
+ * the file. */
+GVariant *
+flatpak_variant_store_to_fd (GVariant *variant,
+                             int       fd,
+                             GError  **error)
+{
+  gsize size = g_variant_get_size (variant);
+  g_autoptr(GMappedFile) mfile = NULL;
+  g_autoptr(GBytes) bytes = NULL;
+  void *data;
+
+  if (size > 0)
+    {
+      if (ftruncate (fd, size) != 0)
+        return glnx_null_throw_errno_prefix (error, "ftruncate");
+
+      data = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+      if (data == MAP_FAILED)
+        return glnx_null_throw_errno_prefix (error, "mmap");
+
+      g_variant_store (variant, data);
+
+      if (munmap (data, size) != 0)
+        return glnx_null_throw_errno_prefix (error, "munmap");
+    }
+
+  mfile = g_mapped_file_new_from_fd (fd, FALSE, error);
+  if (mfile == NULL)
+    return NULL;
+
+  bytes = g_mapped_file_get_bytes (mfile);
+  return g_variant_ref_sink (g_variant_new_from_bytes (g_variant_get_type (variant), bytes, TRUE));
+}
+
 /* This special cases the ref lookup which by doing a
    bsearch since the array is sorted */
 gboolean
@@ -6563,8 +6950,12 @@ maybe_swap_endian_u64 (gboolean swap,
 }
 
 static guint64
-flatpak_bundle_get_installed_size (GVariant *bundle, gboolean byte_swap)
+flatpak_bundle_get_parts_size (GVariant *bundle,
+                               gboolean  byte_swap,
+                               guint    *out_n_parts,
+                               guint64  *out_installed_size)
 {
+  guint64 total_size = 0;
   guint64 total_usize = 0;
   g_autoptr(GVariant) meta_entries = NULL;
   guint i, n_parts;
@@ -6581,26 +6972,41 @@ flatpak_bundle_get_installed_size (GVariant *bundle, gboolean byte_swap)
       g_variant_get_child (meta_entries, i, "(u@aytt@ay)",
                            &version, NULL, &size, &usize, &objects);
 
+      total_size += maybe_swap_endian_u64 (byte_swap, size);
       total_usize += maybe_swap_endian_u64 (byte_swap, usize);
     }
 
-  return total_usize;
+  *out_n_parts = n_parts;
+  *out_installed_size = total_usize;
+
+  return total_size;
 }
 
-GVariant *
-flatpak_bundle_load (GFile              *file,
-                     char              **commit,
-                     FlatpakDecomposed **ref,
-                     char              **origin,
-                     char              **runtime_repo,
-                     char              **app_metadata,
-                     guint64            *installed_size,
-                     GBytes            **gpg_keys,
-                     char              **collection_id,
-                     GError             **error)
+void
+flatpak_bundle_header_free (FlatpakBundleHeader *header)
+{
+  g_free (header->commit);
+  g_free (header->ref);
+  g_free (header->origin);
+  g_free (header->runtime_repo);
+  g_free (header->app_metadata);
+  g_free (header->collection_id);
+  g_clear_pointer (&header->gpg_keys, g_bytes_unref);
+  g_clear_pointer (&header->metadata, g_variant_unref);
+  g_free (header);
+}
+
+/* Parses and validates everything we need from the header of a bundle,
+ * so the callers involved in installing it don't each have to map and
+ * parse the file again. */
+FlatpakBundleHeader *
+flatpak_bundle_header_load (GFile   *file,
+                            GError **error)
 {
+  g_autoptr(FlatpakBundleHeader) header = g_new0 (FlatpakBundleHeader, 1);
   g_autoptr(GVariant) delta = NULL;
   g_autoptr(GVariant) metadata = NULL;
+  g_autoptr(GVariant) gpg_value = NULL;
   g_autoptr(GBytes) bytes = NULL;
   g_autoptr(GBytes) copy = NULL;
   g_autoptr(GVariant) to_csum_v = NULL;
@@ -6644,24 +7050,73 @@ flatpak_bundle_load (GFile              *file,
       byte_swap = (G_BYTE_ORDER != file_byte_order);
     }
 
-  if (commit)
-    *commit = ostree_checksum_from_bytes_v (to_csum_v);
+  header->commit = ostree_checksum_from_bytes_v (to_csum_v);
+  header->parts_size = flatpak_bundle_get_parts_size (delta, byte_swap, &header->n_parts,
+                                                      &header->installed_size);
 
-  if (installed_size)
-    *installed_size = flatpak_bundle_get_installed_size (delta, byte_swap);
+  if (!g_variant_lookup (metadata, "ref", "s", &header->ref))
+    header->ref = NULL;
+
+  if (!g_variant_lookup (metadata, "origin", "s", &header->origin))
+    header->origin = NULL;
+
+  if (!g_variant_lookup (metadata, "runtime-repo", "s", &header->runtime_repo))
+    header->runtime_repo = NULL;
+
+  if (!g_variant_lookup (metadata, "collection-id", "s", &header->collection_id) ||
+      *header->collection_id == '\0')
+    g_clear_pointer (&header->collection_id, g_free);
+
+  if (!g_variant_lookup (metadata, "metadata", "s", &header->app_metadata))
+    header->app_metadata = NULL;
+
+  gpg_value = g_variant_lookup_value (metadata, "gpg-keys", G_VARIANT_TYPE ("ay"));
+  if (gpg_value)
+    {
+      gsize n_elements;
+      const char *data = g_variant_get_fixed_array (gpg_value, &n_elements, 1);
+      header->gpg_keys = g_bytes_new (data, n_elements);
+    }
+
+  /* Make a copy of the data so we can return it after freeing the file */
+  copy = g_bytes_new (g_variant_get_data (metadata),
+                      g_variant_get_size (metadata));
+  header->metadata = g_variant_ref_sink (g_variant_new_from_bytes (g_variant_get_type (metadata),
+                                                                   copy,
+                                                                   FALSE));
+
+  return g_steal_pointer (&header);
+}
+
+GVariant *
+flatpak_bundle_load (GFile              *file,
+                     char              **commit,
+                     FlatpakDecomposed **ref,
+                     char              **origin,
+                     char              **runtime_repo,
+                     char              **app_metadata,
+                     guint64            *installed_size,
+                     GBytes            **gpg_keys,
+                     char              **collection_id,
+                     GError             **error)
+{
+  g_autoptr(FlatpakBundleHeader) header = NULL;
+
+  header = flatpak_bundle_header_load (file, error);
+  if (header == NULL)
+    return NULL;
 
   if (ref != NULL)
     {
       FlatpakDecomposed *the_ref = NULL;
-      g_autofree char *ref_str = NULL;
 
-      if (!g_variant_lookup (metadata, "ref", "s", &ref_str))
+      if (header->ref == NULL)
         {
           flatpak_fail_error (error, FLATPAK_ERROR_INVALID_DATA, _("Invalid bundle, no ref in metadata"));
           return NULL;
         }
 
-      the_ref = flatpak_decomposed_new_from_ref (ref_str, error);
+      the_ref = flatpak_decomposed_new_from_ref (header->ref, error);
       if (the_ref == NULL)
         return NULL;
 
@@ -6669,59 +7124,28 @@ flatpak_bundle_load (GFile              *file,
       *ref = the_ref;
     }
 
+  if (commit)
+    *commit = g_strdup (header->commit);
+
+  if (installed_size)
+    *installed_size = header->installed_size;
+
   if (origin != NULL)
-    {
-      if (!g_variant_lookup (metadata, "origin", "s", origin))
-        *origin = NULL;
-    }
+    *origin = g_strdup (header->origin);
 
   if (runtime_repo != NULL)
-    {
-      if (!g_variant_lookup (metadata, "runtime-repo", "s", runtime_repo))
-        *runtime_repo = NULL;
-    }
+    *runtime_repo = g_strdup (header->runtime_repo);
 
   if (collection_id != NULL)
-    {
-      if (!g_variant_lookup (metadata, "collection-id", "s", collection_id))
-        {
-          *collection_id = NULL;
-        }
-      else if (**collection_id == '\0')
-        {
-          g_free (*collection_id);
-          *collection_id = NULL;
-        }
-    }
+    *collection_id = g_strdup (header->collection_id);
 
   if (app_metadata != NULL)
-    {
-      if (!g_variant_lookup (metadata, "metadata", "s", app_metadata))
-        *app_metadata = NULL;
-    }
+    *app_metadata = g_strdup (header->app_metadata);
 
   if (gpg_keys != NULL)
-    {
-      g_autoptr(GVariant) gpg_value = g_variant_lookup_value (metadata, "gpg-keys",
-                                                              G_VARIANT_TYPE ("ay"));
-      if (gpg_value)
-        {
-          gsize n_elements;
-          const char *data = g_variant_get_fixed_array (gpg_value, &n_elements, 1);
-          *gpg_keys = g_bytes_new (data, n_elements);
-        }
-      else
-        {
-          *gpg_keys = NULL;
-        }
-    }
+    *gpg_keys = header->gpg_keys ? g_bytes_ref (header->gpg_keys) : NULL;
 
-  /* Make a copy of the data so we can return it after freeing the file */
-  copy = g_bytes_new (g_variant_get_data (metadata),
-                      g_variant_get_size (metadata));
-  return g_variant_ref_sink (g_variant_new_from_bytes (g_variant_get_type (metadata),
-                                                       copy,
-                                                       FALSE));
+  return g_variant_ref (header->metadata);
 }
 
 gboolean
@@ -6732,25 +7156,47 @@ flatpak_pull_from_bundle (OstreeRepo   *repo,
                           gboolean      require_gpg_signature,
                           GCancellable *cancellable,
                           GError      **error)
+{
+  g_autoptr(FlatpakBundleHeader) header = NULL;
+
+  header = flatpak_bundle_header_load (file, error);
+  if (header == NULL)
+    return FALSE;
+
+  return flatpak_pull_from_bundle_header (repo, file, header, remote, ref,
+                                          require_gpg_signature, NULL,
+                                          cancellable, error);
+}
+
+/* Like flatpak_pull_from_bundle(), but using a @header the caller already
+ * loaded from @file. Reports progress in units of delta parts, though
+ * libostree applies the parts in one go, so this is only updated before
+ * and after that. */
+gboolean
+flatpak_pull_from_bundle_header (OstreeRepo          *repo,
+                                 GFile               *file,
+                                 FlatpakBundleHeader *header,
+                                 const char          *remote,
+                                 const char          *ref,
+                                 gboolean             require_gpg_signature,
+                                 FlatpakProgress     *progress,
+                                 GCancellable        *cancellable,
+                                 GError             **error)
 {
   gsize metadata_size = 0;
-  g_autofree char *metadata_contents = NULL;
-  g_autofree char *to_checksum = NULL;
+  const char *metadata_contents = header->app_metadata;
+  const char *to_checksum = header->commit;
+  const char *collection_id = header->collection_id;
   g_autoptr(GFile) root = NULL;
   g_autoptr(GFile) metadata_file = NULL;
   g_autoptr(GInputStream) in = NULL;
   g_autoptr(OstreeGpgVerifyResult) gpg_result = NULL;
   g_autoptr(GError) my_error = NULL;
-  g_autoptr(GVariant) metadata = NULL;
   gboolean metadata_valid;
   g_autofree char *remote_collection_id = NULL;
-  g_autofree char *collection_id = NULL;
 
-  metadata = flatpak_bundle_load (file, &to_checksum, NULL, NULL, NULL, &metadata_contents, NULL, NULL, &collection_id, error);
-  if (metadata == NULL)
-    return FALSE;
-
-  metadata_size = strlen (metadata_contents);
+  if (metadata_contents != NULL)
+    metadata_size = strlen (metadata_contents);
 
   if (!ostree_repo_get_remote_option (repo, remote, "collection-id", NULL,
                                       &remote_collection_id, NULL))
@@ -6767,6 +7213,8 @@ flatpak_pull_from_bundle (OstreeRepo   *repo,
   /* Don’t need to set the collection ID here, since the remote binds this ref to the collection. */
   ostree_repo_transaction_set_ref (repo, remote, ref, to_checksum);
 
+  flatpak_progress_start_bundle (progress, header->parts_size, header->n_parts);
+
   if (!ostree_repo_static_delta_execute_offline (repo,
                                                  file,
                                                  FALSE,
@@ -6774,6 +7222,8 @@ flatpak_pull_from_bundle (OstreeRepo   *repo,
                                                  error))
     return FALSE;
 
+  flatpak_progress_complete_bundle (progress);
+
   gpg_result = ostree_repo_verify_commit_ext (repo, to_checksum,
                                               NULL, NULL, cancellable, &my_error);
   if (gpg_result == NULL)
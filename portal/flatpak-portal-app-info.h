@@ -38,6 +38,8 @@
 #define FLATPAK_METADATA_KEY_DEVEL "devel"
 #define FLATPAK_METADATA_KEY_INSTANCE_PATH "instance-path"
 #define FLATPAK_METADATA_KEY_INSTANCE_ID "instance-id"
+#define FLATPAK_METADATA_KEY_ORIGINAL_APP_PATH "original-app-path"
+#define FLATPAK_METADATA_KEY_APP_PATH "app-path"
 
 GKeyFile * flatpak_invocation_lookup_app_info (GDBusMethodInvocation *invocation,
                                                GCancellable          *cancellable,
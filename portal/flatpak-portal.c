@@ -64,6 +64,7 @@ G_DEFINE_AUTOPTR_CLEANUP_FUNC (PortalFlatpakUpdateMonitorSkeleton, g_object_unre
 #define CHILD_STATUS_CHECK_ATTEMPTS 20
 
 static GHashTable *client_pid_data_hash = NULL;
+static GHashTable *spawn_installation_args = NULL; /* app path -> flatpak run option, or "" */
 static GDBusConnection *session_bus = NULL;
 static GNetworkMonitor *network_monitor = NULL;
 static gboolean no_idle_exit = FALSE;
@@ -741,6 +742,58 @@ get_path_for_fd (int fd,
   return g_steal_pointer (&path);
 }
 
+/* Returns the `flatpak run` option selecting the installation that
+ * @app_path was deployed from, or NULL if that isn't known. Passing it
+ * means the spawned `flatpak run` only has to look for the app deploy
+ * in that one installation rather than loading all of them. The result
+ * is cached, so the lookup is only done once per app deploy.
+ *
+ * There is no such option for the runtime, which `flatpak run` still
+ * looks up in all installations. */
+static const char *
+get_spawn_installation_arg (const char *app_path)
+{
+  const char *arg;
+
+  if (spawn_installation_args == NULL)
+    spawn_installation_args = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+
+  arg = g_hash_table_lookup (spawn_installation_args, app_path);
+  if (arg == NULL)
+    {
+      g_autoptr(GFile) app_file = g_file_new_for_path (app_path);
+      g_autoptr(GFile) path = NULL;
+      g_autoptr(GFile) user_path = NULL;
+      g_autoptr(FlatpakDir) dir = NULL;
+      const char *id;
+      char *new_arg = NULL;
+
+      /* Same layout as in update_monitor_get_installation_path() */
+      path = g_file_resolve_relative_path (app_file, "../../../../../..");
+      user_path = flatpak_get_user_base_dir_location ();
+      dir = flatpak_dir_get_by_path (path);
+      id = flatpak_dir_get_id (dir);
+
+      /* flatpak_dir_get_by_path() assumes anything that isn't a configured
+       * system installation is a user one, which is only right for the
+       * actual user installation */
+      if (flatpak_dir_is_user (dir))
+        new_arg = g_strdup (g_file_equal (path, user_path) ? "--user" : "");
+      else if (g_strcmp0 (id, SYSTEM_DIR_DEFAULT_ID) == 0)
+        new_arg = g_strdup ("--system");
+      else if (id != NULL)
+        new_arg = g_strdup_printf ("--installation=%s", id);
+      else
+        new_arg = g_strdup ("");
+
+      g_debug ("Spawns from %s use installation arg '%s'", app_path, new_arg);
+      g_hash_table_insert (spawn_installation_args, g_strdup (app_path), new_arg);
+      arg = new_arg;
+    }
+
+  return *arg != 0 ? arg : NULL;
+}
+
 static gboolean
 handle_spawn (PortalFlatpak         *object,
               GDBusMethodInvocation *invocation,
@@ -773,6 +826,7 @@ handle_spawn (PortalFlatpak         *object,
   g_auto(GStrv) runtime_parts = NULL;
   g_autofree char *runtime_commit = NULL;
   g_autofree char *instance_path = NULL;
+  g_autofree char *app_path = NULL;
   g_auto(GStrv) extra_args = NULL;
   g_auto(GStrv) shares = NULL;
   g_auto(GStrv) sockets = NULL;
@@ -873,6 +927,13 @@ handle_spawn (PortalFlatpak         *object,
   arch = g_key_file_get_string (app_info,
                                 FLATPAK_METADATA_GROUP_INSTANCE,
                                 FLATPAK_METADATA_KEY_ARCH, NULL);
+  app_path = g_key_file_get_string (app_info,
+                                    FLATPAK_METADATA_GROUP_INSTANCE,
+                                    FLATPAK_METADATA_KEY_ORIGINAL_APP_PATH, NULL);
+  if (app_path == NULL)
+    app_path = g_key_file_get_string (app_info,
+                                      FLATPAK_METADATA_GROUP_INSTANCE,
+                                      FLATPAK_METADATA_KEY_APP_PATH, NULL);
   extra_args = g_key_file_get_string_list (app_info,
                                            FLATPAK_METADATA_GROUP_INSTANCE,
                                            FLATPAK_METADATA_KEY_EXTRA_ARGS, NULL, NULL);
@@ -882,6 +943,17 @@ handle_spawn (PortalFlatpak         *object,
   runtime_commit = g_key_file_get_string (app_info,
                                           FLATPAK_METADATA_GROUP_INSTANCE,
                                           FLATPAK_METADATA_KEY_RUNTIME_COMMIT, NULL);
+
+  if (testing && app_path == NULL)
+    {
+      /* Pretend the app is a deploy in the user installation */
+      g_autoptr(GFile) user_base_dir = flatpak_get_user_base_dir_location ();
+
+      app_path = g_build_filename (flatpak_file_get_path_cached (user_base_dir),
+                                   "app", app_id, "m68k", "master", "active", "files", NULL);
+      g_clear_pointer (&app_commit, g_free);
+      app_commit = g_strnfill (64, '0');
+    }
   shares = g_key_file_get_string_list (app_info, FLATPAK_METADATA_GROUP_CONTEXT,
                                        FLATPAK_METADATA_KEY_SHARED, NULL, NULL);
   sockets = g_key_file_get_string_list (app_info, FLATPAK_METADATA_GROUP_CONTEXT,
@@ -1411,6 +1483,15 @@ handle_spawn (PortalFlatpak         *object,
 
   if ((arg_flags & FLATPAK_SPAWN_FLAGS_LATEST_VERSION) == 0)
     {
+      /* The caller's commit is pinned, so it is going to be found in
+       * the caller's installation anyway */
+      const char *installation_arg = NULL;
+
+      if (app_path != NULL && app_commit != NULL)
+        installation_arg = get_spawn_installation_arg (app_path);
+      if (installation_arg != NULL)
+        g_ptr_array_add (flatpak_argv, g_strdup (installation_arg));
+
       if (app_commit)
         g_ptr_array_add (flatpak_argv, g_strdup_printf ("--commit=%s", app_commit));
       if (runtime_commit)
@@ -1829,19 +1910,64 @@ update_monitor_get_installation_path (PortalFlatpakUpdateMonitor *monitor)
   return g_file_resolve_relative_path (app_path, "../../../../../..");
 }
 
+/* The per-monitor part of an update check, for a monitor whose app is
+ * still installed */
+typedef struct
+{
+  PortalFlatpakUpdateMonitor *monitor;
+  FlatpakInstallation        *installation;
+  char                       *group; /* Installation path and origin */
+  char                       *origin;
+  char                       *ref;
+  char                       *local_commit;
+} UpdateCheck;
+
+static void
+update_check_free (UpdateCheck *check)
+{
+  g_object_unref (check->monitor);
+  g_object_unref (check->installation);
+  g_free (check->group);
+  g_free (check->origin);
+  g_free (check->ref);
+  g_free (check->local_commit);
+  g_free (check);
+}
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (UpdateCheck, update_check_free)
+
+/* What the last poll learned about a remote of an installation. If the
+ * summary of the remote is unchanged, so are the commits in it, and the
+ * monitors for it don't need to look anything up again. This is only
+ * used from the update check thread, and kept between polls. */
+typedef struct
+{
+  char       *digest;
+  GHashTable *remote_commits; /* ref -> commit */
+} RemoteCheck;
+
 static void
-check_for_updates (PortalFlatpakUpdateMonitor *monitor)
+remote_check_free (RemoteCheck *check)
+{
+  g_free (check->digest);
+  g_hash_table_unref (check->remote_commits);
+  g_free (check);
+}
+
+static GHashTable *remote_checks = NULL;
+
+/* Does the local part of the update check, returns NULL if there is
+ * nothing to check */
+static UpdateCheck *
+update_check_new (PortalFlatpakUpdateMonitor *monitor)
 {
   UpdateMonitorData *m = update_monitor_get_data (monitor);
   g_autoptr(GFile) installation_path = NULL;
   g_autoptr(FlatpakInstallation) installation = NULL;
   g_autoptr(FlatpakInstalledRef) installed_ref = NULL;
-  g_autoptr(FlatpakRemoteRef) remote_ref = NULL;
-  const char *origin = NULL;
-  const char *local_commit = NULL;
-  const char *remote_commit;
   g_autoptr(GError) error = NULL;
   g_autoptr(FlatpakDir) dir = NULL;
+  UpdateCheck *check;
   const char *ref;
 
   installation_path = update_monitor_get_installation_path (monitor);
@@ -1852,7 +1978,7 @@ check_for_updates (PortalFlatpakUpdateMonitor *monitor)
   if (installation == NULL)
     {
       g_debug ("Unable to find installation for path %s: %s", flatpak_file_get_path_cached (installation_path), error->message);
-      return;
+      return NULL;
     }
 
   installed_ref = flatpak_installation_get_installed_ref (installation,
@@ -1862,46 +1988,35 @@ check_for_updates (PortalFlatpakUpdateMonitor *monitor)
   if (installed_ref == NULL)
     {
       g_debug ("getting installed ref failed: %s", error->message);
-      return; /* Never report updates for uninstalled refs */
+      return NULL; /* Never report updates for uninstalled refs */
     }
 
   dir = flatpak_installation_get_dir (installation, NULL);
   if (dir == NULL)
-    return;
+    return NULL;
 
   ref = flatpak_ref_format_ref_cached (FLATPAK_REF (installed_ref));
   if (flatpak_dir_ref_is_masked (dir, ref))
-    return; /* Never report updates for masked refs */
+    return NULL; /* Never report updates for masked refs */
 
-  local_commit = flatpak_ref_get_commit (FLATPAK_REF (installed_ref));
+  check = g_new0 (UpdateCheck, 1);
+  check->monitor = g_object_ref (monitor);
+  check->installation = g_steal_pointer (&installation);
+  check->origin = g_strdup (flatpak_installed_ref_get_origin (installed_ref));
+  check->group = g_strconcat (flatpak_file_get_path_cached (installation_path), "\n", check->origin, NULL);
+  check->ref = g_strdup (ref);
+  check->local_commit = g_strdup (flatpak_ref_get_commit (FLATPAK_REF (installed_ref)));
 
-  origin = flatpak_installed_ref_get_origin (installed_ref);
+  return check;
+}
 
-  remote_ref = flatpak_installation_fetch_remote_ref_sync (installation, origin,
-                                                           FLATPAK_REF_KIND_APP,
-                                                           m->name, m->arch, m->branch,
-                                                           m->cancellable, &error);
-  if (remote_ref == NULL)
-    {
-      /* Probably some network issue.
-       * Fall back to the local_commit to at least be able to pick up already installed updates.
-       */
-      g_debug ("getting remote ref failed: %s", error->message);
-      g_clear_error (&error);
-      remote_commit = local_commit;
-    }
-  else
-    {
-      remote_commit = flatpak_ref_get_commit (FLATPAK_REF (remote_ref));
-      if (remote_commit == NULL)
-        {
-          /* This can happen if we're offline and there is an update from an usb drive.
-           * Not much we can do in terms of reporting it, but at least handle the case
-           */
-          g_debug ("Unknown remote commit, setting to local_commit");
-          remote_commit = local_commit;
-        }
-    }
+static void
+update_monitor_report (PortalFlatpakUpdateMonitor *monitor,
+                       const char                 *local_commit,
+                       const char                 *remote_commit)
+{
+  UpdateMonitorData *m = update_monitor_get_data (monitor);
+  g_autoptr(GError) error = NULL;
 
   if (g_strcmp0 (m->reported_local_commit, local_commit) != 0 ||
       g_strcmp0 (m->reported_remote_commit, remote_commit) != 0)
@@ -1943,20 +2058,132 @@ check_for_updates (PortalFlatpakUpdateMonitor *monitor)
     }
 }
 
+static char *
+remote_state_get_digest (FlatpakRemoteState *state)
+{
+  g_autoptr(GBytes) bytes = NULL;
+
+  /* Sideloaded refs can change without the summary changing */
+  if (state->sideload_repos->len > 0)
+    return NULL;
+
+  if (state->index != NULL)
+    bytes = g_variant_get_data_as_bytes (state->index);
+  else if (state->summary != NULL)
+    bytes = g_variant_get_data_as_bytes (state->summary);
+  else
+    return NULL;
+
+  return g_compute_checksum_for_bytes (G_CHECKSUM_SHA256, bytes);
+}
+
+/* Checks all the monitors for one remote of an installation, fetching
+ * the summary of the remote only once */
+static void
+check_for_updates (const char *group,
+                   GPtrArray  *checks)
+{
+  UpdateCheck *first = g_ptr_array_index (checks, 0);
+  g_autoptr(FlatpakDir) dir = NULL;
+  g_autoptr(FlatpakRemoteState) state = NULL;
+  g_autoptr(GError) error = NULL;
+  g_autofree char *digest = NULL;
+  RemoteCheck *remote_check;
+
+  dir = flatpak_installation_get_dir (first->installation, &error);
+  if (dir != NULL)
+    {
+      /* This revalidates the cached summaries in the background, so that
+       * commands using a remote with xa.summary-max-age set can skip it */
+      flatpak_dir_set_revalidate_summaries (dir, TRUE);
+
+      state = flatpak_dir_get_remote_state (dir, first->origin, FALSE, NULL, &error);
+    }
+
+  if (state == NULL)
+    {
+      /* Probably some network issue.
+       * Fall back to the local_commit to at least be able to pick up already installed updates.
+       */
+      g_debug ("getting remote state for %s failed: %s", first->origin, error->message);
+      g_hash_table_remove (remote_checks, group);
+
+      for (guint i = 0; i < checks->len; i++)
+        {
+          UpdateCheck *check = g_ptr_array_index (checks, i);
+          update_monitor_report (check->monitor, check->local_commit, check->local_commit);
+        }
+
+      return;
+    }
+
+  digest = remote_state_get_digest (state);
+
+  remote_check = g_hash_table_lookup (remote_checks, group);
+  if (remote_check == NULL || digest == NULL || g_strcmp0 (remote_check->digest, digest) != 0)
+    {
+      remote_check = g_new0 (RemoteCheck, 1);
+      remote_check->digest = g_steal_pointer (&digest);
+      remote_check->remote_commits = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+      g_hash_table_replace (remote_checks, g_strdup (group), remote_check);
+    }
+  else
+    g_debug ("Summary for %s unchanged since the last check", first->origin);
+
+  for (guint i = 0; i < checks->len; i++)
+    {
+      UpdateCheck *check = g_ptr_array_index (checks, i);
+      UpdateMonitorData *m = update_monitor_get_data (check->monitor);
+      const char *remote_commit;
+
+      remote_commit = g_hash_table_lookup (remote_check->remote_commits, check->ref);
+      if (remote_commit == NULL)
+        {
+          g_autofree char *commit = NULL;
+          g_autoptr(GError) local_error = NULL;
+
+          if (!flatpak_remote_state_ensure_subsummary (state, dir, m->arch, FALSE, m->cancellable, &local_error) ||
+              !flatpak_remote_state_lookup_ref (state, check->ref, &commit, NULL, NULL, NULL, &local_error))
+            g_debug ("getting remote ref failed: %s", local_error->message);
+
+          /* This can happen if we're offline and there is an update from an usb drive.
+           * Not much we can do in terms of reporting it, but at least handle the case
+           */
+          if (commit == NULL)
+            {
+              g_debug ("Unknown remote commit, setting to local_commit");
+              update_monitor_report (check->monitor, check->local_commit, check->local_commit);
+              continue;
+            }
+
+          remote_commit = commit;
+          g_hash_table_insert (remote_check->remote_commits, g_strdup (check->ref), g_steal_pointer (&commit));
+        }
+
+      update_monitor_report (check->monitor, check->local_commit, remote_commit);
+    }
+}
+
 static void
 check_all_for_updates_in_thread_func (GTask *task,
                                       gpointer source_object,
                                       gpointer task_data,
                                       GCancellable *cancellable)
 {
+  g_autoptr(GHashTable) groups = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, (GDestroyNotify) g_ptr_array_unref);
   GList *monitors, *l;
 
   monitors = update_monitors_get_all (NULL);
 
+  if (remote_checks == NULL)
+    remote_checks = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify) remote_check_free);
+
   for (l = monitors; l != NULL; l = l->next)
     {
       PortalFlatpakUpdateMonitor *monitor = l->data;
       UpdateMonitorData *m = update_monitor_get_data (monitor);
+      g_autoptr(UpdateCheck) check = NULL;
+      GPtrArray *group_checks;
       gboolean was_closed = FALSE;
 
       g_mutex_lock (&m->lock);
@@ -1966,16 +2193,52 @@ check_all_for_updates_in_thread_func (GTask *task,
         m->running = TRUE;
       g_mutex_unlock (&m->lock);
 
-      if (!was_closed)
+      if (was_closed)
+        continue;
+
+      check = update_check_new (monitor);
+      if (check == NULL)
+        continue;
+
+      /* Group the monitors by installation and remote */
+      group_checks = g_hash_table_lookup (groups, check->group);
+      if (group_checks == NULL)
         {
-          check_for_updates (monitor);
+          group_checks = g_ptr_array_new_with_free_func ((GDestroyNotify) update_check_free);
+          g_hash_table_insert (groups, check->group, group_checks);
+        }
+      g_ptr_array_add (group_checks, g_steal_pointer (&check));
+    }
+
+  GLNX_HASH_TABLE_FOREACH_KV (groups, const char *, group, GPtrArray *, group_checks)
+    check_for_updates (group, group_checks);
+
+  /* Forget about remotes no longer used by any monitor */
+  {
+    GHashTableIter iter;
+    const char *group;
+
+    g_hash_table_iter_init (&iter, remote_checks);
+    while (g_hash_table_iter_next (&iter, (gpointer *) &group, NULL))
+      if (!g_hash_table_contains (groups, group))
+        g_hash_table_iter_remove (&iter);
+  }
+
+  g_clear_pointer (&groups, g_hash_table_unref);
 
-          g_mutex_lock (&m->lock);
+  for (l = monitors; l != NULL; l = l->next)
+    {
+      PortalFlatpakUpdateMonitor *monitor = l->data;
+      UpdateMonitorData *m = update_monitor_get_data (monitor);
+
+      g_mutex_lock (&m->lock);
+      if (m->running)
+        {
           m->running = FALSE;
           if (m->closed) /* Was closed during running, do delayed close */
             update_monitor_do_close (monitor);
-          g_mutex_unlock (&m->lock);
         }
+      g_mutex_unlock (&m->lock);
     }
 
   g_list_free_full (monitors, g_object_unref);
@@ -379,20 +379,50 @@ take_ongoing_pull_by_dir (const gchar *src_dir)
   return pull;
 }
 
+static void
+propagate_helper_error (GError    **dest,
+                        GError     *src,
+                        const char *fmt,
+                        ...) G_GNUC_PRINTF (3, 4);
+
+/* Like flatpak_invocation_return_error(), but for errors that are
+ * returned later */
+static void
+propagate_helper_error (GError    **dest,
+                        GError     *src,
+                        const char *fmt,
+                        ...)
+{
+  if (src->domain == FLATPAK_ERROR)
+    g_propagate_error (dest, src);
+  else
+    {
+      va_list args;
+      g_autofree char *prefix = NULL;
+      va_start (args, fmt);
+      g_vasprintf (&prefix, fmt, args);
+      va_end (args);
+      g_set_error (dest, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
+                   "%s: %s", prefix, src->message);
+      g_error_free (src);
+    }
+}
+
+/* Does the work of a Deploy call, or of one entry of a DeployMany call */
 static gboolean
-handle_deploy (FlatpakSystemHelper   *object,
-               GDBusMethodInvocation *invocation,
-               const gchar           *arg_repo_path,
-               guint32                arg_flags,
-               const gchar           *arg_ref,
-               const gchar           *arg_origin,
-               const gchar *const    *arg_subpaths,
-               const gchar *const    *arg_previous_ids,
-               const gchar           *arg_installation)
+deploy_ref (FlatpakDir            *system,
+            GDBusMethodInvocation *invocation,
+            const gchar           *arg_repo_path,
+            guint32                arg_flags,
+            const gchar           *arg_ref,
+            const gchar           *arg_origin,
+            const gchar *const    *arg_subpaths,
+            const gchar *const    *arg_previous_ids,
+            const gchar           *arg_installation,
+            GError               **error)
 {
-  g_autoptr(FlatpakDir) system = NULL;
   g_autoptr(GFile) repo_file = g_file_new_for_path (arg_repo_path);
-  g_autoptr(GError) error = NULL;
+  g_autoptr(GError) local_error = NULL;
   g_autoptr(GFile) deploy_dir = NULL;
   gboolean is_oci;
   gboolean is_update;
@@ -405,52 +435,42 @@ handle_deploy (FlatpakSystemHelper   *object,
   g_autofree gchar *src_dir = NULL;
   g_autoptr(FlatpakDecomposed) ref = NULL;
 
-  g_debug ("Deploy %s %u %s %s %s", arg_repo_path, arg_flags, arg_ref, arg_origin, arg_installation);
-
-  system = dir_get_system (arg_installation, get_sender_pid (invocation), (arg_flags & FLATPAK_HELPER_DEPLOY_FLAGS_NO_INTERACTION) != 0, &error);
-  if (system == NULL)
-    {
-      g_dbus_method_invocation_return_gerror (invocation, error);
-      return G_DBUS_METHOD_INVOCATION_HANDLED;
-    }
-
   if ((arg_flags & ~FLATPAK_HELPER_DEPLOY_FLAGS_ALL) != 0)
     {
-      g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS,
-                                             "Unsupported flags enabled: 0x%x", (arg_flags & ~FLATPAK_HELPER_DEPLOY_FLAGS_ALL));
-      return G_DBUS_METHOD_INVOCATION_HANDLED;
+      g_set_error (error, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS,
+                   "Unsupported flags enabled: 0x%x", (arg_flags & ~FLATPAK_HELPER_DEPLOY_FLAGS_ALL));
+      return FALSE;
     }
 
   if (strlen (arg_repo_path) > 0)
     {
       if (!g_file_query_exists (repo_file, NULL))
         {
-          g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS,
-                                                 "Path does not exist");
-          return G_DBUS_METHOD_INVOCATION_HANDLED;
+          g_set_error (error, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS,
+                       "Path does not exist");
+          return FALSE;
         }
 
       src_dir = g_path_get_dirname (arg_repo_path);
       ongoing_pull = take_ongoing_pull_by_dir (src_dir);
       if (ongoing_pull != NULL)
         {
-          g_autoptr(GError) local_error = NULL;
           uid_t uid;
 
           /* Ensure that pull's uid is same as the caller's uid */
           if (!get_connection_uid (invocation, &uid, &local_error))
             {
-              g_dbus_method_invocation_return_gerror (invocation, local_error);
-              return G_DBUS_METHOD_INVOCATION_HANDLED;
+              g_propagate_error (error, g_steal_pointer (&local_error));
+              return FALSE;
             }
           else
             {
               if (ongoing_pull->uid != uid)
                 {
-                  g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
-                                                         "Ongoing pull's uid(%d) does not match with peer uid(%d)",
-                                                         ongoing_pull->uid, uid);
-                  return G_DBUS_METHOD_INVOCATION_HANDLED;
+                  g_set_error (error, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
+                               "Ongoing pull's uid(%d) does not match with peer uid(%d)",
+                               ongoing_pull->uid, uid);
+                  return FALSE;
                 }
             }
 
@@ -462,10 +482,10 @@ handle_deploy (FlatpakSystemHelper   *object,
                                                  getuid() == 0 ? 0 : -1,
                                                  &local_error))
             {
-              g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
-                                                     "Failed to canonicalize permissions of repo %s: %s",
-                                                     arg_repo_path, local_error->message);
-              return G_DBUS_METHOD_INVOCATION_HANDLED;
+              g_set_error (error, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
+                           "Failed to canonicalize permissions of repo %s: %s",
+                           arg_repo_path, local_error->message);
+              return FALSE;
             }
 
           /* At this point, the cache-dir's repo is owned by root. Hence, any failure
@@ -474,11 +494,11 @@ handle_deploy (FlatpakSystemHelper   *object,
         }
     }
 
-  ref = flatpak_decomposed_new_from_ref (arg_ref, &error);
+  ref = flatpak_decomposed_new_from_ref (arg_ref, &local_error);
   if (ref == NULL)
     {
-      g_dbus_method_invocation_return_gerror (invocation, error);
-      return G_DBUS_METHOD_INVOCATION_HANDLED;
+      g_propagate_error (error, g_steal_pointer (&local_error));
+      return FALSE;
     }
 
   no_deploy = (arg_flags & FLATPAK_HELPER_DEPLOY_FLAGS_NO_DEPLOY) != 0;
@@ -495,16 +515,16 @@ handle_deploy (FlatpakSystemHelper   *object,
       real_origin = flatpak_dir_get_origin (system, ref, NULL, NULL);
       if (g_strcmp0 (real_origin, arg_origin) != 0)
         {
-          g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS,
-                                                 "Wrong origin %s for update", arg_origin);
-          return G_DBUS_METHOD_INVOCATION_HANDLED;
+          g_set_error (error, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS,
+                       "Wrong origin %s for update", arg_origin);
+          return FALSE;
         }
     }
 
-  if (!flatpak_dir_ensure_repo (system, NULL, &error))
+  if (!flatpak_dir_ensure_repo (system, NULL, &local_error))
     {
-      flatpak_invocation_return_error (invocation, error, "Can't open system repo %s", arg_installation);
-      return G_DBUS_METHOD_INVOCATION_HANDLED;
+      propagate_helper_error (error, g_steal_pointer (&local_error), "Can't open system repo %s", arg_installation);
+      return FALSE;
     }
 
   is_oci = flatpak_dir_get_remote_oci (system, arg_origin);
@@ -515,10 +535,10 @@ handle_deploy (FlatpakSystemHelper   *object,
        * after this update operation. See
        * https://github.com/flatpak/flatpak/issues/3222
        */
-      if (!flatpak_dir_delete_mirror_refs (system, FALSE, NULL, &error))
+      if (!flatpak_dir_delete_mirror_refs (system, FALSE, NULL, &local_error))
         {
-          flatpak_invocation_return_error (invocation, error, "Can't delete mirror refs");
-          return G_DBUS_METHOD_INVOCATION_HANDLED;
+          propagate_helper_error (error, g_steal_pointer (&local_error), "Can't delete mirror refs");
+          return FALSE;
         }
     }
 
@@ -544,96 +564,96 @@ handle_deploy (FlatpakSystemHelper   *object,
 
       if (upstream_url == NULL)
         {
-          g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
-                                                 "Remote %s is disabled", arg_origin);
-          return G_DBUS_METHOD_INVOCATION_HANDLED;
+          g_set_error (error, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
+                       "Remote %s is disabled", arg_origin);
+          return FALSE;
         }
 
-      registry = flatpak_oci_registry_new (registry_uri, FALSE, -1, NULL, &error);
+      registry = flatpak_oci_registry_new (registry_uri, FALSE, -1, NULL, &local_error);
       if (registry == NULL)
         {
-          g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
-                                                 "Can't open child OCI registry: %s", error->message);
-          return G_DBUS_METHOD_INVOCATION_HANDLED;
+          g_set_error (error, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
+                       "Can't open child OCI registry: %s", local_error->message);
+          return FALSE;
         }
 
-      index = flatpak_oci_registry_load_index (registry, NULL, &error);
+      index = flatpak_oci_registry_load_index (registry, NULL, &local_error);
       if (index == NULL)
         {
-          g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
-                                                 "Can't open child OCI registry index: %s", error->message);
-          return G_DBUS_METHOD_INVOCATION_HANDLED;
+          g_set_error (error, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
+                       "Can't open child OCI registry index: %s", local_error->message);
+          return FALSE;
         }
 
       desc = flatpak_oci_index_get_manifest (index, arg_ref);
       if (desc == NULL)
         {
-          g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
-                                                 "Can't find ref %s in child OCI registry index", arg_ref);
-          return G_DBUS_METHOD_INVOCATION_HANDLED;
+          g_set_error (error, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
+                       "Can't find ref %s in child OCI registry index", arg_ref);
+          return FALSE;
         }
 
       versioned = flatpak_oci_registry_load_versioned (registry, NULL, desc->parent.digest, (const char **)desc->parent.urls, NULL,
-                                                       NULL, &error);
+                                                       NULL, &local_error);
       if (versioned == NULL || !FLATPAK_IS_OCI_MANIFEST (versioned))
         {
-          g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
-                                                 "Can't open child manifest");
-          return G_DBUS_METHOD_INVOCATION_HANDLED;
+          g_set_error (error, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
+                       "Can't open child manifest");
+          return FALSE;
         }
 
       image_config = flatpak_oci_registry_load_image_config (registry, NULL,
                                                              FLATPAK_OCI_MANIFEST (versioned)->config.digest,
                                                              (const char **)FLATPAK_OCI_MANIFEST (versioned)->config.urls,
-                                                             NULL, NULL, &error);
+                                                             NULL, NULL, &local_error);
       if (image_config == NULL)
         {
-          g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
-                                                 "Can't open child image config");
-          return G_DBUS_METHOD_INVOCATION_HANDLED;
+          g_set_error (error, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
+                       "Can't open child image config");
+          return FALSE;
         }
 
-      state = flatpak_dir_get_remote_state (system, arg_origin, FALSE, NULL, &error);
+      state = flatpak_dir_get_remote_state (system, arg_origin, FALSE, NULL, &local_error);
       if (state == NULL)
         {
-          g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
-                                                 "%s: Can't get remote state: %s", arg_origin, error->message);
-          return G_DBUS_METHOD_INVOCATION_HANDLED;
+          g_set_error (error, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
+                       "%s: Can't get remote state: %s", arg_origin, local_error->message);
+          return FALSE;
         }
 
       /* We need to use list_all_remote_refs because we don't care about
        * enumerate vs. noenumerate.
        */
-      if (!flatpak_dir_list_all_remote_refs (system, state, &remote_refs, NULL, &error))
+      if (!flatpak_dir_list_all_remote_refs (system, state, &remote_refs, NULL, &local_error))
         {
-          g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
-                                                 "%s: Can't list refs: %s", arg_origin, error->message);
-          return G_DBUS_METHOD_INVOCATION_HANDLED;
+          g_set_error (error, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
+                       "%s: Can't list refs: %s", arg_origin, local_error->message);
+          return FALSE;
         }
 
       verified_digest = g_hash_table_lookup (remote_refs, ref);
       if (!verified_digest)
         {
-          g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
-                                                 "%s: ref %s not found", arg_origin, arg_ref);
-          return G_DBUS_METHOD_INVOCATION_HANDLED;
+          g_set_error (error, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
+                       "%s: ref %s not found", arg_origin, arg_ref);
+          return FALSE;
         }
 
       if (!g_str_has_prefix (desc->parent.digest, "sha256:") ||
           strcmp (desc->parent.digest + strlen ("sha256:"), verified_digest) != 0)
         {
-          g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
-                                                 "%s: manifest hash in downloaded content does not match ref %s", arg_origin, arg_ref);
-          return G_DBUS_METHOD_INVOCATION_HANDLED;
+          g_set_error (error, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
+                       "%s: manifest hash in downloaded content does not match ref %s", arg_origin, arg_ref);
+          return FALSE;
         }
 
       checksum = flatpak_pull_from_oci (flatpak_dir_get_repo (system), registry, NULL, desc->parent.digest, NULL, FLATPAK_OCI_MANIFEST (versioned), image_config,
-                                        arg_origin, arg_ref, FLATPAK_PULL_FLAGS_NONE, NULL, NULL, NULL, &error);
+                                        arg_origin, arg_ref, FLATPAK_PULL_FLAGS_NONE, NULL, NULL, NULL, &local_error);
       if (checksum == NULL)
         {
-          g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
-                                                 "Can't pull ref %s from child OCI registry index: %s", arg_ref, error->message);
-          return G_DBUS_METHOD_INVOCATION_HANDLED;
+          g_set_error (error, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
+                       "Can't pull ref %s from child OCI registry index: %s", arg_ref, local_error->message);
+          return FALSE;
         }
     }
   else if (strlen (arg_repo_path) > 0)
@@ -642,10 +662,10 @@ handle_deploy (FlatpakSystemHelper   *object,
                                              arg_origin,
                                              arg_ref,
                                              (const char **) arg_subpaths,
-                                             NULL, NULL, &error))
+                                             NULL, NULL, &local_error))
         {
-          flatpak_invocation_return_error (invocation, error, "Error pulling from repo");
-          return G_DBUS_METHOD_INVOCATION_HANDLED;
+          propagate_helper_error (error, g_steal_pointer (&local_error), "Error pulling from repo");
+          return FALSE;
         }
     }
   else if (local_pull)
@@ -654,32 +674,32 @@ handle_deploy (FlatpakSystemHelper   *object,
       if (!ostree_repo_remote_get_url (flatpak_dir_get_repo (system),
                                        arg_origin,
                                        &url,
-                                       &error))
+                                       &local_error))
         {
-          flatpak_invocation_return_error (invocation, error, "Error getting remote url");
-          return G_DBUS_METHOD_INVOCATION_HANDLED;
+          propagate_helper_error (error, g_steal_pointer (&local_error), "Error getting remote url");
+          return FALSE;
         }
 
       if (!g_str_has_prefix (url, "file:"))
         {
-          g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
-                                                 "Local pull url doesn't start with file://");
-          return G_DBUS_METHOD_INVOCATION_HANDLED;
+          g_set_error (error, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
+                       "Local pull url doesn't start with file://");
+          return FALSE;
         }
 
-      state = flatpak_dir_get_remote_state_optional (system, arg_origin, FALSE, NULL, &error);
+      state = flatpak_dir_get_remote_state_optional (system, arg_origin, FALSE, NULL, &local_error);
       if (state == NULL)
         {
-          flatpak_invocation_return_error (invocation, error, "Error getting remote state");
-          return G_DBUS_METHOD_INVOCATION_HANDLED;
+          propagate_helper_error (error, g_steal_pointer (&local_error), "Error getting remote state");
+          return FALSE;
         }
 
       if (!flatpak_dir_pull (system, state, arg_ref, NULL, (const char **) arg_subpaths, NULL, NULL, NULL, NULL,
                              FLATPAK_PULL_FLAGS_NONE, OSTREE_REPO_PULL_FLAGS_UNTRUSTED, NULL,
-                             NULL, &error))
+                             NULL, &local_error))
         {
-          flatpak_invocation_return_error (invocation, error, "Error pulling from repo");
-          return G_DBUS_METHOD_INVOCATION_HANDLED;
+          propagate_helper_error (error, g_steal_pointer (&local_error), "Error pulling from repo");
+          return FALSE;
         }
     }
 
@@ -690,10 +710,10 @@ handle_deploy (FlatpakSystemHelper   *object,
           if (!flatpak_dir_deploy_update (system, ref, NULL,
                                           (const char **) arg_subpaths,
                                           (const char **) arg_previous_ids,
-                                          NULL, &error))
+                                          NULL, &local_error))
             {
-              flatpak_invocation_return_error (invocation, error, "Error deploying");
-              return G_DBUS_METHOD_INVOCATION_HANDLED;
+              propagate_helper_error (error, g_steal_pointer (&local_error), "Error deploying");
+              return FALSE;
             }
         }
       else
@@ -701,19 +721,136 @@ handle_deploy (FlatpakSystemHelper   *object,
           if (!flatpak_dir_deploy_install (system, ref, arg_origin,
                                            (const char **) arg_subpaths,
                                            (const char **) arg_previous_ids,
-                                           reinstall, update_pinned, NULL, &error))
+                                           reinstall, update_pinned, NULL, &local_error))
             {
-              flatpak_invocation_return_error (invocation, error, "Error deploying");
-              return G_DBUS_METHOD_INVOCATION_HANDLED;
+              propagate_helper_error (error, g_steal_pointer (&local_error), "Error deploying");
+              return FALSE;
             }
         }
     }
 
+  return TRUE;
+}
+
+static gboolean
+handle_deploy (FlatpakSystemHelper   *object,
+               GDBusMethodInvocation *invocation,
+               const gchar           *arg_repo_path,
+               guint32                arg_flags,
+               const gchar           *arg_ref,
+               const gchar           *arg_origin,
+               const gchar *const    *arg_subpaths,
+               const gchar *const    *arg_previous_ids,
+               const gchar           *arg_installation)
+{
+  g_autoptr(FlatpakDir) system = NULL;
+  g_autoptr(GError) error = NULL;
+
+  g_debug ("Deploy %s %u %s %s %s", arg_repo_path, arg_flags, arg_ref, arg_origin, arg_installation);
+
+  system = dir_get_system (arg_installation, get_sender_pid (invocation), (arg_flags & FLATPAK_HELPER_DEPLOY_FLAGS_NO_INTERACTION) != 0, &error);
+  if (system == NULL)
+    {
+      g_dbus_method_invocation_return_gerror (invocation, error);
+      return G_DBUS_METHOD_INVOCATION_HANDLED;
+    }
+
+  if (!deploy_ref (system, invocation, arg_repo_path, arg_flags, arg_ref, arg_origin,
+                   arg_subpaths, arg_previous_ids, arg_installation, &error))
+    {
+      g_dbus_method_invocation_return_gerror (invocation, error);
+      return G_DBUS_METHOD_INVOCATION_HANDLED;
+    }
+
   flatpak_system_helper_complete_deploy (object, invocation);
 
   return G_DBUS_METHOD_INVOCATION_HANDLED;
 }
 
+static gboolean
+handle_deploy_many (FlatpakSystemHelper   *object,
+                    GDBusMethodInvocation *invocation,
+                    GVariant              *arg_deploys,
+                    guint32                arg_flags,
+                    const gchar           *arg_installation)
+{
+  g_autoptr(FlatpakDir) system = NULL;
+  g_autoptr(GError) error = NULL;
+  g_auto(GLnxLockFile) lock = { 0, };
+  GVariantBuilder errors_builder;
+  gsize i, n_deploys;
+
+  n_deploys = g_variant_n_children (arg_deploys);
+
+  g_debug ("DeployMany %" G_GSIZE_FORMAT " refs %u %s", n_deploys, arg_flags, arg_installation);
+
+  if ((arg_flags & ~FLATPAK_HELPER_DEPLOY_MANY_FLAGS_ALL) != 0)
+    {
+      g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS,
+                                             "Unsupported flags enabled: 0x%x", (arg_flags & ~FLATPAK_HELPER_DEPLOY_MANY_FLAGS_ALL));
+      return G_DBUS_METHOD_INVOCATION_HANDLED;
+    }
+
+  system = dir_get_system (arg_installation, get_sender_pid (invocation), (arg_flags & FLATPAK_HELPER_DEPLOY_MANY_FLAGS_NO_INTERACTION) != 0, &error);
+  if (system == NULL)
+    {
+      g_dbus_method_invocation_return_gerror (invocation, error);
+      return G_DBUS_METHOD_INVOCATION_HANDLED;
+    }
+
+  if (!flatpak_dir_ensure_repo (system, NULL, &error))
+    {
+      flatpak_invocation_return_error (invocation, error, "Can't open system repo %s", arg_installation);
+      return G_DBUS_METHOD_INVOCATION_HANDLED;
+    }
+
+  /* Keep prunes out until the whole batch is deployed. The pulls and
+   * deploys only take shared repo locks themselves, so this doesn't
+   * block them. */
+  if (!flatpak_dir_repo_lock (system, &lock, LOCK_SH, NULL, &error))
+    {
+      flatpak_invocation_return_error (invocation, error, "Can't lock system repo %s", arg_installation);
+      return G_DBUS_METHOD_INVOCATION_HANDLED;
+    }
+
+  /* The refs are deployed in order, and we stop at the first real
+   * failure, leaving the earlier ones deployed. A ref that is already
+   * installed is reported but doesn't stop the batch. */
+  g_variant_builder_init (&errors_builder, G_VARIANT_TYPE ("a(ss)"));
+  for (i = 0; i < n_deploys; i++)
+    {
+      const char *repo_path, *ref, *origin;
+      g_autofree const char **subpaths = NULL;
+      g_autofree const char **previous_ids = NULL;
+      g_autoptr(GError) local_error = NULL;
+      g_autofree char *error_name = NULL;
+      guint32 flags;
+
+      g_variant_get_child (arg_deploys, i, "(^&ayu&s&s^a&s^a&s)",
+                           &repo_path, &flags, &ref, &origin, &subpaths, &previous_ids);
+
+      g_debug ("DeployMany: %s %u %s %s", repo_path, flags, ref, origin);
+
+      if (deploy_ref (system, invocation, repo_path, flags, ref, origin,
+                      subpaths, previous_ids, arg_installation, &local_error))
+        {
+          g_variant_builder_add (&errors_builder, "(ss)", "", "");
+          continue;
+        }
+
+      error_name = g_dbus_error_encode_gerror (local_error);
+      g_variant_builder_add (&errors_builder, "(ss)", error_name, local_error->message);
+
+      if (!g_error_matches (local_error, FLATPAK_ERROR, FLATPAK_ERROR_ALREADY_INSTALLED))
+        break;
+    }
+
+  flatpak_system_helper_complete_deploy_many (object, invocation,
+                                              g_variant_builder_end (&errors_builder));
+
+  return G_DBUS_METHOD_INVOCATION_HANDLED;
+}
+
 static gboolean
 handle_cancel_pull (FlatpakSystemHelper   *object,
                     GDBusMethodInvocation *invocation,
@@ -1028,7 +1165,7 @@ handle_install_bundle (FlatpakSystemHelper   *object,
       return G_DBUS_METHOD_INVOCATION_HANDLED;
     }
 
-  if (!flatpak_dir_install_bundle (system, bundle_file, arg_remote, &ref, NULL, &error))
+  if (!flatpak_dir_install_bundle (system, bundle_file, NULL, arg_remote, &ref, NULL, NULL, &error))
     {
       flatpak_invocation_return_error (invocation, error, "Error installing bundle");
       return G_DBUS_METHOD_INVOCATION_HANDLED;
@@ -1898,6 +2035,125 @@ dir_ref_is_installed (FlatpakDir *dir,
   return deploy_data != NULL;
 }
 
+/* The actions a Deploy can need, strongest first. Each of them implies
+ * the ones after it in our policy. */
+static const char * const deploy_actions[] = {
+  "org.freedesktop.Flatpak.app-install",
+  "org.freedesktop.Flatpak.app-update",
+  "org.freedesktop.Flatpak.runtime-install",
+  "org.freedesktop.Flatpak.runtime-update",
+  "org.freedesktop.Flatpak.metadata-update",
+};
+
+static const char *
+get_deploy_action (guint32      flags,
+                   const char  *ref_str,
+                   const char  *installation,
+                   GError     **error)
+{
+  g_autoptr(GError) local_error = NULL;
+  g_autoptr(FlatpakDecomposed) ref = NULL;
+  gboolean no_interaction;
+  gboolean is_app, is_install;
+
+  /* For metadata updates, redirect to the metadata-update action which
+   * should basically always be allowed */
+  if (ref_str != NULL && g_strcmp0 (ref_str, OSTREE_REPO_METADATA_REF) == 0)
+    return "org.freedesktop.Flatpak.metadata-update";
+
+  ref = flatpak_decomposed_new_from_ref (ref_str, &local_error);
+  if (ref == NULL)
+    {
+      g_set_error (error, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
+                   "Error deployings: %s", local_error->message);
+      return NULL;
+    }
+
+  no_interaction = (flags & FLATPAK_HELPER_DEPLOY_FLAGS_NO_INTERACTION) != 0;
+
+  /* These flags allow clients to "upgrade" the permission,
+   * avoiding the need for multiple polkit dialogs when we first
+   * update a runtime, then install the app that needs it.
+   *
+   * Note that our policy has implications:
+   * app-install > app-update > runtime-install > runtime-update
+   * which means that these hints only ever select a stronger
+   * permission, and are safe in that sense.
+   */
+
+  if ((flags & FLATPAK_HELPER_DEPLOY_FLAGS_APP_HINT) != 0)
+    is_app = TRUE;
+  else
+    is_app = flatpak_decomposed_is_app (ref);
+
+  if ((flags & FLATPAK_HELPER_DEPLOY_FLAGS_INSTALL_HINT) != 0 ||
+      (flags & FLATPAK_HELPER_DEPLOY_FLAGS_REINSTALL) != 0)
+    is_install = TRUE;
+  else
+    {
+      g_autoptr(FlatpakDir) system = dir_get_system (installation, 0, no_interaction, &local_error);
+
+      if (system == NULL)
+        {
+          g_set_error (error, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
+                       "Error getting installation %s: %s", installation, local_error->message);
+          return NULL;
+        }
+
+      is_install = !dir_ref_is_installed (system, ref);
+    }
+
+  if (is_install)
+    {
+      if (is_app)
+        return "org.freedesktop.Flatpak.app-install";
+      else
+        return "org.freedesktop.Flatpak.runtime-install";
+    }
+  else
+    {
+      if (is_app)
+        return "org.freedesktop.Flatpak.app-update";
+      else
+        return "org.freedesktop.Flatpak.runtime-update";
+    }
+}
+
+/* Returns FALSE if the check itself failed, in which case an error has
+ * been returned for @invocation */
+static gboolean
+check_authorization (GDBusMethodInvocation *invocation,
+                     PolkitSubject         *subject,
+                     const char            *action,
+                     PolkitDetails         *details,
+                     gboolean               no_interaction,
+                     gboolean              *out_authorized)
+{
+  g_autoptr(AutoPolkitAuthorizationResult) result = NULL;
+  g_autoptr(GError) error = NULL;
+  PolkitCheckAuthorizationFlags auth_flags;
+
+  if (no_interaction)
+    auth_flags = POLKIT_CHECK_AUTHORIZATION_FLAGS_NONE;
+  else
+    auth_flags = POLKIT_CHECK_AUTHORIZATION_FLAGS_ALLOW_USER_INTERACTION;
+
+  result = polkit_authority_check_authorization_sync (authority, subject,
+                                                      action, details,
+                                                      auth_flags,
+                                                      NULL, &error);
+  if (result == NULL)
+    {
+      g_dbus_error_strip_remote_error (error);
+      g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
+                                             "Authorization error: %s", error->message);
+      return FALSE;
+    }
+
+  *out_authorized = polkit_authorization_result_get_is_authorized (result);
+  return TRUE;
+}
+
 static gboolean
 flatpak_authorize_method_handler (GDBusInterfaceSkeleton *interface,
                                   GDBusMethodInvocation  *invocation,
@@ -1929,84 +2185,102 @@ flatpak_authorize_method_handler (GDBusInterfaceSkeleton *interface,
       const char *installation;
       const char *ref_str, *origin;
       guint32 flags;
+      g_autoptr(GError) error = NULL;
 
       g_variant_get_child (parameters, 1, "u", &flags);
       g_variant_get_child (parameters, 2, "&s", &ref_str);
       g_variant_get_child (parameters, 3, "&s", &origin);
       g_variant_get_child (parameters, 6, "&s", &installation);
 
-      /* For metadata updates, redirect to the metadata-update action which
-       * should basically always be allowed */
-      if (ref_str != NULL && g_strcmp0 (ref_str, OSTREE_REPO_METADATA_REF) == 0)
+      no_interaction = (flags & FLATPAK_HELPER_DEPLOY_FLAGS_NO_INTERACTION) != 0;
+
+      action = get_deploy_action (flags, ref_str, installation, &error);
+      if (action == NULL)
         {
-          action = "org.freedesktop.Flatpak.metadata-update";
+          g_dbus_method_invocation_return_gerror (invocation, error);
+          return FALSE;
         }
-      else
-        {
-          g_autoptr(GError) error = NULL;
-          g_autoptr(FlatpakDecomposed) ref = NULL;
-          gboolean is_app, is_install;
 
-          ref = flatpak_decomposed_new_from_ref (ref_str, &error);
-          if (ref == NULL)
-            {
-              g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
-                                                     "Error deployings: %s", error->message);
-              return FALSE;
-            }
-
-          no_interaction = (flags & FLATPAK_HELPER_DEPLOY_FLAGS_NO_INTERACTION) != 0;
-
-          /* These flags allow clients to "upgrade" the permission,
-           * avoiding the need for multiple polkit dialogs when we first
-           * update a runtime, then install the app that needs it.
-           *
-           * Note that our policy has implications:
-           * app-install > app-update > runtime-install > runtime-update
-           * which means that these hints only ever select a stronger
-           * permission, and are safe in that sense.
-           */
+      polkit_details_insert (details, "origin", origin);
+      polkit_details_insert (details, "ref", ref_str);
+    }
+  else if (g_strcmp0 (method_name, "DeployMany") == 0)
+    {
+      g_autoptr(GVariant) deploys = NULL;
+      g_autoptr(GHashTable) action_refs = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, (GDestroyNotify) g_ptr_array_unref);
+      g_autoptr(GHashTable) action_origins = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, g_free);
+      const char *installation;
+      guint32 flags;
+      gsize i, n_deploys;
 
-          if ((flags & FLATPAK_HELPER_DEPLOY_FLAGS_APP_HINT) != 0)
-            is_app = TRUE;
-          else
-            is_app = flatpak_decomposed_is_app (ref);
+      deploys = g_variant_get_child_value (parameters, 0);
+      g_variant_get_child (parameters, 1, "u", &flags);
+      g_variant_get_child (parameters, 2, "&s", &installation);
 
-          if ((flags & FLATPAK_HELPER_DEPLOY_FLAGS_INSTALL_HINT) != 0 ||
-              (flags & FLATPAK_HELPER_DEPLOY_FLAGS_REINSTALL) != 0)
-            is_install = TRUE;
-          else
-            {
-              g_autoptr(FlatpakDir) system = dir_get_system (installation, 0, no_interaction, &error);
+      no_interaction = (flags & FLATPAK_HELPER_DEPLOY_MANY_FLAGS_NO_INTERACTION) != 0;
 
-              if (system == NULL)
-                {
-                  g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
-                                                         "Error getting installation %s: %s", installation, error->message);
-                  return FALSE;
-                }
+      /* Group the refs by the action they need */
+      n_deploys = g_variant_n_children (deploys);
+      for (i = 0; i < n_deploys; i++)
+        {
+          const char *ref_str, *origin, *ref_action, *action_origin;
+          guint32 ref_flags;
+          GPtrArray *refs;
+          g_autoptr(GError) error = NULL;
 
-              is_install = !dir_ref_is_installed (system, ref);
-            }
+          g_variant_get_child (deploys, i, "(@ayu&s&s@as@as)",
+                               NULL, &ref_flags, &ref_str, &origin, NULL, NULL);
 
-          if (is_install)
+          ref_action = get_deploy_action (ref_flags, ref_str, installation, &error);
+          if (ref_action == NULL)
             {
-              if (is_app)
-                action = "org.freedesktop.Flatpak.app-install";
-              else
-                action = "org.freedesktop.Flatpak.runtime-install";
+              g_dbus_method_invocation_return_gerror (invocation, error);
+              return FALSE;
             }
-          else
+
+          refs = g_hash_table_lookup (action_refs, ref_action);
+          if (refs == NULL)
             {
-              if (is_app)
-                action = "org.freedesktop.Flatpak.app-update";
-              else
-                action = "org.freedesktop.Flatpak.runtime-update";
+              refs = g_ptr_array_new ();
+              g_hash_table_insert (action_refs, (char *) ref_action, refs);
+              g_hash_table_insert (action_origins, (char *) ref_action, g_strdup (origin));
             }
+          g_ptr_array_add (refs, (char *) ref_str);
+
+          /* Only pass on the origin if it is the same for all the refs */
+          action_origin = g_hash_table_lookup (action_origins, ref_action);
+          if (*action_origin != 0 && strcmp (action_origin, origin) != 0)
+            g_hash_table_insert (action_origins, (char *) ref_action, g_strdup (""));
         }
 
-      polkit_details_insert (details, "origin", origin);
-      polkit_details_insert (details, "ref", ref_str);
+      /* Check the strongest action first, so that the weaker ones it
+       * implies don't cause another dialog */
+      authorized = TRUE;
+      for (i = 0; authorized && i < G_N_ELEMENTS (deploy_actions); i++)
+        {
+          GPtrArray *refs = g_hash_table_lookup (action_refs, deploy_actions[i]);
+          const char *action_origin = g_hash_table_lookup (action_origins, deploy_actions[i]);
+          g_autoptr(AutoPolkitDetails) action_details = NULL;
+          g_autofree char *refs_str = NULL;
+
+          if (refs == NULL)
+            continue;
+
+          /* Rules that look at the ref of a Deploy call still work for
+           * single refs, and "refs" lists all of them */
+          action_details = polkit_details_new ();
+          if (*action_origin != 0)
+            polkit_details_insert (action_details, "origin", action_origin);
+          if (refs->len == 1)
+            polkit_details_insert (action_details, "ref", g_ptr_array_index (refs, 0));
+          g_ptr_array_add (refs, NULL);
+          refs_str = g_strjoinv (" ", (char **) refs->pdata);
+          polkit_details_insert (action_details, "refs", refs_str);
+
+          if (!check_authorization (invocation, subject, deploy_actions[i], action_details,
+                                    no_interaction, &authorized))
+            return FALSE;
+        }
     }
   else if (g_strcmp0 (method_name, "DeployAppstream") == 0)
     {
@@ -2160,31 +2434,9 @@ flatpak_authorize_method_handler (GDBusInterfaceSkeleton *interface,
       no_interaction = (flags & (1 << 0)) != 0;
     }
 
-  if (action)
-    {
-      g_autoptr(AutoPolkitAuthorizationResult) result = NULL;
-      g_autoptr(GError) error = NULL;
-      PolkitCheckAuthorizationFlags auth_flags;
-
-      if (no_interaction)
-        auth_flags = POLKIT_CHECK_AUTHORIZATION_FLAGS_NONE;
-      else
-        auth_flags = POLKIT_CHECK_AUTHORIZATION_FLAGS_ALLOW_USER_INTERACTION;
-
-      result = polkit_authority_check_authorization_sync (authority, subject,
-                                                          action, details,
-                                                          auth_flags,
-                                                          NULL, &error);
-      if (result == NULL)
-        {
-          g_dbus_error_strip_remote_error (error);
-          g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
-                                                 "Authorization error: %s", error->message);
-          return FALSE;
-        }
-
-      authorized = polkit_authorization_result_get_is_authorized (result);
-    }
+  if (action &&
+      !check_authorization (invocation, subject, action, details, no_interaction, &authorized))
+    return FALSE;
 
   if (!authorized)
     {
@@ -2210,7 +2462,7 @@ on_bus_acquired (GDBusConnection *connection,
 
   helper = flatpak_system_helper_skeleton_new ();
 
-  flatpak_system_helper_set_version (FLATPAK_SYSTEM_HELPER (helper), 2);
+  flatpak_system_helper_set_version (FLATPAK_SYSTEM_HELPER (helper), 3);
 
   g_object_set_data_full (G_OBJECT (helper), "track-alive", GINT_TO_POINTER (42), skeleton_died_cb);
 
@@ -2218,6 +2470,7 @@ on_bus_acquired (GDBusConnection *connection,
                                        G_DBUS_INTERFACE_SKELETON_FLAGS_HANDLE_METHOD_INVOCATIONS_IN_THREAD);
 
   g_signal_connect (helper, "handle-deploy", G_CALLBACK (handle_deploy), NULL);
+  g_signal_connect (helper, "handle-deploy-many", G_CALLBACK (handle_deploy_many), NULL);
   g_signal_connect (helper, "handle-deploy-appstream", G_CALLBACK (handle_deploy_appstream), NULL);
   g_signal_connect (helper, "handle-uninstall", G_CALLBACK (handle_uninstall), NULL);
   g_signal_connect (helper, "handle-install-bundle", G_CALLBACK (handle_install_bundle), NULL);
@@ -14,6 +14,7 @@ import http.server as http_server
 from io import BytesIO
 
 server_start_time = int(time.time())
+truncated_paths = set()
 
 def parse_http_date(date):
     parsed = parsedate(date)
@@ -49,6 +50,31 @@ class RequestHandler(http_server.BaseHTTPRequestHandler):
                 response = 304
             add_headers['Etag'] = etag
 
+        contents = "path=" + self.path + "\n"
+
+        # Serve a larger body that supports byte ranges. With 'truncate' the
+        # first full response for a path is cut off half-way.
+        truncate_at = None
+        if 'resumable' in query:
+            contents = (contents * 1000).encode('utf-8')
+            range_header = self.headers.get("Range")
+            if_range = self.headers.get("If-Range")
+            if range_header and (if_range is None or if_range == add_headers.get('Etag')):
+                with open("httpd-ranges", 'a') as file:
+                    file.write(range_header + "\n")
+                start = int(range_header[len("bytes="):].split('-')[0])
+                if start >= len(contents):
+                    self.send_response(416)
+                    self.end_headers()
+                    return
+                add_headers['Content-Range'] = "bytes %d-%d/%d" % (start, len(contents) - 1, len(contents))
+                contents = contents[start:]
+                response = 206
+            elif 'truncate' in query and self.path not in truncated_paths:
+                truncated_paths.add(self.path)
+                truncate_at = len(contents) // 2
+            add_headers['Content-Length'] = str(len(contents))
+
         self.send_response(response)
         for k, v in list(add_headers.items()):
             self.send_header(k, v)
@@ -62,12 +88,10 @@ class RequestHandler(http_server.BaseHTTPRequestHandler):
         if 'expires-future' in query:
             self.send_header('Expires', format_date_time(server_start_time + 3600))
 
-        if response == 200:
+        if response == 200 or response == 206:
             self.send_header("Content-Type", "text/plain; charset=UTF-8")
 
-        contents = "path=" + self.path + "\n"
-
-        if not 'ignore-accept-encoding' in query:
+        if not 'ignore-accept-encoding' in query and not 'resumable' in query:
             accept_encoding = self.headers.get("Accept-Encoding")
             if accept_encoding and accept_encoding == 'gzip':
                 self.send_header("Content-Encoding", "gzip")
@@ -83,7 +107,13 @@ class RequestHandler(http_server.BaseHTTPRequestHandler):
 
         self.end_headers()
 
-        if response == 200:
+        if truncate_at is not None:
+            self.wfile.write(contents[:truncate_at])
+            self.wfile.flush()
+            self.close_connection = True
+            return
+
+        if response == 200 or response == 206:
             if isinstance(contents, bytes):
                 self.wfile.write(contents)
             else:
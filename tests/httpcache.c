@@ -1,5 +1,15 @@
 #include "common/flatpak-utils-private.h"
 
+static void
+request_unqueued_cb (SoupSession *session,
+                     SoupMessage *msg,
+                     gpointer     user_data)
+{
+  guint *status = user_data;
+
+  *status = msg->status_code;
+}
+
 int
 main (int argc, char *argv[])
 {
@@ -7,10 +17,15 @@ main (int argc, char *argv[])
   GError *error = NULL;
   const char *url, *dest;
   int flags = 0;
+  gboolean resume = FALSE;
+  guint status = 0;
 
   /* Avoid weird recursive type initialization deadlocks from libsoup */
   g_type_ensure (G_TYPE_SOCKET);
 
+  g_signal_connect (session, "request-unqueued",
+                    G_CALLBACK (request_unqueued_cb), &status);
+
   if (argc == 3)
     {
       url = argv[1];
@@ -22,12 +37,40 @@ main (int argc, char *argv[])
       dest = argv[3];
       flags |= FLATPAK_HTTP_FLAGS_STORE_COMPRESSED;
     }
+  else if (argc == 4 && g_strcmp0 (argv[1], "--resume") == 0)
+    {
+      url = argv[2];
+      dest = argv[3];
+      resume = TRUE;
+    }
   else
     {
-      g_printerr ("Usage httpcache [--compressed] URL DEST\n");
+      g_printerr ("Usage httpcache [--compressed|--resume] URL DEST\n");
       return 1;
     }
 
+  if (resume)
+    {
+      g_autofree char *partial_name = g_strconcat (dest, ".partial", NULL);
+      g_autoptr(GBytes) bytes = NULL;
+      glnx_autofd int fd = -1;
+
+      if (!flatpak_download_http_uri_resumable (session, url, 0,
+                                                AT_FDCWD, partial_name, NULL,
+                                                NULL, NULL, NULL, &fd, NULL, &error) ||
+          (bytes = glnx_fd_readall_bytes (fd, NULL, &error)) == NULL ||
+          !glnx_file_replace_contents_at (AT_FDCWD, dest,
+                                          g_bytes_get_data (bytes, NULL),
+                                          g_bytes_get_size (bytes),
+                                          0, NULL, &error))
+        {
+          g_print ("%s\n", error->message);
+          return 1;
+        }
+
+      g_print ("Server returned status %u: %s\n", status, soup_status_get_phrase (status));
+      return 0;
+    }
 
   if (!flatpak_cache_http_uri (session,
                                url,
@@ -40,7 +83,7 @@ main (int argc, char *argv[])
     }
   else
     {
-      g_print ("Server returned status 200: ok\n");
+      g_print ("Server returned status %u: %s\n", status, soup_status_get_phrase (status));
       return 0;
     }
 }
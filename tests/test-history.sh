@@ -14,17 +14,7 @@ skip_revokefs_without_fuse
 HISTORY_START_TIME=$(date +"%Y-%m-%d %H:%M:%S")
 sleep 1
 
-if ! logger "Checking whether Flatpak can use the journal..."; then
-    skip "Cannot write to Journal with logger"
-fi
-
-messages="$(journalctl --user --since="${HISTORY_START_TIME}" || true)"
-
-if [ -z "$messages" ]; then
-    skip "Cannot read back from Journal with journalctl"
-fi
-
-echo "1..1"
+echo "1..2"
 
 mkdir -p ${TEST_DATA_DIR}/system-history-installation
 mkdir -p ${FLATPAK_CONFIG_DIR}/installations.d
@@ -70,7 +60,16 @@ uninstall	org.test.Hello.Locale	master	system (history-installation)
 remove remote			system (history-installation)	test-repo
 EOF
 
+# The history is kept in the installation, so this works without the journal
+assert_has_dir ${TEST_DATA_DIR}/system-history-installation/history
+
+ok "history looks correct"
+
+${FLATPAK} --installation=history-installation history --since="${HISTORY_START_TIME}" --reverse \
+    --columns=change,application,branch,installation,remote > history-log-reverse
+tac history-log | diff history-log-reverse - >&2
+
 rm -f ${FLATPAK_CONFIG_DIR}/installations.d/history-inst.conf
 rm -rf ${TEST_DATA_DIR}/system-history-installation
 
-ok "history looks correct"
+ok "history --reverse"
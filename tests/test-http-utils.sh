@@ -27,8 +27,8 @@ port=$(cat httpd-port)
 assert_result() {
     test_string=$1
     compressed=
-    if [ "$2" = "--compressed" ] ; then
-	compressed="--compressed"
+    if [ "$2" = "--compressed" ] || [ "$2" = "--resume" ] ; then
+	compressed="$2"
 	shift
     fi
     remote=$2
@@ -59,13 +59,17 @@ assert_ok() {
     assert_result "Server returned status 200:" $@
 }
 
+assert_partial() {
+    assert_result "Server returned status 206:" $@
+}
+
 
 have_xattrs() {
     touch $1/test-xattrs
     setfattr -n user.testvalue -v somevalue $1/test-xattrs > /dev/null 2>&1
 }
 
-echo "1..6"
+echo "1..8"
 
 # Without anything else, cached for 30 minutes
 assert_ok "/" $test_tmpdir/output
@@ -126,6 +130,29 @@ rm -f $test_tmpdir/output*
 
 ok 'compress after download'
 
+# Test resuming an interrupted download with a range request
+assert_partial --resume "/resumable?resumable&etag&truncate" $test_tmpdir/output
+assert_not_has_file $test_tmpdir/output.partial
+assert_file_has_content httpd-ranges "^bytes=[1-9][0-9]*-$"
+python3 -c "import sys; sys.stdout.write('path=/resumable?resumable&etag&truncate\\n' * 1000)" > $test_tmpdir/expected
+cmp $test_tmpdir/output $test_tmpdir/expected
+rm -f $test_tmpdir/output* $test_tmpdir/expected httpd-ranges
+
+ok 'resumed download'
+
+# A partial download that another download holds the lock on is left
+# alone, and the download goes to an anonymous file instead
+exec 9>> $test_tmpdir/output.partial
+flock 9
+assert_partial --resume "/resumable?resumable&etag&truncate&locked" $test_tmpdir/output
+exec 9>&-
+assert_streq "$(stat -c %s $test_tmpdir/output.partial)" 0
+python3 -c "import sys; sys.stdout.write('path=/resumable?resumable&etag&truncate&locked\\n' * 1000)" > $test_tmpdir/expected
+cmp $test_tmpdir/output $test_tmpdir/expected
+rm -f $test_tmpdir/output* $test_tmpdir/expected httpd-ranges
+
+ok 'locked partial download'
+
 # Testing that things work without xattr support
 
 if have_xattrs $test_tmpdir ; then
@@ -156,6 +156,26 @@ ok "change remote to non-OCI"
 ${FLATPAK} remote-modify ${U} --url=oci+http://127.0.0.1:${port} oci-registry >&2
 ${FLATPAK} update ${U} --appstream oci-registry >&2
 
+# The index didn't change, so the summary should not be regenerated
+
+summary_inode=$(stat -c %i $base/oci/oci-registry.summary)
+${FLATPAK} remote-ls ${U} oci-registry >&2
+assert_streq "$summary_inode" "$(stat -c %i $base/oci/oci-registry.summary)"
+
+# The summary is tagged with the index it was generated from, so one
+# that doesn't match the index is regenerated even though it is newer
+
+if setfattr -n user.flatpak.oci-index -v stale $base/oci/oci-registry.summary 2>/dev/null; then
+    ${FLATPAK} update ${U} --appstream oci-registry >&2
+    assert_not_streq "$summary_inode" "$(stat -c %i $base/oci/oci-registry.summary)"
+    getfattr --only-values -n user.flatpak.oci-index $base/oci/oci-registry.summary > summary-key
+    assert_not_file_has_content summary-key "^stale$"
+
+    summary_inode=$(stat -c %i $base/oci/oci-registry.summary)
+    ${FLATPAK} update ${U} --appstream oci-registry >&2
+    assert_streq "$summary_inode" "$(stat -c %i $base/oci/oci-registry.summary)"
+fi
+
 # Delete the remote, check that everything was removed
 
 assert_has_file $base/oci/oci-registry.index.gz
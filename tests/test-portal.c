@@ -459,13 +459,78 @@ test_replace (Fixture *f,
   g_assert_no_error (error);
 }
 
+/* Spawn() passes the installation of the calling app to `flatpak run`,
+ * which here is a deploy in the user installation */
 static void
-teardown (Fixture *f,
-          gconstpointer context G_GNUC_UNUSED)
+test_spawn_installation (Fixture *f,
+                         gconstpointer context G_GNUC_UNUSED)
 {
-  tests_dbus_daemon_teardown (&f->dbus_daemon);
-  g_clear_object (&f->portal);
-  g_free (f->portal_path);
+  g_autoptr(GUnixFDList) fds_in = g_unix_fd_list_new ();
+  g_autoptr(GUnixFDList) fds_out = NULL;
+  g_autoptr(GError) error = NULL;
+  g_auto(GVariantBuilder) fd_map_builder = {};
+  const char * const argv[] = { "hello", NULL };
+  g_autofree char *tempfile_path = g_strdup ("/tmp/flatpak-portal-test.XXXXXX");
+  glnx_autofd int tempfile_fd = -1;
+  g_autofree char *output = NULL;
+  gsize times_exited = 0;
+  gulong handler_id;
+  guint pid;
+  gboolean ok;
+  int handle;
+
+  fixture_start_portal (f);
+
+  handler_id = g_signal_connect (f->proxy, "spawn-exited",
+                                 G_CALLBACK (count_successful_exit_cb),
+                                 &times_exited);
+
+  tempfile_fd = g_mkstemp (tempfile_path);
+  g_assert_no_errno (tempfile_fd);
+  handle = g_unix_fd_list_append (fds_in, tempfile_fd, &error);
+  g_assert_no_error (error);
+
+  g_variant_builder_init (&fd_map_builder, G_VARIANT_TYPE ("a{uh}"));
+  g_variant_builder_add (&fd_map_builder, "{uh}", STDOUT_FILENO, (gint32) handle);
+
+  ok = portal_flatpak_call_spawn_sync (f->proxy,
+                                       "/",           /* cwd */
+                                       argv,          /* argv */
+                                       g_variant_builder_end (&fd_map_builder),
+                                       g_variant_new ("a{ss}", NULL),
+                                       FLATPAK_SPAWN_FLAGS_NONE,
+                                       g_variant_new ("a{sv}", NULL),
+                                       fds_in,
+                                       &pid,
+                                       &fds_out,
+                                       NULL,
+                                       &error);
+  g_assert_no_error (error);
+  g_assert_true (ok);
+
+  while (times_exited == 0)
+    g_main_context_iteration (NULL, TRUE);
+
+  g_signal_handler_disconnect (f->proxy, handler_id);
+
+  g_assert_no_errno (lseek (tempfile_fd, 0, SEEK_SET));
+  output = glnx_fd_readall_utf8 (tempfile_fd, NULL, NULL, &error);
+  g_assert_no_error (error);
+  g_test_message ("Output from mock Flatpak: %s", output);
+
+  if (g_regex_match_simple ("^argv\\[[0-9]+\\] = --user$", output, G_REGEX_MULTILINE, 0))
+    g_test_message ("Found --user in argv");
+  else
+    g_error ("--user not found in \"%s\"", output);
+
+  if (strstr (output, " = --commit=") == NULL)
+    g_error ("--commit not found in \"%s\"", output);
+
+  g_subprocess_send_signal (f->portal, SIGTERM);
+  g_subprocess_wait (f->portal, NULL, &error);
+  g_assert_no_error (error);
+
+  g_assert_no_errno (unlink (tempfile_path));
 }
 
 int
@@ -478,6 +543,7 @@ main (int argc,
   g_test_add ("/basic", Fixture, NULL, setup, test_basic, teardown);
   g_test_add ("/fd-passing", Fixture, NULL, setup, test_fd_passing, teardown);
   g_test_add ("/replace", Fixture, NULL, setup, test_replace, teardown);
+  g_test_add ("/spawn-installation", Fixture, NULL, setup, test_spawn_installation, teardown);
 
   return g_test_run ();
 }
@@ -24,7 +24,7 @@ set -euo pipefail
 skip_without_bwrap
 skip_revokefs_without_fuse
 
-echo "1..44"
+echo "1..48"
 
 #Regular repo
 setup_repo
@@ -102,6 +102,7 @@ assert_has_file $FL_DIR/appstream/test-repo/$ARCH/.timestamp
 assert_has_symlink $FL_DIR/appstream/test-repo/$ARCH/active
 assert_has_file $FL_DIR/appstream/test-repo/$ARCH/active/appstream.xml
 assert_has_file $FL_DIR/appstream/test-repo/$ARCH/active/appstream.xml.gz
+assert_has_file $FL_DIR/appstream/test-repo/$ARCH/active/search-index.gv
 
 ok "update appstream"
 
@@ -109,6 +110,19 @@ ok "update appstream"
 ${FLATPAK} search Hello > search-results
 assert_file_has_content search-results "Print a greeting"
 
+# Prefix matches and the app id substring match go through the index
+${FLATPAK} search hel > search-results
+assert_file_has_content search-results "org.test.Hello"
+${FLATPAK} search test.hel > search-results
+assert_file_has_content search-results "org.test.Hello"
+
+# Without the index, search falls back to parsing the appstream data
+cp $FL_DIR/appstream/test-repo/$ARCH/active/search-index.gv search-index.gv.orig
+rm $FL_DIR/appstream/test-repo/$ARCH/active/search-index.gv
+${FLATPAK} search Hello > search-results
+assert_file_has_content search-results "Print a greeting"
+cp search-index.gv.orig $FL_DIR/appstream/test-repo/$ARCH/active/search-index.gv
+
 ok "search"
 
 if [ x${USE_COLLECTIONS_IN_CLIENT-} != xyes ] ; then
@@ -364,6 +378,28 @@ assert_file_has_content branches-log "^app/org\.test\.Hello/.*eol=Reason1"
 
 ok "eol build-commit-from"
 
+ostree init --repo=repos/test-parallel-copy --mode=archive-z2 ${copy_collection_args} >&2
+${FLATPAK} build-commit-from --parallel --src-repo=repos/test repos/test-parallel-copy > commit-from-log
+assert_file_has_content commit-from-log "^app/org\.test\.Hello/$ARCH/master: "
+assert_file_has_content commit-from-log "^runtime/org\.test\.Platform/$ARCH/master: "
+assert_has_file repos/test-parallel-copy/summary
+
+for ref in app/org.test.Hello/$ARCH/master runtime/org.test.Platform/$ARCH/master; do
+    SRC_COMMIT=$(ostree --repo=repos/test rev-parse $ref)
+    ostree --repo=repos/test-parallel-copy show --print-metadata-key=xa.from_commit $ref > from-commit
+    assert_file_has_content from-commit "$SRC_COMMIT"
+    ostree --repo=repos/test ls -R -C $ref > src-tree
+    ostree --repo=repos/test-parallel-copy ls -R -C $ref > dst-tree
+    diff -u src-tree dst-tree >&2
+done
+
+# Nothing changed, so running it again shouldn't make new commits
+${FLATPAK} build-commit-from --parallel --src-repo=repos/test repos/test-parallel-copy > commit-from-log
+assert_file_has_content commit-from-log "^app/org\.test\.Hello/$ARCH/master: no change"
+assert_not_file_has_content commit-from-log ": [0-9a-f]\{64\}$"
+
+ok "parallel build-commit-from"
+
 ${FLATPAK} ${U} install -y test-repo org.test.Hello >&2
 
 EXPORT_ARGS="--end-of-life=Reason2" make_updated_app
@@ -402,6 +438,53 @@ EXPORT_ARGS="" make_updated_app
 
 ok "eol build-export"
 
+${FLATPAK} ${U} install -y test-repo org.test.Hello >&2
+OLD_COMMIT=$(${FLATPAK} ${U} info --show-commit org.test.Hello)
+
+make_updated_app
+${FLATPAK} ${U} update -y org.test.Hello >&2
+NEW_COMMIT=$(${FLATPAK} ${U} info --show-commit org.test.Hello)
+assert_not_streq "$OLD_COMMIT" "$NEW_COMMIT"
+
+# Drop the old commit locally, so resolving it has to download the commit object
+ostree prune --repo=$FL_DIR/repo --refs-only --depth=0 >&2
+
+# The old commit is not in the summary, so it is resolved by loading the
+# commit object, which should only be requested once by the resolve and
+# once by the actual pull
+httpd_clear_log
+${FLATPAK} ${U} update -y --commit=${OLD_COMMIT} org.test.Hello >&2
+assert_streq "$OLD_COMMIT" "$(${FLATPAK} ${U} info --show-commit org.test.Hello)"
+
+N_COMMIT_REQUESTS=$(grep -c "GET /test/$(commit_to_path $OLD_COMMIT commit) " httpd-log || true)
+if [ "$N_COMMIT_REQUESTS" -lt 1 ] || [ "$N_COMMIT_REQUESTS" -gt 2 ]; then
+    assert_not_reached "Commit object requested $N_COMMIT_REQUESTS times"
+fi
+
+# Without the flatpak cache data in the summary every op has to load its
+# commit object, and these should be fetched in one batch rather than one
+# op at a time
+make_updated_app
+make_updated_runtime
+rm -rf repos/test-nocache
+cp -a repos/test repos/test-nocache
+rm -rf repos/test-nocache/summary* repos/test-nocache/summaries
+ostree summary -u --repo=repos/test-nocache ${FL_GPGARGS} >&2
+${FLATPAK} ${U} remote-modify --url="http://127.0.0.1:${port}/test-nocache" test-repo >&2
+
+${FLATPAK} ${U} update -y -v org.test.Hello org.test.Platform &> update-log
+N_BATCHED=$(sed -n 's/.*Fetching \([0-9]*\) commit objects.*/\1/p' update-log | head -n 1)
+if [ -z "$N_BATCHED" ] || [ "$N_BATCHED" -lt 2 ]; then
+    assert_not_reached "Commit objects of the updated refs not fetched in one batch"
+fi
+
+${FLATPAK} ${U} remote-modify --url="http://127.0.0.1:${port}/test" test-repo >&2
+rm -rf repos/test-nocache
+
+${FLATPAK} ${U} uninstall -y org.test.Hello >&2
+
+ok "resolve commit missing from summary"
+
 if [ x${USE_COLLECTIONS_IN_SERVER-} == xyes ] ; then
     REBASE_COLLECTION_ID=org.test.Collection.rebase
     rebase_collection_args=--collection-id=${REBASE_COLLECTION_ID}
@@ -555,6 +638,16 @@ assert_has_file $FL_DIR/repo/refs/remotes/test-repo/app/org.test.Hello/$ARCH/mas
 
 ok "mirror ref deletion on update"
 
+OLD_COMMIT=$(${FLATPAK} ${U} info --show-commit org.test.Hello)
+make_updated_app test org.test.Collection.test master UPDATE3
+
+# No ${U}, so this covers both the user and the system installation
+${FLATPAK} update --parallel > update-log
+assert_file_has_content update-log "Done with app/org\.test\.Hello/$ARCH/master"
+assert_not_streq "$OLD_COMMIT" "$(${FLATPAK} ${U} info --show-commit org.test.Hello)"
+
+ok "update --parallel"
+
 ${FLATPAK} ${U} list --arch=$ARCH --columns=ref > list-log
 assert_file_has_content list-log "org\.test\.Hello/"
 assert_file_has_content list-log "org\.test\.Platform/"
@@ -576,6 +669,11 @@ ok "uninstall vs installations"
 
 ${FLATPAK} ${U} install -y test-repo org.test.Hello >&2
 
+# The app and runtime are pulled together, which must not leave partial commits
+for REF in org.test.Hello org.test.Platform; do
+    assert_not_has_file $FL_DIR/repo/state/$(${FLATPAK} ${U} info --show-commit $REF).commitpartial
+done
+
 ${FLATPAK} ${U} list --columns=ref > list-log
 assert_file_has_content list-log "org\.test\.Hello/"
 assert_file_has_content list-log "org\.test\.Platform/"
@@ -637,7 +735,15 @@ assert_not_file_has_content list-log "org\.test\.Platform/"
 
 ok "uninstall --all"
 
-${FLATPAK} ${U} install -y test-repo org.test.Hello >&2
+${FLATPAK} ${U} install -y -v test-repo org.test.Hello &> install-log
+
+# The app and its runtime are deployed with a single system helper call
+if [ x${USE_SYSTEMDIR-} == xyes ] && [ x${UID} != x0 ]; then
+    assert_streq "$(grep -c 'Calling system helper: DeployMany$' install-log)" 1
+    assert_not_file_has_content install-log "Calling system helper: Deploy$"
+fi
+
+ok "install deploys in one batch"
 
 ${FLATPAK} ${U} list -a --columns=ref > list-log
 assert_file_has_content list-log "org\.test\.Hello/"
@@ -24,7 +24,7 @@ set -euo pipefail
 skip_without_bwrap
 skip_revokefs_without_fuse
 
-echo "1..20"
+echo "1..24"
 
 # Use stable rather than master as the branch so we can test that the run
 # command automatically finds the branch correctly
@@ -299,6 +299,15 @@ fi
 
 ok "null update"
 
+EXPORTED_DESKTOP=$FL_DIR/app/org.test.Hello/$ARCH/stable/active/export/share/applications/org.test.Hello.desktop
+OLD_DESKTOP_INODE=$(stat -c %i $EXPORTED_DESKTOP)
+
+# Only links into the updated app are checked for being dangling
+ln -s ../../../app/org.test.Hello/current/active/export/share/applications/org.test.Hello.Gone.desktop \
+   $FL_DIR/exports/share/applications/org.test.Hello.Gone.desktop
+ln -s ../../../app/org.test.Other/current/active/export/share/applications/org.test.Other.desktop \
+   $FL_DIR/exports/share/applications/org.test.Other.desktop
+
 make_updated_app "" "" stable
 
 ${FLATPAK} ${U} update -y org.test.Hello >&2
@@ -312,6 +321,27 @@ assert_file_has_content hello_out '^Hello world, from a sandboxUPDATED$'
 
 ok "update"
 
+# The desktop file didn't change, so where the installation supports user
+# xattrs to record how it was rewritten, the new deploy reuses the file
+touch $FL_DIR/xattr-test
+if setfattr -n user.testvalue -v somevalue $FL_DIR/xattr-test > /dev/null 2>&1; then
+    getfattr -n user.flatpak.export-rewrite $EXPORTED_DESKTOP >&2
+    assert_streq "$OLD_DESKTOP_INODE" "$(stat -c %i $EXPORTED_DESKTOP)"
+fi
+rm -f $FL_DIR/xattr-test
+assert_file_has_content $EXPORTED_DESKTOP "^Exec=.*flatpak run --branch=stable --arch=$ARCH --command=hello\.sh org\.test\.Hello$"
+
+ok "unchanged export reused"
+
+if test -L $FL_DIR/exports/share/applications/org.test.Hello.Gone.desktop; then
+    assert_not_reached "Dangling export of the updated app not removed"
+fi
+assert_has_symlink $FL_DIR/exports/share/applications/org.test.Other.desktop
+assert_has_symlink $FL_DIR/exports/share/applications/org.test.Hello.desktop
+rm $FL_DIR/exports/share/applications/org.test.Other.desktop
+
+ok "dangling export removed"
+
 ostree --repo=repos/test reset app/org.test.Hello/$ARCH/stable "$OLD_COMMIT" >&2
 update_repo
 
@@ -543,3 +573,77 @@ ${FLATPAK} ${U} info -m org.test.App > out
 assert_file_has_content out "^sdk=org\.test\.Sdk/$(flatpak --default-arch)/stable$"
 
 ok "--sdk option"
+
+rm -f "$XDG_RUNTIME_DIR"/.dbus-proxy/shared-*
+ARGS="--share-dbus-proxy" run_sh org.test.Hello 'echo started; sleep 5' > first-instance &
+first_pid=$!
+for i in $(seq 50); do
+    if grep -q started first-instance; then
+        break
+    fi
+    sleep 0.1
+done
+assert_file_has_content first-instance '^started$'
+ARGS="--share-dbus-proxy" run_sh org.test.Hello 'echo second; sleep 2' > second-instance &
+second_pid=$!
+for i in $(seq 50); do
+    if grep -q second second-instance; then
+        break
+    fi
+    sleep 0.1
+done
+assert_file_has_content second-instance '^second$'
+
+ls "$XDG_RUNTIME_DIR"/.dbus-proxy/ | grep '^shared-.*\.fifo$' > shared-fifos
+assert_streq "$(wc -l < shared-fifos)" "1"
+
+# Exactly one proxy holds the fifo while both instances are running
+fifo_id=$(stat -c %d:%i "$XDG_RUNTIME_DIR/.dbus-proxy/$(cat shared-fifos)")
+for pid in $(ls /proc | grep '^[0-9]*$'); do
+    case "$(readlink /proc/$pid/exe 2>/dev/null || :)" in
+        *dbus-proxy)
+            for fd in /proc/$pid/fd/*; do
+                if [ "$(stat -L -c %d:%i $fd 2>/dev/null || :)" = "$fifo_id" ]; then
+                    echo $pid
+                    break
+                fi
+            done
+            ;;
+    esac
+done > shared-proxies
+assert_streq "$(wc -l < shared-proxies)" "1"
+
+wait $first_pid
+wait $second_pid
+
+# The next shared proxy, here with another bus policy, cleans up after
+# the exited one
+for i in $(seq 50); do
+    if ! [ -d /proc/$(cat shared-proxies) ]; then
+        break
+    fi
+    sleep 0.1
+done
+ARGS="--share-dbus-proxy --talk-name=org.example.Other" run_sh org.test.Hello 'true'
+ls "$XDG_RUNTIME_DIR"/.dbus-proxy/ | grep '^shared-' > shared-files-after
+assert_not_file_has_content shared-files-after "^$(basename $(cat shared-fifos) .fifo)"
+assert_not_file_has_content shared-files-after '\.lock$'
+
+ok "--share-dbus-proxy"
+
+# Compare a build dir that is copied from the deploys with one checked out
+# from the repo, and report how long each took
+rm -rf app-copy app-checkout
+start=$(date +%s%N)
+${FLATPAK} build-init --writable-sdk --var=org.test.Platform app-copy org.test.Checkout org.test.Platform org.test.Platform stable >&2
+copy_ms=$(( ($(date +%s%N) - start) / 1000000 ))
+start=$(date +%s%N)
+${FLATPAK} build-init --checkout --writable-sdk --var=org.test.Platform app-checkout org.test.Checkout org.test.Platform org.test.Platform stable >&2
+checkout_ms=$(( ($(date +%s%N) - start) / 1000000 ))
+echo "# build-init took ${copy_ms}ms copying, ${checkout_ms}ms with --checkout" >&2
+
+diff -r --no-dereference app-copy/usr app-checkout/usr >&2
+diff -r --no-dereference app-copy/var app-checkout/var >&2
+assert_has_file app-checkout/usr/.ref
+
+ok "build-init --checkout"
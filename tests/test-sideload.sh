@@ -48,6 +48,16 @@ assert_has_file usb_dir/repo/refs/mirrors/org.test.Collection.test/runtime/org.t
 assert_has_file usb_dir/repo/refs/mirrors/org.test.Collection.test/runtime/org.test.Platform/${ARCH}/master
 assert_has_file usb_dir/repo/refs/mirrors/org.test.Collection.test/appstream2/${ARCH}
 
+mkdir usb_dir_parallel
+${FLATPAK} ${U} create-usb --parallel --destination-repo=repo usb_dir_parallel org.test.Hello > create-usb-out
+assert_file_has_content create-usb-out '^Copied [0-9]* objects'
+for ref in app/org.test.Hello/${ARCH}/master runtime/org.test.Hello.Locale/${ARCH}/master runtime/org.test.Platform/${ARCH}/master appstream2/${ARCH}; do
+    assert_streq "$(cat usb_dir_parallel/repo/refs/mirrors/org.test.Collection.test/$ref)" \
+                 "$(cat usb_dir/repo/refs/mirrors/org.test.Collection.test/$ref)"
+done
+assert_has_file usb_dir_parallel/repo/summary
+ostree fsck --repo=usb_dir_parallel/repo >&2
+
 ${FLATPAK} ${U} uninstall -y --all >&2
 
 ok "created sideloaded repo"
@@ -21,7 +21,7 @@ set -euo pipefail
 
 . $(dirname $0)/libtest.sh
 
-echo "1..2"
+echo "1..3"
 
 setup_repo
 
@@ -261,3 +261,27 @@ assert_not_file_has_content httpd-log summaries/${ACTIVE_SUBSET}.gz
 assert_not_file_has_content httpd-log summaries/${OLD_ACTIVE_SUBSET}-${ACTIVE_SUBSET}.delta
 
 ok subsummary fetching and caching
+
+# This clears the cached summaries, so the next use revalidates
+$FLATPAK $U remote-modify --summary-max-age=3600 test-repo
+
+httpd_clear_log
+$FLATPAK $U remote-ls test-repo > /dev/null
+assert_file_has_content httpd-log summary.idx
+
+$FLATPAK build-commit-from ${GPGARGS} --src-ref=app/org.app.App1/$ARCH/master repos/test app/org.app.App1.NEW3/$ARCH/master >&2
+
+# Within the max age the validated cache is used without the network
+httpd_clear_log
+$FLATPAK $U remote-ls test-repo > remote-ls-log
+assert_not_file_has_content httpd-log summary.idx
+assert_not_file_has_content remote-ls-log org.app.App1.NEW3
+
+$FLATPAK $U remote-modify --summary-max-age=0 test-repo
+
+httpd_clear_log
+$FLATPAK $U remote-ls test-repo > remote-ls-log
+assert_file_has_content httpd-log summary.idx
+assert_file_has_content remote-ls-log org.app.App1.NEW3
+
+ok summary max age
@@ -1,14 +1,21 @@
 #include "config.h"
 
+#include <fcntl.h>
+#include <linux/magic.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/vfs.h>
 #include <sys/wait.h>
 
 #include <glib.h>
 #include "flatpak.h"
 #include "flatpak-utils-private.h"
 #include "flatpak-appdata-private.h"
+#include "flatpak-json-oci-private.h"
 #include "flatpak-builtins-utils.h"
+#include "flatpak-dir-private.h"
+#include "flatpak-history-private.h"
 #include "flatpak-run-private.h"
 #include "flatpak-table-printer.h"
 #include "parse-datetime.h"
@@ -1837,6 +1844,540 @@ test_parse_x11_display (void)
     }
 }
 
+/* Generates an OCI registry index like the ones served by /index/static */
+static GBytes *
+make_oci_index (guint n_repos)
+{
+  GString *s = g_string_new ("{ \"Registry\": \"https://registry.example.com/\",\n  \"Results\": [\n");
+  guint i;
+
+  for (i = 0; i < n_repos; i++)
+    {
+      g_string_append_printf (s,
+                              "    { \"Name\": \"org.example.App%u\",\n"
+                              "      \"Images\": [\n"
+                              "        { \"Digest\": \"sha256:%064x\",\n"
+                              "          \"MediaType\": \"application/vnd.oci.image.manifest.v1+json\",\n"
+                              "          \"OS\": \"linux\", \"Architecture\": \"amd64\",\n"
+                              "          \"Size\": %u, \"Unknown\": [ 1.5e3, { \"a\": null }, true ],\n"
+                              "          \"Annotations\": { \"org.example.escaped\": \"\\u00e9\\ud83d\\ude00\\t\\\"\" },\n"
+                              "          \"Labels\": { \"org.flatpak.ref\": \"app/org.example.App%u/x86_64/stable\",\n"
+                              "                      \"org.flatpak.metadata\": \"[Application]\\nname=org.example.App%u\\n\" },\n"
+                              "          \"Tags\": [ \"latest\", 42, \"stable\" ] }\n"
+                              "      ],\n"
+                              "      \"Lists\": [ { \"Digest\": \"sha256:%064x\", \"Images\": [], \"Tags\": null } ] }%s\n",
+                              i, i, i * 1000, i, i, i + 1,
+                              i + 1 < n_repos ? "," : "");
+    }
+
+  g_string_append (s, "  ]\n}\n");
+
+  return g_string_free_to_bytes (s);
+}
+
+static FlatpakOciIndexResponse *
+oci_index_from_stream (GBytes  *bytes,
+                       GError **error)
+{
+  g_autoptr(GInputStream) in = g_memory_input_stream_new_from_bytes (bytes);
+
+  return (FlatpakOciIndexResponse *) flatpak_json_from_stream (in, FLATPAK_TYPE_OCI_INDEX_RESPONSE,
+                                                               NULL, error);
+}
+
+static void
+assert_oci_index_image_equal (FlatpakOciIndexImage *a,
+                              FlatpakOciIndexImage *b)
+{
+  gsize i;
+
+  g_assert_cmpstr (a->digest, ==, b->digest);
+  g_assert_cmpstr (a->mediatype, ==, b->mediatype);
+  g_assert_cmpstr (a->os, ==, b->os);
+  g_assert_cmpstr (a->architecture, ==, b->architecture);
+  g_assert_cmpstr (g_hash_table_lookup (a->labels, "org.flatpak.ref"), ==,
+                   g_hash_table_lookup (b->labels, "org.flatpak.ref"));
+  g_assert_cmpstr (g_hash_table_lookup (a->labels, "org.flatpak.metadata"), ==,
+                   g_hash_table_lookup (b->labels, "org.flatpak.metadata"));
+  g_assert_cmpstr (g_hash_table_lookup (a->annotations, "org.example.escaped"), ==,
+                   g_hash_table_lookup (b->annotations, "org.example.escaped"));
+  g_assert_cmpuint (g_strv_length (a->tags), ==, g_strv_length (b->tags));
+  for (i = 0; a->tags[i] != NULL; i++)
+    g_assert_cmpstr (a->tags[i], ==, b->tags[i]);
+}
+
+static void
+test_json_stream (void)
+{
+  g_autoptr(GBytes) bytes = make_oci_index (50);
+  g_autoptr(FlatpakOciIndexResponse) tree = NULL;
+  g_autoptr(FlatpakOciIndexResponse) streamed = NULL;
+  g_autoptr(GError) error = NULL;
+  const char *bad_json[] = {
+    "",
+    "[]",
+    "{ \"Registry\": \"a\" ",
+    "{ \"Registry\": \"a\", }",
+    "{ \"Registry\": \"a\" } x",
+    "{ \"Registry\": 1 }",
+    "{ \"Registry\": \"\\ud800\" }",
+    "{ \"Results\": [ 1 ] }",
+    "{ \"Results\": [ { \"Images\": [ { \"Labels\": { \"a\": 1 } } ] } ] }",
+  };
+  gsize i;
+  int j;
+
+  tree = (FlatpakOciIndexResponse *) flatpak_json_from_bytes (bytes, FLATPAK_TYPE_OCI_INDEX_RESPONSE, &error);
+  g_assert_no_error (error);
+  streamed = oci_index_from_stream (bytes, &error);
+  g_assert_no_error (error);
+
+  g_assert_cmpstr (tree->registry, ==, streamed->registry);
+  for (i = 0; tree->results[i] != NULL; i++)
+    {
+      FlatpakOciIndexRepository *a = tree->results[i];
+      FlatpakOciIndexRepository *b = streamed->results[i];
+
+      g_assert_nonnull (b);
+      g_assert_cmpstr (a->name, ==, b->name);
+      for (j = 0; a->images[j] != NULL; j++)
+        assert_oci_index_image_equal (a->images[j], b->images[j]);
+      g_assert_null (b->images[j]);
+
+      g_assert_cmpstr (a->lists[0]->digest, ==, b->lists[0]->digest);
+      g_assert_null (b->lists[0]->images[0]);
+      g_assert_null (b->lists[0]->tags);
+    }
+  g_assert_null (streamed->results[i]);
+  g_assert_cmpuint (i, ==, 50);
+
+  g_assert_cmpstr (g_hash_table_lookup (streamed->results[0]->images[0]->annotations, "org.example.escaped"),
+                   ==, "\xc3\xa9\xf0\x9f\x98\x80\t\"");
+  g_assert_cmpstr (streamed->results[0]->images[0]->tags[1], ==, "stable");
+
+  for (i = 0; i < G_N_ELEMENTS (bad_json); i++)
+    {
+      g_autoptr(GBytes) bad = g_bytes_new_static (bad_json[i], strlen (bad_json[i]));
+      g_autoptr(FlatpakOciIndexResponse) res = NULL;
+
+      g_test_message ("%s", bad_json[i]);
+      res = oci_index_from_stream (bad, &error);
+      g_assert_null (res);
+      g_assert_nonnull (error);
+      g_test_message ("-> %s", error->message);
+      g_clear_error (&error);
+    }
+
+  if (g_test_perf ())
+    {
+      g_autoptr(GBytes) large = make_oci_index (20000);
+      g_autoptr(GTimer) timer = g_timer_new ();
+      double elapsed;
+
+      for (j = 0; j < 5; j++)
+        {
+          g_autoptr(FlatpakJson) json = flatpak_json_from_bytes (large, FLATPAK_TYPE_OCI_INDEX_RESPONSE, &error);
+          g_assert_no_error (error);
+        }
+      elapsed = g_timer_elapsed (timer, NULL) / 5;
+      g_test_minimized_result (elapsed, "tree parse of %" G_GSIZE_FORMAT " byte index: %.3f s",
+                               g_bytes_get_size (large), elapsed);
+
+      g_timer_start (timer);
+      for (j = 0; j < 5; j++)
+        {
+          g_autoptr(FlatpakOciIndexResponse) json = oci_index_from_stream (large, &error);
+          g_assert_no_error (error);
+        }
+      elapsed = g_timer_elapsed (timer, NULL) / 5;
+      g_test_minimized_result (elapsed, "streaming parse of %" G_GSIZE_FORMAT " byte index: %.3f s",
+                               g_bytes_get_size (large), elapsed);
+    }
+}
+
+#define SIDELOAD_TEST_COLLECTION_ID "org.test.Sideload"
+
+/* Creates a sideload repo at @path with one commit for all of @refs,
+ * timestamped @timestamp, and returns its checksum */
+static char *
+make_sideload_repo (const char   *path,
+                    const char  **refs,
+                    guint64       timestamp)
+{
+  g_autoptr(GFile) file = g_file_new_for_path (path);
+  g_autoptr(OstreeRepo) repo = ostree_repo_new (file);
+  g_autoptr(OstreeMutableTree) mtree = ostree_mutable_tree_new ();
+  g_autoptr(GFileInfo) finfo = g_file_info_new ();
+  g_autoptr(GKeyFile) config = NULL;
+  g_autoptr(GVariant) dirmeta = NULL;
+  g_autofree guchar *dirmeta_csum = NULL;
+  g_autofree char *dirmeta_checksum = NULL;
+  g_autoptr(GFile) root = NULL;
+  g_autoptr(GError) error = NULL;
+  char *commit = NULL;
+  gsize i;
+
+  ostree_repo_create (repo, OSTREE_REPO_MODE_ARCHIVE, NULL, &error);
+  g_assert_no_error (error);
+  ostree_repo_set_collection_id (repo, SIDELOAD_TEST_COLLECTION_ID, &error);
+  g_assert_no_error (error);
+  config = ostree_repo_copy_config (repo);
+  ostree_repo_write_config (repo, config, &error);
+  g_assert_no_error (error);
+
+  ostree_repo_prepare_transaction (repo, NULL, NULL, &error);
+  g_assert_no_error (error);
+
+  g_file_info_set_attribute_uint32 (finfo, "unix::uid", 0);
+  g_file_info_set_attribute_uint32 (finfo, "unix::gid", 0);
+  g_file_info_set_attribute_uint32 (finfo, "unix::mode", 040755);
+  dirmeta = g_variant_ref_sink (ostree_create_directory_metadata (finfo, NULL));
+  ostree_repo_write_metadata (repo, OSTREE_OBJECT_TYPE_DIR_META, NULL, dirmeta,
+                              &dirmeta_csum, NULL, &error);
+  g_assert_no_error (error);
+  dirmeta_checksum = ostree_checksum_from_bytes (dirmeta_csum);
+  ostree_mutable_tree_set_metadata_checksum (mtree, dirmeta_checksum);
+
+  ostree_repo_write_mtree (repo, mtree, &root, NULL, &error);
+  g_assert_no_error (error);
+  ostree_repo_write_commit_with_time (repo, NULL, "sideload", NULL, NULL,
+                                      OSTREE_REPO_FILE (root), timestamp,
+                                      &commit, NULL, &error);
+  g_assert_no_error (error);
+
+  for (i = 0; refs[i] != NULL; i++)
+    {
+      OstreeCollectionRef collection_ref = { (char *) SIDELOAD_TEST_COLLECTION_ID, (char *) refs[i] };
+
+      ostree_repo_transaction_set_collection_ref (repo, &collection_ref, commit);
+    }
+
+  ostree_repo_commit_transaction (repo, NULL, NULL, &error);
+  g_assert_no_error (error);
+  ostree_repo_regenerate_summary (repo, NULL, NULL, &error);
+  g_assert_no_error (error);
+
+  return commit;
+}
+
+static void
+test_sideload_index (void)
+{
+  const guint n_repos = 50;
+  const guint n_refs = 20;
+  g_autoptr(FlatpakRemoteState) state = flatpak_remote_state_new ();
+  g_autoptr(GPtrArray) refs = g_ptr_array_new_with_free_func (g_free);
+  g_autoptr(GPtrArray) repo_paths = g_ptr_array_new_with_free_func (g_free);
+  g_autofree char *newest_commit = NULL;
+  g_autofree char *tmpdir = NULL;
+  g_autoptr(GTimer) timer = NULL;
+  g_autoptr(GError) error = NULL;
+  double elapsed;
+  guint i, j;
+
+  tmpdir = g_dir_make_tmp ("flatpak-test-sideload.XXXXXX", &error);
+  g_assert_no_error (error);
+
+  for (i = 0; i < n_refs; i++)
+    g_ptr_array_add (refs, g_strdup_printf ("app/org.test.App%u/x86_64/stable", i));
+  g_ptr_array_add (refs, NULL);
+
+  /* Every repo has all the refs, the one created last has the newest commit */
+  for (i = 0; i < n_repos; i++)
+    {
+      char *path = g_strdup_printf ("%s/repo%u", tmpdir, i);
+
+      g_ptr_array_add (repo_paths, path);
+      g_free (newest_commit);
+      newest_commit = make_sideload_repo (path, (const char **) refs->pdata, 1000 + i);
+    }
+
+  state->remote_name = g_strdup ("test-repo");
+  state->collection_id = g_strdup (SIDELOAD_TEST_COLLECTION_ID);
+
+  timer = g_timer_new ();
+  for (i = 0; i < n_repos; i++)
+    {
+      g_autoptr(GFile) file = g_file_new_for_path (g_ptr_array_index (repo_paths, i));
+
+      flatpak_remote_state_add_sideload_dir (state, file);
+    }
+  elapsed = g_timer_elapsed (timer, NULL);
+  g_assert_cmpuint (state->sideload_repos->len, ==, n_repos);
+  g_test_message ("adding %u sideload repos: %.3f s", n_repos, elapsed);
+
+  for (i = 0; i < n_refs; i++)
+    {
+      const char *ref = g_ptr_array_index (refs, i);
+      g_autofree char *checksum = NULL;
+      g_autoptr(GFile) sideload_path = NULL;
+      guint64 timestamp;
+
+      flatpak_remote_state_lookup_ref (state, ref, &checksum, &timestamp, NULL, &sideload_path, &error);
+      g_assert_no_error (error);
+      g_assert_cmpstr (checksum, ==, newest_commit);
+      g_assert_cmpuint (timestamp, ==, 1000 + n_repos - 1);
+      g_assert_cmpstr (flatpak_file_get_path_cached (sideload_path), ==,
+                       g_ptr_array_index (repo_paths, n_repos - 1));
+    }
+
+  g_assert_false (flatpak_remote_state_lookup_ref (state, "app/org.test.Missing/x86_64/stable",
+                                                   NULL, NULL, NULL, NULL, &error));
+  g_assert_error (error, FLATPAK_ERROR, FLATPAK_ERROR_REF_NOT_FOUND);
+  g_clear_error (&error);
+
+  if (g_test_perf ())
+    {
+      const guint n_iterations = 1000;
+
+      g_timer_start (timer);
+      for (j = 0; j < n_iterations; j++)
+        for (i = 0; i < n_refs; i++)
+          {
+            g_autofree char *checksum = NULL;
+            g_autoptr(GFile) sideload_path = NULL;
+
+            flatpak_remote_state_lookup_ref (state, g_ptr_array_index (refs, i),
+                                             &checksum, NULL, NULL, &sideload_path, &error);
+            g_assert_no_error (error);
+
+            g_clear_object (&sideload_path);
+            sideload_path = flatpak_remote_state_lookup_sideload_checksum (state, checksum);
+            g_assert_nonnull (sideload_path);
+          }
+      elapsed = g_timer_elapsed (timer, NULL);
+      g_test_minimized_result (elapsed / (n_iterations * n_refs),
+                               "ref and commit lookup with %u sideload repos: %.3f us",
+                               n_repos, elapsed * G_USEC_PER_SEC / (n_iterations * n_refs));
+    }
+
+  glnx_shutil_rm_rf_at (AT_FDCWD, tmpdir, NULL, &error);
+  g_assert_no_error (error);
+}
+
+/* Returns the number following @key in the /proc/self file @name */
+static guint64
+read_proc_self_value (const char *name,
+                      const char *key)
+{
+  g_autofree char *path = g_build_filename ("/proc/self", name, NULL);
+  g_autofree char *contents = NULL;
+  const char *line;
+
+  if (!g_file_get_contents (path, &contents, NULL, NULL))
+    return 0;
+
+  line = strstr (contents, key);
+  if (line == NULL)
+    return 0;
+
+  return g_ascii_strtoull (line + strlen (key), NULL, 10);
+}
+
+/* Builds detached metadata like the one flatpak_dir_pull_extra_data()
+ * writes, with @size bytes of extra data mapped from @blob_tmpf */
+static GVariant *
+make_extra_data_metadata (gsize        size,
+                          GLnxTmpfile *blob_tmpf)
+{
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GMappedFile) mfile = NULL;
+  g_autoptr(GBytes) bytes = NULL;
+  g_autofree guint8 *chunk = g_malloc (1024 * 1024);
+  g_autoptr(GVariantBuilder) extra_data_builder = g_variant_builder_new (G_VARIANT_TYPE ("a(ayay)"));
+  g_auto(GVariantDict) dict = FLATPAK_VARIANT_DICT_INITIALIZER;
+  gsize offset;
+
+  glnx_open_anonymous_tmpfile (O_RDWR | O_CLOEXEC, blob_tmpf, &error);
+  g_assert_no_error (error);
+
+  for (offset = 0; offset < 1024 * 1024; offset++)
+    chunk[offset] = offset % 251;
+
+  for (offset = 0; offset < size; offset += 1024 * 1024)
+    g_assert_no_errno (glnx_loop_write (blob_tmpf->fd, chunk, MIN (size - offset, 1024 * 1024)));
+
+  mfile = g_mapped_file_new_from_fd (blob_tmpf->fd, FALSE, &error);
+  g_assert_no_error (error);
+  bytes = g_mapped_file_get_bytes (mfile);
+
+  g_variant_builder_add (extra_data_builder, "(^ay@ay)", "extra-data.bin",
+                         g_variant_new_from_bytes (G_VARIANT_TYPE ("ay"), bytes, TRUE));
+
+  g_variant_dict_init (&dict, NULL);
+  g_variant_dict_insert (&dict, "xa.other", "s", "value");
+  g_variant_dict_insert_value (&dict, "xa.extra-data", g_variant_builder_end (extra_data_builder));
+
+  return g_variant_ref_sink (g_variant_dict_end (&dict));
+}
+
+static void
+test_variant_store_to_fd (void)
+{
+  g_autoptr(GError) error = NULL;
+  g_auto(GLnxTmpfile) blob_tmpf = { 0 };
+  g_auto(GLnxTmpfile) tmpf = { 0 };
+  g_autoptr(GVariant) metadata = NULL;
+  g_autoptr(GVariant) stored = NULL;
+  g_autoptr(GVariant) extra_data = NULL;
+
+  metadata = make_extra_data_metadata (1024 * 1024 + 3, &blob_tmpf);
+
+  glnx_open_anonymous_tmpfile (O_RDWR | O_CLOEXEC, &tmpf, &error);
+  g_assert_no_error (error);
+  stored = flatpak_variant_store_to_fd (metadata, tmpf.fd, &error);
+  g_assert_no_error (error);
+
+  g_assert_cmpint (lseek (tmpf.fd, 0, SEEK_END), ==, g_variant_get_size (metadata));
+  g_assert_true (g_variant_is_normal_form (stored));
+  g_assert_true (g_variant_equal (stored, metadata));
+
+  extra_data = g_variant_lookup_value (stored, "xa.extra-data", G_VARIANT_TYPE ("a(ayay)"));
+  g_assert_nonnull (extra_data);
+  g_assert_cmpuint (g_variant_n_children (extra_data), ==, 1);
+
+  if (g_test_perf ())
+    {
+      const gsize size = 256 * 1024 * 1024;
+      g_auto(GLnxTmpfile) large_blob_tmpf = { 0 };
+      g_auto(GLnxTmpfile) large_tmpf = { 0 };
+      g_auto(GLnxTmpfile) copy_tmpf = { 0 };
+      g_autoptr(GVariant) large = NULL;
+      g_autoptr(GVariant) large_stored = NULL;
+      g_autoptr(GBytes) large_bytes = NULL;
+      guint64 anon_before, written_before;
+      guint64 anon_kb, written;
+
+      large = make_extra_data_metadata (size, &large_blob_tmpf);
+
+      /* Streamed into the file, as flatpak_dir_pull_extra_data() does */
+      glnx_open_anonymous_tmpfile (O_RDWR | O_CLOEXEC, &large_tmpf, &error);
+      g_assert_no_error (error);
+      anon_before = read_proc_self_value ("status", "RssAnon:");
+      written_before = read_proc_self_value ("io", "wchar:");
+      large_stored = flatpak_variant_store_to_fd (large, large_tmpf.fd, &error);
+      g_assert_no_error (error);
+      anon_kb = read_proc_self_value ("status", "RssAnon:") - anon_before;
+      written = read_proc_self_value ("io", "wchar:") - written_before;
+      g_test_minimized_result (anon_kb,
+                               "anonymous memory for %" G_GSIZE_FORMAT " MiB of extra data, streamed: %" G_GUINT64_FORMAT " KiB, %" G_GUINT64_FORMAT " bytes written",
+                               size / (1024 * 1024), anon_kb, written);
+
+      /* Serialized in memory and then written, as before */
+      glnx_open_anonymous_tmpfile (O_RDWR | O_CLOEXEC, &copy_tmpf, &error);
+      g_assert_no_error (error);
+      anon_before = read_proc_self_value ("status", "RssAnon:");
+      written_before = read_proc_self_value ("io", "wchar:");
+      large_bytes = g_variant_get_data_as_bytes (large);
+      g_assert_no_errno (glnx_loop_write (copy_tmpf.fd, g_bytes_get_data (large_bytes, NULL),
+                                          g_bytes_get_size (large_bytes)));
+      anon_kb = read_proc_self_value ("status", "RssAnon:") - anon_before;
+      written = read_proc_self_value ("io", "wchar:") - written_before;
+      g_test_message ("anonymous memory for %" G_GSIZE_FORMAT " MiB of extra data, in memory: %" G_GUINT64_FORMAT " KiB, %" G_GUINT64_FORMAT " bytes written",
+                      size / (1024 * 1024), anon_kb, written);
+    }
+}
+
+/* tmpfs has no reflink support, so this checks the fallback that makes
+ * the system helper copy objects instead of reflinking them */
+static void
+test_reflink_fd_fallback (void)
+{
+  g_autoptr(GError) error = NULL;
+  g_auto(GLnxTmpfile) src_tmpf = { 0 };
+  g_auto(GLnxTmpfile) dest_tmpf = { 0 };
+  glnx_autofd int dfd = -1;
+  struct statfs stfs;
+  gboolean linked = TRUE;
+
+  if (!glnx_opendirat (AT_FDCWD, "/dev/shm", TRUE, &dfd, NULL) ||
+      fstatfs (dfd, &stfs) != 0 || stfs.f_type != TMPFS_MAGIC)
+    {
+      g_test_skip ("/dev/shm is not a tmpfs");
+      return;
+    }
+
+  glnx_open_tmpfile_linkable_at (dfd, ".", O_RDWR | O_CLOEXEC, &src_tmpf, &error);
+  g_assert_no_error (error);
+  glnx_open_tmpfile_linkable_at (dfd, ".", O_RDWR | O_CLOEXEC, &dest_tmpf, &error);
+  g_assert_no_error (error);
+
+  g_assert_no_errno (glnx_loop_write (src_tmpf.fd, "some data", strlen ("some data")));
+
+  g_assert_true (flatpak_reflink_fd (src_tmpf.fd, dest_tmpf.fd, &linked, &error));
+  g_assert_no_error (error);
+  g_assert_false (linked);
+  g_assert_cmpint (lseek (dest_tmpf.fd, 0, SEEK_END), ==, 0);
+
+  /* The second time the result is remembered for the filesystem */
+  linked = TRUE;
+  g_assert_true (flatpak_reflink_fd (src_tmpf.fd, dest_tmpf.fd, &linked, &error));
+  g_assert_no_error (error);
+  g_assert_false (linked);
+  g_assert_cmpint (lseek (dest_tmpf.fd, 0, SEEK_END), ==, 0);
+}
+
+/* A record that was cut short leaves the ones appended after it
+ * unaligned, they must still be found */
+static void
+test_history_torn_record (void)
+{
+  g_autoptr(GError) error = NULL;
+  g_autofree char *tmpdir = NULL;
+  g_autofree char *segment = NULL;
+  g_autofree char *contents = NULL;
+  g_autoptr(GFile) history_dir = NULL;
+  g_autoptr(GPtrArray) entries = NULL;
+  const char *fields[] = { "OPERATION", "deploy install", "REF", "app/org.test.Hello/x86_64/master", NULL };
+  glnx_autofd int fd = -1;
+  gint64 oldest = 0;
+  gsize len;
+  struct stat stbuf;
+  int i;
+
+  tmpdir = g_dir_make_tmp ("flatpak-history-XXXXXX", &error);
+  g_assert_no_error (error);
+  history_dir = g_file_new_build_filename (tmpdir, "history", NULL);
+
+  for (i = 0; i < 2; i++)
+    {
+      flatpak_history_append (history_dir, 1000 + i, fields, &error);
+      g_assert_no_error (error);
+    }
+
+  segment = g_build_filename (tmpdir, "history", "00000000000000001000.log", NULL);
+  g_assert_no_errno (stat (segment, &stbuf));
+  g_assert_cmpint (stbuf.st_mode & 0777, ==, 0600);
+
+  /* Append the first 11 bytes of a record again, as if a write was interrupted */
+  g_file_get_contents (segment, &contents, &len, &error);
+  g_assert_no_error (error);
+  fd = open (segment, O_WRONLY | O_APPEND | O_CLOEXEC);
+  g_assert_no_errno (fd);
+  g_assert_no_errno (glnx_loop_write (fd, contents, 11));
+
+  for (i = 2; i < 4; i++)
+    {
+      flatpak_history_append (history_dir, 1000 + i, fields, &error);
+      g_assert_no_error (error);
+    }
+
+  entries = flatpak_history_load (history_dir, 0, 0, &oldest, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_cmpint (oldest, ==, 1000);
+  g_assert_cmpint (entries->len, ==, 4);
+
+  for (i = 0; i < 4; i++)
+    {
+      FlatpakHistoryEntry *entry = entries->pdata[i];
+
+      g_assert_cmpint (entry->time, ==, 1000 + i);
+      g_assert_cmpstr (g_hash_table_lookup (entry->fields, "REF"), ==, "app/org.test.Hello/x86_64/master");
+    }
+
+  glnx_shutil_rm_rf_at (AT_FDCWD, tmpdir, NULL, NULL);
+}
+
 int
 main (int argc, char *argv[])
 {
@@ -1870,6 +2411,11 @@ main (int argc, char *argv[])
   g_test_add_func ("/common/quote-argv", test_quote_argv);
   g_test_add_func ("/common/str-is-integer", test_str_is_integer);
   g_test_add_func ("/common/parse-x11-display", test_parse_x11_display);
+  g_test_add_func ("/common/json-stream", test_json_stream);
+  g_test_add_func ("/common/sideload-index", test_sideload_index);
+  g_test_add_func ("/common/variant-store-to-fd", test_variant_store_to_fd);
+  g_test_add_func ("/common/reflink-fd-fallback", test_reflink_fd_fallback);
+  g_test_add_func ("/common/history-torn-record", test_history_torn_record);
 
   g_test_add_func ("/app/looks-like-branch", test_looks_like_branch);
   g_test_add_func ("/app/columns", test_columns);
@@ -4591,6 +4591,89 @@ test_install_bundle (void)
   g_assert_nonnull (ref);
 }
 
+static void
+bundle_progress_changed (FlatpakTransactionProgress *progress,
+                         gpointer                    user_data)
+{
+  GArray *values = user_data;
+  int value = flatpak_transaction_progress_get_progress (progress);
+
+  g_array_append_val (values, value);
+}
+
+static void
+bundle_new_op (FlatpakTransaction          *transaction,
+               FlatpakTransactionOperation *op,
+               FlatpakTransactionProgress  *progress,
+               gpointer                     user_data)
+{
+  if (flatpak_transaction_operation_get_operation_type (op) == FLATPAK_TRANSACTION_OPERATION_INSTALL_BUNDLE)
+    g_signal_connect (progress, "changed", G_CALLBACK (bundle_progress_changed), user_data);
+}
+
+static int
+bundle_choose_remote (FlatpakTransaction *transaction,
+                      const char         *ref,
+                      const char         *runtime,
+                      const char        **remotes)
+{
+  int i;
+
+  for (i = 0; remotes[i] != NULL; i++)
+    {
+      if (strcmp (remotes[i], repo_name) == 0)
+        return i;
+    }
+
+  return -1;
+}
+
+/* install a bundle in a transaction and check its progress reporting */
+static void
+test_transaction_install_bundle (void)
+{
+  g_autoptr(FlatpakInstallation) inst = NULL;
+  g_autoptr(FlatpakTransaction) transaction = NULL;
+  g_autoptr(GArray) values = g_array_new (FALSE, FALSE, sizeof (int));
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GFile) file = NULL;
+  g_autofree char *path = NULL;
+  gboolean res;
+  guint i;
+
+  inst = flatpak_installation_new_user (NULL, &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (inst);
+
+  empty_installation (inst);
+
+  path = g_build_filename (testdir, "bundles", "hello.flatpak", NULL);
+  file = g_file_new_for_path (path);
+
+  transaction = flatpak_transaction_new_for_installation (inst, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (transaction);
+
+  res = flatpak_transaction_add_install_bundle (transaction, file, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_true (res);
+
+  g_signal_connect (transaction, "choose-remote-for-ref", G_CALLBACK (bundle_choose_remote), NULL);
+  g_signal_connect (transaction, "new-operation", G_CALLBACK (bundle_new_op), values);
+
+  res = flatpak_transaction_run (transaction, NULL, &error);
+  g_assert_no_error (error);
+  g_assert_true (res);
+
+  /* The delta of the bundle is applied in one go, so there is a change
+   * when it starts and one when it is done */
+  g_assert_cmpuint (values->len, >=, 2);
+  g_assert_cmpint (g_array_index (values, int, 0), <, 100);
+  for (i = 1; i < values->len; i++)
+    g_assert_cmpint (g_array_index (values, int, i), >=, g_array_index (values, int, i - 1));
+  g_assert_cmpint (g_array_index (values, int, values->len - 1), ==, 100);
+}
+
 /* use the installation api to install a flatpakref */
 static void
 test_install_flatpakref (void)
@@ -5097,6 +5180,7 @@ main (int argc, char *argv[])
   g_test_add_func ("/library/overrides", test_overrides);
   g_test_add_func ("/library/bundle", test_bundle);
   g_test_add_func ("/library/install-bundle", test_install_bundle);
+  g_test_add_func ("/library/transaction-install-bundle", test_transaction_install_bundle);
   g_test_add_func ("/library/install-flatpakref", test_install_flatpakref);
   g_test_add_func ("/library/list-installed-related-refs", test_list_installed_related_refs);
   g_test_add_func ("/library/update-related-refs", test_update_related_refs);